@@ -1,156 +1,418 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <stdexcept>
+#include <thread>
 #include "chip8screen.hpp"
-#include "chip8timer.hpp"
-#include "chip8keyboard.hpp"
-#include "chip8cpu.hpp"
+#include "chip8speaker.hpp"
+#include "chip8channel.hpp"
+#include "chip8core.hpp"
+#include "chip8scheduler.hpp"
+#include "chip8pack.hpp"
+#include "chip8recording.hpp"
+#include "chip8gdb.hpp"
+#include "chip8runahead.hpp"
+#include "chip8telemetry.hpp"
 
+// what the SDL thread tells the emulation thread
+enum Chip8InputType {
+    CHIP8_INPUT_KEY,        // hex key press or release
+    CHIP8_INPUT_REWIND,     // backspace press or release
+    CHIP8_INPUT_FAST,       // tab press or release
+    CHIP8_INPUT_SAVE,
+    CHIP8_INPUT_LOAD,
+    CHIP8_INPUT_STEP,
+    CHIP8_INPUT_PROFILE,
+    CHIP8_INPUT_QUIT
+};
+
+struct Chip8Input {
+    Chip8InputType type;
+    unsigned char key;
+    bool pressed;
+};
+
+// a finished framebuffer on its way to the SDL thread
+struct Chip8Frame {
+    Chip8Framebuffer framebuffer;
+};
+
+// SDL frontend. the calling thread owns the window and the event loop and
+// presents at 60 Hz; a second thread owns the Chip8Core and runs it at its
+// own pace. input goes one way as a queue of transitions, frames come back
+// through a triple buffer, so neither thread ever waits on the other.
 class Chip8Emu {
 private:
-    unsigned char* memory;
-
     Chip8Screen* screen;
-    Chip8Cpu* cpu;
-    Chip8Timer* delay_timer;
-    Chip8Timer* sound_timer;
-    Chip8Keyboard* keyboard;
-public:
-    Chip8Emu(Chip8Screen& screen, Chip8Cpu& cpu, Chip8Timer& delay_timer, Chip8Timer& sound_timer, Chip8Keyboard& keyboard) {
-        // allocate memory
-        this->memory = new unsigned char [4096];
-
-        // check for allocation errors
-        if (this->memory == NULL)
-            throw std::runtime_error("Failed to allocate memory!");
-
-        // erase memory (init)
-        for (size_t i = 0; i < 4096; i++)
-            this->memory[i] = 0;
-
-        char fonts [] = { 0xF0, 0x90, 0x90, 0x90, 0xF0,
-                          0x20, 0x60, 0x20, 0x20, 0x70,
-                          0xF0, 0x10, 0xF0, 0x80, 0xF0,
-                          0xF0, 0x10, 0xF0, 0x10, 0xF0,
-                          0x90, 0x90, 0xF0, 0x10, 0x10,
-                          0xF0, 0x80, 0xF0, 0x10, 0xF0,
-                          0xF0, 0x80, 0xF0, 0x90, 0xF0,
-                          0xF0, 0x10, 0x20, 0x40, 0x40,
-                          0xF0, 0x90, 0xF0, 0x90, 0xF0,
-                          0xF0, 0x90, 0xF0, 0x10, 0xF0,
-                          0xF0, 0x90, 0xF0, 0x90, 0x90,
-                          0xE0, 0x90, 0x90, 0x90, 0xE0,
-                          0xF0, 0x80, 0xF0, 0x80, 0xF0,
-                          0xF0, 0x80, 0xF0, 0x80, 0x80};
-
-        for (size_t i = 0; i < 80; i++)
-            this->memory[i] = fonts[i];
+    Chip8Core* core;
+    Chip8Scheduler* scheduler;
+    Chip8Rewind rewind;
+    Chip8Recording* recording;
+    Chip8GdbStub* gdb;
+    Chip8Beeper* beeper;
+    Chip8RunAhead* runahead;
+    Chip8Telemetry* telemetry;
 
-        this->screen = &screen;
-        this->cpu = &cpu;
-        this->delay_timer = &delay_timer;
-        this->sound_timer = &sound_timer;
-        this->keyboard = &keyboard;
-    }
+    Chip8SpscQueue<Chip8Input, 256> inputs;
+    Chip8TripleBuffer<Chip8Frame> frames;
 
-    ~Chip8Emu() {
-        // cleanup
-        delete[] this->memory;
-    }
+    // keypad state handed to the core once per frame: the keys held now plus
+    // any pressed since the last frame, so a tap shorter than a frame is
+    // still seen, and a recording of the masks reproduces the session
+    unsigned short int held;
+    unsigned short int tapped;
 
-    bool play(bool debug) {
-        unsigned long ticks = SDL_GetTicks();
-        unsigned short int tick_delta = 0;
-        SDL_Event event;
-        while (true) {
-            tick_delta = SDL_GetTicks() - ticks;
-
-            if (SDL_PollEvent(&event) && event.type == SDL_QUIT)
-                break;
-            else if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP)
-                this->keyboard->notify(event);
-
-            if (debug) {
-                if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_n)
-                    this->cpu->cycle(this->memory, this->screen, this->delay_timer, this->sound_timer, this->keyboard);
-            } else {
-                this->cpu->cycle(this->memory, this->screen, this->delay_timer, this->sound_timer, this->keyboard);
-            }
+    // frames the SDL thread never got to see, because a newer one replaced
+    // them first
+    unsigned long long dropped;
 
-            if (tick_delta >= 17) {
-                tick_delta = 0;
-                ticks = SDL_GetTicks();
+    // maps the host keyboard onto the hex keypad, -1 if unmapped
+    int map_key(SDL_Keycode key) {
+        switch (key) {
+        case SDLK_1: return 0x0;
+        case SDLK_2: return 0x1;
+        case SDLK_3: return 0x2;
+        case SDLK_4: return 0x3;
+        case SDLK_q: return 0x4;
+        case SDLK_w: return 0x5;
+        case SDLK_e: return 0x6;
+        case SDLK_r: return 0x7;
+        case SDLK_a: return 0x8;
+        case SDLK_s: return 0x9;
+        case SDLK_d: return 0xA;
+        case SDLK_f: return 0xB;
+        case SDLK_z: return 0xC;
+        case SDLK_x: return 0xD;
+        case SDLK_c: return 0xE;
+        case SDLK_v: return 0xF;
+        }
+        return -1;
+    }
 
-                this->delay_timer->tick();
-                this->sound_timer->tick();
-            }
-            // this->print_screen_memory();
-            // SDL_Delay(500);
+    // SDL thread: the emulation thread drains the queue every frame, so a
+    // full queue only ever lasts a moment
+    void send(Chip8InputType type, unsigned char key = 0, bool pressed = false) {
+        Chip8Input input = { type, key, pressed };
+        while (!this->inputs.push(input))
+            std::this_thread::yield();
+    }
+
+    // SDL thread: translate one event, false on quit
+    bool handle(const SDL_Event& event) {
+        if (event.type == SDL_QUIT) {
+            this->send(CHIP8_INPUT_QUIT);
+            return false;
         }
+        if ((event.type != SDL_KEYDOWN && event.type != SDL_KEYUP) || event.key.repeat)
+            return true;
 
+        bool pressed = event.type == SDL_KEYDOWN;
+        int key = this->map_key(event.key.keysym.sym);
+        if (key >= 0)
+            this->send(CHIP8_INPUT_KEY, key, pressed);
+        else if (event.key.keysym.sym == SDLK_BACKSPACE)
+            this->send(CHIP8_INPUT_REWIND, 0, pressed);
+        else if (event.key.keysym.sym == SDLK_TAB)
+            this->send(CHIP8_INPUT_FAST, 0, pressed);
+        else if (pressed && event.key.keysym.sym == SDLK_F5)
+            this->send(CHIP8_INPUT_SAVE);
+        else if (pressed && event.key.keysym.sym == SDLK_F9)
+            this->send(CHIP8_INPUT_LOAD);
+        else if (pressed && event.key.keysym.sym == SDLK_n)
+            this->send(CHIP8_INPUT_STEP);
+        else if (pressed && event.key.keysym.sym == SDLK_F2)
+            this->send(CHIP8_INPUT_PROFILE);
         return true;
     }
 
-    bool load_game(const char* filename) {
-        // open the specified file
-        if (FILE* game_file = fopen(filename, "rb")) {
-            // calculate file size
-            fseek(game_file, 0, SEEK_END);
-            size_t file_size = ftell(game_file);
-
-            // if the file wouldn't fit in memory (4096 - 512 - 256 - 96)
-            if (file_size > 3232) {
-                printf("* File too large! (%d)\n", file_size);
-                return false;
+    // emulation thread (or after it's done): the hot loop table to stdout and
+    // the folded stacks to profile.folded, in profile builds only
+    void dump_profile() {
+#ifdef CHIP8_PROFILE
+        Chip8DefaultProfile& profile = this->core->get_cpu().get_profile();
+        profile.report(stdout);
+        if (profile.write_folded("profile.folded"))
+            printf("* folded stacks written to profile.folded\n");
+#endif
+    }
+
+    // emulation thread: runs frames until told to quit. a halted core (the
+    // debugger, or n stepping with debug) just keeps presenting the same frame
+    void emulate(bool debug) {
+        bool rewinding = false;
+        if (debug)
+            this->core->get_debugger().halt();
+        Chip8State state;
+        Chip8Input input;
+        while (true) {
+            if (this->gdb)
+                this->gdb->service();
+
+            while (this->inputs.pop(input)) {
+                switch (input.type) {
+                case CHIP8_INPUT_KEY:
+                    if (input.pressed) {
+                        this->held |= 1 << input.key;
+                        this->tapped |= 1 << input.key;
+                    } else
+                        this->held &= ~(1 << input.key);
+                    break;
+                case CHIP8_INPUT_REWIND:
+                    rewinding = input.pressed && this->recording == NULL;
+                    break;
+                case CHIP8_INPUT_FAST:
+                    this->scheduler->set_throttled(!input.pressed);
+                    break;
+                case CHIP8_INPUT_SAVE:
+                    this->core->save_state(state);
+                    state.save("quicksave.c8s");
+                    break;
+                case CHIP8_INPUT_LOAD:
+                    if (this->recording == NULL && state.load("quicksave.c8s")) {
+                        this->core->load_state(state);
+                        this->rewind.clear();
+                        if (this->telemetry)
+                            this->telemetry->pause();
+                    }
+                    break;
+                case CHIP8_INPUT_STEP:
+                    if (debug && this->core->is_halted())
+                        this->core->get_debugger().step();
+                    break;
+                case CHIP8_INPUT_PROFILE:
+                    this->dump_profile();
+                    break;
+                case CHIP8_INPUT_QUIT:
+                    return;
+                }
             }
 
-            // read the file and copy it to memory
-            rewind(game_file);
-            size_t result = fread(this->memory + 512, 1, file_size, game_file);
-            if (result != file_size) {
-                printf("* File reading failed! (%d/%d)\n", result, file_size);
-                return false;
+            bool ran = false;
+            unsigned short int keys = this->held | this->tapped;
+            this->tapped = 0;
+            this->core->get_keyboard().set_keys(keys);
+
+            if (rewinding) {
+                // step back one frame per frame held
+                if (this->rewind.pop(state))
+                    this->core->load_state(state);
+            } else if (!this->core->is_halted()) {
+                ran = true;
+                if (this->recording == NULL) {
+                    this->core->save_state(state);
+                    this->rewind.push(state);
+                }
+                if (this->telemetry)
+                    this->telemetry->begin_frame(*this->scheduler);
+                this->scheduler->run_frame(*this->core);
+                if (this->recording) {
+                    this->recording->record(keys);
+                    this->recording->record_screen(this->recording->get_frames(), this->core->screen_hash());
+                }
             }
 
-            return true;
+            // one gate per frame, silent while rewinding or halted
+            if (this->beeper)
+                this->beeper->push(!rewinding && !this->core->is_halted() && this->core->is_beeping());
 
-        } else {
-            printf("* Unable to open file! (%s)\n", filename);
-            return false;
+            // hand over the framebuffer only when something was drawn, or
+            // with run-ahead the one a few frames on, every frame
+            if (ran && this->runahead) {
+                this->frames.back().framebuffer = this->runahead->run(*this->core, *this->scheduler);
+                this->dropped += this->frames.publish();
+            } else if (this->core->get_cpu().take_redraw()) {
+                this->frames.back().framebuffer = this->core->get_framebuffer();
+                this->dropped += this->frames.publish();
+            }
+            if (this->telemetry) {
+                if (ran)
+                    this->telemetry->end_frame(*this->core, *this->scheduler, this->dropped);
+                else
+                    this->telemetry->pause();
+            }
+            this->scheduler->wait();
         }
     }
+public:
+    Chip8Emu(Chip8Screen& screen, Chip8Core& core, Chip8Scheduler& scheduler, Chip8Recording* recording = NULL, Chip8GdbStub* gdb = NULL, Chip8Beeper* beeper = NULL, Chip8RunAhead* runahead = NULL, Chip8Telemetry* telemetry = NULL) {
+        this->screen = &screen;
+        this->core = &core;
+        this->scheduler = &scheduler;
+        this->recording = recording;
+        this->gdb = gdb;
+        this->beeper = beeper;
+        this->runahead = runahead;
+        this->telemetry = telemetry;
+        this->held = 0;
+        this->tapped = 0;
+        this->dropped = 0;
+    }
+
+    // backspace (held) rewinds, tab (held) runs unthrottled, F5 quick saves,
+    // F9 quick loads, F2 dumps the profile. while recording, rewinding and loading are off, as the
+    // recording only moves forward
+    bool play(bool debug) {
+        std::thread emulation (&Chip8Emu::emulate, this, debug);
+
+        // paces the window only; emulated time is kept by the other thread
+        Chip8Scheduler display;
+        SDL_Event event;
+        bool running = true;
+        unsigned long long render_time = 0;
+        while (running) {
+            // drain every pending event once per frame
+            while (running && SDL_PollEvent(&event))
+                running = this->handle(event);
 
-    void print_memory() {
-        for (size_t i = 0; i < 4096; i += 2) {
-            if (i % 16 == 0)
-                printf("\n%08x: ", i);
-            printf("%02x%02x ", this->memory[i], this->memory[i+1]);
+            // present at most once per frame, and only if something was drawn
+            bool changed = this->frames.update();
+            if (this->telemetry) {
+                unsigned long long start = chip8_telemetry_now();
+                this->screen->frame(this->frames.front().framebuffer, changed);
+                render_time += chip8_telemetry_now() - start;
+                this->telemetry->presented(this->screen->get_presented(), this->screen->get_skipped(), render_time);
+            } else
+                this->screen->frame(this->frames.front().framebuffer, changed);
+            display.wait();
         }
-        printf("\n");
+        emulation.join();
+
+        printf("* %llu frames presented, %llu skipped, %llu late, %llu dropped\n", this->screen->get_presented(),
+            this->screen->get_skipped(), this->scheduler->get_late_frames(), this->dropped);
+        printf("* %zu rewind states (%.0f s) in %zu bytes, room for about %.0f s\n", this->rewind.size(), this->rewind.seconds(),
+            this->rewind.bytes(), this->rewind.capacity());
+        if (this->beeper)
+            printf("* %llu audio frames played, %llu underruns, %llu trimmed, latency %.1f ms average, %.1f ms max\n",
+                this->beeper->get_played(), this->beeper->get_underruns(), this->beeper->get_trimmed(),
+                this->beeper->get_average_latency(), this->beeper->get_max_latency());
+        if (this->runahead)
+            printf("* run-ahead of %u frames: %.1f us per frame (%.1f us snapshot, %.1f us rollback)\n",
+                this->runahead->get_frames(), this->runahead->get_cost(), this->runahead->get_save_cost(), this->runahead->get_restore_cost());
+        this->dump_profile();
+        return true;
     }
+};
+
+// chip8 [rom | -p pack rom_name_or_hash] [-R recording_file] [-S seed] [-d] [-g port|socket] [-L latency_ms] [-a frames]
+//       [-q quirk_profile] [-T]
+// -d starts halted and steps one instruction per press of n, -g serves GDB,
+// -L is how far audio may trail emulation (0 mutes), -a runs ahead frames
+// to cut input lag, -q overrides the quirk profile (modern, or the pack's),
+// -T publishes live counters for chip8stat
+static void usage(const char* argv0) {
+    printf("usage: %s [rom | -p pack rom_name_or_hash] [-R recording_file] [-S seed] [-d] [-g port|socket] [-L latency_ms] [-a frames]\n"
+           "       [-q modern|vip|chip48|schip] [-T]\n", argv0);
+}
 
-    void print_screen_memory() {
-        for (size_t i = 0xF00; i < 0xFFF; i += 2) {
-            if (i % 16 == 0)
-                printf("\n%08x: ", i);
-            printf("%02x%02x ", this->memory[i], this->memory[i+1]);
+int main(int argc, char** argv) {
+    const char* rom = "spaceinvaders.ch8";
+    const char* pack_file = NULL;
+    const char* recording_file = NULL;
+    unsigned int seed = CHIP8_DEFAULT_SEED;
+    bool debug = false;
+    const char* gdb_address = NULL;
+    unsigned int latency = 50;
+    unsigned int ahead = 0;
+    Chip8Quirks quirks = CHIP8_QUIRKS_MODERN;
+    bool quirks_set = false;
+    bool telemetry_enabled = false;
+
+    for (int a = 1; a < argc; a++) {
+        if (!strcmp(argv[a], "-p") && a + 1 < argc)
+            pack_file = argv[++a];
+        else if (!strcmp(argv[a], "-R") && a + 1 < argc)
+            recording_file = argv[++a];
+        else if (!strcmp(argv[a], "-S") && a + 1 < argc)
+            seed = strtoul(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-d"))
+            debug = true;
+        else if (!strcmp(argv[a], "-g") && a + 1 < argc)
+            gdb_address = argv[++a];
+        else if (!strcmp(argv[a], "-L") && a + 1 < argc)
+            latency = strtoul(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-a") && a + 1 < argc)
+            ahead = strtoul(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-q") && a + 1 < argc) {
+            if (!chip8_parse_quirks(argv[++a], quirks))
+                return 1;
+            quirks_set = true;
+        }
+        else if (!strcmp(argv[a], "-T"))
+            telemetry_enabled = true;
+        else if (argv[a][0] != '-')
+            rom = argv[a];
+        else {
+            usage(argv[0]);
+            return 1;
         }
-        printf("\n");
     }
-};
 
-int main() {
+    // a recording only moves forward in whole frames
+    if (recording_file && (debug || gdb_address)) {
+        printf("* Recording while debugging is not supported!\n");
+        return 1;
+    }
+    // speculative frames would run into breakpoints
+    if (ahead && (debug || gdb_address)) {
+        printf("* Run-ahead while debugging is not supported!\n");
+        return 1;
+    }
+    // and would be profiled, though they're rolled back
+    if (ahead && Chip8DefaultProfile::enabled) {
+        printf("* Run-ahead in profile builds is not supported!\n");
+        return 1;
+    }
+
     try {
-        Chip8Screen screen = Chip8Screen(8);
-        Chip8Cpu cpu = Chip8Cpu(400);
-        Chip8Timer delay_timer = Chip8Timer();
-        Chip8Timer sound_timer = Chip8Timer();
-        Chip8Keyboard keyboard = Chip8Keyboard();
+        Chip8Core core;
+        unsigned int ipf = CHIP8_DEFAULT_IPF;
+
+        // pick the ROM before opening a window, so a typo fails fast
+        if (pack_file) {
+            Chip8Pack pack;
+            Chip8PackEntry entry;
+            if (!pack.open(pack_file) || !pack.find(rom, entry) || !core.load_rom(entry.data, entry.size))
+                return 1;
+            if (entry.ipf)
+                ipf = entry.ipf;
+            if (!quirks_set && !chip8_quirks_from_id(entry.quirks, quirks))
+                return 1;
+        } else if (!core.load_game(rom))
+            return 1;
+        core.seed(seed);
+        core.set_quirks(quirks);
 
-        Chip8Emu emu = Chip8Emu(screen, cpu, delay_timer, sound_timer, keyboard);
+        Chip8Recording recording (seed, ipf, Chip8Recording::image_hash(core.get_memory()), quirks);
 
-        if (emu.load_game("spaceinvaders.ch8"))
-            emu.play(false);
+        Chip8Screen screen(8);
+        Chip8Scheduler scheduler(ipf);
+
+        // the device buffer (512 samples, ~11 ms) comes on top of the queue
+        Chip8Beeper beeper (48000, (latency * 60 + 999) / 1000);
+        Chip8Speaker* speaker = latency ? new Chip8Speaker(beeper) : NULL;
+        Chip8RunAhead runahead (ahead);
+
+        Chip8GdbStub gdb (core);
+        if (gdb_address) {
+            if (!gdb.listen(gdb_address))
+                return 1;
+            printf("* waiting for GDB on %s\n", gdb_address);
+        }
+
+        Chip8Telemetry telemetry;
+        if (telemetry_enabled && !telemetry.open(rom))
+            return 1;
+
+        Chip8Emu emu = Chip8Emu(screen, core, scheduler, recording_file ? &recording : NULL, gdb_address ? &gdb : NULL,
+            speaker && speaker->is_open() ? &beeper : NULL, ahead ? &runahead : NULL, telemetry_enabled ? &telemetry : NULL);
+        emu.play(debug);
+        delete speaker;
+
+        if (recording_file) {
+            if (!recording.save(recording_file))
+                return 1;
+            printf("* %llu frames recorded in %zu runs to %s\n", recording.get_frames(), recording.get_runs(), recording_file);
+        }
 
         return 0;
     } catch (const std::exception& e) {
@@ -0,0 +1,566 @@
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "chip8hash.hpp"
+#include "chip8quirks.hpp"
+
+// compiles a ROM ahead of time into C++ with one function per basic block
+// reachable from 0x200, plus a main() (see chip8aotmain.hpp) that runs it.
+// -q picks the quirk profile the code is generated for (default modern):
+//   chip8aot <rom> <output.cpp> [-q quirk_profile]
+//   c++ -std=c++17 -O2 -I <this directory> output.cpp -o program
+// the walk follows fallthrough, jumps, calls (and the instruction after
+// each call, where 00EE comes back to) and both sides of every skip. Bnnn
+// targets aren't known until runtime, so they, whatever 00EE returns to that
+// the walk didn't find, Fx0A and 00FD are left to the interpreter the
+// program embeds. it prints how much of the ROM it covered.
+static void usage(const char* argv0) {
+    printf("usage: %s <rom> <output.cpp> [-q modern|vip|chip48|schip]\n", argv0);
+}
+
+// longest block, in instructions
+static const unsigned int MAX_BLOCK = 64;
+
+static const unsigned char* rom;
+static size_t rom_size;
+static Chip8QuirkFlags quirks;
+
+static std::string format(const char* fmt, ...) {
+    char out [256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(out, sizeof(out), fmt, args);
+    va_end(args);
+    return out;
+}
+
+// whole instructions only: code runs off the end of the ROM into memory
+// that is zero until written, which only the interpreter can follow
+static bool in_rom(unsigned int addr) {
+    return addr >= 0x200 && addr + 1 < 0x200 + rom_size;
+}
+
+static unsigned short int fetch(unsigned int addr) {
+    return (rom[addr - 0x200] << 8) | rom[addr + 1 - 0x200];
+}
+
+// left to the interpreter: they don't leave the pc where a block could
+static bool interpreted(unsigned short int op) {
+    return op == 0x00FD || (op & 0xF0FF) == 0xF00A;
+}
+
+// the pc doesn't simply move on after these. Fx33/Fx55 end blocks too, so
+// a store into code is seen before that code runs
+static bool ends(unsigned short int op) {
+    switch (op >> 12) {
+    case 0x0:
+        return op == 0x00EE;
+    case 0x1: case 0x2: case 0x3: case 0x4: case 0x5: case 0x9: case 0xB:
+        return true;
+    case 0xE:
+        return (op & 0xFF) == 0x9E || (op & 0xFF) == 0xA1;
+    case 0xF:
+        return (op & 0xFF) == 0x33 || (op & 0xFF) == 0x55;
+    }
+    return false;
+}
+
+static const char* quirks_enum(Chip8Quirks profile) {
+    switch (profile) {
+    case CHIP8_QUIRKS_VIP: return "CHIP8_QUIRKS_VIP";
+    case CHIP8_QUIRKS_CHIP48: return "CHIP8_QUIRKS_CHIP48";
+    case CHIP8_QUIRKS_SCHIP: return "CHIP8_QUIRKS_SCHIP";
+    default: return "CHIP8_QUIRKS_MODERN";
+    }
+}
+
+struct Block {
+    unsigned int addr;
+    unsigned int count;
+};
+
+// one block's C++: the body is written first, recording which registers it
+// uses, so the locals it needs can be declared in front
+class BlockWriter {
+private:
+    std::string body;
+    unsigned int used;
+    unsigned int written;
+    bool uses_i;
+    bool writes_i;
+    bool uses_sp;
+    bool uses_memory;
+public:
+    BlockWriter() {
+        this->used = 0;
+        this->written = 0;
+        this->uses_i = false;
+        this->writes_i = false;
+        this->uses_sp = false;
+        this->uses_memory = false;
+    }
+
+    std::string v(unsigned int x) {
+        this->used |= 1 << x;
+        return format("v%X", x);
+    }
+
+    std::string set_v(unsigned int x) {
+        this->written |= 1 << x;
+        return this->v(x);
+    }
+
+    std::string i() {
+        this->uses_i = true;
+        return "i";
+    }
+
+    std::string set_i() {
+        this->writes_i = true;
+        return this->i();
+    }
+
+    std::string sp() {
+        this->uses_sp = true;
+        return "sp";
+    }
+
+    std::string memory() {
+        this->uses_memory = true;
+        return "memory";
+    }
+
+    void line(const std::string& text, unsigned int indent = 1) {
+        this->body += std::string(indent * 4, ' ') + text + "\n";
+    }
+
+    // write back what the block changed and leave for target
+    void exit(const std::string& target, unsigned int indent = 1) {
+        for (unsigned int x = 0; x < 16; x++) {
+            if ((this->written >> x) & 1)
+                this->line(format("c.v[0x%X] = v%X;", x, x), indent);
+        }
+        if (this->writes_i)
+            this->line("c.i = i;", indent);
+        if (this->uses_sp)
+            this->line("c.sp = sp;", indent);
+        this->line("c.pc = " + target + ";", indent);
+    }
+
+    void skip(const std::string& condition, unsigned int addr) {
+        this->line("if (" + condition + ") {");
+        this->exit(format("0x%03X", addr + 4), 2);
+        this->line("return;", 2);
+        this->line("}");
+        this->exit(format("0x%03X", addr + 2));
+    }
+
+    // the budget may end after k instructions: leave for next then
+    void limit(unsigned int k, unsigned int next) {
+        this->line(format("if (limit == %u) {", k));
+        this->exit(format("0x%03X", next), 2);
+        this->line("return;", 2);
+        this->line("}");
+    }
+
+    std::string finish(unsigned int addr, unsigned int count) {
+        std::string out = format("// 0x%03X-0x%03X\n", addr, addr + count * 2 - 1);
+        out += format("static void block_%03X(Chip8AotContext& c, unsigned int limit) {\n", addr);
+        if (count == 1)
+            out += "    (void) limit;\n";
+        if (this->uses_memory)
+            out += "    unsigned char* memory = c.memory;\n";
+        if (this->uses_i)
+            out += "    unsigned short int i = c.i;\n";
+        if (this->uses_sp)
+            out += "    unsigned char sp = c.sp;\n";
+        for (unsigned int x = 0; x < 16; x++) {
+            if ((this->used >> x) & 1)
+                out += format("    unsigned char v%X = c.v[0x%X];\n", x, x);
+        }
+        return out + this->body + "}\n\n";
+    }
+};
+
+// the C++ for one instruction, with the same effect Chip8Cpu::cycle has
+static void emit(BlockWriter& w, unsigned int addr, unsigned short int op) {
+    unsigned int x = (op >> 8) & 0xF;
+    unsigned int y = (op >> 4) & 0xF;
+    unsigned int n = op & 0xF;
+    unsigned int kk = op & 0xFF;
+    unsigned int nnn = op & 0xFFF;
+
+    w.line(format("// 0x%03X: %04X", addr, op));
+    switch (op >> 12) {
+    case 0x0:
+        if (op == 0x00E0)
+            w.line("c.framebuffer->clear();");
+        else if (op == 0x00EE) {
+            w.line("unsigned short int pc = " + w.memory() + "[(0xEA0 - 2 + " + w.sp() + " * 2) & 0xFFF] << 8;");
+            w.line("pc ^= memory[(0xEA0 - 2 + sp * 2 + 1) & 0xFFF];");
+            w.line("sp--;");
+            w.exit("pc + 2");
+            return;
+        }
+        else if ((op & 0xFFF0) == 0x00C0)
+            w.line(format("c.framebuffer->scroll_down(%u);", n));
+        else if (op == 0x00FB)
+            w.line("c.framebuffer->scroll_right(4);");
+        else if (op == 0x00FC)
+            w.line("c.framebuffer->scroll_left(4);");
+        else if (op == 0x00FE || op == 0x00FF)
+            w.line(op == 0x00FF ? "c.framebuffer->set_hires(true);" : "c.framebuffer->set_hires(false);");
+        else
+            return;
+        w.line("c.redraw = true;");
+        return;
+    case 0x1:
+        w.exit(format("0x%03X", nnn));
+        return;
+    case 0x2:
+        w.line(w.sp() + "++;");
+        w.line(w.memory() + format("[(0xEA0 - 2 + sp * 2) & 0xFFF] = 0x%02X;", addr >> 8));
+        w.line(format("memory[(0xEA0 - 2 + sp * 2 + 1) & 0xFFF] = 0x%02X;", addr & 0xFF));
+        w.exit(format("0x%03X", nnn));
+        return;
+    case 0x3:
+        w.skip(w.v(x) + format(" == 0x%02X", kk), addr);
+        return;
+    case 0x4:
+        w.skip(w.v(x) + format(" != 0x%02X", kk), addr);
+        return;
+    case 0x5:
+        // a register always equals itself: no condition, which compilers warn about
+        if (x == y) {
+            w.exit(format("0x%03X", addr + 4));
+            return;
+        }
+        w.skip(w.v(x) + " == " + w.v(y), addr);
+        return;
+    case 0x6:
+        w.line(w.set_v(x) + format(" = 0x%02X;", kk));
+        return;
+    case 0x7:
+        w.line(w.set_v(x) + format(" += 0x%02X;", kk));
+        return;
+    case 0x8:
+        switch (n) {
+        case 0x0:
+            w.line(w.set_v(x) + " = " + w.v(y) + ";");
+            return;
+        case 0x1:
+        case 0x2:
+        case 0x3:
+            w.line(w.set_v(x) + (n == 0x1 ? " |= " : n == 0x2 ? " &= " : " ^= ") + w.v(y) + ";");
+            if (quirks.vf_reset)
+                w.line(w.set_v(0xF) + " = 0;");
+            return;
+        case 0x4:
+            w.line("{");
+            w.line("unsigned short int result = " + w.v(x) + " + " + w.v(y) + ";", 2);
+            w.line(w.set_v(0xF) + " = result > 0xFF ? 1 : 0;", 2);
+            w.line(w.set_v(x) + " = (unsigned char) (result & 0xFF);", 2);
+            w.line("}");
+            return;
+        case 0x5:
+            // from itself: no borrow and nothing left
+            if (x == y) {
+                w.line(w.set_v(0xF) + " = 0;");
+                w.line(w.set_v(x) + " = 0;");
+                return;
+            }
+            w.line(w.set_v(0xF) + " = " + w.v(y) + " < " + w.v(x) + " ? 1 : 0;");
+            w.line(w.set_v(x) + " -= " + w.v(y) + ";");
+            return;
+        case 0x6:
+            if (!quirks.shift_vy) {
+                w.line(w.set_v(0xF) + " = " + w.v(x) + " & 0x01;");
+                w.line(w.set_v(x) + " >>= 1;");
+                return;
+            }
+            w.line("{");
+            w.line("unsigned char vv = " + w.v(y) + ";", 2);
+            w.line(w.set_v(0xF) + " = vv & 0x01;", 2);
+            w.line(w.set_v(x) + " = vv >> 1;", 2);
+            w.line("}");
+            return;
+        case 0x7:
+            if (x == y) {
+                w.line(w.set_v(0xF) + " = 0;");
+                w.line(w.set_v(x) + " = 0;");
+                return;
+            }
+            w.line(w.set_v(0xF) + " = " + w.v(y) + " > " + w.v(x) + " ? 1 : 0;");
+            w.line(w.set_v(x) + " = " + w.v(y) + " - " + w.v(x) + ";");
+            return;
+        case 0xE:
+            if (!quirks.shift_vy) {
+                w.line(w.set_v(0xF) + " = (" + w.v(x) + " & 0x80) >> 7;");
+                w.line(w.set_v(x) + " <<= 1;");
+                return;
+            }
+            w.line("{");
+            w.line("unsigned char vv = " + w.v(y) + ";", 2);
+            w.line(w.set_v(0xF) + " = (vv & 0x80) >> 7;", 2);
+            w.line(w.set_v(x) + " = (unsigned char) (vv << 1);", 2);
+            w.line("}");
+            return;
+        }
+        return;
+    case 0x9:
+        if (x == y) {
+            w.exit(format("0x%03X", addr + 2));
+            return;
+        }
+        w.skip(w.v(x) + " != " + w.v(y), addr);
+        return;
+    case 0xA:
+        w.line(w.set_i() + format(" = 0x%03X;", nnn));
+        return;
+    case 0xB:
+        w.exit(format("0x%03X + ", nnn) + w.v(quirks.jump_vx ? x : 0));
+        return;
+    case 0xC:
+        w.line(w.set_v(x) + format(" = c.cpu->random() & 0x%02X;", kk));
+        return;
+    case 0xD:
+        w.line(w.set_v(0xF) + " = c.framebuffer->draw(" + w.memory() + ", " + w.i() + ", " + w.v(x) + ", " + w.v(y) + format(", %u);", n));
+        w.line("c.redraw = true;");
+        return;
+    case 0xE:
+        if (kk == 0x9E)
+            w.skip("c.keyboard->get_key(" + w.v(x) + ")", addr);
+        else if (kk == 0xA1)
+            w.skip("!c.keyboard->get_key(" + w.v(x) + ")", addr);
+        return;
+    case 0xF:
+        switch (kk) {
+        case 0x07:
+            w.line(w.set_v(x) + " = c.delay_timer->get_value();");
+            return;
+        case 0x15:
+            w.line("c.delay_timer->set(" + w.v(x) + ");");
+            return;
+        case 0x18:
+            w.line("c.sound_timer->set(" + w.v(x) + ");");
+            return;
+        case 0x1E:
+            w.line("{");
+            w.line("unsigned int result = " + w.i() + " + " + w.v(x) + ";", 2);
+            w.line(w.set_v(0xF) + " = result > 0xFFFF ? 1 : 0;", 2);
+            w.line(w.set_i() + " = (unsigned short int) (result & 0xFFFF);", 2);
+            w.line("}");
+            return;
+        case 0x29:
+            w.line(w.set_i() + " = 5 * " + w.v(x) + ";");
+            return;
+        case 0x30:
+            w.line(w.set_i() + " = CHIP8_BIG_FONT + 10 * (" + w.v(x) + " & 0x0F);");
+            return;
+        case 0x33:
+            w.line(w.memory() + "[" + w.i() + " & 0xFFF] = " + w.v(x) + " / 100;");
+            w.line(format("memory[(i + 1) & 0xFFF] = (v%X / 10) %% 10;", x));
+            w.line(format("memory[(i + 2) & 0xFFF] = v%X %% 10;", x));
+            w.line("c.aot->wrote(memory, i & 0xFFF, 3);");
+            w.exit(format("0x%03X", addr + 2));
+            return;
+        case 0x55:
+            for (unsigned int o = 0; o <= x; o++)
+                w.line(w.memory() + "[(" + w.i() + format(" + %u) & 0xFFF] = ", o) + w.v(o) + ";");
+            w.line(format("c.aot->wrote(memory, i & 0xFFF, %u);", x + 1));
+            if (quirks.load_store != CHIP8_LOAD_STORE_KEEP)
+                w.line(w.set_i() + format(" += %u;", x + (quirks.load_store == CHIP8_LOAD_STORE_PAST)));
+            w.exit(format("0x%03X", addr + 2));
+            return;
+        case 0x65:
+            for (unsigned int o = 0; o <= x; o++)
+                w.line(w.set_v(o) + " = " + w.memory() + "[(" + w.i() + format(" + %u) & 0xFFF];", o));
+            if (quirks.load_store != CHIP8_LOAD_STORE_KEEP)
+                w.line(w.set_i() + format(" += %u;", x + (quirks.load_store == CHIP8_LOAD_STORE_PAST)));
+            return;
+        case 0x75:
+            for (unsigned int o = 0; o <= (x & 0x7); o++)
+                w.line(format("c.rpl[%u] = ", o) + w.v(o) + ";");
+            return;
+        case 0x85:
+            for (unsigned int o = 0; o <= (x & 0x7); o++)
+                w.line(w.set_v(o) + format(" = c.rpl[%u];", o));
+            return;
+        }
+        return;
+    }
+}
+
+int main(int argc, char** argv) {
+    Chip8Quirks profile = CHIP8_QUIRKS_MODERN;
+    if (argc == 5 && !strcmp(argv[3], "-q")) {
+        if (!chip8_parse_quirks(argv[4], profile))
+            return 1;
+    } else if (argc != 3) {
+        usage(argv[0]);
+        return 1;
+    }
+    quirks = Chip8QuirkFlags::of(profile);
+
+    FILE* in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        printf("* Unable to open file! (%s)\n", argv[1]);
+        return 1;
+    }
+    // one byte more than fits, so oversized files are caught
+    static unsigned char data [3233];
+    rom_size = fread(data, 1, sizeof(data), in);
+    fclose(in);
+    rom = data;
+    if (rom_size > 3232) {
+        printf("* File too large! (%zu)\n", rom_size);
+        return 1;
+    }
+
+    // walk the control flow from 0x200
+    std::map<unsigned int, Block> blocks;
+    std::set<unsigned int> seen;
+    std::set<unsigned int> left;     // Fx0A and 00FD
+    std::set<unsigned int> dynamic;  // Bnnn
+    std::vector<unsigned int> work;
+    work.push_back(0x200);
+    while (!work.empty()) {
+        unsigned int addr = work.back();
+        work.pop_back();
+        if (!in_rom(addr) || !seen.insert(addr).second)
+            continue;
+
+        Block block = { addr, 0 };
+        unsigned int a = addr;
+        for (; in_rom(a) && block.count < MAX_BLOCK; a += 2) {
+            unsigned short int op = fetch(a);
+            if (interpreted(op)) {
+                left.insert(a);
+                // Fx0A moves on once a key comes, 00FD never does
+                if (op != 0x00FD)
+                    work.push_back(a + 2);
+                break;
+            }
+            block.count++;
+            if (!ends(op))
+                continue;
+
+            switch (op >> 12) {
+            case 0x1:
+                work.push_back(op & 0xFFF);
+                break;
+            case 0x2:
+                work.push_back(op & 0xFFF);
+                work.push_back(a + 2);
+                break;
+            case 0xB:
+                dynamic.insert(a);
+                break;
+            case 0x0:
+                break;
+            case 0xF:
+                work.push_back(a + 2);
+                break;
+            default:
+                work.push_back(a + 2);
+                work.push_back(a + 4);
+                break;
+            }
+            break;
+        }
+        // cut short by the size limit
+        if (block.count == MAX_BLOCK && !ends(fetch(a - 2)))
+            work.push_back(a);
+        if (block.count)
+            blocks[addr] = block;
+    }
+
+    // coverage
+    std::vector<bool> covered (rom_size, false);
+    unsigned long long instructions = 0;
+    for (std::map<unsigned int, Block>::iterator b = blocks.begin(); b != blocks.end(); ++b) {
+        instructions += b->second.count;
+        for (unsigned int o = 0; o < b->second.count * 2; o++)
+            covered[b->second.addr - 0x200 + o] = true;
+    }
+    size_t bytes = 0;
+    for (size_t o = 0; o < rom_size; o++)
+        bytes += covered[o];
+
+    // the program
+    const char* name = strrchr(argv[1], '/') ? strrchr(argv[1], '/') + 1 : argv[1];
+    std::string safe_name;
+    for (const char* c = name; *c; c++)
+        safe_name += (*c == '"' || *c == '\\' || *c < 0x20) ? '_' : *c;
+
+    std::string out = format("// generated by chip8aot from %s (%016llx), do not edit.\n", safe_name.c_str(), chip8_hash(rom, rom_size));
+    out += format("// %zu blocks, %llu instructions, covering %zu of %zu ROM bytes, %s quirks\n", blocks.size(), instructions, bytes, rom_size, chip8_quirks_name(profile));
+    out += "#include \"chip8aotmain.hpp\"\n\n";
+    out += "static const unsigned char rom [] = {";
+    for (size_t o = 0; o < rom_size; o++)
+        out += format(o % 16 ? " 0x%02X," : "\n    0x%02X,", rom[o]);
+    out += rom_size ? "\n};\n\n" : "\n    0\n};\n\n";
+
+    for (std::map<unsigned int, Block>::iterator b = blocks.begin(); b != blocks.end(); ++b) {
+        BlockWriter w;
+        unsigned int a = b->second.addr;
+        for (unsigned int k = 0; k < b->second.count; k++, a += 2) {
+            emit(w, a, fetch(a));
+            if (k + 1 < b->second.count)
+                w.limit(k + 1, a + 2);
+        }
+        if (!ends(fetch(a - 2)))
+            w.exit(format("0x%03X", a));
+        out += w.finish(b->second.addr, b->second.count);
+    }
+
+    out += "static const Chip8AotBlock blocks [] = {\n";
+    for (std::map<unsigned int, Block>::iterator b = blocks.begin(); b != blocks.end(); ++b) {
+        unsigned int first = b->second.addr >> 8;
+        unsigned int last = (b->second.addr + b->second.count * 2 - 1) >> 8;
+        unsigned int pages = (1 << first) | (1 << last);
+        out += format("    { 0x%03X, %u, 0x%04X, block_%03X },\n", b->second.addr, b->second.count, pages, b->second.addr);
+    }
+    if (blocks.empty())
+        out += "    { 0, 0, 0, NULL }\n";
+    out += "};\n\n";
+    out += "int main(int argc, char** argv) {\n";
+    out += format("    return chip8_aot_main(argc, argv, \"%s\", rom, %zu, %s, blocks, %zu);\n", safe_name.c_str(), rom_size, quirks_enum(profile), blocks.size());
+    out += "}\n";
+
+    FILE* file = fopen(argv[2], "wb");
+    if (file == NULL) {
+        printf("* Unable to open file! (%s)\n", argv[2]);
+        return 1;
+    }
+    bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+    fclose(file);
+    if (!ok) {
+        printf("* File writing failed! (%s)\n", argv[2]);
+        return 1;
+    }
+
+    // report
+    printf("* %s: %zu blocks, %llu instructions, %s quirks\n", safe_name.c_str(), blocks.size(), instructions, chip8_quirks_name(profile));
+    printf("* %zu of %zu ROM bytes (%.1f%%) compiled, the rest is data or only reached dynamically\n",
+        bytes, rom_size, rom_size ? 100.0 * bytes / rom_size : 0.0);
+    if (!left.empty()) {
+        printf("* interpreted:");
+        for (std::set<unsigned int>::iterator a = left.begin(); a != left.end(); ++a)
+            printf(" %04X at 0x%03X", fetch(*a), *a);
+        printf("\n");
+    }
+    if (!dynamic.empty()) {
+        printf("* dynamic jumps, interpreted unless they land on a compiled block:");
+        for (std::set<unsigned int>::iterator a = dynamic.begin(); a != dynamic.end(); ++a)
+            printf(" %04X at 0x%03X", fetch(*a), *a);
+        printf("\n");
+    }
+    printf("* written to %s\n", argv[2]);
+    return 0;
+}
@@ -0,0 +1,186 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include "chip8timer.hpp"
+#include "chip8keyboard.hpp"
+#include "chip8cpu.hpp"
+#include "chip8framebuffer.hpp"
+
+class Chip8Aot;
+
+// machine state as seen by code chip8aot generated. blocks keep the V
+// registers, I and SP they use in locals and write them back on exit.
+struct Chip8AotContext {
+    unsigned char* v;
+    unsigned char* memory;
+    unsigned char* rpl;
+    unsigned short int pc;
+    unsigned short int i;
+    unsigned char sp;
+    bool redraw;
+    Chip8Cpu* cpu;
+    Chip8Framebuffer* framebuffer;
+    Chip8Timer* delay_timer;
+    Chip8Timer* sound_timer;
+    Chip8Keyboard* keyboard;
+    Chip8Aot* aot;
+};
+
+// one basic block of a ROM compiled ahead of time: count instructions from
+// addr, valid as long as the 256 byte pages in the pages mask still hold
+// what the ROM had there. run() stops early after limit instructions, so a
+// frame's budget can end inside a block
+struct Chip8AotBlock {
+    unsigned short int addr;
+    unsigned short int count;
+    unsigned short int pages;
+    void (*run)(Chip8AotContext& c, unsigned int limit);
+};
+
+// runs a ROM chip8aot compiled into native blocks. a block runs when the pc
+// lands on its first address and none of its pages were written since the
+// ROM was loaded; everything else (addresses the static walk didn't reach,
+// Bnnn and 00EE to them, Fx0A, 00FD, self-modified code) is run by
+// Chip8Cpu::cycle. memory is compared against
+// the ROM image page by page whenever Fx33/Fx55 store into it, so code that
+// patches itself and later puts the original bytes back runs native again.
+//
+// the blocks bake in the quirk profile chip8aot compiled them for; a cpu
+// with another profile is interpreted throughout. like the jit, trace and
+// profile builds interpret everything.
+class Chip8Aot {
+private:
+    const unsigned char* rom;
+    size_t rom_size;
+    Chip8Quirks quirks;
+
+    // block starting at each address, NULL if none
+    const Chip8AotBlock* table [4096];
+    // pages that no longer match the ROM
+    unsigned short int stale;
+
+    Chip8AotContext ctx;
+
+    unsigned long long compiled;
+    unsigned long long interpreted;
+
+    bool matches(const unsigned char* memory, unsigned int p) {
+        unsigned int lo = p * 256 > 0x200 ? p * 256 : 0x200;
+        unsigned int hi = p * 256 + 256 < 0x200 + this->rom_size ? p * 256 + 256 : 0x200 + this->rom_size;
+        return hi <= lo || !memcmp(memory + lo, this->rom + lo - 0x200, hi - lo);
+    }
+public:
+    Chip8Aot(const unsigned char* rom, size_t rom_size, Chip8Quirks quirks, const Chip8AotBlock* blocks, size_t count) {
+        this->rom = rom;
+        this->rom_size = rom_size;
+        this->quirks = quirks;
+        this->stale = 0;
+        this->compiled = 0;
+        this->interpreted = 0;
+
+        for (size_t a = 0; a < 4096; a++)
+            this->table[a] = NULL;
+        for (size_t b = 0; b < count; b++)
+            this->table[blocks[b].addr & 0xFFF] = &blocks[b];
+    }
+
+    Chip8Aot(const Chip8Aot&) = delete;
+    Chip8Aot& operator=(const Chip8Aot&) = delete;
+
+    const unsigned char* get_rom() {
+        return this->rom;
+    }
+
+    size_t get_rom_size() {
+        return this->rom_size;
+    }
+
+    Chip8Quirks get_quirks() {
+        return this->quirks;
+    }
+
+    // instructions run by compiled blocks and by the interpreter
+    unsigned long long get_compiled() {
+        return this->compiled;
+    }
+
+    unsigned long long get_interpreted() {
+        return this->interpreted;
+    }
+
+    // recheck the pages len bytes from addr touch, after a store
+    void wrote(const unsigned char* memory, unsigned int addr, unsigned int len) {
+        for (unsigned int a = addr & ~0xFF; a < addr + len; a += 256) {
+            unsigned int p = (a & 0xFFF) >> 8;
+            if (this->matches(memory, p))
+                this->stale &= ~(1 << p);
+            else
+                this->stale |= 1 << p;
+        }
+    }
+
+    // recheck every page, after memory changed wholesale
+    void revalidate(const unsigned char* memory) {
+        this->wrote(memory, 0, 4096);
+    }
+
+    // execute n instructions on the given cpu
+    void run(Chip8Cpu& cpu, unsigned char* memory, Chip8Framebuffer& framebuffer, Chip8Timer& delay_timer, Chip8Timer& sound_timer, Chip8Keyboard& keyboard, unsigned long long n) {
+#if !defined(CHIP8_TRACE) && !defined(CHIP8_PROFILE)
+        if (cpu.quirks != this->quirks) {
+            cpu.run(memory, framebuffer, delay_timer, sound_timer, keyboard, n);
+            this->interpreted += n;
+            return;
+        }
+        this->ctx.v = cpu.v;
+        this->ctx.memory = memory;
+        this->ctx.rpl = cpu.rpl;
+        this->ctx.pc = cpu.pc;
+        this->ctx.i = cpu.i;
+        this->ctx.sp = cpu.sp;
+        this->ctx.redraw = false;
+        this->ctx.cpu = &cpu;
+        this->ctx.framebuffer = &framebuffer;
+        this->ctx.delay_timer = &delay_timer;
+        this->ctx.sound_timer = &sound_timer;
+        this->ctx.keyboard = &keyboard;
+        this->ctx.aot = this;
+
+        unsigned long long budget = n;
+        while (budget > 0) {
+            unsigned int pc = this->ctx.pc;
+            const Chip8AotBlock* block = pc < 0x1000 ? this->table[pc] : NULL;
+            if (block && !(block->pages & this->stale)) {
+                unsigned int limit = block->count <= budget ? block->count : (unsigned int) budget;
+                block->run(this->ctx, limit);
+                budget -= limit;
+                this->compiled += limit;
+                continue;
+            }
+
+            // single interpreted instruction
+            unsigned short int instruction = (memory[pc & 0xFFF] << 8) | memory[(pc + 1) & 0xFFF];
+            cpu.pc = this->ctx.pc;
+            cpu.i = this->ctx.i;
+            cpu.sp = this->ctx.sp;
+            cpu.cycle(memory, framebuffer, delay_timer, sound_timer, keyboard);
+            if ((instruction & 0xF0FF) == 0xF033 || (instruction & 0xF0FF) == 0xF055)
+                this->wrote(memory, this->ctx.i & 0xFFF, (instruction & 0xFF) == 0x33 ? 3 : ((instruction >> 8) & 0xF) + 1);
+            this->ctx.pc = cpu.pc;
+            this->ctx.i = cpu.i;
+            this->ctx.sp = cpu.sp;
+            budget--;
+            this->interpreted++;
+        }
+
+        cpu.pc = this->ctx.pc;
+        cpu.i = this->ctx.i;
+        cpu.sp = this->ctx.sp;
+        if (this->ctx.redraw)
+            cpu.redraw = true;
+#else
+        cpu.run(memory, framebuffer, delay_timer, sound_timer, keyboard, n);
+        this->interpreted += n;
+#endif
+    }
+};
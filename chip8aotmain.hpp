@@ -0,0 +1,118 @@
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <stdexcept>
+#include "chip8core.hpp"
+#include "chip8aot.hpp"
+#include "chip8scheduler.hpp"
+#include "chip8state.hpp"
+
+// what a program chip8aot generated runs as its main(): the compiled ROM
+// without a window, like chip8headless (which it matches screen for screen
+// and state for state). -e picks another engine to compare against. the
+// quirk profile is the one the ROM was compiled for; -q overrides it, which
+// leaves the compiled blocks unused:
+//   <program> [-c cycles | -f frames] [-i instructions_per_frame] [-e aot|interpreter|predecoded|jit] [-q quirk_profile] [-s state_file] [-n]
+static void chip8_aot_usage(const char* argv0) {
+    printf("usage: %s [-c cycles | -f frames] [-i instructions_per_frame] [-e aot|interpreter|predecoded|jit] [-q modern|vip|chip48|schip]\n"
+           "       [-s save_state_file] [-n]\n", argv0);
+}
+
+static int chip8_aot_main(int argc, char** argv, const char* name, const unsigned char* rom, size_t rom_size,
+                          Chip8Quirks compiled, const Chip8AotBlock* blocks, size_t count) {
+    unsigned long long cycles = 0;
+    unsigned long long frames = 0;
+    unsigned int ipf = CHIP8_DEFAULT_IPF;
+    Chip8Engine engine = CHIP8_ENGINE_AOT;
+    const char* save_file = NULL;
+    bool idle_skip = true;
+    Chip8Quirks quirks = compiled;
+
+    for (int a = 1; a < argc; a++) {
+        if (!strcmp(argv[a], "-c") && a + 1 < argc)
+            cycles = strtoull(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-f") && a + 1 < argc)
+            frames = strtoull(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-i") && a + 1 < argc)
+            ipf = strtoul(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-e") && a + 1 < argc) {
+            a++;
+            if (!strcmp(argv[a], "aot"))
+                engine = CHIP8_ENGINE_AOT;
+            else if (!strcmp(argv[a], "interpreter"))
+                engine = CHIP8_ENGINE_INTERPRETER;
+            else if (!strcmp(argv[a], "predecoded"))
+                engine = CHIP8_ENGINE_PREDECODED;
+            else if (!strcmp(argv[a], "jit"))
+                engine = CHIP8_ENGINE_JIT;
+            else {
+                chip8_aot_usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[a], "-q") && a + 1 < argc) {
+            if (!chip8_parse_quirks(argv[++a], quirks))
+                return 1;
+        }
+        else if (!strcmp(argv[a], "-s") && a + 1 < argc)
+            save_file = argv[++a];
+        else if (!strcmp(argv[a], "-n"))
+            idle_skip = false;
+        else {
+            chip8_aot_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (ipf == 0) {
+        chip8_aot_usage(argv[0]);
+        return 1;
+    }
+
+    // default to one emulated minute
+    if (cycles == 0 && frames == 0)
+        frames = 3600;
+    if (frames)
+        cycles = frames * ipf;
+
+    try {
+        Chip8Core core;
+        Chip8Aot aot (rom, rom_size, compiled, blocks, count);
+        if (!core.load_rom(rom, rom_size))
+            return 1;
+        core.set_quirks(quirks);
+        if (engine == CHIP8_ENGINE_AOT)
+            core.set_aot(&aot);
+        else
+            core.set_engine(engine);
+        if (!idle_skip)
+            core.set_idle_skip(false);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        core.run_frames(cycles / ipf, ipf);
+        core.run_cycles(cycles % ipf);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        printf("* %s: %llu instructions, %llu frames in %.6f s\n", name, core.get_cycles(), core.get_frames(), elapsed);
+        if (elapsed > 0)
+            printf("* %.0f instructions/s\n", core.get_cycles() / elapsed);
+        if (core.get_idle_cycles())
+            printf("* %llu of them skipped in idle loops\n", core.get_idle_cycles());
+        unsigned long long ran = aot.get_compiled() + aot.get_interpreted();
+        if (ran)
+            printf("* %.1f%% of the instructions run ran compiled\n", 100.0 * aot.get_compiled() / ran);
+        printf("* screen %016llx\n", core.screen_hash());
+
+        if (save_file) {
+            Chip8State state;
+            core.save_state(state);
+            if (!state.save(save_file))
+                return 1;
+        }
+        return 0;
+    } catch (const std::exception& e) {
+        printf("* Runtime error! %s\n", e.what());
+        return 1;
+    }
+}
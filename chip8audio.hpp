@@ -0,0 +1,246 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "chip8channel.hpp"
+
+// the beeper's state for one emulated frame, on its way to the audio thread
+struct Chip8AudioFrame {
+    bool gate;              // the sound timer was running during the frame
+    long long queued;       // steady clock ns when the frame was emulated
+};
+
+// square wave beeper. the emulation thread pushes one gate per emulated
+// frame; the audio side renders exactly rate / 60 samples per frame, so tone
+// edges land on the sample where their frame starts no matter how the
+// callback's buffers line up. playback starts once latency frames are
+// queued and falls back to waiting for them after an underrun; a queue that
+// grows past twice that (e.g. while fast forwarding) is trimmed back. the
+// queue is the only thing the threads share, and it's lock-free.
+class Chip8Beeper {
+private:
+    typedef std::chrono::steady_clock clock;
+
+    Chip8SpscQueue<Chip8AudioFrame, 256> frames;
+
+    unsigned int rate;
+    unsigned int frequency;
+    short int amplitude;
+    unsigned int latency;
+
+    // audio side
+    bool playing;
+    bool gate;
+    size_t left;            // samples left of the current frame
+    unsigned int remainder; // rate / 60 carried over in 1/60 samples
+    unsigned int phase;     // position in the wave period, in 1/rate s
+
+    std::atomic<unsigned long long> played;
+    std::atomic<unsigned long long> underruns;
+    std::atomic<unsigned long long> overruns;
+    std::atomic<unsigned long long> trimmed;
+    std::atomic<long long> latency_sum;
+    std::atomic<long long> latency_max;
+
+    static long long now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now().time_since_epoch()).count();
+    }
+
+    // start playing the next queued frame, false if there is none
+    bool next(long long start, size_t offset) {
+        Chip8AudioFrame frame;
+        if (!this->frames.pop(frame))
+            return false;
+        this->remainder += this->rate;
+        this->left = this->remainder / 60;
+        this->remainder %= 60;
+        // restart the wave on every rising edge, so every beep sounds the same
+        if (frame.gate && !this->gate)
+            this->phase = 0;
+        this->gate = frame.gate;
+
+        // emulated until heard: the wait in the queue, plus the samples ahead
+        // of this one in the buffer being filled
+        long long latency = start - frame.queued + (long long) offset * 1000000000LL / this->rate;
+        this->latency_sum.fetch_add(latency, std::memory_order_relaxed);
+        if (latency > this->latency_max.load(std::memory_order_relaxed))
+            this->latency_max.store(latency, std::memory_order_relaxed);
+        this->played.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+public:
+    // latency is in frames of 1/60 s
+    Chip8Beeper(unsigned int rate = 48000, unsigned int latency = 3, unsigned int frequency = 440) :
+        played(0), underruns(0), overruns(0), trimmed(0), latency_sum(0), latency_max(0) {
+        this->rate = rate;
+        this->frequency = frequency;
+        this->amplitude = 4000;
+        this->latency = latency;
+        this->playing = false;
+        this->gate = false;
+        this->left = 0;
+        this->remainder = 0;
+        this->phase = 0;
+    }
+
+    Chip8Beeper(const Chip8Beeper&) = delete;
+    Chip8Beeper& operator=(const Chip8Beeper&) = delete;
+
+    unsigned int get_rate() {
+        return this->rate;
+    }
+
+    unsigned int get_latency() {
+        return this->latency;
+    }
+
+    // emulation thread: once per emulated frame. a frame the audio side has
+    // no room for is lost
+    void push(bool gate) {
+        Chip8AudioFrame frame = { gate, now() };
+        if (!this->frames.push(frame))
+            this->overruns.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // audio thread: fill n signed 16-bit mono samples
+    void render(short int* out, size_t n) {
+        long long start = now();
+        size_t queued = this->frames.size();
+        if (!this->playing && queued >= this->latency)
+            this->playing = true;
+        // keep at most twice the latency queued, dropping the oldest frames
+        for (; this->playing && queued > 2 * this->latency + 1; queued--) {
+            Chip8AudioFrame frame;
+            this->frames.pop(frame);
+            this->trimmed.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        unsigned int half = this->rate / (2 * this->frequency);
+        for (size_t s = 0; s < n; s++) {
+            if (this->left == 0 && (!this->playing || !this->next(start, s))) {
+                // ran dry mid-stream: silence until the queue refills
+                if (this->playing)
+                    this->underruns.fetch_add(1, std::memory_order_relaxed);
+                this->playing = false;
+                this->gate = false;
+                memset(out + s, 0, (n - s) * sizeof(short int));
+                return;
+            }
+            out[s] = this->gate ? (this->phase < half ? this->amplitude : -this->amplitude) : 0;
+            if (++this->phase >= 2 * half)
+                this->phase = 0;
+            this->left--;
+        }
+    }
+
+    unsigned long long get_played() {
+        return this->played.load(std::memory_order_relaxed);
+    }
+
+    // the audio side needed a frame and none was queued
+    unsigned long long get_underruns() {
+        return this->underruns.load(std::memory_order_relaxed);
+    }
+
+    // frames pushed into a full queue
+    unsigned long long get_overruns() {
+        return this->overruns.load(std::memory_order_relaxed);
+    }
+
+    // frames dropped to keep the latency down
+    unsigned long long get_trimmed() {
+        return this->trimmed.load(std::memory_order_relaxed);
+    }
+
+    // measured from push() to the frame's first sample leaving render(),
+    // in ms. the device adds its own buffer on top
+    double get_average_latency() {
+        unsigned long long played = this->get_played();
+        return played ? this->latency_sum.load(std::memory_order_relaxed) / 1e6 / played : 0;
+    }
+
+    double get_max_latency() {
+        return this->latency_max.load(std::memory_order_relaxed) / 1e6;
+    }
+};
+
+// 16-bit mono PCM WAV file, for headless runs. the sizes in the header are
+// filled in on close
+class Chip8WavWriter {
+private:
+    FILE* file;
+    unsigned int rate;
+    unsigned long long samples;
+
+    static void put(unsigned char* out, unsigned int value, size_t bytes) {
+        for (size_t b = 0; b < bytes; b++)
+            out[b] = (value >> (b * 8)) & 0xFF;
+    }
+
+    void header() {
+        unsigned char out [44];
+        unsigned int bytes = this->samples * 2;
+        memcpy(out, "RIFF", 4);
+        put(out + 4, 36 + bytes, 4);
+        memcpy(out + 8, "WAVEfmt ", 8);
+        put(out + 16, 16, 4);
+        put(out + 20, 1, 2);                // PCM
+        put(out + 22, 1, 2);                // mono
+        put(out + 24, this->rate, 4);
+        put(out + 28, this->rate * 2, 4);   // bytes per second
+        put(out + 32, 2, 2);                // bytes per sample
+        put(out + 34, 16, 2);
+        memcpy(out + 36, "data", 4);
+        put(out + 40, bytes, 4);
+        fwrite(out, 1, sizeof(out), this->file);
+    }
+public:
+    Chip8WavWriter() {
+        this->file = NULL;
+        this->rate = 0;
+        this->samples = 0;
+    }
+
+    ~Chip8WavWriter() {
+        this->close();
+    }
+
+    Chip8WavWriter(const Chip8WavWriter&) = delete;
+    Chip8WavWriter& operator=(const Chip8WavWriter&) = delete;
+
+    bool open(const char* filename, unsigned int rate) {
+        this->close();
+        this->file = fopen(filename, "wb");
+        if (this->file == NULL) {
+            printf("* Unable to open file! (%s)\n", filename);
+            return false;
+        }
+        this->rate = rate;
+        this->samples = 0;
+        this->header();
+        return true;
+    }
+
+    void write(const short int* samples, size_t n) {
+        unsigned char out [2];
+        for (size_t s = 0; s < n; s++) {
+            put(out, (unsigned short int) samples[s], 2);
+            fwrite(out, 1, 2, this->file);
+        }
+        this->samples += n;
+    }
+
+    unsigned long long get_samples() {
+        return this->samples;
+    }
+
+    void close() {
+        if (this->file == NULL)
+            return;
+        fseek(this->file, 0, SEEK_SET);
+        this->header();
+        fclose(this->file);
+        this->file = NULL;
+    }
+};
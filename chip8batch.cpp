@@ -0,0 +1,217 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include "chip8pool.hpp"
+#include "chip8lockstep.hpp"
+#include "chip8scheduler.hpp"
+
+// runs many instances of one ROM in parallel, each with its own Cxkk seed,
+// and reports their final screens. -w runs them in lockstep groups of 16 or
+// 32 vector lanes instead of one core per instance:
+//   chip8batch <rom> [-n instances] [-j threads] [-f frames] [-i instructions_per_frame] [-e engine] [-w lanes] [-v]
+static void usage(const char* argv0) {
+    printf("usage: %s <rom> [-n instances] [-j threads] [-f frames] [-i instructions_per_frame] [-e interpreter|predecoded|jit]\n"
+           "       [-w 16|32] [-v]\n", argv0);
+}
+
+// lockstep groups share a counter the threads take groups from
+template <unsigned int LANES>
+struct Chip8LockstepBatch {
+    const unsigned char* rom;
+    size_t rom_size;
+    size_t instances;
+    unsigned long long frames;
+    unsigned int ipf;
+    std::atomic<size_t> next;
+    std::vector<Chip8PoolResult> results;
+
+    std::mutex lock;
+    unsigned long long steps;
+    unsigned long long lane_steps;
+    unsigned long long scalar_instructions;
+
+    void work() {
+        while (true) {
+            size_t first = this->next.fetch_add(LANES);
+            if (first >= this->instances)
+                break;
+
+            // every group starts from a clean machine
+            Chip8Lockstep<LANES> group;
+            group.load_rom(this->rom, this->rom_size);
+            for (unsigned int l = 0; l < LANES; l++)
+                group.seed(l, first + l + 1);
+            group.run_frames(this->frames, this->ipf);
+
+            for (unsigned int l = 0; l < LANES && first + l < this->instances; l++) {
+                Chip8PoolResult& r = this->results[first + l];
+                r.cycles = group.get_cycles();
+                r.frames = group.get_frames();
+                r.hash = group.screen_hash(l);
+                r.stalled = group.get_keyboard(l).is_awaiting();
+            }
+
+            std::lock_guard<std::mutex> guard(this->lock);
+            this->steps += group.get_steps();
+            this->lane_steps += group.get_lane_steps();
+            this->scalar_instructions += group.get_scalar_instructions();
+        }
+    }
+
+    void run(unsigned int threads) {
+        this->next = 0;
+        this->steps = 0;
+        this->lane_steps = 0;
+        this->scalar_instructions = 0;
+        this->results.resize(this->instances);
+
+        std::vector<std::thread> pool;
+        for (unsigned int t = 1; t < threads; t++)
+            pool.push_back(std::thread(&Chip8LockstepBatch::work, this));
+        this->work();
+        for (size_t t = 0; t < pool.size(); t++)
+            pool[t].join();
+    }
+};
+
+static void report(const char* mode, size_t instances, unsigned int threads, const Chip8PoolResult* results,
+                   unsigned long long instructions, double elapsed, bool verbose) {
+    size_t stalled = 0;
+    std::vector<unsigned long long> hashes;
+    for (size_t k = 0; k < instances; k++) {
+        const Chip8PoolResult& r = results[k];
+        if (verbose)
+            printf("%zu: %llu instructions, %llu frames, screen %016llx%s\n", k, r.cycles, r.frames, r.hash, r.stalled ? " (stalled on Fx0A)" : "");
+        if (r.stalled)
+            stalled++;
+        hashes.push_back(r.hash);
+    }
+    std::sort(hashes.begin(), hashes.end());
+    size_t distinct = std::unique(hashes.begin(), hashes.end()) - hashes.begin();
+
+    printf("* %zu instances (%s) on %u threads, %zu stalled, %zu distinct screens\n", instances, mode, threads, stalled, distinct);
+    printf("* %llu instructions in %.6f s\n", instructions, elapsed);
+    if (elapsed > 0)
+        printf("* %.0f instructions/s\n", instructions / elapsed);
+}
+
+template <unsigned int LANES>
+static int run_lockstep(const char* rom, size_t instances, unsigned int threads, unsigned long long frames, unsigned int ipf, bool verbose) {
+    FILE* game_file = fopen(rom, "rb");
+    if (game_file == NULL) {
+        printf("* Unable to open file! (%s)\n", rom);
+        return 1;
+    }
+    unsigned char data [3233];
+    size_t size = fread(data, 1, sizeof(data), game_file);
+    fclose(game_file);
+    if (size > 3232) {
+        printf("* File too large! (%zu)\n", size);
+        return 1;
+    }
+
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    Chip8LockstepBatch<LANES> batch;
+    batch.rom = data;
+    batch.rom_size = size;
+    batch.instances = instances;
+    batch.frames = frames;
+    batch.ipf = ipf;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    batch.run(threads);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    char mode [32];
+    snprintf(mode, sizeof(mode), "lockstep x%u", LANES);
+    report(mode, instances, threads, batch.results.data(), frames * ipf * instances, elapsed, verbose);
+
+    // lane-instructions: what the groups ran, including lanes past the last instance
+    unsigned long long total = batch.lane_steps + batch.scalar_instructions;
+    if (batch.steps)
+        printf("* lane occupancy %.1f%%, %.1f%% of lane-instructions run in scalar\n",
+            100.0 * batch.lane_steps / (batch.steps * LANES), total ? 100.0 * batch.scalar_instructions / total : 0);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char* rom = NULL;
+    size_t instances = 1000;
+    unsigned int threads = 0;
+    unsigned long long frames = 3600;
+    unsigned int ipf = CHIP8_DEFAULT_IPF;
+    Chip8Engine engine = CHIP8_ENGINE_INTERPRETER;
+    bool verbose = false;
+    unsigned int lanes = 0;
+
+    for (int a = 1; a < argc; a++) {
+        if (!strcmp(argv[a], "-n") && a + 1 < argc)
+            instances = strtoull(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-j") && a + 1 < argc)
+            threads = strtoul(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-f") && a + 1 < argc)
+            frames = strtoull(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-i") && a + 1 < argc)
+            ipf = strtoul(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-e") && a + 1 < argc) {
+            a++;
+            if (!strcmp(argv[a], "interpreter"))
+                engine = CHIP8_ENGINE_INTERPRETER;
+            else if (!strcmp(argv[a], "predecoded"))
+                engine = CHIP8_ENGINE_PREDECODED;
+            else if (!strcmp(argv[a], "jit"))
+                engine = CHIP8_ENGINE_JIT;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[a], "-w") && a + 1 < argc)
+            lanes = strtoul(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-v"))
+            verbose = true;
+        else if (argv[a][0] != '-')
+            rom = argv[a];
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (rom == NULL || instances == 0 || ipf == 0 || (lanes != 0 && lanes != 16 && lanes != 32)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    try {
+        if (lanes == 16)
+            return run_lockstep<16>(rom, instances, threads, frames, ipf, verbose);
+        else if (lanes == 32)
+            return run_lockstep<32>(rom, instances, threads, frames, ipf, verbose);
+
+        Chip8Pool pool(instances, threads);
+        pool.set_engine(engine);
+        if (!pool.load_game(rom))
+            return 1;
+
+        pool.run(frames, ipf);
+
+        std::vector<Chip8PoolResult> results;
+        for (size_t k = 0; k < pool.size(); k++)
+            results.push_back(pool.get_result(k));
+        report("cores", pool.size(), pool.get_threads(), results.data(), pool.get_instructions(), pool.get_elapsed(), verbose);
+
+        return 0;
+    } catch (const std::exception& e) {
+        printf("* Runtime error! %s\n", e.what());
+        return 1;
+    }
+}
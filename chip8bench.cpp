@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "chip8core.hpp"
+#include "chip8framebuffer.hpp"
+
+// benchmarks the execution engines on synthetic ROMs that each stress one
+// path, plus optionally every .ch8 in a directory, and times the renderer's
+// framebuffer expansion:
+//   chip8bench [-d rom_dir] [-e engine] [-n instructions] [-r repetitions] [-i instructions_per_frame]
+static void usage(const char* argv0) {
+    printf("usage: %s [-d rom_dir] [-e interpreter|predecoded|jit] [-n instructions] [-r repetitions] [-i instructions_per_frame]\n", argv0);
+}
+
+struct Chip8BenchRom {
+    std::string name;
+    std::vector<unsigned char> data;
+    // Dxyn per instruction in the steady state loop, 0 if unknown
+    double draws;
+};
+
+static Chip8BenchRom assemble(const char* name, double draws, std::vector<unsigned short int> program) {
+    Chip8BenchRom rom;
+    rom.name = name;
+    rom.draws = draws;
+    for (size_t k = 0; k < program.size(); k++) {
+        rom.data.push_back(program[k] >> 8);
+        rom.data.push_back(program[k] & 0xFF);
+    }
+    return rom;
+}
+
+// programs start at 0x200; gaps are padded with 0000, which executes as a no-op
+static std::vector<Chip8BenchRom> synthetic_roms() {
+    std::vector<Chip8BenchRom> roms;
+
+    // 8xyN arithmetic in a tight loop (10 instructions)
+    roms.push_back(assemble("alu", 0, {
+        0x6001, 0x6103, 0x6207,
+        0x8014, 0x8125, 0x8236, 0x8013, 0x8317, 0x842E, 0x8501, 0x8652, 0x7001, 0x1206 }));
+
+    // 15 row sprites at unaligned x, y kept on screen (5 instructions, 1 draw)
+    roms.push_back(assemble("draw", 1.0 / 5, {
+        0xA000, 0x6000, 0x6100, 0x621F,
+        0xD01F, 0x7009, 0x7103, 0x8122, 0x1208 }));
+
+    // four nested 2nnn/00EE levels (10 instructions)
+    roms.push_back(assemble("call", 0, {
+        0x2210, 0x1200, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+        0x2220, 0x00EE, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+        0x2230, 0x00EE, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+        0x2240, 0x00EE, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+        0x7001, 0x00EE }));
+
+    // 16 byte Fx55/Fx65 transfers to a data page (3 instructions)
+    roms.push_back(assemble("bulk", 0, {
+        0xA300, 0xFF55, 0xFF65, 0x1202 }));
+
+    return roms;
+}
+
+static bool read_rom(const std::filesystem::path& path, Chip8BenchRom& rom) {
+    FILE* in = fopen(path.string().c_str(), "rb");
+    if (in == NULL) {
+        printf("* Unable to open file! (%s)\n", path.string().c_str());
+        return false;
+    }
+    unsigned char data [3233];
+    size_t size = fread(data, 1, sizeof(data), in);
+    fclose(in);
+    if (size > 3232) {
+        printf("* File too large, skipped! (%s)\n", path.string().c_str());
+        return false;
+    }
+
+    rom.name = path.filename().string();
+    rom.data.assign(data, data + size);
+    rom.draws = 0;
+    return true;
+}
+
+// median, spread and coefficient of variation of the repetitions
+struct Chip8BenchStats {
+    double median;
+    double min;
+    double max;
+    double cv;
+};
+
+static Chip8BenchStats summarize(std::vector<double> samples) {
+    Chip8BenchStats stats;
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    stats.median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    stats.min = samples.front();
+    stats.max = samples.back();
+
+    double mean = 0;
+    for (size_t k = 0; k < n; k++)
+        mean += samples[k];
+    mean /= n;
+    double var = 0;
+    for (size_t k = 0; k < n; k++)
+        var += (samples[k] - mean) * (samples[k] - mean);
+    stats.cv = n > 1 && mean > 0 ? std::sqrt(var / (n - 1)) / mean : 0;
+    return stats;
+}
+
+static const char* engine_name(Chip8Engine engine) {
+    switch (engine) {
+    case CHIP8_ENGINE_PREDECODED: return "predecoded";
+    case CHIP8_ENGINE_JIT: return "jit";
+    default: return "interpreter";
+    }
+}
+
+// ns per instruction of every repetition; each one runs on a fresh core
+// after an untimed warmup, so caches and translations are in steady state
+static std::vector<double> time_engine(const Chip8BenchRom& rom, Chip8Engine engine, unsigned long long instructions,
+                                       unsigned int repetitions, unsigned int ipf, unsigned long long& checksum) {
+    std::vector<double> samples;
+    unsigned long long frames = (instructions + ipf - 1) / ipf;
+    for (unsigned int r = 0; r < repetitions; r++) {
+        Chip8Core core;
+        core.set_engine(engine);
+        core.load_rom(rom.data.data(), rom.data.size());
+        core.run_frames(frames / 10 + 1, ipf);
+
+        unsigned long long start_cycles = core.get_cycles();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        core.run_frames(frames, ipf);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        samples.push_back(elapsed * 1e9 / (core.get_cycles() - start_cycles));
+        checksum ^= core.screen_hash();
+    }
+    return samples;
+}
+
+int main(int argc, char** argv) {
+    const char* rom_dir = NULL;
+    unsigned long long instructions = 2000000;
+    unsigned int repetitions = 5;
+    unsigned int ipf = 1000;
+    std::vector<Chip8Engine> engines = { CHIP8_ENGINE_INTERPRETER, CHIP8_ENGINE_PREDECODED, CHIP8_ENGINE_JIT };
+
+    for (int a = 1; a < argc; a++) {
+        if (!strcmp(argv[a], "-d") && a + 1 < argc)
+            rom_dir = argv[++a];
+        else if (!strcmp(argv[a], "-n") && a + 1 < argc)
+            instructions = strtoull(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-r") && a + 1 < argc)
+            repetitions = strtoul(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-i") && a + 1 < argc)
+            ipf = strtoul(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-e") && a + 1 < argc) {
+            a++;
+            if (!strcmp(argv[a], "interpreter"))
+                engines = { CHIP8_ENGINE_INTERPRETER };
+            else if (!strcmp(argv[a], "predecoded"))
+                engines = { CHIP8_ENGINE_PREDECODED };
+            else if (!strcmp(argv[a], "jit"))
+                engines = { CHIP8_ENGINE_JIT };
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (instructions == 0 || repetitions == 0 || ipf == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    try {
+        std::vector<Chip8BenchRom> roms = synthetic_roms();
+        if (rom_dir) {
+            std::vector<std::filesystem::path> paths;
+            for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(rom_dir)) {
+                if (entry.is_regular_file() && entry.path().extension() == ".ch8")
+                    paths.push_back(entry.path());
+            }
+            // directory order isn't stable, the report should be
+            std::sort(paths.begin(), paths.end());
+            for (size_t k = 0; k < paths.size(); k++) {
+                Chip8BenchRom rom;
+                if (read_rom(paths[k], rom))
+                    roms.push_back(rom);
+            }
+        }
+
+        printf("* %llu instructions x %u repetitions, %u instructions per frame\n", instructions, repetitions, ipf);
+        printf("%-20s %-12s %10s %21s %7s %12s %12s\n", "rom", "engine", "ns/instr", "(min - max)", "cv", "instr/s", "draws/s");
+
+        unsigned long long checksum = 0;
+        for (size_t k = 0; k < roms.size(); k++) {
+            for (size_t e = 0; e < engines.size(); e++) {
+                Chip8BenchStats stats = summarize(time_engine(roms[k], engines[e], instructions, repetitions, ipf, checksum));
+                double ips = 1e9 / stats.median;
+                printf("%-20s %-12s %10.3f   (%7.3f - %7.3f)   %5.1f%% %12.0f ", roms[k].name.c_str(), engine_name(engines[e]),
+                    stats.median, stats.min, stats.max, 100 * stats.cv, ips);
+                if (roms[k].draws > 0)
+                    printf("%12.0f\n", ips * roms[k].draws);
+                else
+                    printf("%12s\n", "-");
+            }
+        }
+
+        // renderer: expanding the framebuffer the draw benchmark left behind
+        Chip8Core core;
+        core.load_rom(roms[1].data.data(), roms[1].data.size());
+        core.run_cycles(100000);
+
+        std::vector<unsigned int> pixels (128 * 64);
+        const unsigned int frames = 20000;
+        std::vector<double> samples;
+        for (unsigned int r = 0; r < repetitions; r++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (unsigned int f = 0; f < frames; f++) {
+                core.get_framebuffer().expand(pixels.data(), 128 * sizeof(unsigned int));
+                checksum += pixels[f & 0x7FF];
+            }
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            samples.push_back(elapsed * 1e9 / frames);
+        }
+        Chip8BenchStats stats = summarize(samples);
+        printf("%-20s %-12s %10.1f   (%7.1f - %7.1f)   %5.1f%% %12s %12s\n", "renderer", "expand", stats.median,
+            stats.min, stats.max, 100 * stats.cv, "ns/frame", "-");
+
+        // keeps the work observable, so none of it can be optimized away
+        printf("* checksum %016llx\n", checksum);
+        return 0;
+    } catch (const std::exception& e) {
+        printf("* Runtime error! %s\n", e.what());
+        return 1;
+    }
+}
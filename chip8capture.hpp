@@ -0,0 +1,447 @@
+#pragma once
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "chip8channel.hpp"
+#include "chip8framebuffer.hpp"
+
+enum Chip8CaptureFormat {
+    CHIP8_CAPTURE_RAW,  // 8-bit grayscale frames back to back, no header
+    CHIP8_CAPTURE_Y4M,  // YUV4MPEG2 (luma only), 60 fps
+    CHIP8_CAPTURE_GIF   // animated GIF, one image per change
+};
+
+// one slot of the capture pool
+struct Chip8CaptureFrame {
+    Chip8Framebuffer framebuffer;
+    // frames dropped right before this one because the pool was full
+    unsigned int missed;
+    bool end;
+};
+
+// records every frame of a run to a lossless video file without slowing the
+// emulation down. capture() copies the framebuffer into a preallocated slot
+// of a lock-free ring (about a kilobyte, no allocation, no lock, no syscall)
+// and a writer thread does everything else: it drops duplicate frames,
+// scales, encodes and writes.
+//
+// the video is always 128x64 times the scale, so a ROM switching between the
+// 64x32 and 128x64 modes keeps one size (64x32 pixels come out as 2x2
+// blocks). raw and Y4M files have one picture per emulated frame; GIF has
+// one per change and stretches its delay over the duplicates, rounded to the
+// 1/100 s GIF counts in. a change shorter than 1/50 s (which many viewers
+// would slow down) is merged into the next one.
+//
+// when the writer falls behind and the ring is full, capture() either waits
+// for a slot (block) or drops the frame; the writer repeats the previous
+// picture in its place so the timeline stays intact.
+class Chip8Capture {
+private:
+    static const size_t SLOTS = 64;
+
+    Chip8SpscQueue<Chip8CaptureFrame, SLOTS> queue;
+    std::thread writer;
+    FILE* file;
+    Chip8CaptureFormat format;
+    unsigned int scale;
+    bool block;
+    unsigned int width;
+    unsigned int height;
+
+    // emulation thread
+    unsigned long long captured;
+    unsigned long long dropped;
+    unsigned long long stalls;
+    size_t max_queued;
+    unsigned int missed;
+
+    // writer thread, read back after close()
+    Chip8Framebuffer last;
+    bool have_last;
+    std::vector<unsigned char> pixels;
+    unsigned long long unique;
+    unsigned long long duplicates;
+    unsigned long long written;
+
+    // GIF: the image waiting for its delay, and the frame it started on
+    std::vector<unsigned char> pending;
+    bool have_pending;
+    unsigned long long pending_start;
+    unsigned long long time;
+
+    static void put(unsigned char* out, unsigned int value, size_t bytes) {
+        for (size_t b = 0; b < bytes; b++)
+            out[b] = (value >> (b * 8)) & 0xFF;
+    }
+
+    static bool same(Chip8Framebuffer& a, Chip8Framebuffer& b) {
+        if (a.is_hires() != b.is_hires())
+            return false;
+        for (unsigned int y = 0; y < 64; y++)
+            if (a.get_row(y)[0] != b.get_row(y)[0] || a.get_row(y)[1] != b.get_row(y)[1])
+                return false;
+        return true;
+    }
+
+    // the last frame scaled to the video size, 0 or 255 per pixel
+    void render() {
+        bool hires = this->last.is_hires();
+        unsigned int unit = hires ? this->scale : this->scale * 2;
+        unsigned char* out = this->pixels.data();
+        for (unsigned int y = 0; y < this->height; y++, out += this->width) {
+            if (y % unit) {
+                memcpy(out, out - this->width, this->width);
+                continue;
+            }
+            const unsigned long long* row = this->last.get_row(y / unit);
+            for (unsigned int x = 0; x < this->width; x++) {
+                unsigned int px = x / unit;
+                out[x] = (row[px >> 6] >> (63 - (px & 63))) & 0x01 ? 255 : 0;
+            }
+        }
+    }
+
+    void header() {
+        if (this->format == CHIP8_CAPTURE_Y4M)
+            fprintf(this->file, "YUV4MPEG2 W%u H%u F60:1 Ip A1:1 Cmono\n", this->width, this->height);
+        else if (this->format == CHIP8_CAPTURE_GIF) {
+            // two color global palette, looping forever
+            unsigned char out [13 + 6 + 19];
+            memcpy(out, "GIF89a", 6);
+            put(out + 6, this->width, 2);
+            put(out + 8, this->height, 2);
+            out[10] = 0x80;
+            out[11] = 0;
+            out[12] = 0;
+            memcpy(out + 13, "\x00\x00\x00\xFF\xFF\xFF", 6);
+            memcpy(out + 19, "\x21\xFF\x0BNETSCAPE2.0\x03\x01\x00\x00\x00", 19);
+            fwrite(out, 1, sizeof(out), this->file);
+        }
+    }
+
+    // GIF image data: LZW with 2 bit codes to start (the smallest GIF
+    // allows) over pixels that are only ever 0 or 1
+    void lzw(const std::vector<unsigned char>& image) {
+        const unsigned int CLEAR = 4;
+        const unsigned int EOI = 5;
+        std::vector<unsigned short int> next (4096 * 2, 0);
+        unsigned int max_code = EOI;
+        unsigned int size = 3;
+
+        unsigned char block [256];
+        unsigned int used = 0;
+        unsigned int bits = 0;
+        unsigned int count = 0;
+        fputc(2, this->file);
+        auto write_code = [&](unsigned int code) {
+            bits |= code << count;
+            count += size;
+            while (count >= 8) {
+                block[1 + used++] = bits & 0xFF;
+                bits >>= 8;
+                count -= 8;
+                if (used == 255) {
+                    block[0] = used;
+                    fwrite(block, 1, used + 1, this->file);
+                    used = 0;
+                }
+            }
+        };
+
+        write_code(CLEAR);
+        unsigned int code = image[0] ? 1 : 0;
+        for (size_t p = 1; p < image.size(); p++) {
+            unsigned int pixel = image[p] ? 1 : 0;
+            if (next[code * 2 + pixel]) {
+                code = next[code * 2 + pixel];
+                continue;
+            }
+            write_code(code);
+            next[code * 2 + pixel] = ++max_code;
+            if (max_code >= (1u << size))
+                size++;
+            if (max_code == 4095) {
+                write_code(CLEAR);
+                std::fill(next.begin(), next.end(), 0);
+                max_code = EOI;
+                size = 3;
+            }
+            code = pixel;
+        }
+        write_code(code);
+        write_code(EOI);
+        if (count)
+            block[1 + used++] = bits & 0xFF;
+        if (used) {
+            block[0] = used;
+            fwrite(block, 1, used + 1, this->file);
+        }
+        fputc(0, this->file);
+    }
+
+    // the pending image, shown until the given frame
+    void flush_gif(unsigned long long until) {
+        // centiseconds since the start, rounded, so the delays add up
+        unsigned int delay = (until * 100 + 30) / 60 - (this->pending_start * 100 + 30) / 60;
+        unsigned char out [8 + 10];
+        memcpy(out, "\x21\xF9\x04\x00", 4);
+        put(out + 4, delay, 2);
+        out[6] = 0;
+        out[7] = 0;
+        out[8] = 0x2C;
+        put(out + 9, 0, 2);
+        put(out + 11, 0, 2);
+        put(out + 13, this->width, 2);
+        put(out + 15, this->height, 2);
+        out[17] = 0;
+        fwrite(out, 1, sizeof(out), this->file);
+        this->lzw(this->pending);
+        this->written++;
+    }
+
+    // one more emulated frame showing the last frame; changed if it wasn't
+    // on screen in the frame before
+    void emit(bool changed) {
+        if (this->format == CHIP8_CAPTURE_GIF) {
+            // a delay has 16 bits, so a picture that stays for over ten
+            // minutes goes in again
+            if (this->have_pending && (this->time * 100 + 30) / 60 - (this->pending_start * 100 + 30) / 60 >= 60000) {
+                this->flush_gif(this->time);
+                this->pending_start = this->time;
+            }
+            if (changed) {
+                if (this->have_pending && (this->time * 100 + 30) / 60 - (this->pending_start * 100 + 30) / 60 >= 2) {
+                    this->flush_gif(this->time);
+                    this->pending_start = this->time;
+                }
+                if (!this->have_pending)
+                    this->pending_start = this->time;
+                this->pending = this->pixels;
+                this->have_pending = true;
+            }
+            this->time++;
+            return;
+        }
+        if (this->format == CHIP8_CAPTURE_Y4M)
+            fputs("FRAME\n", this->file);
+        fwrite(this->pixels.data(), 1, this->pixels.size(), this->file);
+        this->written++;
+    }
+
+    void work() {
+        while (true) {
+            Chip8CaptureFrame* frame = this->queue.peek();
+            if (frame == NULL) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            if (frame->end) {
+                // frames dropped at the very end still take their time
+                if (this->have_last)
+                    for (unsigned int m = 0; m < frame->missed; m++)
+                        this->emit(false);
+                this->queue.release();
+                break;
+            }
+
+            if (this->have_last)
+                for (unsigned int m = 0; m < frame->missed; m++)
+                    this->emit(false);
+            if (this->have_last && same(frame->framebuffer, this->last)) {
+                this->queue.release();
+                this->duplicates++;
+                this->emit(false);
+                continue;
+            }
+            this->last = frame->framebuffer;
+            this->queue.release();
+            this->have_last = true;
+            this->unique++;
+            this->render();
+            this->emit(true);
+        }
+
+        if (this->format == CHIP8_CAPTURE_GIF) {
+            if (this->have_pending) {
+                // the last image still needs a visible delay
+                unsigned long long until = this->time;
+                if ((until * 100 + 30) / 60 - (this->pending_start * 100 + 30) / 60 < 2)
+                    until = this->pending_start + 2;
+                this->flush_gif(until);
+            }
+            fputc(0x3B, this->file);
+        }
+    }
+public:
+    Chip8Capture() {
+        this->file = NULL;
+        this->format = CHIP8_CAPTURE_RAW;
+        this->scale = 1;
+        this->block = true;
+        this->width = 0;
+        this->height = 0;
+        this->captured = 0;
+        this->dropped = 0;
+        this->stalls = 0;
+        this->max_queued = 0;
+        this->missed = 0;
+        this->have_last = false;
+        this->unique = 0;
+        this->duplicates = 0;
+        this->written = 0;
+        this->have_pending = false;
+        this->pending_start = 0;
+        this->time = 0;
+    }
+
+    ~Chip8Capture() {
+        this->close();
+    }
+
+    Chip8Capture(const Chip8Capture&) = delete;
+    Chip8Capture& operator=(const Chip8Capture&) = delete;
+
+    // by extension: .gif, .y4m, anything else raw
+    static Chip8CaptureFormat format_of(const char* filename) {
+        const char* dot = strrchr(filename, '.');
+        if (dot && !strcmp(dot, ".gif"))
+            return CHIP8_CAPTURE_GIF;
+        if (dot && !strcmp(dot, ".y4m"))
+            return CHIP8_CAPTURE_Y4M;
+        return CHIP8_CAPTURE_RAW;
+    }
+
+    // block picks waiting over dropping when the writer falls behind
+    bool open(const char* filename, Chip8CaptureFormat format, unsigned int scale, bool block) {
+        this->close();
+        if (scale == 0 || scale > 16) {
+            printf("* Invalid video scale! (%u)\n", scale);
+            return false;
+        }
+        this->file = fopen(filename, "wb");
+        if (this->file == NULL) {
+            printf("* Unable to open file! (%s)\n", filename);
+            return false;
+        }
+
+        this->format = format;
+        this->scale = scale;
+        this->block = block;
+        this->width = 128 * scale;
+        this->height = 64 * scale;
+        this->captured = 0;
+        this->dropped = 0;
+        this->stalls = 0;
+        this->max_queued = 0;
+        this->missed = 0;
+        this->have_last = false;
+        this->pixels.assign((size_t) this->width * this->height, 0);
+        this->unique = 0;
+        this->duplicates = 0;
+        this->written = 0;
+        this->have_pending = false;
+        this->time = 0;
+
+        this->header();
+        this->writer = std::thread(&Chip8Capture::work, this);
+        return true;
+    }
+
+    bool is_open() {
+        return this->file != NULL;
+    }
+
+    // called once per emulated frame, from the emulation thread. returns
+    // false if there was no free slot, whether the frame was dropped or had
+    // to wait
+    bool capture(Chip8Framebuffer& framebuffer) {
+        Chip8CaptureFrame* slot = this->queue.claim();
+        bool free = slot != NULL;
+        if (slot == NULL) {
+            if (!this->block) {
+                this->dropped++;
+                this->missed++;
+                return false;
+            }
+            this->stalls++;
+            while ((slot = this->queue.claim()) == NULL)
+                std::this_thread::yield();
+        }
+        slot->framebuffer = framebuffer;
+        slot->missed = this->missed;
+        slot->end = false;
+        this->queue.publish();
+        this->missed = 0;
+        this->captured++;
+
+        size_t queued = this->queue.size();
+        if (queued > this->max_queued)
+            this->max_queued = queued;
+        return free;
+    }
+
+    // waits for the writer to catch up and finishes the file
+    void close() {
+        if (this->file == NULL)
+            return;
+        Chip8CaptureFrame* slot;
+        while ((slot = this->queue.claim()) == NULL)
+            std::this_thread::yield();
+        slot->missed = this->missed;
+        slot->end = true;
+        this->queue.publish();
+        this->writer.join();
+        this->missed = 0;
+
+        fclose(this->file);
+        this->file = NULL;
+    }
+
+    unsigned int get_width() {
+        return this->width;
+    }
+
+    unsigned int get_height() {
+        return this->height;
+    }
+
+    // frames handed to the writer, and those that found the pool full:
+    // dropped ones, or (blocking) ones that had to wait
+    unsigned long long get_captured() {
+        return this->captured;
+    }
+
+    unsigned long long get_dropped() {
+        return this->dropped;
+    }
+
+    unsigned long long get_stalls() {
+        return this->stalls;
+    }
+
+    // the most frames ever waiting for the writer, out of get_slots()
+    size_t get_max_queued() {
+        return this->max_queued;
+    }
+
+    static size_t get_slots() {
+        return SLOTS;
+    }
+
+    // after close(): distinct frames encoded, frames equal to the one before,
+    // and pictures in the file
+    unsigned long long get_unique() {
+        return this->unique;
+    }
+
+    unsigned long long get_duplicates() {
+        return this->duplicates;
+    }
+
+    unsigned long long get_written() {
+        return this->written;
+    }
+};
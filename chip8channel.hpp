@@ -0,0 +1,122 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+// lock-free hand-off between exactly one producer thread and one consumer
+// thread, e.g. the SDL thread and the emulation thread
+
+// bounded ring of messages. push fails when the ring is full and pop when
+// it's empty; neither ever blocks.
+template <typename T, size_t SIZE>
+class Chip8SpscQueue {
+private:
+    static_assert(SIZE && (SIZE & (SIZE - 1)) == 0, "queue size must be a power of two");
+
+    T items [SIZE];
+    // free running counters, each written by one side only and kept on
+    // separate cache lines so the two threads don't fight over them
+    alignas(64) std::atomic<size_t> head;   // next item to pop
+    alignas(64) std::atomic<size_t> tail;   // next slot to push into
+public:
+    Chip8SpscQueue() : head(0), tail(0) {}
+
+    Chip8SpscQueue(const Chip8SpscQueue&) = delete;
+    Chip8SpscQueue& operator=(const Chip8SpscQueue&) = delete;
+
+    // producer side
+    bool push(const T& item) {
+        size_t tail = this->tail.load(std::memory_order_relaxed);
+        if (tail - this->head.load(std::memory_order_acquire) == SIZE)
+            return false;
+        this->items[tail & (SIZE - 1)] = item;
+        this->tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // producer side, in place: the slot the next push would fill, NULL if
+    // the ring is full. publish() hands it over
+    T* claim() {
+        size_t tail = this->tail.load(std::memory_order_relaxed);
+        if (tail - this->head.load(std::memory_order_acquire) == SIZE)
+            return NULL;
+        return &this->items[tail & (SIZE - 1)];
+    }
+
+    void publish() {
+        this->tail.store(this->tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // items queued; exact from the consumer side, a lower bound from the
+    // producer side
+    size_t size() {
+        return this->tail.load(std::memory_order_acquire) - this->head.load(std::memory_order_relaxed);
+    }
+
+    // consumer side
+    bool pop(T& item) {
+        size_t head = this->head.load(std::memory_order_relaxed);
+        if (head == this->tail.load(std::memory_order_acquire))
+            return false;
+        item = this->items[head & (SIZE - 1)];
+        this->head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side, in place: the next item, NULL if there is none. it
+    // stays valid until release()
+    T* peek() {
+        size_t head = this->head.load(std::memory_order_relaxed);
+        if (head == this->tail.load(std::memory_order_acquire))
+            return NULL;
+        return &this->items[head & (SIZE - 1)];
+    }
+
+    void release() {
+        this->head.store(this->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
+
+// latest-value hand-off of a large object. the producer fills back() and
+// publishes it, the consumer picks up whatever was published last with
+// update() and reads front(). neither side waits for the other, and
+// intermediate values the consumer was too slow for are simply dropped.
+template <typename T>
+class Chip8TripleBuffer {
+private:
+    static const unsigned int FRESH = 0x4;
+
+    T buffers [3];
+    unsigned int back_index;    // owned by the producer
+    unsigned int front_index;   // owned by the consumer
+    // the buffer in between, plus FRESH when the consumer hasn't seen it yet
+    alignas(64) std::atomic<unsigned int> middle;
+public:
+    Chip8TripleBuffer() : back_index(0), front_index(1), middle(2) {}
+
+    Chip8TripleBuffer(const Chip8TripleBuffer&) = delete;
+    Chip8TripleBuffer& operator=(const Chip8TripleBuffer&) = delete;
+
+    // producer side
+    T& back() {
+        return this->buffers[this->back_index];
+    }
+
+    // true if this replaced a buffer the consumer never saw
+    bool publish() {
+        unsigned int previous = this->middle.exchange(this->back_index | FRESH, std::memory_order_acq_rel);
+        this->back_index = previous & 0x3;
+        return previous & FRESH;
+    }
+
+    // consumer side: true if front() changed since the last update
+    bool update() {
+        if (!(this->middle.load(std::memory_order_relaxed) & FRESH))
+            return false;
+        this->front_index = this->middle.exchange(this->front_index, std::memory_order_acq_rel) & 0x3;
+        return true;
+    }
+
+    T& front() {
+        return this->buffers[this->front_index];
+    }
+};
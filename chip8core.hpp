@@ -0,0 +1,516 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include "chip8timer.hpp"
+#include "chip8keyboard.hpp"
+#include "chip8cpu.hpp"
+#include "chip8predecode.hpp"
+#include "chip8jit.hpp"
+#include "chip8aot.hpp"
+#include "chip8debug.hpp"
+#include "chip8state.hpp"
+#include "chip8framebuffer.hpp"
+#include "chip8hash.hpp"
+
+// execution engines a core can run its cpu with, selectable at runtime
+enum Chip8Engine {
+    CHIP8_ENGINE_INTERPRETER,
+    CHIP8_ENGINE_PREDECODED,
+    CHIP8_ENGINE_JIT,
+    CHIP8_ENGINE_AOT      // a ROM compiled by chip8aot, see set_aot()
+};
+
+// the whole machine minus any frontend: memory, cpu, framebuffer, timers
+// and key states.
+// nothing in here depends on SDL, so it can run on render-less hosts.
+// an interpreted core is one cache line aligned block with nothing on the
+// heap, so it can be placed in a caller's arena (see libchip8.h).
+class alignas(64) Chip8Core {
+private:
+    unsigned char memory [4096];
+
+    Chip8Cpu cpu;
+    Chip8Framebuffer framebuffer;
+    Chip8Timer delay_timer;
+    Chip8Timer sound_timer;
+    Chip8Keyboard keyboard;
+
+    // engines are only allocated once selected, so large pools of
+    // interpreted cores don't carry their tables around
+    Chip8Engine engine;
+    Chip8Predecoder* predecoder;
+    Chip8Jit* jit;
+    // not owned: it lives in the program chip8aot generated
+    Chip8Aot* aot;
+    // false whenever memory may have changed behind the active engine's back
+    bool decoded;
+
+    // NULL until first asked for, and only consulted while armed
+    Chip8Debugger* debugger;
+
+    unsigned long long cycles;
+    unsigned long long frames;
+
+    // the sound timer was running during the last frame
+    bool beeping;
+
+    // fast-forward through idle loops, and how many instructions that saved
+    bool idle_skip;
+    unsigned long long idle_cycles;
+
+    // n instructions on the active engine
+    void execute(unsigned long long n) {
+        if (this->engine == CHIP8_ENGINE_PREDECODED) {
+            if (!this->decoded) {
+                this->predecoder->set_quirks(this->cpu.get_quirks());
+                this->predecoder->decode_all(this->memory);
+                this->decoded = true;
+            }
+            this->predecoder->run(this->cpu, this->memory, this->framebuffer, this->delay_timer, this->sound_timer, this->keyboard, n);
+        } else if (this->engine == CHIP8_ENGINE_JIT) {
+            if (!this->decoded) {
+                this->jit->set_quirks(this->cpu.get_quirks());
+                this->jit->flush();
+                this->decoded = true;
+            }
+            this->jit->run(this->cpu, this->memory, this->framebuffer, this->delay_timer, this->sound_timer, this->keyboard, n);
+        } else if (this->engine == CHIP8_ENGINE_AOT) {
+            if (!this->decoded) {
+                this->aot->revalidate(this->memory);
+                this->decoded = true;
+            }
+            this->aot->run(this->cpu, this->memory, this->framebuffer, this->delay_timer, this->sound_timer, this->keyboard, n);
+        } else {
+            this->cpu.run(this->memory, this->framebuffer, this->delay_timer, this->sound_timer, this->keyboard, n);
+            this->decoded = false;
+        }
+        this->cycles += n;
+    }
+
+    unsigned short int fetch(unsigned int addr) {
+        return (this->memory[addr & 0xFFF] << 8) | this->memory[(addr + 1) & 0xFFF];
+    }
+
+    // length in instructions of the idle loop starting at addr, 0 if there
+    // is none or it would end during this frame. recognized are a jump to
+    // itself, Fx0A still waiting for a key, and polls of the delay timer
+    // (Fx07, 3xkk/4xkk, 1nnn back) or a key (Ex9E/ExA1, 1nnn back)
+    unsigned int idle_at(unsigned int addr) {
+        unsigned short int op = this->fetch(addr);
+        unsigned int x = (op >> 8) & 0x0F;
+        unsigned short int back = 0x1000 | (addr & 0xFFF);
+
+        // a jump to itself, or 00FD which stays put
+        if (op == back || op == 0x00FD)
+            return 1;
+        if ((op & 0xF0FF) == 0xF00A && this->keyboard.is_awaiting() && !this->keyboard.has_keypress())
+            return 1;
+        if ((op & 0xF0FF) == 0xF007) {
+            unsigned short int test = this->fetch(addr + 2);
+            if (this->fetch(addr + 4) != back || ((test >> 8) & 0x0F) != x)
+                return 0;
+            unsigned char dt = this->delay_timer.get_value();
+            if ((test >> 12) == 0x3 && dt != (test & 0xFF))
+                return 3;
+            if ((test >> 12) == 0x4 && dt == (test & 0xFF))
+                return 3;
+            return 0;
+        }
+        if ((op & 0xF0FF) == 0xE09E || (op & 0xF0FF) == 0xE0A1) {
+            if (this->fetch(addr + 2) != back)
+                return 0;
+            bool pressed = this->keyboard.get_key(this->cpu.get_v(x) & 0x0F);
+            return pressed == ((op & 0xFF) == 0xA1) ? 2 : 0;
+        }
+        return 0;
+    }
+
+    unsigned int idle_length() {
+        return this->idle_at(this->cpu.get_pc());
+    }
+
+    // instructions to go until the pc is back at the top of a delay timer
+    // or key poll it's in the middle of, 0 if it isn't in one
+    unsigned int idle_lead() {
+        unsigned int pc = this->cpu.get_pc();
+        unsigned short int op = this->fetch(pc);
+        if ((op >> 12) == 0x1) {
+            unsigned int top = op & 0x0FFF;
+            unsigned short int poll = this->fetch(top) & 0xF0FF;
+            if (top == ((pc - 2) & 0xFFF) && (poll == 0xE09E || poll == 0xE0A1))
+                return 1;
+            if (top == ((pc - 4) & 0xFFF) && poll == 0xF007)
+                return 1;
+        } else if ((op >> 12) == 0x3 || (op >> 12) == 0x4) {
+            if ((this->fetch(pc - 2) & 0xF0FF) == 0xF007 && this->fetch(pc + 2) == (0x1000 | ((pc - 2) & 0xFFF)))
+                return 2;
+        }
+        return 0;
+    }
+public:
+    Chip8Core() {
+        // erase memory (init)
+        for (size_t i = 0; i < 4096; i++)
+            this->memory[i] = 0;
+
+        unsigned char fonts [] = { 0xF0, 0x90, 0x90, 0x90, 0xF0,
+                                   0x20, 0x60, 0x20, 0x20, 0x70,
+                                   0xF0, 0x10, 0xF0, 0x80, 0xF0,
+                                   0xF0, 0x10, 0xF0, 0x10, 0xF0,
+                                   0x90, 0x90, 0xF0, 0x10, 0x10,
+                                   0xF0, 0x80, 0xF0, 0x10, 0xF0,
+                                   0xF0, 0x80, 0xF0, 0x90, 0xF0,
+                                   0xF0, 0x10, 0x20, 0x40, 0x40,
+                                   0xF0, 0x90, 0xF0, 0x90, 0xF0,
+                                   0xF0, 0x90, 0xF0, 0x10, 0xF0,
+                                   0xF0, 0x90, 0xF0, 0x90, 0x90,
+                                   0xE0, 0x90, 0xE0, 0x90, 0xE0,
+                                   0xF0, 0x80, 0x80, 0x80, 0xF0,
+                                   0xE0, 0x90, 0x90, 0x90, 0xE0,
+                                   0xF0, 0x80, 0xF0, 0x80, 0xF0,
+                                   0xF0, 0x80, 0xF0, 0x80, 0x80};
+
+        for (size_t i = 0; i < 80; i++)
+            this->memory[i] = fonts[i];
+
+        // SUPER-CHIP 8x10 digits
+        unsigned char big_fonts [] = { 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF,
+                                       0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF,
+                                       0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF,
+                                       0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF,
+                                       0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03,
+                                       0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF,
+                                       0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF,
+                                       0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18,
+                                       0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF,
+                                       0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF,
+                                       0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3,
+                                       0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC,
+                                       0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C,
+                                       0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC,
+                                       0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF,
+                                       0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0};
+
+        for (size_t i = 0; i < 160; i++)
+            this->memory[CHIP8_BIG_FONT + i] = big_fonts[i];
+
+        this->engine = CHIP8_ENGINE_INTERPRETER;
+        this->predecoder = NULL;
+        this->jit = NULL;
+        this->aot = NULL;
+        this->decoded = false;
+        this->debugger = NULL;
+
+        this->cycles = 0;
+        this->frames = 0;
+        this->beeping = false;
+        // traces and profiles should see every instruction
+        this->idle_skip = !Chip8DefaultTrace::enabled && !Chip8DefaultProfile::enabled;
+        this->idle_cycles = 0;
+    }
+
+    ~Chip8Core() {
+        // cleanup
+        delete this->predecoder;
+        delete this->jit;
+        delete this->debugger;
+    }
+
+    Chip8Core(const Chip8Core&) = delete;
+    Chip8Core& operator=(const Chip8Core&) = delete;
+
+    unsigned char* get_memory() {
+        return this->memory;
+    }
+
+    Chip8Cpu& get_cpu() {
+        return this->cpu;
+    }
+
+    Chip8Framebuffer& get_framebuffer() {
+        return this->framebuffer;
+    }
+
+    Chip8Keyboard& get_keyboard() {
+        return this->keyboard;
+    }
+
+    Chip8Timer& get_delay_timer() {
+        return this->delay_timer;
+    }
+
+    Chip8Timer& get_sound_timer() {
+        return this->sound_timer;
+    }
+
+    Chip8Engine get_engine() {
+        return this->engine;
+    }
+
+    void set_engine(Chip8Engine engine) {
+        if (engine == CHIP8_ENGINE_AOT && this->aot == NULL)
+            throw std::runtime_error("No compiled ROM attached!");
+        if (engine == CHIP8_ENGINE_PREDECODED && this->predecoder == NULL)
+            this->predecoder = new Chip8Predecoder();
+        else if (engine == CHIP8_ENGINE_JIT && this->jit == NULL)
+            this->jit = new Chip8Jit();
+        this->engine = engine;
+        this->decoded = false;
+    }
+
+    Chip8Quirks get_quirks() {
+        return this->cpu.get_quirks();
+    }
+
+    // the quirk profile the ROM expects. decoded and translated code is
+    // redone for it on the next instruction
+    void set_quirks(Chip8Quirks quirks) {
+        this->cpu.set_quirks(quirks);
+        this->decoded = false;
+    }
+
+    // run the blocks chip8aot compiled for the ROM in memory, from now on
+    void set_aot(Chip8Aot* aot) {
+        this->aot = aot;
+        this->set_engine(CHIP8_ENGINE_AOT);
+    }
+
+    // NULL until the jit engine has been selected once
+    Chip8Jit* get_jit() {
+        return this->jit;
+    }
+
+    Chip8Debugger& get_debugger() {
+        if (this->debugger == NULL)
+            this->debugger = new Chip8Debugger();
+        return *this->debugger;
+    }
+
+    // stopped by the debugger: instructions and timers stand still
+    bool is_halted() {
+        return this->debugger && this->debugger->is_halted();
+    }
+
+    // start a new Cxkk random sequence
+    void seed(unsigned int seed) {
+        this->cpu.seed(seed);
+    }
+
+    // must be called after writing to get_memory() directly
+    void memory_changed() {
+        this->decoded = false;
+    }
+
+    unsigned long long get_cycles() {
+        return this->cycles;
+    }
+
+    unsigned long long get_frames() {
+        return this->frames;
+    }
+
+    // skipped idle loop laps still count as executed instructions (results
+    // are the same either way)
+    void set_idle_skip(bool idle_skip) {
+        this->idle_skip = idle_skip;
+    }
+
+    // instructions skipped in idle loops
+    unsigned long long get_idle_cycles() {
+        return this->idle_cycles;
+    }
+
+    // not part of Chip8State, so whoever rolls back frames puts it back
+    void set_idle_cycles(unsigned long long idle_cycles) {
+        this->idle_cycles = idle_cycles;
+    }
+
+    // whether the beeper sounded during the last frame
+    bool is_beeping() {
+        return this->beeping;
+    }
+
+    // likewise
+    void set_beeping(bool beeping) {
+        this->beeping = beeping;
+    }
+
+    // execute a single instruction
+    void step() {
+        this->run_cycles(1);
+    }
+
+    // execute n instructions back to back, without any throttling. an armed
+    // debugger may stop it early, then get_cycles() tells how far it got
+    void run_cycles(unsigned long long n) {
+        if (this->debugger && this->debugger->is_armed()) {
+            this->cycles += this->run_debugged(n);
+            return;
+        }
+
+        if (this->idle_skip) {
+            // run into the top of an idle loop and once around it for real;
+            // from there on every lap leaves the machine as it was, until
+            // the timers tick or the keys change between frames
+            unsigned int lead = this->idle_lead();
+            if (lead && lead < n) {
+                this->execute(lead);
+                n -= lead;
+            }
+            unsigned int length = this->idle_length();
+            if (length && n > length) {
+                this->execute(length);
+                n -= length;
+                unsigned long long laps = n / length * length;
+                this->idle_cycles += laps;
+                this->cycles += laps;
+                n -= laps;
+            }
+        }
+        this->execute(n);
+    }
+
+    // one interpreted instruction at a time, between the debugger's checks,
+    // whatever the engine. returns the number of instructions that ran
+    unsigned long long run_debugged(unsigned long long n) {
+        unsigned long long c = 0;
+        while (c < n && this->debugger->before(this->cpu, this->memory, this->delay_timer, this->sound_timer)) {
+            this->cpu.cycle(this->memory, this->framebuffer, this->delay_timer, this->sound_timer, this->keyboard);
+            c++;
+            if (!this->debugger->after())
+                break;
+        }
+        this->decoded = false;
+        return c;
+    }
+
+    // advance the 60 Hz timers by one tick
+    void tick_timers() {
+        if (this->is_halted())
+            return;
+        // sampled before the tick, so a timer set to 1 still beeps for a frame
+        this->beeping = this->sound_timer.get_value() != 0;
+        this->delay_timer.tick();
+        this->sound_timer.tick();
+        this->frames++;
+    }
+
+    // emulate n 60 Hz frames of ipf instructions each, as fast as possible
+    void run_frames(unsigned long long n, unsigned int ipf) {
+        for (unsigned long long f = 0; f < n; f++) {
+            this->run_cycles(ipf);
+            this->tick_timers();
+        }
+    }
+
+    // snapshot the whole machine, cheap enough to do every frame
+    void save_state(Chip8State& state) {
+        memcpy(state.memory, this->memory, 4096);
+        this->cpu.save(state);
+        state.delay_timer = this->delay_timer.get_value();
+        state.sound_timer = this->sound_timer.get_value();
+        this->framebuffer.save(state);
+        this->keyboard.save(state);
+        state.cycles = this->cycles;
+        state.frames = this->frames;
+        state.quirks = this->cpu.get_quirks() + 1;
+    }
+
+    // only the 256 byte pages that differ are re-decoded, so going back to a
+    // recent state (rewind, run-ahead) keeps most of the engine's work
+    void load_state(const Chip8State& state) {
+        unsigned int dirty = 0;
+        for (unsigned int p = 0; p < 16 && this->decoded; p++) {
+            if (memcmp(this->memory + p * 256, state.memory + p * 256, 256))
+                dirty |= 1 << p;
+        }
+        memcpy(this->memory, state.memory, 4096);
+        for (unsigned int p = 0; p < 16 && dirty; p++) {
+            if (!(dirty & (1 << p)))
+                continue;
+            if (this->engine == CHIP8_ENGINE_PREDECODED)
+                this->predecoder->invalidate(p * 256, 256);
+            else if (this->engine == CHIP8_ENGINE_JIT)
+                this->jit->invalidate(p * 256, 256);
+            else if (this->engine == CHIP8_ENGINE_AOT)
+                this->aot->wrote(this->memory, p * 256, 256);
+        }
+        this->cpu.load(state);
+        this->delay_timer.set(state.delay_timer);
+        this->sound_timer.set(state.sound_timer);
+        this->framebuffer.load(state);
+        this->keyboard.load(state);
+        this->cycles = state.cycles;
+        this->frames = state.frames;
+        // a state saved under another profile brings it along (older files don't say)
+        if (state.quirks && state.quirks - 1U < CHIP8_QUIRKS_COUNT && state.quirks - 1U != (unsigned int) this->cpu.get_quirks())
+            this->set_quirks((Chip8Quirks) (state.quirks - 1));
+    }
+
+    unsigned long long screen_hash() {
+        return this->framebuffer.hash();
+    }
+
+    // copy a ROM image that's already in host memory to 0x200
+    bool load_rom(const unsigned char* data, size_t size) {
+        // if the rom wouldn't fit in memory (4096 - 512 - 256 - 96)
+        if (size > 3232) {
+            printf("* File too large! (%zu)\n", size);
+            return false;
+        }
+
+        memcpy(this->memory + 512, data, size);
+        this->decoded = false;
+        return true;
+    }
+
+    bool load_game(const char* filename) {
+        // open the specified file
+        if (FILE* game_file = fopen(filename, "rb")) {
+            // calculate file size
+            fseek(game_file, 0, SEEK_END);
+            size_t file_size = ftell(game_file);
+
+            // if the file wouldn't fit in memory (4096 - 512 - 256 - 96)
+            if (file_size > 3232) {
+                printf("* File too large! (%zu)\n", file_size);
+                fclose(game_file);
+                return false;
+            }
+
+            // read the file and copy it to memory
+            rewind(game_file);
+            size_t result = fread(this->memory + 512, 1, file_size, game_file);
+            fclose(game_file);
+            this->decoded = false;
+            if (result != file_size) {
+                printf("* File reading failed! (%zu/%zu)\n", result, file_size);
+                return false;
+            }
+
+            return true;
+
+        } else {
+            printf("* Unable to open file! (%s)\n", filename);
+            return false;
+        }
+    }
+
+    void print_memory() {
+        for (size_t i = 0; i < 4096; i += 2) {
+            if (i % 16 == 0)
+                printf("\n%08zx: ", i);
+            printf("%02x%02x ", this->memory[i], this->memory[i+1]);
+        }
+        printf("\n");
+    }
+
+    void print_screen() {
+        for (unsigned int y = 0; y < this->framebuffer.get_height(); y++) {
+            for (unsigned int x = 0; x < this->framebuffer.get_width(); x++)
+                printf("%c", this->framebuffer.get_pixel(x, y) ? '#' : '.');
+            printf("\n");
+        }
+    }
+};
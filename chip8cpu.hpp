@@ -1,163 +1,233 @@
 #pragma once
+#include <cstdio>
 #include <cstdlib>
 #include <cmath>
+#include <cstring>
+#include "chip8timer.hpp"
+#include "chip8keyboard.hpp"
+#include "chip8trace.hpp"
+#include "chip8profile.hpp"
+#include "chip8state.hpp"
+#include "chip8framebuffer.hpp"
+#include "chip8quirks.hpp"
+
+// Cxkk random sequence a cpu starts with unless it's reseeded
+static const unsigned int CHIP8_DEFAULT_SEED = 1;
+
+// where the SUPER-CHIP 8x10 digits (Fx30) live, right after the 4x5 ones
+static const unsigned short int CHIP8_BIG_FONT = 0x50;
+
+template <unsigned int LANES> class Chip8Lockstep;
 
 class Chip8Cpu {
+    friend class Chip8Predecoder;
+    friend class Chip8Jit;
+    friend class Chip8Aot;
+    friend class Chip8Debugger;
+    template <unsigned int LANES> friend class Chip8Lockstep;
 private:
-    unsigned char* v;
+    unsigned char v [16];
     unsigned short int i;
     unsigned short int pc;
     unsigned char sp;
 
-    unsigned int frequency;
-    double delay;
+    // xorshift32 state for Cxkk, per cpu so instances stay deterministic
+    // and independent of each other
+    unsigned int rng;
+
+    // SUPER-CHIP Fx75/Fx85 flags
+    unsigned char rpl [8];
+
+    // set whenever the framebuffer changes
+    bool redraw;
 
-    void clear_screen(unsigned char*& memory) {
-        for (size_t i = 0xF00; i <= 0xFFF; i++)
-            memory[i] = 0;
+    // fixed per ROM, see chip8quirks.hpp
+    Chip8Quirks quirks;
+
+    // compile-time trace policy, see chip8trace.hpp
+    Chip8DefaultTrace trace;
+
+    // compile-time profile policy, see chip8profile.hpp
+    Chip8DefaultProfile profile;
+public:
+    Chip8Cpu() {
+        this->i = 0;
+        this->pc = 0x200;
+        this->sp = 0;
+        this->redraw = false;
+        this->quirks = CHIP8_QUIRKS_MODERN;
+        this->seed(CHIP8_DEFAULT_SEED);
+
+        // erase registers (init)
+        for (size_t i = 0; i < 16; i++)
+            this->v[i] = 0;
+        for (size_t i = 0; i < 8; i++)
+            this->rpl[i] = 0;
     }
 
-    bool draw_sprite(unsigned char*& memory, unsigned char x, unsigned char y, unsigned char h) {
-        bool setvf = false;
+    Chip8Cpu(const Chip8Cpu&) = delete;
+    Chip8Cpu& operator=(const Chip8Cpu&) = delete;
 
-        printf("  drawing: I = %04x @(%d, %d)\n", this->i, x, y);
-        for (size_t row = 0; row < h; row++) {
-            unsigned short int memptr = 0xF00 + ((y + row) * 8) + floor(x / 8);
-            unsigned char newmem;
-            unsigned char oldmem;
+    unsigned short int get_pc() {
+        return this->pc;
+    }
 
-            if (!(x % 8)) {
-                oldmem = memory[memptr];
-                newmem = oldmem ^ memory[this->i + row];
-                memory[memptr] = newmem;
-            } else {
-                oldmem = (memory[memptr] << (x % 8)) | (memory[memptr+1] >> (8 - (x % 8)));
-                newmem = oldmem ^ memory[this->i + row];
+    unsigned char get_v(unsigned int x) {
+        return this->v[x & 0x0F];
+    }
 
-                // all this stuff can be simplified todo
-                // memory[memptr] = (memory[memptr] >> (8 - (x % 8))) << (8 - (x % 8));
-                // memory[memptr] |= newmem >> (x % 8);
-                // memory[memptr+1] = (memory[memptr+1] << (x % 8)) >> (x % 8);
-                // memory[memptr+1] |= newmem << (8 - (x % 8));
-                memory[memptr] ^= memory[this->i + row] >> (x % 8);
-                memory[memptr+1] ^= memory[this->i + row] << (8 - (x % 8));
-            }
+    Chip8Quirks get_quirks() {
+        return this->quirks;
+    }
 
-            for (size_t i = 0; i < 8; i++) {
-                if (((oldmem >> i) & 0x01) && !((newmem >> i) & 0x01)) {
-                    setvf = true;
-                    break;
-                }
-            }
+    // engines that decode or translate ahead (see Chip8Core::set_quirks)
+    // have to be told too
+    void set_quirks(Chip8Quirks quirks) {
+        this->quirks = quirks;
+    }
 
-            printf("  -> %04x: %02x (I=%04x)\n", memptr, (memory[this->i + row]), (this->i + row));
-        }
+    // restart the Cxkk sequence; nearby seeds give unrelated sequences
+    void seed(unsigned int seed) {
+        seed ^= seed >> 16;
+        seed *= 0x7FEB352D;
+        seed ^= seed >> 15;
+        seed *= 0x846CA68B;
+        seed ^= seed >> 16;
+        // xorshift never leaves an all-zero state
+        this->rng = seed ? seed : 1;
+    }
 
-        return setvf;
+    unsigned char random() {
+        this->rng ^= this->rng << 13;
+        this->rng ^= this->rng >> 17;
+        this->rng ^= this->rng << 5;
+        return this->rng >> 24;
     }
 
-    void print_stack(unsigned char*& memory) {
-        for (size_t i = 0; i < this->sp; i++)
-            printf("  %04x: %02x\n  %04x: %02x\n",
-                (0xEA0 - 2 + (this->sp * 2)),
-                memory[0xEA0 - 2 + (this->sp * 2)],
-                (0xEA0 - 2 + (this->sp * 2) + 1),
-                memory[0xEA0 - 2 + (this->sp * 2) + 1]
-            );
+    void save(Chip8State& state) {
+        memcpy(state.v, this->v, 16);
+        state.i = this->i;
+        state.pc = this->pc;
+        state.sp = this->sp;
+        state.rng = this->rng;
+        memcpy(state.rpl, this->rpl, 8);
     }
-public:
-    Chip8Cpu(unsigned int frequency) {
-        // allocate registers
-        this->v = new unsigned char [16];
-        this->i = 0;
-        this->pc = 0x200;
-        this->sp = 0;
 
-        // set cpu frequency
-        this->frequency = frequency;
-        this->delay = (1.0 / frequency) * 1000;
+    void load(const Chip8State& state) {
+        memcpy(this->v, state.v, 16);
+        memcpy(this->rpl, state.rpl, 8);
+        this->i = state.i;
+        this->pc = state.pc;
+        this->sp = state.sp;
+        // states without a generator (version 1) restart the default sequence
+        if (state.rng)
+            this->rng = state.rng;
+        else
+            this->seed(CHIP8_DEFAULT_SEED);
+        this->redraw = true;
+    }
 
-        // check for allocation errors
-        if (this->v == NULL)
-            throw std::runtime_error("Failed to allocate memory!");
+    Chip8DefaultTrace& get_trace() {
+        return this->trace;
+    }
 
-        // erase registers (init)
-        for (size_t i = 0; i < 16; i++)
-            this->v[i] = 0;
+    Chip8DefaultProfile& get_profile() {
+        return this->profile;
     }
 
-    void cycle(unsigned char*& memory, Chip8Screen*& screen, Chip8Timer*& delay_timer, Chip8Timer*& sound_timer, Chip8Keyboard*& keyboard) {
-        unsigned short int instruction = (memory[this->pc] << 8) | (memory[this->pc + 1]);
-        unsigned long int ticks = SDL_GetTicks();
+    // returns true (and clears the flag) if the screen changed since the last call
+    bool take_redraw() {
+        bool out = this->redraw;
+        this->redraw = false;
+        return out;
+    }
 
-        printf("frequency %d, delay %9.6f\n", this->frequency, this->delay);
-        printf("@%04x: %04x - ", this->pc, instruction);
-        printf("dt: %d, st: %d\n", delay_timer->get_value(), sound_timer->get_value());
-        printf("I = %04x, V [ ", this->i);
+    // one instruction with the quirks of profile Q, which are all constant
+    // here. all memory accesses are wrapped to the 4 KB address space, so a
+    // runaway ROM can't read or write outside of the machine
+    template <Chip8Quirks Q>
+    void step(unsigned char* memory, Chip8Framebuffer& framebuffer, Chip8Timer& delay_timer, Chip8Timer& sound_timer, Chip8Keyboard& keyboard) {
+        typedef Chip8QuirkProfile<Q> Quirks;
+        unsigned short int instruction = (memory[this->pc & 0xFFF] << 8) | (memory[(this->pc + 1) & 0xFFF]);
 
-        for (size_t i = 0; i <= 0xF; i++) {
-            printf("%01X: %02x", i, this->v[i]);
-            if (i != 0xF)
-                printf(", ");
-        }
-        printf(" ]\n");
+        this->trace.record(this->pc, instruction, this->i, this->sp, delay_timer.get_value(), sound_timer.get_value(), this->v);
+        this->profile.record(this->pc, instruction, delay_timer.get_value());
 
         if (instruction == 0xE0) {
-            this->clear_screen(memory);
-            printf("  screen cleared\n");
+            framebuffer.clear();
+            this->redraw = true;
         }
         else if (instruction == 0xEE) {
-            this->print_stack(memory);
-            this->pc = memory[0xEA0 - 2 + (this->sp * 2)] << 8;
-            this->pc ^= memory[0xEA0 - 2 + (this->sp-- * 2) + 1];
-            printf("  returning to: %04x, sp=%d\n", this->pc, this->sp);
+            this->pc = memory[(0xEA0 - 2 + (this->sp * 2)) & 0xFFF] << 8;
+            this->pc ^= memory[(0xEA0 - 2 + (this->sp-- * 2) + 1) & 0xFFF];
+        }
+        else if ((instruction & 0xFFF0) == 0xC0) {
+            framebuffer.scroll_down(instruction & 0x000F);
+            this->redraw = true;
+        }
+        else if (instruction == 0xFB) {
+            framebuffer.scroll_right(4);
+            this->redraw = true;
+        }
+        else if (instruction == 0xFC) {
+            framebuffer.scroll_left(4);
+            this->redraw = true;
+        }
+        else if (instruction == 0xFD) {
+            // exit: there's nothing to return to, so stay here
+            this->pc -= 2;
+        }
+        else if (instruction == 0xFE || instruction == 0xFF) {
+            framebuffer.set_hires(instruction == 0xFF);
+            this->redraw = true;
         }
         else if ((instruction >> 12) == 0x1) {
             this->pc = (instruction & 0x0FFF) - 2;
-            printf("  jumping to: %04x\n", this->pc+2);
         }
         else if ((instruction >> 12) == 0x2) {
-            memory[0xEA0 - 2 + (++this->sp * 2)] = this->pc >> 8;
-            memory[0xEA0 - 2 + (this->sp * 2) + 1] = this->pc & 0x00FF;
-            this->print_stack(memory);
+            memory[(0xEA0 - 2 + (++this->sp * 2)) & 0xFFF] = this->pc >> 8;
+            memory[(0xEA0 - 2 + (this->sp * 2) + 1) & 0xFFF] = this->pc & 0x00FF;
             this->pc = (instruction & 0x0FFF) - 2;
-            printf("  calling fn @: %04x, sp=%d\n", this->pc+2, this->sp);
         }
         else if ((instruction >> 12) == 0x3) {
             if (this->v[(instruction >> 8) & 0x000F] == (instruction & 0x00FF)) {
                 this->pc += 2;
-                printf("  V%01X == %02x, skipping %04x, next %04x\n", ((instruction >> 8) & 0x000F), (instruction & 0x00FF), this->pc, this->pc+2);
             }
         }
         else if ((instruction >> 12) == 0x4) {
             if (this->v[(instruction >> 8) & 0x000F] != (instruction & 0x00FF)) {
                 this->pc += 2;
-                printf("  V%01X != %02x, skipping %04x, next %04x\n", ((instruction >> 8) & 0x000F), (instruction & 0x00FF), this->pc, this->pc+2);
             }
         }
         else if ((instruction >> 12) == 0x5) {
             if (this->v[(instruction >> 8) & 0x000F] == this->v[(instruction >> 4) & 0x000F]) {
                 this->pc += 2;
-                printf("  V%01X == V%01X, skipping %04x, next %04x\n", ((instruction >> 8) & 0x000F), ((instruction >> 4) & 0x000F), this->pc, this->pc+2);
             }
         }
         else if ((instruction >> 12) == 0x6) {
             this->v[(instruction >> 8) & 0x000F] = (instruction & 0x00FF);
-            printf("  V%01X = %02x\n", ((instruction >> 8) & 0x000F), (instruction & 0x00FF));
         }
         else if ((instruction >> 12) == 0x7) {
             this->v[(instruction >> 8) & 0x000F] += (instruction & 0x00FF);
-            printf("  V%01X += %02x\n", ((instruction >> 8) & 0x000F), (instruction & 0x00FF));
         }
         else if ((instruction >> 12) == 0x8) {
             if ((instruction & 0x000F) == 0x0)
                 this->v[(instruction >> 8) & 0x000F] = this->v[(instruction >> 4) & 0x000F];
-            else if ((instruction & 0x000F) == 0x1)
+            else if ((instruction & 0x000F) == 0x1) {
                 this->v[(instruction >> 8) & 0x000F] |= this->v[(instruction >> 4) & 0x000F];
-            else if ((instruction & 0x000F) == 0x2)
+                if (Quirks::vf_reset)
+                    this->v[0xF] = 0;
+            }
+            else if ((instruction & 0x000F) == 0x2) {
                 this->v[(instruction >> 8) & 0x000F] &= this->v[(instruction >> 4) & 0x000F];
-            else if ((instruction & 0x000F) == 0x3)
+                if (Quirks::vf_reset)
+                    this->v[0xF] = 0;
+            }
+            else if ((instruction & 0x000F) == 0x3) {
                 this->v[(instruction >> 8) & 0x000F] ^= this->v[(instruction >> 4) & 0x000F];
+                if (Quirks::vf_reset)
+                    this->v[0xF] = 0;
+            }
             else if ((instruction & 0x000F) == 0x4) {
                 unsigned short int result = this->v[(instruction >> 8) & 0x000F] + this->v[(instruction >> 4) & 0x000F];
                 if (result > 0xFF)
@@ -174,8 +244,15 @@ public:
                 this->v[(instruction >> 8) & 0x000F] -= this->v[(instruction >> 4) & 0x000F];
             }
             else if ((instruction & 0x000F) == 0x6) {
-                this->v[0xF] = (this->v[(instruction >> 8) & 0x000F] & 0x01);
-                this->v[(instruction >> 8) & 0x000F] >>= 1;
+                if (Quirks::shift_vy) {
+                    unsigned char vv = this->v[(instruction >> 4) & 0x000F];
+                    this->v[0xF] = (vv & 0x01);
+                    this->v[(instruction >> 8) & 0x000F] = vv >> 1;
+                }
+                else {
+                    this->v[0xF] = (this->v[(instruction >> 8) & 0x000F] & 0x01);
+                    this->v[(instruction >> 8) & 0x000F] >>= 1;
+                }
             }
             else if ((instruction & 0x000F) == 0x7) {
                 if (this->v[(instruction >> 4) & 0x000F] > this->v[(instruction >> 8) & 0x000F])
@@ -185,52 +262,57 @@ public:
                 this->v[(instruction >> 8) & 0x000F] = this->v[(instruction >> 4) & 0x000F] - this->v[(instruction >> 8) & 0x000F];
             }
             else if ((instruction & 0x000F) == 0xE) {
-                this->v[0xF] = (this->v[(instruction >> 8) & 0x000F] & 0x80) >> 7;
-                this->v[(instruction >> 8) & 0x000F] <<= 1;
+                if (Quirks::shift_vy) {
+                    unsigned char vv = this->v[(instruction >> 4) & 0x000F];
+                    this->v[0xF] = (vv & 0x80) >> 7;
+                    this->v[(instruction >> 8) & 0x000F] = vv << 1;
+                }
+                else {
+                    this->v[0xF] = (this->v[(instruction >> 8) & 0x000F] & 0x80) >> 7;
+                    this->v[(instruction >> 8) & 0x000F] <<= 1;
+                }
             }
         }
         else if ((instruction >> 12) == 0x9) {
             if (this->v[(instruction >> 8) & 0x000F] != this->v[(instruction >> 4) & 0x000F]) {
                 this->pc += 2;
-                printf("  V%01X != V%01X, skipping %04x, next %04x\n", ((instruction >> 8) & 0x000F), ((instruction >> 4) & 0x000F), this->pc, this->pc+2);
             }
         }
         else if ((instruction >> 12) == 0xA)
             this->i = (instruction & 0x0FFF);
         else if ((instruction >> 12) == 0xB)
-            this->pc = (instruction & 0x0FFF) + this->v[0x0] - 2;
+            this->pc = (instruction & 0x0FFF) + this->v[Quirks::jump_vx ? (instruction >> 8) & 0x000F : 0x0] - 2;
         else if ((instruction >> 12) == 0xC)
-            this->v[(instruction >> 8) & 0x000F] = ((rand() % 256) & (instruction & 0x00FF));
+            this->v[(instruction >> 8) & 0x000F] = (this->random() & (instruction & 0x00FF));
         else if ((instruction >> 12) == 0xD) {
-            this->v[0xF] = this->draw_sprite(memory, this->v[(instruction >> 8) & 0x000F], this->v[(instruction >> 4) & 0x000F], (instruction & 0x000F));
-            screen->update(memory);
+            this->v[0xF] = framebuffer.draw(memory, this->i, this->v[(instruction >> 8) & 0x000F], this->v[(instruction >> 4) & 0x000F], (instruction & 0x000F));
+            this->redraw = true;
         }
         else if ((instruction >> 12) == 0xE) {
             if ((instruction & 0x00FF) == 0x9E) {
-                if (keyboard->get_key(this->v[(instruction >> 8) & 0x000F]))
+                if (keyboard.get_key(this->v[(instruction >> 8) & 0x000F]))
                     this->pc += 2;
             }
             else if ((instruction & 0x00FF) == 0xA1) {
-                if (!keyboard->get_key(this->v[(instruction >> 8) & 0x000F]))
+                if (!keyboard.get_key(this->v[(instruction >> 8) & 0x000F]))
                     this->pc += 2;
             }
         }
         else if ((instruction >> 12) == 0xF) {
             if ((instruction & 0x00FF) == 0x07)
-                this->v[(instruction >> 8) & 0x000F] = delay_timer->get_value();
+                this->v[(instruction >> 8) & 0x000F] = delay_timer.get_value();
             else if ((instruction & 0x00FF) == 0x0A) {
-                keyboard->await();
-                if (!keyboard->ack_key())
+                keyboard.await();
+                if (!keyboard.ack_key())
                     this->pc -= 2;
                 else {
-                    this->v[(instruction >> 8) & 0x000F] = keyboard->last_key();
-                    printf("  last key pressed: %01X\n", this->v[(instruction >> 8) & 0x000F]);
+                    this->v[(instruction >> 8) & 0x000F] = keyboard.last_key();
                 }
             }
             else if ((instruction & 0x00FF) == 0x15)
-                delay_timer->set(this->v[(instruction >> 8) & 0x000F]);
+                delay_timer.set(this->v[(instruction >> 8) & 0x000F]);
             else if ((instruction & 0x00FF) == 0x18)
-                sound_timer->set(this->v[(instruction >> 8) & 0x000F]);
+                sound_timer.set(this->v[(instruction >> 8) & 0x000F]);
             else if ((instruction & 0x00FF) == 0x1E) {
                 unsigned int result = this->i + this->v[(instruction >> 8) & 0x000F];
                 if (result > 0xFFFF)
@@ -241,38 +323,63 @@ public:
             }
             else if ((instruction & 0x00FF) == 0x29)
                 this->i = 5 * (this->v[(instruction >> 8) & 0x000F]);
+            else if ((instruction & 0x00FF) == 0x30)
+                this->i = CHIP8_BIG_FONT + 10 * (this->v[(instruction >> 8) & 0x000F] & 0x0F);
             else if ((instruction & 0x00FF) == 0x33) {
                 unsigned char vv = this->v[(instruction >> 8) & 0x000F];
 
-                memory[this->i] = 0;
-                memory[this->i+1] = 0;
-                memory[this->i+2] = 0;
-
-                while (vv > 99) {
-                    memory[this->i]++;
-                    vv -= 100;
-                }
-                while (vv > 9) {
-                    memory[this->i+1]++;
-                    vv -= 10;
-                }
-                while (vv > 0) {
-                    memory[this->i+2]++;
-                    vv -= 1;
-                }
+                memory[this->i & 0xFFF] = vv / 100;
+                memory[(this->i+1) & 0xFFF] = (vv / 10) % 10;
+                memory[(this->i+2) & 0xFFF] = vv % 10;
             }
             else if ((instruction & 0x00FF) == 0x55) {
                 for (size_t o = 0; o <= ((instruction >> 8) & 0x000F); o++)
-                    memory[this->i + o] = this->v[o];
+                    memory[(this->i + o) & 0xFFF] = this->v[o];
+                if (Quirks::load_store != CHIP8_LOAD_STORE_KEEP)
+                    this->i += ((instruction >> 8) & 0x000F) + (Quirks::load_store == CHIP8_LOAD_STORE_PAST);
             }
             else if ((instruction & 0x00FF) == 0x65) {
                 for (size_t o = 0; o <= ((instruction >> 8) & 0x000F); o++)
-                    this->v[o] = memory[this->i + o];
+                    this->v[o] = memory[(this->i + o) & 0xFFF];
+                if (Quirks::load_store != CHIP8_LOAD_STORE_KEEP)
+                    this->i += ((instruction >> 8) & 0x000F) + (Quirks::load_store == CHIP8_LOAD_STORE_PAST);
+            }
+            else if ((instruction & 0x00FF) == 0x75) {
+                for (size_t o = 0; o <= ((instruction >> 8) & 0x0007); o++)
+                    this->rpl[o] = this->v[o];
+            }
+            else if ((instruction & 0x00FF) == 0x85) {
+                for (size_t o = 0; o <= ((instruction >> 8) & 0x0007); o++)
+                    this->v[o] = this->rpl[o];
             }
         }
 
-        SDL_Delay(this->delay);
-
         this->pc += 2;
     }
+
+    template <Chip8Quirks Q>
+    void run_as(unsigned char* memory, Chip8Framebuffer& framebuffer, Chip8Timer& delay_timer, Chip8Timer& sound_timer, Chip8Keyboard& keyboard, unsigned long long n) {
+        for (unsigned long long c = 0; c < n; c++)
+            this->step<Q>(memory, framebuffer, delay_timer, sound_timer, keyboard);
+    }
+
+    // one instruction with the cpu's quirks
+    void cycle(unsigned char* memory, Chip8Framebuffer& framebuffer, Chip8Timer& delay_timer, Chip8Timer& sound_timer, Chip8Keyboard& keyboard) {
+        switch (this->quirks) {
+        case CHIP8_QUIRKS_VIP: this->step<CHIP8_QUIRKS_VIP>(memory, framebuffer, delay_timer, sound_timer, keyboard); break;
+        case CHIP8_QUIRKS_CHIP48: this->step<CHIP8_QUIRKS_CHIP48>(memory, framebuffer, delay_timer, sound_timer, keyboard); break;
+        case CHIP8_QUIRKS_SCHIP: this->step<CHIP8_QUIRKS_SCHIP>(memory, framebuffer, delay_timer, sound_timer, keyboard); break;
+        default: this->step<CHIP8_QUIRKS_MODERN>(memory, framebuffer, delay_timer, sound_timer, keyboard); break;
+        }
+    }
+
+    // n instructions, picking the specialization once for all of them
+    void run(unsigned char* memory, Chip8Framebuffer& framebuffer, Chip8Timer& delay_timer, Chip8Timer& sound_timer, Chip8Keyboard& keyboard, unsigned long long n) {
+        switch (this->quirks) {
+        case CHIP8_QUIRKS_VIP: this->run_as<CHIP8_QUIRKS_VIP>(memory, framebuffer, delay_timer, sound_timer, keyboard, n); break;
+        case CHIP8_QUIRKS_CHIP48: this->run_as<CHIP8_QUIRKS_CHIP48>(memory, framebuffer, delay_timer, sound_timer, keyboard, n); break;
+        case CHIP8_QUIRKS_SCHIP: this->run_as<CHIP8_QUIRKS_SCHIP>(memory, framebuffer, delay_timer, sound_timer, keyboard, n); break;
+        default: this->run_as<CHIP8_QUIRKS_MODERN>(memory, framebuffer, delay_timer, sound_timer, keyboard, n); break;
+        }
+    }
 };
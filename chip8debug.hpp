@@ -0,0 +1,356 @@
+#pragma once
+#include <cstring>
+#include <vector>
+#include "chip8cpu.hpp"
+#include "chip8timer.hpp"
+
+// why a debugged core stopped
+enum Chip8StopReason {
+    CHIP8_STOP_NONE,
+    CHIP8_STOP_BREAKPOINT,
+    CHIP8_STOP_CONDITION,     // a global register condition became true
+    CHIP8_STOP_WATCH_READ,
+    CHIP8_STOP_WATCH_WRITE,
+    CHIP8_STOP_STEP,
+    CHIP8_STOP_INTERRUPT,
+    CHIP8_STOP_EXIT           // 00FD
+};
+
+// registers conditions can test: V0-VF are 0-15
+enum Chip8DebugRegister {
+    CHIP8_DEBUG_I = 16,
+    CHIP8_DEBUG_PC,
+    CHIP8_DEBUG_SP,
+    CHIP8_DEBUG_DT,
+    CHIP8_DEBUG_ST
+};
+
+enum Chip8DebugCompare {
+    CHIP8_DEBUG_EQ,
+    CHIP8_DEBUG_NE,
+    CHIP8_DEBUG_LT,
+    CHIP8_DEBUG_LE,
+    CHIP8_DEBUG_GT,
+    CHIP8_DEBUG_GE
+};
+
+// a condition at this address is checked before every instruction
+static const unsigned short int CHIP8_DEBUG_ANYWHERE = 0xFFFF;
+
+struct Chip8DebugCondition {
+    unsigned short int addr;
+    unsigned int reg;
+    Chip8DebugCompare compare;
+    unsigned short int value;
+};
+
+// breakpoints, watchpoints and register conditions for one core. the core
+// only consults it while is_armed(), and then runs one interpreted
+// instruction at a time between before() and after(); otherwise the active
+// engine runs at full speed and the debugger costs one test per run_cycles.
+// breakpoints stop before the instruction at their address runs,
+// watchpoints after the instruction that touched their address.
+class Chip8Debugger {
+private:
+    // one bit per address: any breakpoint, unconditional ones, watches
+    unsigned long long traps [64];
+    unsigned long long unconditional [64];
+    unsigned long long reads [64];
+    unsigned long long writes [64];
+    unsigned int trap_count;
+    unsigned int watch_count;
+
+    std::vector<Chip8DebugCondition> conditions;
+    unsigned int anywhere_count;
+    // global conditions stop when they become true, not while they stay true
+    bool anywhere_matched;
+
+    bool halted;
+    bool stepping;
+    // the instruction a resume starts at doesn't trip its own breakpoint
+    bool resumed;
+    Chip8StopReason reason;
+    unsigned short int watch_addr;
+
+    // memory the instruction about to run will touch
+    unsigned short int access_start;
+    unsigned int access_length;
+    bool access_write;
+    unsigned short int instruction;
+
+    static bool test(const unsigned long long* bits, unsigned int addr) {
+        return (bits[(addr & 0xFFF) >> 6] >> (addr & 63)) & 0x01;
+    }
+
+    static void assign(unsigned long long* bits, unsigned int addr, bool on) {
+        if (on)
+            bits[(addr & 0xFFF) >> 6] |= 1ULL << (addr & 63);
+        else
+            bits[(addr & 0xFFF) >> 6] &= ~(1ULL << (addr & 63));
+    }
+
+    static unsigned short int read(Chip8Cpu& cpu, Chip8Timer& delay_timer, Chip8Timer& sound_timer, unsigned int reg) {
+        if (reg < 16)
+            return cpu.v[reg];
+        switch (reg) {
+        case CHIP8_DEBUG_I: return cpu.i;
+        case CHIP8_DEBUG_PC: return cpu.pc;
+        case CHIP8_DEBUG_SP: return cpu.sp;
+        case CHIP8_DEBUG_DT: return delay_timer.get_value();
+        case CHIP8_DEBUG_ST: return sound_timer.get_value();
+        }
+        return 0;
+    }
+
+    static bool compare(unsigned short int a, Chip8DebugCompare compare, unsigned short int b) {
+        switch (compare) {
+        case CHIP8_DEBUG_EQ: return a == b;
+        case CHIP8_DEBUG_NE: return a != b;
+        case CHIP8_DEBUG_LT: return a < b;
+        case CHIP8_DEBUG_LE: return a <= b;
+        case CHIP8_DEBUG_GT: return a > b;
+        case CHIP8_DEBUG_GE: return a >= b;
+        }
+        return false;
+    }
+
+    // true if any condition registered at addr holds
+    bool match(Chip8Cpu& cpu, Chip8Timer& delay_timer, Chip8Timer& sound_timer, unsigned short int addr) {
+        for (size_t c = 0; c < this->conditions.size(); c++) {
+            const Chip8DebugCondition& cond = this->conditions[c];
+            if (cond.addr == addr && compare(read(cpu, delay_timer, sound_timer, cond.reg), cond.compare, cond.value))
+                return true;
+        }
+        return false;
+    }
+
+    // recompute the trap bit at addr after removing something there
+    void retrap(unsigned short int addr) {
+        bool trap = test(this->unconditional, addr);
+        for (size_t c = 0; c < this->conditions.size() && !trap; c++)
+            trap = this->conditions[c].addr == addr;
+        if (test(this->traps, addr) && !trap)
+            this->trap_count--;
+        assign(this->traps, addr, trap);
+    }
+
+    void stop(Chip8StopReason reason) {
+        this->halted = true;
+        this->stepping = false;
+        this->reason = reason;
+    }
+public:
+    Chip8Debugger() {
+        this->clear();
+    }
+
+    Chip8Debugger(const Chip8Debugger&) = delete;
+    Chip8Debugger& operator=(const Chip8Debugger&) = delete;
+
+    // drop every breakpoint, watchpoint and condition and let the core run
+    void clear() {
+        memset(this->traps, 0, sizeof(this->traps));
+        memset(this->unconditional, 0, sizeof(this->unconditional));
+        memset(this->reads, 0, sizeof(this->reads));
+        memset(this->writes, 0, sizeof(this->writes));
+        this->trap_count = 0;
+        this->watch_count = 0;
+        this->conditions.clear();
+        this->anywhere_count = 0;
+        this->anywhere_matched = false;
+        this->halted = false;
+        this->stepping = false;
+        this->resumed = false;
+        this->reason = CHIP8_STOP_NONE;
+        this->watch_addr = 0;
+        this->access_length = 0;
+        this->access_write = false;
+        this->instruction = 0;
+    }
+
+    // whether the core has to run instructions through before()/after()
+    bool is_armed() {
+        return this->trap_count || this->watch_count || this->anywhere_count || this->halted || this->stepping;
+    }
+
+    bool is_halted() {
+        return this->halted;
+    }
+
+    Chip8StopReason get_reason() {
+        return this->reason;
+    }
+
+    // the watched address that stopped the core
+    unsigned short int get_watch_addr() {
+        return this->watch_addr;
+    }
+
+    void set_breakpoint(unsigned short int addr) {
+        if (!test(this->traps, addr))
+            this->trap_count++;
+        assign(this->traps, addr, true);
+        assign(this->unconditional, addr, true);
+    }
+
+    // stop at addr only when reg compares true against value, or with
+    // CHIP8_DEBUG_ANYWHERE as soon as it does anywhere
+    void add_condition(unsigned short int addr, unsigned int reg, Chip8DebugCompare compare, unsigned short int value) {
+        if (addr != CHIP8_DEBUG_ANYWHERE)
+            addr &= 0xFFF;
+        Chip8DebugCondition cond = { addr, reg, compare, value };
+        this->conditions.push_back(cond);
+        if (addr == CHIP8_DEBUG_ANYWHERE)
+            this->anywhere_count++;
+        else {
+            if (!test(this->traps, addr))
+                this->trap_count++;
+            assign(this->traps, addr, true);
+        }
+    }
+
+    // removes the unconditional breakpoint at addr (conditions stay, GDB
+    // takes its breakpoints out at every stop)
+    void clear_breakpoint(unsigned short int addr) {
+        addr &= 0xFFF;
+        assign(this->unconditional, addr, false);
+        this->retrap(addr);
+    }
+
+    // removes the conditions at addr, or all global ones
+    void clear_conditions(unsigned short int addr) {
+        if (addr != CHIP8_DEBUG_ANYWHERE)
+            addr &= 0xFFF;
+        for (size_t c = this->conditions.size(); c-- > 0; ) {
+            if (this->conditions[c].addr == addr)
+                this->conditions.erase(this->conditions.begin() + c);
+        }
+        if (addr == CHIP8_DEBUG_ANYWHERE) {
+            this->anywhere_count = 0;
+            this->anywhere_matched = false;
+        } else
+            this->retrap(addr);
+    }
+
+    bool has_breakpoint(unsigned short int addr) {
+        return test(this->traps, addr);
+    }
+
+    // watch length bytes from addr for reads, writes or both
+    void set_watchpoint(unsigned short int addr, unsigned int length, bool read, bool write) {
+        for (unsigned int a = addr; a < addr + length; a++) {
+            bool was = test(this->reads, a) || test(this->writes, a);
+            if (read)
+                assign(this->reads, a, true);
+            if (write)
+                assign(this->writes, a, true);
+            if (!was && (read || write))
+                this->watch_count++;
+        }
+    }
+
+    void clear_watchpoint(unsigned short int addr, unsigned int length, bool read, bool write) {
+        for (unsigned int a = addr; a < addr + length; a++) {
+            bool was = test(this->reads, a) || test(this->writes, a);
+            if (read)
+                assign(this->reads, a, false);
+            if (write)
+                assign(this->writes, a, false);
+            if (was && !test(this->reads, a) && !test(this->writes, a))
+                this->watch_count--;
+        }
+    }
+
+    bool is_watched(unsigned short int addr, bool write) {
+        return test(write ? this->writes : this->reads, addr);
+    }
+
+    // stop before the next instruction, e.g. on a GDB interrupt. like
+    // everything else here, only call it from the thread running the core
+    void halt() {
+        if (!this->halted)
+            this->stop(CHIP8_STOP_INTERRUPT);
+    }
+
+    void resume() {
+        this->halted = false;
+        this->resumed = true;
+        this->reason = CHIP8_STOP_NONE;
+    }
+
+    // run exactly one instruction, then stop again
+    void step() {
+        this->resume();
+        this->stepping = true;
+    }
+
+    // the memory an instruction about to run reads (Dxyn, Fx65) or writes
+    // (Fx33, Fx55), false if none
+    static bool access(unsigned short int instruction, unsigned short int i, unsigned short int& start, unsigned int& length, bool& write) {
+        unsigned int x = (instruction >> 8) & 0x000F;
+        start = i & 0xFFF;
+        if ((instruction >> 12) == 0xD) {
+            length = (instruction & 0x000F) ? (instruction & 0x000F) : 32;
+            write = false;
+            return true;
+        }
+        if ((instruction >> 12) != 0xF)
+            return false;
+        switch (instruction & 0x00FF) {
+        case 0x33: length = 3; write = true; return true;
+        case 0x55: length = x + 1; write = true; return true;
+        case 0x65: length = x + 1; write = false; return true;
+        }
+        return false;
+    }
+
+    // before the instruction at the cpu's pc runs: false if it must not
+    bool before(Chip8Cpu& cpu, const unsigned char* memory, Chip8Timer& delay_timer, Chip8Timer& sound_timer) {
+        if (this->halted)
+            return false;
+
+        unsigned short int pc = cpu.pc & 0xFFF;
+        bool resumed = this->resumed;
+        this->resumed = false;
+        if (!resumed && test(this->traps, pc) &&
+            (test(this->unconditional, pc) || this->match(cpu, delay_timer, sound_timer, pc))) {
+            this->stop(CHIP8_STOP_BREAKPOINT);
+            return false;
+        }
+        if (this->anywhere_count) {
+            bool matched = this->match(cpu, delay_timer, sound_timer, CHIP8_DEBUG_ANYWHERE);
+            bool rose = matched && !this->anywhere_matched;
+            this->anywhere_matched = matched;
+            if (rose && !resumed) {
+                this->stop(CHIP8_STOP_CONDITION);
+                return false;
+            }
+        }
+
+        this->instruction = (memory[pc] << 8) | memory[(pc + 1) & 0xFFF];
+        if (!this->watch_count || !access(this->instruction, cpu.i, this->access_start, this->access_length, this->access_write))
+            this->access_length = 0;
+        return true;
+    }
+
+    // after it ran: false if the core has to stop now
+    bool after() {
+        for (unsigned int a = 0; a < this->access_length; a++) {
+            unsigned short int addr = (this->access_start + a) & 0xFFF;
+            if (test(this->access_write ? this->writes : this->reads, addr)) {
+                this->watch_addr = addr;
+                this->stop(this->access_write ? CHIP8_STOP_WATCH_WRITE : CHIP8_STOP_WATCH_READ);
+                return false;
+            }
+        }
+        if (this->instruction == 0x00FD) {
+            this->stop(CHIP8_STOP_EXIT);
+            return false;
+        }
+        if (this->stepping) {
+            this->stop(CHIP8_STOP_STEP);
+            return false;
+        }
+        return true;
+    }
+};
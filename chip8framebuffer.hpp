@@ -0,0 +1,168 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include "chip8hash.hpp"
+#include "chip8state.hpp"
+
+// the display, one bit per pixel with the leftmost pixel in the most
+// significant bit. every row is one 64-bit word in the 64x32 mode and two
+// (left half first) in the SUPER-CHIP 128x64 mode, so a sprite row is a
+// shift and an XOR, and collision is an AND. sprites wrap around as a whole
+// but are clipped at the right and bottom edges. plain data, so it can be
+// copied as a snapshot (e.g. to hand a frame to another thread).
+class Chip8Framebuffer {
+private:
+    unsigned long long rows [64][2];
+    bool hires;
+
+    // row bits of a sprite line of the given width at x, in both words
+    void place(unsigned long long line, unsigned int width, unsigned int x, unsigned long long& left, unsigned long long& right) {
+        unsigned long long bits = line << (64 - width);
+        left = 0;
+        right = 0;
+        if (x < 64) {
+            left = bits >> x;
+            if (this->hires && x + width > 64)
+                right = bits << (64 - x);
+        } else
+            right = bits >> (x - 64);
+    }
+public:
+    Chip8Framebuffer() {
+        this->hires = false;
+        this->clear();
+    }
+
+    unsigned int get_width() {
+        return this->hires ? 128 : 64;
+    }
+
+    unsigned int get_height() {
+        return this->hires ? 64 : 32;
+    }
+
+    bool is_hires() {
+        return this->hires;
+    }
+
+    // 00FF/00FE; switching resolution clears the screen
+    void set_hires(bool hires) {
+        this->hires = hires;
+        this->clear();
+    }
+
+    // row y, two words (the second one is always 0 in the 64x32 mode)
+    const unsigned long long* get_row(unsigned int y) {
+        return this->rows[y];
+    }
+
+    bool get_pixel(unsigned int x, unsigned int y) {
+        return (this->rows[y][x >> 6] >> (63 - (x & 63))) & 0x01;
+    }
+
+    // 00E0
+    void clear() {
+        memset(this->rows, 0, sizeof(this->rows));
+    }
+
+    // Dxyn: n rows of 8 pixels from memory at i, or with n = 0 a 16x16
+    // sprite of two bytes per row. returns true if any pixel was turned off
+    bool draw(const unsigned char* memory, unsigned short int i, unsigned char x, unsigned char y, unsigned int n) {
+        unsigned int width = n ? 8 : 16;
+        unsigned int height = n ? n : 16;
+        x %= this->get_width();
+        y %= this->get_height();
+        if (y + height > this->get_height())
+            height = this->get_height() - y;
+
+        unsigned long long hit = 0;
+        for (unsigned int row = 0; row < height; row++) {
+            unsigned long long line;
+            if (n)
+                line = memory[(i + row) & 0xFFF];
+            else
+                line = (memory[(i + row * 2) & 0xFFF] << 8) | memory[(i + row * 2 + 1) & 0xFFF];
+
+            unsigned long long left, right;
+            this->place(line, width, x, left, right);
+            unsigned long long* out = this->rows[y + row];
+            hit |= (out[0] & left) | (out[1] & right);
+            out[0] ^= left;
+            out[1] ^= right;
+        }
+        return hit != 0;
+    }
+
+    // 00Cn
+    void scroll_down(unsigned int n) {
+        unsigned int height = this->get_height();
+        if (n > height)
+            n = height;
+        memmove(this->rows[n], this->rows[0], (height - n) * sizeof(this->rows[0]));
+        memset(this->rows[0], 0, n * sizeof(this->rows[0]));
+    }
+
+    // 00FB
+    void scroll_right(unsigned int n) {
+        for (unsigned int y = 0; y < this->get_height(); y++) {
+            unsigned long long* row = this->rows[y];
+            if (this->hires)
+                row[1] = (row[1] >> n) | (row[0] << (64 - n));
+            row[0] >>= n;
+        }
+    }
+
+    // 00FC
+    void scroll_left(unsigned int n) {
+        for (unsigned int y = 0; y < this->get_height(); y++) {
+            unsigned long long* row = this->rows[y];
+            row[0] = (row[0] << n) | (row[1] >> (64 - n));
+            row[1] <<= n;
+        }
+    }
+
+    // the visible rows as bytes, most significant first. in the 64x32 mode
+    // that's the 256 byte layout the framebuffer used to have at 0xF00,
+    // returns the number of bytes written (256 or 1024)
+    size_t pack(unsigned char* out) {
+        size_t n = 0;
+        for (unsigned int y = 0; y < this->get_height(); y++) {
+            for (unsigned int w = 0; w < this->get_width() / 64; w++) {
+                for (int b = 56; b >= 0; b -= 8)
+                    out[n++] = (this->rows[y][w] >> b) & 0xFF;
+            }
+        }
+        return n;
+    }
+
+    // to compare runs without dumping screens; 64x32 screens hash the same
+    // as the old 0xF00-0xFFF framebuffer did
+    unsigned long long hash() {
+        unsigned char bytes [1024];
+        return chip8_hash(bytes, this->pack(bytes));
+    }
+
+    // expand into get_width() x get_height() 32-bit pixels, pitch bytes apart
+    // per row. SDL-free, so it can be timed headless.
+    void expand(void* pixels, size_t pitch, unsigned int on = 0xFFFFFFFF, unsigned int off = 0xFF000000) {
+        unsigned int width = this->get_width();
+        for (unsigned int y = 0; y < this->get_height(); y++) {
+            unsigned int* out = (unsigned int*) ((unsigned char*) pixels + y * pitch);
+            for (unsigned int w = 0; w < width / 64; w++) {
+                unsigned long long bits = this->rows[y][w];
+                for (int k = 63; k >= 0; k--)
+                    *out++ = ((bits >> k) & 0x01) ? on : off;
+            }
+        }
+    }
+
+    void save(Chip8State& state) {
+        memcpy(state.screen, this->rows, sizeof(this->rows));
+        state.display_flags = this->hires ? Chip8State::HIRES : 0;
+    }
+
+    void load(const Chip8State& state) {
+        memcpy(this->rows, state.screen, sizeof(this->rows));
+        this->hires = state.display_flags & Chip8State::HIRES;
+    }
+};
@@ -0,0 +1,540 @@
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "chip8core.hpp"
+#include "chip8debug.hpp"
+
+#ifdef __unix__
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+// register layout of g/G/p/P, all little endian: V0-VF, I, PC, SP, DT, ST
+static const char CHIP8_GDB_TARGET_XML [] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target version=\"1.0\"><feature name=\"org.chip8emu.core\">"
+    "<reg name=\"v0\" bitsize=\"8\" regnum=\"0\"/><reg name=\"v1\" bitsize=\"8\"/><reg name=\"v2\" bitsize=\"8\"/>"
+    "<reg name=\"v3\" bitsize=\"8\"/><reg name=\"v4\" bitsize=\"8\"/><reg name=\"v5\" bitsize=\"8\"/>"
+    "<reg name=\"v6\" bitsize=\"8\"/><reg name=\"v7\" bitsize=\"8\"/><reg name=\"v8\" bitsize=\"8\"/>"
+    "<reg name=\"v9\" bitsize=\"8\"/><reg name=\"va\" bitsize=\"8\"/><reg name=\"vb\" bitsize=\"8\"/>"
+    "<reg name=\"vc\" bitsize=\"8\"/><reg name=\"vd\" bitsize=\"8\"/><reg name=\"ve\" bitsize=\"8\"/>"
+    "<reg name=\"vf\" bitsize=\"8\"/><reg name=\"i\" bitsize=\"16\" type=\"data_ptr\"/>"
+    "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/><reg name=\"sp\" bitsize=\"8\"/>"
+    "<reg name=\"dt\" bitsize=\"8\"/><reg name=\"st\" bitsize=\"8\"/>"
+    "</feature></target>";
+
+// GDB remote serial protocol server for one core, on a loopback TCP port or
+// a unix socket. service() never blocks, so it's called once per frame from
+// whichever thread runs the core; a halted core simply runs no instructions
+// until the client resumes it. besides the usual packets, "monitor" commands
+// set the conditional breaks GDB's own conditions can't express here:
+//   monitor break <addr|*> <v0-vf|i|pc|sp|dt|st> <==|!=|<|<=|>|>=> <value>
+//   monitor delete <addr|*>
+class Chip8GdbStub {
+private:
+    Chip8Core* core;
+    Chip8Debugger* debugger;
+
+    int server;
+    int client;
+    std::string path;
+
+    std::string input;
+    std::string last;
+    bool no_ack;
+    // a c or s is in flight: report the next stop
+    bool running;
+    bool killed;
+
+    static int unhex(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    static std::string hex(const unsigned char* data, size_t size) {
+        static const char digits [] = "0123456789abcdef";
+        std::string out;
+        for (size_t k = 0; k < size; k++) {
+            out += digits[data[k] >> 4];
+            out += digits[data[k] & 0x0F];
+        }
+        return out;
+    }
+
+    static std::string unhex_string(const std::string& text) {
+        std::string out;
+        for (size_t k = 0; k + 1 < text.size(); k += 2)
+            out += (char) ((unhex(text[k]) << 4) | unhex(text[k + 1]));
+        return out;
+    }
+
+    void write_all(const std::string& data) {
+#ifdef __unix__
+        size_t sent = 0;
+        while (this->client >= 0 && sent < data.size()) {
+            ssize_t n = send(this->client, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                struct pollfd fd = { this->client, POLLOUT, 0 };
+                if (poll(&fd, 1, 1000) <= 0) {
+                    this->disconnect();
+                    return;
+                }
+                continue;
+            }
+            sent += n;
+        }
+#endif
+    }
+
+    void reply(const std::string& payload) {
+        unsigned char sum = 0;
+        for (size_t k = 0; k < payload.size(); k++)
+            sum += payload[k];
+        char tail [4];
+        snprintf(tail, sizeof(tail), "#%02x", sum);
+        this->last = "$" + payload + tail;
+        this->write_all(this->last);
+    }
+
+    void disconnect() {
+#ifdef __unix__
+        if (this->client >= 0)
+            ::close(this->client);
+#endif
+        this->client = -1;
+        this->input.clear();
+        this->running = false;
+        this->no_ack = false;
+        // nobody is left to resume it
+        this->debugger->clear();
+    }
+
+    std::string stop_reply() {
+        char out [32];
+        switch (this->debugger->get_reason()) {
+        case CHIP8_STOP_INTERRUPT:
+            return "S02";
+        case CHIP8_STOP_EXIT:
+            return "W00";
+        case CHIP8_STOP_WATCH_READ:
+        case CHIP8_STOP_WATCH_WRITE: {
+            unsigned short int addr = this->debugger->get_watch_addr();
+            const char* kind = "rwatch";
+            if (this->debugger->is_watched(addr, true) && this->debugger->is_watched(addr, false))
+                kind = "awatch";
+            else if (this->debugger->get_reason() == CHIP8_STOP_WATCH_WRITE)
+                kind = "watch";
+            snprintf(out, sizeof(out), "T05%s:%x;", kind, addr);
+            return out;
+        }
+        default:
+            return "S05";
+        }
+    }
+
+    // the registers in the order of CHIP8_GDB_TARGET_XML
+    void read_registers(unsigned char* regs) {
+        Chip8Cpu& cpu = this->core->get_cpu();
+        Chip8State state;
+        cpu.save(state);
+        memcpy(regs, state.v, 16);
+        regs[16] = state.i & 0xFF;
+        regs[17] = state.i >> 8;
+        regs[18] = state.pc & 0xFF;
+        regs[19] = state.pc >> 8;
+        regs[20] = state.sp;
+        regs[21] = this->core->get_delay_timer().get_value();
+        regs[22] = this->core->get_sound_timer().get_value();
+    }
+
+    void write_registers(const unsigned char* regs) {
+        Chip8State state;
+        this->core->save_state(state);
+        memcpy(state.v, regs, 16);
+        state.i = regs[16] | (regs[17] << 8);
+        state.pc = regs[18] | (regs[19] << 8);
+        state.sp = regs[20];
+        state.delay_timer = regs[21];
+        state.sound_timer = regs[22];
+        this->core->load_state(state);
+    }
+
+    // offset and size of register n in the g packet
+    static bool locate(unsigned int n, unsigned int& offset, unsigned int& size) {
+        static const unsigned int offsets [] = { 16, 18, 20, 21, 22 };
+        if (n < 16) {
+            offset = n;
+            size = 1;
+        } else if (n < 21) {
+            offset = offsets[n - 16];
+            size = (n == 16 || n == 17) ? 2 : 1;
+        } else
+            return false;
+        return true;
+    }
+
+    static bool parse_register(const std::string& name, unsigned int& reg) {
+        if (name.size() == 2 && (name[0] == 'v' || name[0] == 'V') && unhex(name[1]) >= 0)
+            reg = unhex(name[1]);
+        else if (name == "i")
+            reg = CHIP8_DEBUG_I;
+        else if (name == "pc")
+            reg = CHIP8_DEBUG_PC;
+        else if (name == "sp")
+            reg = CHIP8_DEBUG_SP;
+        else if (name == "dt")
+            reg = CHIP8_DEBUG_DT;
+        else if (name == "st")
+            reg = CHIP8_DEBUG_ST;
+        else
+            return false;
+        return true;
+    }
+
+    static bool parse_compare(const std::string& op, Chip8DebugCompare& compare) {
+        static const char* const names [] = { "==", "!=", "<", "<=", ">", ">=" };
+        for (unsigned int k = 0; k < 6; k++) {
+            if (op == names[k]) {
+                compare = (Chip8DebugCompare) k;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::string monitor(const std::string& command) {
+        char what [16], where [16], reg [8], op [4];
+        unsigned int value;
+        int fields = sscanf(command.c_str(), "%15s %15s %7s %3s %i", what, where, reg, op, &value);
+        if (fields >= 2) {
+            unsigned short int addr = !strcmp(where, "*") ? CHIP8_DEBUG_ANYWHERE : strtoul(where, NULL, 0);
+            unsigned int r;
+            Chip8DebugCompare compare;
+            if (!strcmp(what, "break") && fields == 5 && parse_register(reg, r) && parse_compare(op, compare)) {
+                this->debugger->add_condition(addr, r, compare, value);
+                return "conditional break set\n";
+            }
+            if (!strcmp(what, "delete") && fields == 2) {
+                this->debugger->clear_conditions(addr);
+                return "conditional breaks deleted\n";
+            }
+        }
+        return "usage: monitor break <addr|*> <v0-vf|i|pc|sp|dt|st> <op> <value>\n"
+               "       monitor delete <addr|*>\n";
+    }
+
+    // one packet's payload, checksum already verified
+    void handle(const std::string& packet) {
+        unsigned char* memory = this->core->get_memory();
+        char command = packet.empty() ? 0 : packet[0];
+        const char* args = packet.c_str() + 1;
+
+        if (command == '?')
+            this->reply(this->stop_reply());
+        else if (command == 'g') {
+            unsigned char regs [23];
+            this->read_registers(regs);
+            this->reply(hex(regs, sizeof(regs)));
+        } else if (command == 'G') {
+            unsigned char regs [23];
+            if (packet.size() < 1 + 2 * sizeof(regs)) {
+                this->reply("E01");
+                return;
+            }
+            for (size_t k = 0; k < sizeof(regs); k++)
+                regs[k] = (unhex(args[k * 2]) << 4) | unhex(args[k * 2 + 1]);
+            this->write_registers(regs);
+            this->reply("OK");
+        } else if (command == 'p' || command == 'P') {
+            unsigned char regs [23];
+            char* end;
+            unsigned int offset, size;
+            unsigned int n = strtoul(args, &end, 16);
+            if (!locate(n, offset, size)) {
+                this->reply("E01");
+                return;
+            }
+            this->read_registers(regs);
+            if (command == 'p') {
+                this->reply(hex(regs + offset, size));
+                return;
+            }
+            if (*end != '=' || strlen(end + 1) < size * 2) {
+                this->reply("E01");
+                return;
+            }
+            for (unsigned int k = 0; k < size; k++)
+                regs[offset + k] = (unhex(end[1 + k * 2]) << 4) | unhex(end[2 + k * 2]);
+            this->write_registers(regs);
+            this->reply("OK");
+        } else if (command == 'm' || command == 'M') {
+            char* end;
+            unsigned int addr = strtoul(args, &end, 16);
+            unsigned int length = (*end == ',') ? strtoul(end + 1, &end, 16) : 0;
+            if (length > 4096) {
+                this->reply("E01");
+                return;
+            }
+            if (command == 'm') {
+                std::string out;
+                for (unsigned int k = 0; k < length; k++)
+                    out += hex(memory + ((addr + k) & 0xFFF), 1);
+                this->reply(out);
+                return;
+            }
+            if (*end != ':' || strlen(end + 1) < length * 2) {
+                this->reply("E01");
+                return;
+            }
+            for (unsigned int k = 0; k < length; k++)
+                memory[(addr + k) & 0xFFF] = (unhex(end[1 + k * 2]) << 4) | unhex(end[2 + k * 2]);
+            this->core->memory_changed();
+            this->reply("OK");
+        } else if (command == 'c' || command == 's') {
+            if (*args) {
+                Chip8State state;
+                this->core->save_state(state);
+                state.pc = strtoul(args, NULL, 16) & 0xFFF;
+                this->core->load_state(state);
+            }
+            if (command == 'c')
+                this->debugger->resume();
+            else
+                this->debugger->step();
+            this->running = true;
+        } else if (command == 'Z' || command == 'z') {
+            char* end;
+            unsigned int type = strtoul(args, &end, 16);
+            unsigned int addr = (*end == ',') ? strtoul(end + 1, &end, 16) : 0;
+            unsigned int length = (*end == ',') ? strtoul(end + 1, &end, 16) : 1;
+            if (type > 4 || addr > 0xFFF) {
+                this->reply("");
+                return;
+            }
+            if (type <= 1) {
+                if (command == 'Z')
+                    this->debugger->set_breakpoint(addr);
+                else
+                    this->debugger->clear_breakpoint(addr);
+            } else {
+                bool write = type == 2 || type == 4;
+                bool read = type == 3 || type == 4;
+                if (command == 'Z')
+                    this->debugger->set_watchpoint(addr, length, read, write);
+                else
+                    this->debugger->clear_watchpoint(addr, length, read, write);
+            }
+            this->reply("OK");
+        } else if (command == 'k') {
+            this->killed = true;
+            this->disconnect();
+        } else if (command == 'D') {
+            this->reply("OK");
+            this->disconnect();
+        } else if (command == 'H')
+            this->reply("OK");
+        else if (packet.compare(0, 10, "qSupported") == 0)
+            this->reply("PacketSize=4000;qXfer:features:read+;QStartNoAckMode+");
+        else if (packet == "QStartNoAckMode") {
+            this->reply("OK");
+            this->no_ack = true;
+        } else if (packet.compare(0, 31, "qXfer:features:read:target.xml:") == 0) {
+            unsigned int offset = 0, length = 0;
+            sscanf(packet.c_str() + 31, "%x,%x", &offset, &length);
+            size_t size = sizeof(CHIP8_GDB_TARGET_XML) - 1;
+            if (offset >= size)
+                this->reply("l");
+            else if (offset + length >= size)
+                this->reply("l" + std::string(CHIP8_GDB_TARGET_XML + offset));
+            else
+                this->reply("m" + std::string(CHIP8_GDB_TARGET_XML + offset, length));
+        } else if (packet == "qAttached")
+            this->reply("1");
+        else if (packet == "qC")
+            this->reply("QC1");
+        else if (packet == "qfThreadInfo")
+            this->reply("m1");
+        else if (packet == "qsThreadInfo")
+            this->reply("l");
+        else if (packet.compare(0, 6, "qRcmd,") == 0) {
+            std::string out = this->monitor(unhex_string(packet.substr(6)));
+            this->reply("O" + hex((const unsigned char*) out.data(), out.size()));
+            this->reply("OK");
+        } else
+            // unsupported, the client falls back on something else
+            this->reply("");
+    }
+
+    // split whatever arrived into acks, interrupts and packets
+    void parse() {
+        while (!this->input.empty()) {
+            char c = this->input[0];
+            if (c == '+') {
+                this->input.erase(0, 1);
+            } else if (c == '-') {
+                this->input.erase(0, 1);
+                this->write_all(this->last);
+            } else if (c == 0x03) {
+                this->input.erase(0, 1);
+                if (this->running)
+                    this->debugger->halt();
+            } else if (c == '$') {
+                size_t end = this->input.find('#');
+                if (end == std::string::npos || end + 2 >= this->input.size())
+                    return;
+                std::string payload = this->input.substr(1, end - 1);
+                unsigned char sum = 0;
+                for (size_t k = 0; k < payload.size(); k++)
+                    sum += payload[k];
+                bool valid = unhex(this->input[end + 1]) * 16 + unhex(this->input[end + 2]) == sum;
+                this->input.erase(0, end + 3);
+                if (!this->no_ack)
+                    this->write_all(valid ? "+" : "-");
+                if (valid)
+                    this->handle(payload);
+                if (this->client < 0)
+                    return;
+            } else
+                this->input.erase(0, 1);
+        }
+    }
+public:
+    Chip8GdbStub(Chip8Core& core) {
+        this->core = &core;
+        this->debugger = &core.get_debugger();
+        this->server = -1;
+        this->client = -1;
+        this->no_ack = false;
+        this->running = false;
+        this->killed = false;
+    }
+
+    ~Chip8GdbStub() {
+        this->close();
+    }
+
+    Chip8GdbStub(const Chip8GdbStub&) = delete;
+    Chip8GdbStub& operator=(const Chip8GdbStub&) = delete;
+
+    // a port number for 127.0.0.1, or a path for a unix socket. the core
+    // halts until a client attaches and lets it run
+    bool listen(const char* where) {
+#ifdef __unix__
+        this->close();
+        if (strchr(where, '/')) {
+            struct sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            if (strlen(where) >= sizeof(addr.sun_path)) {
+                printf("* Socket path too long! (%s)\n", where);
+                return false;
+            }
+            strcpy(addr.sun_path, where);
+            unlink(where);
+            this->server = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (this->server < 0 || bind(this->server, (struct sockaddr*) &addr, sizeof(addr)) < 0 || ::listen(this->server, 1) < 0) {
+                printf("* Unable to listen on %s!\n", where);
+                this->close();
+                return false;
+            }
+            this->path = where;
+        } else {
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = htons(strtoul(where, NULL, 10));
+            int on = 1;
+            this->server = socket(AF_INET, SOCK_STREAM, 0);
+            if (this->server >= 0)
+                setsockopt(this->server, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (this->server < 0 || bind(this->server, (struct sockaddr*) &addr, sizeof(addr)) < 0 || ::listen(this->server, 1) < 0) {
+                printf("* Unable to listen on port %s!\n", where);
+                this->close();
+                return false;
+            }
+        }
+        fcntl(this->server, F_SETFL, fcntl(this->server, F_GETFL) | O_NONBLOCK);
+        this->debugger->halt();
+        return true;
+#else
+        printf("* The GDB stub needs a unix host! (%s)\n", where);
+        return false;
+#endif
+    }
+
+    void close() {
+#ifdef __unix__
+        if (this->client >= 0)
+            this->disconnect();
+        if (this->server >= 0)
+            ::close(this->server);
+        if (!this->path.empty())
+            unlink(this->path.c_str());
+#endif
+        this->server = -1;
+        this->path.clear();
+    }
+
+    bool is_connected() {
+        return this->client >= 0;
+    }
+
+    // the client sent k
+    bool is_killed() {
+        return this->killed;
+    }
+
+    // accept a client, answer its packets and report a stop, without blocking
+    void service() {
+#ifdef __unix__
+        if (this->server < 0)
+            return;
+        if (this->client < 0) {
+            this->client = accept(this->server, NULL, NULL);
+            if (this->client < 0)
+                return;
+            fcntl(this->client, F_SETFL, fcntl(this->client, F_GETFL) | O_NONBLOCK);
+            // a client expects to find the target stopped
+            this->debugger->halt();
+        }
+
+        char buffer [4096];
+        while (this->client >= 0) {
+            ssize_t n = recv(this->client, buffer, sizeof(buffer), 0);
+            if (n == 0) {
+                this->disconnect();
+                return;
+            }
+            if (n < 0)
+                break;
+            this->input.append(buffer, n);
+        }
+        this->parse();
+
+        if (this->running && this->debugger->is_halted()) {
+            this->running = false;
+            this->reply(this->stop_reply());
+        }
+#endif
+    }
+
+    // sleep until the client (or a new one) has something to say, at most
+    // timeout ms; for hosts with nothing else to do while the core is halted
+    void wait(int timeout) {
+#ifdef __unix__
+        struct pollfd fd = { this->client >= 0 ? this->client : this->server, POLLIN, 0 };
+        if (fd.fd >= 0)
+            poll(&fd, 1, timeout);
+#endif
+    }
+};
@@ -0,0 +1,12 @@
+#pragma once
+#include <cstddef>
+
+// 64-bit FNV-1a, used to identify ROMs and compare screens
+inline unsigned long long chip8_hash(const unsigned char* data, size_t size) {
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
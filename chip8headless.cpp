@@ -0,0 +1,370 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <stdexcept>
+#include "chip8core.hpp"
+#include "chip8scheduler.hpp"
+#include "chip8pack.hpp"
+#include "chip8recording.hpp"
+#include "chip8gdb.hpp"
+#include "chip8audio.hpp"
+#include "chip8runahead.hpp"
+#include "chip8capture.hpp"
+#include "chip8telemetry.hpp"
+
+// runs a ROM without any window, as fast as the host allows (or in real
+// time at 60 frames per second with -r). with -p the ROM is picked from a
+// pack by name or hash instead of read from a file. -P replays an input
+// recording made by chip8 -R, checking the screen against it as it goes.
+// -F and -H (profile builds) write folded stacks and print the top hot loops.
+// -g waits for a GDB client on a loopback port or a unix socket path. -w
+// writes what the beeper played to a WAV file. -a speculates frames ahead
+// after every frame and rolls back, as chip8 -a does, to time it. -n runs
+// idle loops instruction by instruction instead of skipping them. -V records
+// every frame to a .gif, .y4m or raw grayscale video, scaled by -S. -q
+// picks the quirk profile, overriding the pack's, a recording's or a save
+// state's. -T publishes live counters for chip8stat:
+//   chip8headless <rom> [-p pack] [-c cycles | -f frames] [-i instructions_per_frame] [-e engine] [-t trace_file] [-r]
+//                 [-l state_file] [-s state_file] [-P recording_file] [-F folded_file] [-H top] [-g port|socket] [-w wav_file] [-a frames] [-n]
+//                 [-V video_file] [-S scale] [-q quirk_profile] [-T]
+static void usage(const char* argv0) {
+    printf("usage: %s <rom> [-p pack] [-c cycles | -f frames] [-i instructions_per_frame] [-e interpreter|predecoded|jit] [-t trace_file] [-r]\n"
+           "       [-l load_state_file] [-s save_state_file] [-P recording_file] [-F folded_file] [-H top] [-g port|socket] [-w wav_file] [-a frames] [-n]\n"
+           "       [-V video_file] [-S scale] [-q modern|vip|chip48|schip] [-T]\n", argv0);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char* rom = NULL;
+    unsigned long long cycles = 0;
+    unsigned long long frames = 0;
+    unsigned int ipf = 0;
+    const char* pack_file = NULL;
+    bool realtime = false;
+    Chip8Engine engine = CHIP8_ENGINE_INTERPRETER;
+    const char* trace_file = NULL;
+    const char* load_file = NULL;
+    const char* save_file = NULL;
+    const char* replay_file = NULL;
+    const char* folded_file = NULL;
+    unsigned int top = 0;
+    const char* gdb_address = NULL;
+    const char* wav_file = NULL;
+    unsigned int ahead = 0;
+    bool idle_skip = true;
+    const char* video_file = NULL;
+    unsigned int video_scale = 4;
+    Chip8Quirks quirks = CHIP8_QUIRKS_MODERN;
+    bool quirks_set = false;
+    bool telemetry_enabled = false;
+
+    for (int a = 1; a < argc; a++) {
+        if (!strcmp(argv[a], "-c") && a + 1 < argc)
+            cycles = strtoull(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-f") && a + 1 < argc)
+            frames = strtoull(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-i") && a + 1 < argc)
+            ipf = strtoul(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-e") && a + 1 < argc) {
+            a++;
+            if (!strcmp(argv[a], "interpreter"))
+                engine = CHIP8_ENGINE_INTERPRETER;
+            else if (!strcmp(argv[a], "predecoded"))
+                engine = CHIP8_ENGINE_PREDECODED;
+            else if (!strcmp(argv[a], "jit"))
+                engine = CHIP8_ENGINE_JIT;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[a], "-r"))
+            realtime = true;
+        else if (!strcmp(argv[a], "-l") && a + 1 < argc)
+            load_file = argv[++a];
+        else if (!strcmp(argv[a], "-s") && a + 1 < argc)
+            save_file = argv[++a];
+        else if (!strcmp(argv[a], "-P") && a + 1 < argc)
+            replay_file = argv[++a];
+        else if (!strcmp(argv[a], "-p") && a + 1 < argc)
+            pack_file = argv[++a];
+        else if (!strcmp(argv[a], "-t") && a + 1 < argc)
+            trace_file = argv[++a];
+        else if (!strcmp(argv[a], "-F") && a + 1 < argc)
+            folded_file = argv[++a];
+        else if (!strcmp(argv[a], "-H") && a + 1 < argc)
+            top = strtoul(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-g") && a + 1 < argc)
+            gdb_address = argv[++a];
+        else if (!strcmp(argv[a], "-w") && a + 1 < argc)
+            wav_file = argv[++a];
+        else if (!strcmp(argv[a], "-a") && a + 1 < argc)
+            ahead = strtoul(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-n"))
+            idle_skip = false;
+        else if (!strcmp(argv[a], "-V") && a + 1 < argc)
+            video_file = argv[++a];
+        else if (!strcmp(argv[a], "-S") && a + 1 < argc)
+            video_scale = strtoul(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-q") && a + 1 < argc) {
+            if (!chip8_parse_quirks(argv[++a], quirks))
+                return 1;
+            quirks_set = true;
+        }
+        else if (!strcmp(argv[a], "-T"))
+            telemetry_enabled = true;
+        else if (argv[a][0] != '-')
+            rom = argv[a];
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // a save state brings its own memory image, so the ROM is optional then
+    // a recording starts from power on
+    if ((rom == NULL && load_file == NULL) || (pack_file && rom == NULL) || (replay_file && (rom == NULL || load_file))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // speculative frames would run into breakpoints
+    if (ahead && gdb_address) {
+        printf("* Run-ahead while debugging is not supported!\n");
+        return 1;
+    }
+    // and would be traced and profiled, though they're rolled back
+    if (ahead && (trace_file || folded_file || top)) {
+        printf("* Run-ahead while tracing or profiling is not supported!\n");
+        return 1;
+    }
+
+    // default to one emulated minute
+    if (cycles == 0 && frames == 0)
+        frames = 3600;
+
+    try {
+        Chip8Core core;
+        core.set_engine(engine);
+        if (!idle_skip)
+            core.set_idle_skip(false);
+
+        if (pack_file) {
+            Chip8Pack pack;
+            Chip8PackEntry entry;
+            if (!pack.open(pack_file) || !pack.find(rom, entry) || !core.load_rom(entry.data, entry.size))
+                return 1;
+            // the pack's suggested speed and quirks, unless -i and -q override them
+            if (ipf == 0)
+                ipf = entry.ipf;
+            if (!quirks_set && !chip8_quirks_from_id(entry.quirks, quirks))
+                return 1;
+        } else if (rom && !core.load_game(rom))
+            return 1;
+        if (ipf == 0)
+            ipf = CHIP8_DEFAULT_IPF;
+        core.set_quirks(quirks);
+
+        // the recording decides the seed, speed, length and (unless -q) quirks
+        Chip8Recording recording;
+        if (replay_file) {
+            if (!recording.load(replay_file))
+                return 1;
+            if (recording.get_image() != Chip8Recording::image_hash(core.get_memory())) {
+                printf("* Recording was made with a different ROM! (%s)\n", replay_file);
+                return 1;
+            }
+            core.seed(recording.get_seed());
+            ipf = recording.get_ipf();
+            if (!quirks_set && recording.get_quirks(quirks))
+                core.set_quirks(quirks);
+            cycles = 0;
+            frames = recording.get_frames();
+        }
+
+        if (load_file) {
+            Chip8State state;
+            if (!state.load(load_file))
+                return 1;
+            // which brings its quirk profile, unless -q overrides it
+            core.load_state(state);
+            if (quirks_set)
+                core.set_quirks(quirks);
+        }
+
+        FILE* trace = NULL;
+        if (trace_file) {
+            if (!Chip8DefaultTrace::enabled) {
+                printf("* Tracing is not compiled in, rebuild with -DCHIP8_TRACE\n");
+                return 1;
+            }
+            trace = fopen(trace_file, "wb");
+            if (trace == NULL) {
+                printf("* Unable to open file! (%s)\n", trace_file);
+                return 1;
+            }
+            Chip8RingTrace::write_header(trace);
+        }
+
+        if ((folded_file || top) && !Chip8DefaultProfile::enabled) {
+            printf("* Profiling is not compiled in, rebuild with -DCHIP8_PROFILE\n");
+            return 1;
+        }
+
+        Chip8GdbStub gdb (core);
+        if (gdb_address) {
+            if (!gdb.listen(gdb_address))
+                return 1;
+            printf("* waiting for GDB on %s\n", gdb_address);
+        }
+
+        // rendered right after each frame, so no latency is needed
+        Chip8Beeper beeper (48000, 0);
+        Chip8WavWriter wav;
+        if (wav_file && !wav.open(wav_file, beeper.get_rate()))
+            return 1;
+        Chip8RunAhead runahead (ahead);
+        // a batch run can wait for the writer, a real-time one drops frames
+        Chip8Capture capture;
+        if (video_file && !capture.open(video_file, Chip8Capture::format_of(video_file), video_scale, !realtime))
+            return 1;
+        double capture_time = 0;
+        Chip8Telemetry telemetry;
+        if (telemetry_enabled && !telemetry.open(rom ? rom : load_file))
+            return 1;
+        unsigned long long fast_captures = 0;
+        short int samples [48000 / 60 + 1];
+        unsigned long long rendered = 0;
+
+        unsigned long long start_cycles = core.get_cycles();
+        unsigned long long start_frames = core.get_frames();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        Chip8Scheduler scheduler(ipf, realtime);
+
+        // keep the timers running at the same rate in both modes
+        if (frames)
+            cycles = frames * ipf;
+        unsigned long long checked = 0;
+        for (unsigned long long c = 0; c < cycles; c += ipf) {
+            if (gdb_address) {
+                // nothing runs while halted, so sleep on the socket instead of spinning
+                gdb.service();
+                while (core.is_halted() && !gdb.is_killed()) {
+                    telemetry.pause();
+                    gdb.wait(100);
+                    gdb.service();
+                }
+                if (gdb.is_killed())
+                    break;
+            }
+            unsigned short int keys;
+            if (replay_file && recording.next(keys))
+                core.get_keyboard().set_keys(keys);
+            if (cycles - c >= ipf) {
+                if (telemetry.is_open())
+                    telemetry.begin_frame(scheduler);
+                scheduler.run_frame(core);
+                // (a frame the debugger halted didn't happen)
+                if (wav_file && core.get_frames() - start_frames > rendered) {
+                    rendered++;
+                    size_t n = (rendered * beeper.get_rate()) / 60 - ((rendered - 1) * beeper.get_rate()) / 60;
+                    beeper.push(core.is_beeping());
+                    beeper.render(samples, n);
+                    wav.write(samples, n);
+                }
+                if (video_file && core.get_frames() - start_frames > capture.get_captured() + capture.get_dropped()) {
+                    std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+                    // only captures that found a free slot, the rest measure the writer
+                    if (capture.capture(core.get_framebuffer())) {
+                        capture_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+                        fast_captures++;
+                    }
+                }
+                if (ahead && !core.is_halted())
+                    runahead.run(core, scheduler);
+                if (telemetry.is_open()) {
+                    telemetry.end_frame(core, scheduler, capture.get_dropped());
+                    // frames written out are the ones presented, capturing is rendering
+                    telemetry.presented(capture.get_captured(), 0, (unsigned long long) (capture_time * 1e9));
+                }
+            } else
+                core.run_cycles(cycles - c);
+            scheduler.wait();
+            unsigned long long expected;
+            if (replay_file && recording.checkpoint(core.get_frames() - start_frames, expected)) {
+                if (core.screen_hash() != expected) {
+                    printf("* Replay diverged from the recording by frame %llu!\n", core.get_frames() - start_frames);
+                    return 1;
+                }
+                checked++;
+            }
+#ifdef CHIP8_TRACE
+            // drain every frame so nothing is dropped as long as ipf fits the ring
+            if (trace)
+                core.get_cpu().get_trace().drain(trace);
+#endif
+        }
+
+        if (save_file) {
+            Chip8State state;
+            core.save_state(state);
+            if (!state.save(save_file))
+                return 1;
+        }
+
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        unsigned long long ran = core.get_cycles() - start_cycles;
+        printf("* %llu instructions, %llu frames in %.6f s\n", ran, core.get_frames() - start_frames, elapsed);
+        if (elapsed > 0)
+            printf("* %.0f instructions/s\n", ran / elapsed);
+        if (core.get_idle_cycles())
+            printf("* %llu of them skipped in idle loops\n", core.get_idle_cycles());
+        if (wav_file) {
+            wav.close();
+            printf("* %llu audio samples written to %s\n", wav.get_samples(), wav_file);
+        }
+        if (video_file) {
+            unsigned long long taken = capture.get_captured() + capture.get_dropped();
+            capture.close();
+            printf("* %llu frames captured to %s at %ux%u: %llu unique, %llu duplicates, %llu pictures written\n",
+                taken, video_file, capture.get_width(), capture.get_height(), capture.get_unique(), capture.get_duplicates(), capture.get_written());
+            printf("* %.0f ns per capture, %llu dropped, %llu waited for the writer, at most %zu of %zu slots queued\n",
+                fast_captures ? capture_time * 1e9 / fast_captures : 0.0, capture.get_dropped(), capture.get_stalls(), capture.get_max_queued(), Chip8Capture::get_slots());
+        }
+        if (ahead)
+            printf("* run-ahead of %u frames: %.1f us per frame (%.1f us snapshot, %.1f us rollback)\n",
+                ahead, runahead.get_cost(), runahead.get_save_cost(), runahead.get_restore_cost());
+        if (replay_file)
+            printf("* replay matches the recording at all %llu checkpoints\n", checked);
+        printf("* screen %016llx\n", core.screen_hash());
+
+#ifdef CHIP8_TRACE
+        if (trace) {
+            printf("* trace written to %s (%llu records dropped)\n", trace_file, core.get_cpu().get_trace().get_dropped());
+            fclose(trace);
+        }
+#endif
+
+#ifdef CHIP8_PROFILE
+        if (top)
+            core.get_cpu().get_profile().report(stdout, top);
+        if (folded_file) {
+            if (!core.get_cpu().get_profile().write_folded(folded_file))
+                return 1;
+            printf("* folded stacks written to %s\n", folded_file);
+        }
+#endif
+
+        return 0;
+    } catch (const std::exception& e) {
+        printf("* Runtime error! %s\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,754 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include "chip8timer.hpp"
+#include "chip8keyboard.hpp"
+#include "chip8cpu.hpp"
+
+#if defined(__x86_64__) && defined(__unix__)
+#define CHIP8_JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+// machine state as seen by translated code (addressed through rbx)
+struct Chip8JitContext {
+    unsigned char* v;
+    unsigned char* memory;
+    void** blocks;
+    long long budget;
+    unsigned short int pc;
+    unsigned short int i;
+    unsigned char sp;
+};
+
+// basic-block dynamic recompiler for x86-64.
+//
+// straight-line runs of ALU, I and no-op instructions are translated into
+// native code, ending at the first 1nnn/2nnn/00EE/Bnnn or skip. the V
+// registers a block touches live in host registers for the whole block and
+// are written back on exit. blocks jump straight into each other through the
+// block table, returning to C++ only when the instruction budget runs out or
+// the next address has no translation. everything else (Dxyn, Fx0A, timers,
+// keys, Cxkk, memory transfers, SUPER-CHIP ops, and whatever the quirk
+// profile changes) is run by Chip8Cpu::cycle.
+//
+// code is only translated from 0x100-0xDFF. the stack and the wrapped stack
+// area in page 0 are never translated, so the writes done by native 2nnn
+// never hit translated code; Fx33/Fx55 run in the interpreter and invalidate
+// the pages they wrote.
+class Chip8Jit {
+private:
+    static const size_t CODE_SIZE = 1 << 20;
+    static const unsigned int MAX_BLOCK = 64;
+
+    // translation state per address
+    static const unsigned char UNKNOWN = 0;
+    static const unsigned char TRANSLATED = 1;
+    static const unsigned char INTERPRETED = 2;
+
+    // host registers V registers are allocated from, and the scratch ones
+    static const int RAX = 0, RCX = 1, RDX = 2, RBX = 3, RBP = 5, RSI = 6, RDI = 7;
+
+    Chip8QuirkFlags quirks;
+
+    void** blocks;
+    unsigned char* states;
+    unsigned short int* ends;
+    // pages some translated or interpreted address overlaps, so stores to
+    // pages without code (BCD, score saves) don't scan for translations
+    unsigned short int live;
+
+    unsigned char* code;
+    size_t code_used;
+    size_t code_start;
+    unsigned char* exit_stub;
+
+    Chip8JitContext ctx;
+
+    unsigned long long translated;
+    unsigned long long invalidated;
+
+#ifdef CHIP8_JIT_SUPPORTED
+    // ---- emitter ----
+
+    void emit8(unsigned int b) {
+        this->code[this->code_used++] = (unsigned char) b;
+    }
+
+    void emit16(unsigned int w) {
+        this->emit8(w & 0xFF);
+        this->emit8((w >> 8) & 0xFF);
+    }
+
+    void emit32(unsigned int d) {
+        this->emit16(d & 0xFFFF);
+        this->emit16(d >> 16);
+    }
+
+    void rex(bool w, int reg, int rm, bool force) {
+        unsigned char r = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+        if (r != 0x40 || force)
+            this->emit8(r);
+    }
+
+    void modrm_reg(int reg, int rm) {
+        this->emit8(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    // [base + disp32], base must not be rsp/r12
+    void modrm_mem(int reg, int base, int disp) {
+        this->emit8(0x80 | ((reg & 7) << 3) | (base & 7));
+        this->emit32(disp);
+    }
+
+    void mov_r32_imm(int r, unsigned int imm) {
+        this->rex(false, 0, r, false);
+        this->emit8(0xB8 + (r & 7));
+        this->emit32(imm);
+    }
+
+    // op r/m32, r32 (add 01, or 09, and 21, sub 29, xor 31, cmp 39, mov 89)
+    void alu_r32_r32(unsigned char opcode, int dst, int src) {
+        this->rex(false, src, dst, false);
+        this->emit8(opcode);
+        this->modrm_reg(src, dst);
+    }
+
+    // op r/m32, imm32 (add /0, or /1, and /4, sub /5, xor /6, cmp /7)
+    void alu_r32_imm(int ext, int dst, unsigned int imm) {
+        this->rex(false, 0, dst, false);
+        this->emit8(0x81);
+        this->modrm_reg(ext, dst);
+        this->emit32(imm);
+    }
+
+    // shl /4, shr /5
+    void shift_r32_imm(int ext, int dst, unsigned char imm) {
+        this->rex(false, 0, dst, false);
+        this->emit8(0xC1);
+        this->modrm_reg(ext, dst);
+        this->emit8(imm);
+    }
+
+    void movzx_r32_r8(int dst, int src) {
+        this->rex(false, dst, src, true);
+        this->emit8(0x0F);
+        this->emit8(0xB6);
+        this->modrm_reg(dst, src);
+    }
+
+    void movzx_r32_m8(int dst, int base, int disp) {
+        this->rex(false, dst, base, false);
+        this->emit8(0x0F);
+        this->emit8(0xB6);
+        this->modrm_mem(dst, base, disp);
+    }
+
+    void mov_m8_r8(int base, int disp, int src) {
+        this->rex(false, src, base, true);
+        this->emit8(0x88);
+        this->modrm_mem(src, base, disp);
+    }
+
+    void movzx_r32_m16(int dst, int base, int disp) {
+        this->rex(false, dst, base, false);
+        this->emit8(0x0F);
+        this->emit8(0xB7);
+        this->modrm_mem(dst, base, disp);
+    }
+
+    void mov_m16_r16(int base, int disp, int src) {
+        this->emit8(0x66);
+        this->rex(false, src, base, false);
+        this->emit8(0x89);
+        this->modrm_mem(src, base, disp);
+    }
+
+    void mov_m16_imm(int base, int disp, unsigned int imm) {
+        this->emit8(0x66);
+        this->rex(false, 0, base, false);
+        this->emit8(0xC7);
+        this->modrm_mem(0, base, disp);
+        this->emit16(imm);
+    }
+
+    void mov_r64_m64(int dst, int base, int disp) {
+        this->rex(true, dst, base, true);
+        this->emit8(0x8B);
+        this->modrm_mem(dst, base, disp);
+    }
+
+    void setcc(int cc, int r) {
+        this->rex(false, 0, r, true);
+        this->emit8(0x0F);
+        this->emit8(0x90 | cc);
+        this->modrm_reg(0, r);
+    }
+
+    void jmp_abs(unsigned char* target) {
+        this->emit8(0xE9);
+        this->emit32((unsigned int) (target - (this->code + this->code_used + 4)));
+    }
+
+    void jcc_abs(int cc, unsigned char* target) {
+        this->emit8(0x0F);
+        this->emit8(0x80 | cc);
+        this->emit32((unsigned int) (target - (this->code + this->code_used + 4)));
+    }
+
+    // forward jcc, returns the offset to patch
+    size_t jcc_forward(int cc) {
+        this->emit8(0x0F);
+        this->emit8(0x80 | cc);
+        this->emit32(0);
+        return this->code_used - 4;
+    }
+
+    void patch(size_t at) {
+        unsigned int rel = (unsigned int) (this->code_used - (at + 4));
+        memcpy(this->code + at, &rel, 4);
+    }
+
+    // ---- translation ----
+
+    static const int CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7;
+
+    // sets ctx->pc to a constant and continues in that block, if translated
+    void chain_const(unsigned int target) {
+        this->mov_m16_imm(RBX, offsetof(Chip8JitContext, pc), target);
+        if (target >= 0x1000) {
+            this->jmp_abs(this->exit_stub);
+            return;
+        }
+        this->mov_r64_m64(RAX, RBX, offsetof(Chip8JitContext, blocks));
+        this->mov_r64_m64(RAX, RAX, target * 8);
+        this->emit8(0x48); this->emit8(0x85); this->emit8(0xC0); // test rax, rax
+        this->jcc_abs(CC_E, this->exit_stub);
+        this->emit8(0xFF); this->emit8(0xE0);                      // jmp rax
+    }
+
+    // same with the target pc in edx
+    void chain_edx() {
+        this->mov_m16_r16(RBX, offsetof(Chip8JitContext, pc), RDX);
+        this->alu_r32_imm(7, RDX, 0x1000);
+        this->jcc_abs(CC_AE, this->exit_stub);
+        this->mov_r64_m64(RAX, RBX, offsetof(Chip8JitContext, blocks));
+        this->emit8(0x48); this->emit8(0x8B); this->emit8(0x04); this->emit8(0xD0); // mov rax, [rax+rdx*8]
+        this->emit8(0x48); this->emit8(0x85); this->emit8(0xC0);                     // test rax, rax
+        this->jcc_abs(CC_E, this->exit_stub);
+        this->emit8(0xFF); this->emit8(0xE0);                                         // jmp rax
+    }
+
+    // ecx = (0xEA0 - 2 + sp * 2) & 0xFFF, rax = memory
+    void stack_slot() {
+        this->movzx_r32_m8(RCX, RBX, offsetof(Chip8JitContext, sp));
+        this->alu_r32_r32(0x01, RCX, RCX);
+        this->alu_r32_imm(0, RCX, 0xEA0 - 2);
+        this->alu_r32_imm(4, RCX, 0xFFF);
+        this->mov_r64_m64(RAX, RBX, offsetof(Chip8JitContext, memory));
+    }
+
+    // instructions the quirk profile changes are left to the interpreter
+    // (and Fx55/Fx65 always are)
+    bool translatable(unsigned short int instruction) {
+        switch (instruction >> 12) {
+        case 0x0:
+            // 00E0 and the SUPER-CHIP screen ops (00Cn, 00FB-00FF)
+            return instruction != 0xE0 && (instruction & 0xFFF0) != 0xC0 && (instruction < 0xFB || instruction > 0xFF);
+        case 0x8:
+            switch (instruction & 0x000F) {
+            case 0x1: case 0x2: case 0x3:
+                return !this->quirks.vf_reset;
+            case 0x6: case 0xE:
+                return !this->quirks.shift_vy;
+            }
+            return true;
+        case 0xB:
+            return !this->quirks.jump_vx;
+        case 0xC: case 0xD:
+            return false;
+        case 0xE:
+            return (instruction & 0x00FF) != 0x9E && (instruction & 0x00FF) != 0xA1;
+        case 0xF:
+            switch (instruction & 0x00FF) {
+            case 0x07: case 0x0A: case 0x15: case 0x18: case 0x30: case 0x33: case 0x55: case 0x65: case 0x75: case 0x85:
+                return false;
+            }
+            return true;
+        }
+        return true;
+    }
+
+    static bool terminates(unsigned short int instruction) {
+        switch (instruction >> 12) {
+        case 0x0:
+            return instruction == 0xEE;
+        case 0x1: case 0x2: case 0x3: case 0x4: case 0x5: case 0x9: case 0xB:
+            return true;
+        }
+        return false;
+    }
+
+    // V registers an instruction reads or writes, as a bitmask
+    static unsigned int uses(unsigned short int instruction) {
+        unsigned int x = 1u << ((instruction >> 8) & 0xF);
+        unsigned int y = 1u << ((instruction >> 4) & 0xF);
+        switch (instruction >> 12) {
+        case 0x3: case 0x4: case 0x6: case 0x7:
+            return x;
+        case 0x5: case 0x9:
+            return x | y;
+        case 0x8:
+            switch (instruction & 0xF) {
+            case 0x0: case 0x1: case 0x2: case 0x3:
+                return x | y;
+            case 0x4: case 0x5: case 0x6: case 0x7: case 0xE:
+                return x | y | 0x8000;
+            }
+            return 0;
+        case 0xB:
+            return 1;
+        case 0xF:
+            if ((instruction & 0xFF) == 0x1E)
+                return x | 0x8000;
+            if ((instruction & 0xFF) == 0x29)
+                return x;
+            return 0;
+        }
+        return 0;
+    }
+
+    // translate the block at addr, returns false if its first instruction
+    // has to be interpreted
+    bool translate(unsigned char* memory, unsigned int addr) {
+        if (addr < 0x100 || addr >= 0xE00)
+            return false;
+
+        // scan the block
+        unsigned short int instructions [MAX_BLOCK];
+        unsigned int n = 0;
+        unsigned int used = 0;
+        for (unsigned int a = addr; n < MAX_BLOCK && a + 1 < 0xE00; a += 2) {
+            unsigned short int instruction = (memory[a] << 8) | memory[a + 1];
+            if (!this->translatable(instruction))
+                break;
+            unsigned int next = used | uses(instruction);
+            if (__builtin_popcount(next) > 10)
+                break;
+            used = next;
+            instructions[n++] = instruction;
+            if (terminates(instruction))
+                break;
+        }
+
+        if (n == 0)
+            return false;
+
+        // worst case is well below 64 bytes per instruction plus the exits
+        if (this->code_used + n * 64 + 256 > CODE_SIZE)
+            this->flush();
+
+        // allocate V registers
+        static const int pool [] = { 8, 9, 10, 11, 12, 13, 14, 15, RSI, RDI };
+        int reg [16];
+        size_t next_reg = 0;
+        for (int x = 0; x < 16; x++)
+            reg[x] = (used >> x) & 1 ? pool[next_reg++] : -1;
+
+        mprotect(this->code, CODE_SIZE, PROT_READ | PROT_WRITE);
+
+        unsigned char* entry = this->code + this->code_used;
+
+        // not enough budget left for the whole block: let the caller step
+        this->rex(true, 0, RBX, true);
+        this->emit8(0x81);
+        this->modrm_mem(7, RBX, offsetof(Chip8JitContext, budget));
+        this->emit32(n);
+        size_t body = this->jcc_forward(0xD); // jge
+        this->mov_m16_imm(RBX, offsetof(Chip8JitContext, pc), addr);
+        this->jmp_abs(this->exit_stub);
+        this->patch(body);
+        this->rex(true, 0, RBX, true);
+        this->emit8(0x81);
+        this->modrm_mem(5, RBX, offsetof(Chip8JitContext, budget));
+        this->emit32(n);
+
+        for (int x = 0; x < 16; x++)
+            if (reg[x] >= 0)
+                this->movzx_r32_m8(reg[x], RBP, x);
+
+        unsigned int written = 0;
+        unsigned int a = addr;
+        bool ended = false;
+        for (unsigned int k = 0; k < n; k++, a += 2) {
+            unsigned short int instruction = instructions[k];
+            unsigned int x = (instruction >> 8) & 0xF;
+            unsigned int y = (instruction >> 4) & 0xF;
+            unsigned int kk = instruction & 0xFF;
+            unsigned int nnn = instruction & 0xFFF;
+            int rx = reg[x];
+            int ry = reg[y];
+            int rf = reg[0xF];
+
+            switch (instruction >> 12) {
+            case 0x6:
+                this->mov_r32_imm(rx, kk);
+                written |= 1u << x;
+                break;
+            case 0x7:
+                this->alu_r32_imm(0, rx, kk);
+                this->movzx_r32_r8(rx, rx);
+                written |= 1u << x;
+                break;
+            case 0x8:
+                switch (instruction & 0xF) {
+                case 0x0:
+                    if (rx != ry)
+                        this->alu_r32_r32(0x89, rx, ry);
+                    written |= 1u << x;
+                    break;
+                case 0x1:
+                    this->alu_r32_r32(0x09, rx, ry);
+                    written |= 1u << x;
+                    break;
+                case 0x2:
+                    this->alu_r32_r32(0x21, rx, ry);
+                    written |= 1u << x;
+                    break;
+                case 0x3:
+                    this->alu_r32_r32(0x31, rx, ry);
+                    written |= 1u << x;
+                    break;
+                case 0x4:
+                    this->alu_r32_r32(0x89, RAX, rx);
+                    this->alu_r32_r32(0x01, RAX, ry);
+                    this->alu_r32_r32(0x89, RCX, RAX);
+                    this->shift_r32_imm(5, RCX, 8);
+                    this->alu_r32_r32(0x89, rf, RCX);
+                    this->movzx_r32_r8(RAX, RAX);
+                    this->alu_r32_r32(0x89, rx, RAX);
+                    written |= (1u << x) | 0x8000;
+                    break;
+                case 0x5:
+                case 0x7:
+                    this->alu_r32_r32(0x31, RCX, RCX);
+                    this->alu_r32_r32(0x39, ry, rx);
+                    this->setcc((instruction & 0xF) == 0x5 ? CC_B : CC_A, RCX);
+                    this->alu_r32_r32(0x89, rf, RCX);
+                    if ((instruction & 0xF) == 0x5) {
+                        this->alu_r32_r32(0x89, RAX, rx);
+                        this->alu_r32_r32(0x29, RAX, ry);
+                    } else {
+                        this->alu_r32_r32(0x89, RAX, ry);
+                        this->alu_r32_r32(0x29, RAX, rx);
+                    }
+                    this->movzx_r32_r8(RAX, RAX);
+                    this->alu_r32_r32(0x89, rx, RAX);
+                    written |= (1u << x) | 0x8000;
+                    break;
+                case 0x6:
+                    this->alu_r32_r32(0x89, RCX, rx);
+                    this->alu_r32_imm(4, RCX, 1);
+                    this->alu_r32_r32(0x89, rf, RCX);
+                    this->shift_r32_imm(5, rx, 1);
+                    written |= (1u << x) | 0x8000;
+                    break;
+                case 0xE:
+                    this->alu_r32_r32(0x89, RCX, rx);
+                    this->shift_r32_imm(5, RCX, 7);
+                    this->alu_r32_r32(0x89, rf, RCX);
+                    this->shift_r32_imm(4, rx, 1);
+                    this->movzx_r32_r8(rx, rx);
+                    written |= (1u << x) | 0x8000;
+                    break;
+                }
+                break;
+            case 0xA:
+                this->mov_m16_imm(RBX, offsetof(Chip8JitContext, i), nnn);
+                break;
+            case 0xF:
+                if (kk == 0x1E) {
+                    this->movzx_r32_m16(RAX, RBX, offsetof(Chip8JitContext, i));
+                    this->alu_r32_r32(0x01, RAX, rx);
+                    this->alu_r32_r32(0x89, RCX, RAX);
+                    this->shift_r32_imm(5, RCX, 16);
+                    this->alu_r32_r32(0x89, rf, RCX);
+                    this->mov_m16_r16(RBX, offsetof(Chip8JitContext, i), RAX);
+                    written |= 0x8000;
+                } else if (kk == 0x29) {
+                    this->alu_r32_r32(0x89, RAX, rx);
+                    this->emit8(0x6B); this->emit8(0xC0); this->emit8(0x05); // imul eax, eax, 5
+                    this->mov_m16_r16(RBX, offsetof(Chip8JitContext, i), RAX);
+                }
+                break;
+            }
+
+            if (!terminates(instruction))
+                continue;
+
+            // block exit: flags survive the register stores below (mov only)
+            ended = true;
+            switch (instruction >> 12) {
+            case 0x0: // 00EE
+                this->store(reg, written);
+                this->stack_slot();
+                this->emit8(0x0F); this->emit8(0xB6); this->emit8(0x14); this->emit8(0x08); // movzx edx, byte [rax+rcx]
+                this->shift_r32_imm(4, RDX, 8);
+                this->alu_r32_imm(0, RCX, 1);
+                this->alu_r32_imm(4, RCX, 0xFFF);
+                this->emit8(0x0F); this->emit8(0xB6); this->emit8(0x0C); this->emit8(0x08); // movzx ecx, byte [rax+rcx]
+                this->alu_r32_r32(0x31, RDX, RCX);
+                this->emit8(0xFE); this->modrm_mem(1, RBX, offsetof(Chip8JitContext, sp));  // dec byte [sp]
+                this->alu_r32_imm(0, RDX, 2);
+                this->alu_r32_imm(4, RDX, 0xFFFF);
+                this->chain_edx();
+                break;
+            case 0x1:
+                this->store(reg, written);
+                this->chain_const(nnn);
+                break;
+            case 0x2:
+                this->store(reg, written);
+                this->emit8(0xFE); this->modrm_mem(0, RBX, offsetof(Chip8JitContext, sp));  // inc byte [sp]
+                this->stack_slot();
+                this->emit8(0xC6); this->emit8(0x04); this->emit8(0x08); this->emit8(a >> 8); // mov byte [rax+rcx], imm8
+                this->alu_r32_imm(0, RCX, 1);
+                this->alu_r32_imm(4, RCX, 0xFFF);
+                this->emit8(0xC6); this->emit8(0x04); this->emit8(0x08); this->emit8(a & 0xFF);
+                this->chain_const(nnn);
+                break;
+            case 0xB:
+                this->alu_r32_r32(0x89, RDX, reg[0]);
+                this->alu_r32_imm(0, RDX, nnn);
+                this->store(reg, written);
+                this->chain_edx();
+                break;
+            default: { // skips
+                if ((instruction >> 12) == 0x3 || (instruction >> 12) == 0x4)
+                    this->alu_r32_imm(7, rx, kk);
+                else
+                    this->alu_r32_r32(0x39, rx, ry);
+                this->store(reg, written);
+                bool skip_if_equal = (instruction >> 12) == 0x3 || (instruction >> 12) == 0x5;
+                size_t taken = this->jcc_forward(skip_if_equal ? CC_E : CC_NE);
+                this->chain_const(a + 2);
+                this->patch(taken);
+                this->chain_const(a + 4);
+                break;
+            }
+            }
+        }
+
+        if (!ended) {
+            this->store(reg, written);
+            this->chain_const(a);
+        }
+
+        mprotect(this->code, CODE_SIZE, PROT_READ | PROT_EXEC);
+
+        this->blocks[addr] = entry;
+        this->states[addr] = TRANSLATED;
+        this->ends[addr] = a;
+        this->mark(addr, a);
+        this->translated++;
+        return true;
+    }
+
+    void store(const int* reg, unsigned int written) {
+        for (int x = 0; x < 16; x++)
+            if ((written >> x) & 1)
+                this->mov_m8_r8(RBP, x, reg[x]);
+    }
+
+    void emit_stubs() {
+        mprotect(this->code, CODE_SIZE, PROT_READ | PROT_WRITE);
+        this->code_used = 0;
+
+        // enter(ctx, block): save callee-saved registers, rbx = ctx, rbp = V
+        this->emit8(0x53); this->emit8(0x55);
+        this->emit8(0x41); this->emit8(0x54);
+        this->emit8(0x41); this->emit8(0x55);
+        this->emit8(0x41); this->emit8(0x56);
+        this->emit8(0x41); this->emit8(0x57);
+        this->emit8(0x48); this->emit8(0x89); this->emit8(0xFB); // mov rbx, rdi
+        this->mov_r64_m64(RBP, RBX, offsetof(Chip8JitContext, v));
+        this->emit8(0xFF); this->emit8(0xE6);                     // jmp rsi
+
+        this->exit_stub = this->code + this->code_used;
+        this->emit8(0x41); this->emit8(0x5F);
+        this->emit8(0x41); this->emit8(0x5E);
+        this->emit8(0x41); this->emit8(0x5D);
+        this->emit8(0x41); this->emit8(0x5C);
+        this->emit8(0x5D); this->emit8(0x5B);
+        this->emit8(0xC3);
+
+        this->code_start = this->code_used;
+        mprotect(this->code, CODE_SIZE, PROT_READ | PROT_EXEC);
+    }
+#endif
+
+    // pages [lo, hi) overlaps now hold state that stores must drop
+    void mark(unsigned int lo, unsigned int hi) {
+        for (unsigned int p = lo >> 8; p <= ((hi - 1) & 0xFFF) >> 8; p++)
+            this->live |= 1 << p;
+    }
+
+    // drop every translation overlapping the 256 byte page p
+    void invalidate_page(unsigned int p) {
+        if (p < 1 || p > 0xD || !(this->live & (1 << p)))
+            return;
+        unsigned int lo = p * 256;
+        unsigned int hi = lo + 256;
+        for (unsigned int a = lo - MAX_BLOCK * 2; a < hi; a++) {
+            if (this->states[a] == UNKNOWN)
+                continue;
+            if (this->states[a] == TRANSLATED && this->ends[a] <= lo)
+                continue;
+            if (this->states[a] == INTERPRETED && a + 2 <= lo)
+                continue;
+            this->states[a] = UNKNOWN;
+            this->blocks[a] = NULL;
+            this->invalidated++;
+        }
+        this->live &= ~(1 << p);
+    }
+
+    // invalidate whatever the interpreter is about to write for instruction
+    void invalidate_writes(Chip8Cpu& cpu, unsigned short int instruction) {
+        unsigned int x = (instruction >> 8) & 0xF;
+        if ((instruction & 0xF0FF) == 0xF033 || (instruction & 0xF0FF) == 0xF055) {
+            unsigned int len = (instruction & 0xFF) == 0x33 ? 3 : x + 1;
+            this->invalidate_page((cpu.i & 0xFFF) >> 8);
+            this->invalidate_page(((cpu.i + len - 1) & 0xFFF) >> 8);
+        }
+    }
+public:
+    Chip8Jit() {
+        this->blocks = new void* [4096];
+        this->states = new unsigned char [4096];
+        this->ends = new unsigned short int [4096];
+
+        // check for allocation errors
+        if (this->blocks == NULL || this->states == NULL || this->ends == NULL)
+            throw std::runtime_error("Failed to allocate memory!");
+
+        this->quirks = Chip8QuirkFlags::of(CHIP8_QUIRKS_MODERN);
+        this->code = NULL;
+        this->code_used = 0;
+        this->code_start = 0;
+        this->exit_stub = NULL;
+        this->translated = 0;
+        this->invalidated = 0;
+        this->live = 0;
+
+        for (size_t a = 0; a < 4096; a++) {
+            this->blocks[a] = NULL;
+            this->states[a] = UNKNOWN;
+            this->ends[a] = 0;
+        }
+
+#ifdef CHIP8_JIT_SUPPORTED
+        void* mapped = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED)
+            throw std::runtime_error("Failed to allocate JIT code buffer!");
+        this->code = (unsigned char*) mapped;
+        this->emit_stubs();
+#endif
+    }
+
+    ~Chip8Jit() {
+#ifdef CHIP8_JIT_SUPPORTED
+        munmap(this->code, CODE_SIZE);
+#endif
+        delete[] this->blocks;
+        delete[] this->states;
+        delete[] this->ends;
+    }
+
+    Chip8Jit(const Chip8Jit&) = delete;
+    Chip8Jit& operator=(const Chip8Jit&) = delete;
+
+    unsigned long long get_translated() {
+        return this->translated;
+    }
+
+    unsigned long long get_invalidated() {
+        return this->invalidated;
+    }
+
+    // drop the translations overlapping len bytes from addr, after memory
+    // there changed behind the jit's back
+    void invalidate(unsigned int addr, unsigned int len) {
+        for (unsigned int a = addr & ~0xFF; a < addr + len; a += 256)
+            this->invalidate_page((a & 0xFFF) >> 8);
+    }
+
+    // takes effect with the next flush()
+    void set_quirks(Chip8Quirks quirks) {
+        this->quirks = Chip8QuirkFlags::of(quirks);
+    }
+
+    // throw away every translation, e.g. after memory changed wholesale
+    void flush() {
+        for (size_t a = 0; a < 4096; a++) {
+            this->blocks[a] = NULL;
+            this->states[a] = UNKNOWN;
+        }
+        this->live = 0;
+        this->code_used = this->code_start;
+    }
+
+    // execute n instructions on the given cpu
+    // (translated code can't be traced or profiled, so trace and profile
+    // builds interpret everything)
+    void run(Chip8Cpu& cpu, unsigned char* memory, Chip8Framebuffer& framebuffer, Chip8Timer& delay_timer, Chip8Timer& sound_timer, Chip8Keyboard& keyboard, unsigned long long n) {
+#if defined(CHIP8_JIT_SUPPORTED) && !defined(CHIP8_TRACE) && !defined(CHIP8_PROFILE)
+        typedef void (*enter_fn)(Chip8JitContext*, void*);
+        enter_fn enter = (enter_fn) (void*) this->code;
+
+        this->ctx.v = cpu.v;
+        this->ctx.memory = memory;
+        this->ctx.blocks = this->blocks;
+        this->ctx.budget = (long long) n;
+        this->ctx.pc = cpu.pc;
+        this->ctx.i = cpu.i;
+        this->ctx.sp = cpu.sp;
+
+        while (this->ctx.budget > 0) {
+            unsigned int pc = this->ctx.pc;
+
+            if (pc < 0x1000) {
+                if (this->states[pc] == UNKNOWN && !this->translate(memory, pc)) {
+                    this->states[pc] = INTERPRETED;
+                    this->mark(pc, pc + 2);
+                }
+
+                if (this->states[pc] == TRANSLATED) {
+                    long long before = this->ctx.budget;
+                    enter(&this->ctx, this->blocks[pc]);
+                    if (this->ctx.budget != before)
+                        continue;
+                }
+            }
+
+            // single interpreted instruction
+            cpu.pc = this->ctx.pc;
+            cpu.i = this->ctx.i;
+            cpu.sp = this->ctx.sp;
+            this->invalidate_writes(cpu, (memory[pc & 0xFFF] << 8) | memory[(pc + 1) & 0xFFF]);
+            cpu.cycle(memory, framebuffer, delay_timer, sound_timer, keyboard);
+            this->ctx.pc = cpu.pc;
+            this->ctx.i = cpu.i;
+            this->ctx.sp = cpu.sp;
+            this->ctx.budget--;
+        }
+
+        cpu.pc = this->ctx.pc;
+        cpu.i = this->ctx.i;
+        cpu.sp = this->ctx.sp;
+#else
+        cpu.run(memory, framebuffer, delay_timer, sound_timer, keyboard, n);
+#endif
+    }
+};
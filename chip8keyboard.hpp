@@ -1,77 +1,34 @@
+#pragma once
+#include "chip8state.hpp"
+
 class Chip8Keyboard {
 private:
-    bool* keystates;
+    bool keystates [16];
     bool keypress;
     bool awaiting;
     unsigned char lastkey;
 public:
     Chip8Keyboard() {
-        this->keystates = new bool [16];
         this->keypress = false;
         this->awaiting = false;
         this->lastkey = 0;
 
-        if (this->keystates == NULL)
-            throw std::runtime_error("Failed to allocate memory!");
-
         for (size_t i = 0; i < 16; i++)
             this->keystates[i] = 0;
     }
 
-    void notify(SDL_Event& e) {
-        if (e.type == SDL_KEYDOWN)
+    Chip8Keyboard(const Chip8Keyboard&) = delete;
+    Chip8Keyboard& operator=(const Chip8Keyboard&) = delete;
+
+    // frontends translate their own input events into hex key transitions
+    void set_key(unsigned char n, bool pressed) {
+        if (n > 0xF)
+            return;
+
+        if (pressed)
             this->keypress = true;
 
-        switch (e.key.keysym.sym) {
-        case SDLK_1:
-            this->keystates[0x0] = (e.type == SDL_KEYDOWN);
-            break;
-        case SDLK_2:
-            this->keystates[0x1] = (e.type == SDL_KEYDOWN);
-            break;
-        case SDLK_3:
-            this->keystates[0x2] = (e.type == SDL_KEYDOWN);
-            break;
-        case SDLK_4:
-            this->keystates[0x3] = (e.type == SDL_KEYDOWN);
-            break;
-        case SDLK_q:
-            this->keystates[0x4] = (e.type == SDL_KEYDOWN);
-            break;
-        case SDLK_w:
-            this->keystates[0x5] = (e.type == SDL_KEYDOWN);
-            break;
-        case SDLK_e:
-            this->keystates[0x6] = (e.type == SDL_KEYDOWN);
-            break;
-        case SDLK_r:
-            this->keystates[0x7] = (e.type == SDL_KEYDOWN);
-            break;
-        case SDLK_a:
-            this->keystates[0x8] = (e.type == SDL_KEYDOWN);
-            break;
-        case SDLK_s:
-            this->keystates[0x9] = (e.type == SDL_KEYDOWN);
-            break;
-        case SDLK_d:
-            this->keystates[0xA] = (e.type == SDL_KEYDOWN);
-            break;
-        case SDLK_f:
-            this->keystates[0xB] = (e.type == SDL_KEYDOWN);
-            break;
-        case SDLK_z:
-            this->keystates[0xC] = (e.type == SDL_KEYDOWN);
-            break;
-        case SDLK_x:
-            this->keystates[0xD] = (e.type == SDL_KEYDOWN);
-            break;
-        case SDLK_c:
-            this->keystates[0xE] = (e.type == SDL_KEYDOWN);
-            break;
-        case SDLK_v:
-            this->keystates[0xF] = (e.type == SDL_KEYDOWN);
-            break;
-        }
+        this->keystates[n] = pressed;
 
         for (size_t i = 0; i <= 0xF; i++) {
             if (this->keystates[i] == 1 && this->lastkey != i) {
@@ -81,6 +38,23 @@ public:
         }
     }
 
+    // apply a whole keypad state at once, one key at a time in ascending
+    // order, so a given sequence of masks always has the same effect
+    void set_keys(unsigned short int keys) {
+        for (unsigned char n = 0; n <= 0xF; n++) {
+            bool pressed = (keys >> n) & 0x01;
+            if (pressed != this->keystates[n])
+                this->set_key(n, pressed);
+        }
+    }
+
+    unsigned short int get_keys() {
+        unsigned short int keys = 0;
+        for (size_t i = 0; i <= 0xF; i++)
+            keys |= this->keystates[i] << i;
+        return keys;
+    }
+
     bool get_key(unsigned char n) {
         if (n > 0xF)
             return false;
@@ -92,12 +66,36 @@ public:
         return this->lastkey;
     }
 
+    // true while Fx0A is blocked waiting for a key press
+    bool is_awaiting() {
+        return this->awaiting;
+    }
+
+    // a key was pressed that Fx0A hasn't taken yet
+    bool has_keypress() {
+        return this->keypress;
+    }
+
     void await() {
         if (!this->awaiting)
             this->keypress = false;
         this->awaiting = true;
     }
 
+    void save(Chip8State& state) {
+        state.keys = this->get_keys();
+        state.keyboard_flags = (this->keypress ? Chip8State::KEY_PRESSED : 0) | (this->awaiting ? Chip8State::AWAITING_KEY : 0);
+        state.last_key = this->lastkey;
+    }
+
+    void load(const Chip8State& state) {
+        for (size_t i = 0; i <= 0xF; i++)
+            this->keystates[i] = (state.keys >> i) & 0x01;
+        this->keypress = state.keyboard_flags & Chip8State::KEY_PRESSED;
+        this->awaiting = state.keyboard_flags & Chip8State::AWAITING_KEY;
+        this->lastkey = state.last_key;
+    }
+
     bool ack_key() {
         bool out = this->keypress;
         if (out)
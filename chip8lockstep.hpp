@@ -0,0 +1,471 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include "chip8timer.hpp"
+#include "chip8keyboard.hpp"
+#include "chip8cpu.hpp"
+#include "chip8core.hpp"
+#include "chip8state.hpp"
+
+// dst = value in the lanes set in mask, unchanged in the others
+#define CHIP8_MASKED(dst, mask, value) \
+    dst = ((value) & (__typeof__(dst)) (mask)) | (dst & ~(__typeof__(dst)) (mask))
+
+// 1 in the lanes where a vector comparison held, 0 elsewhere
+#define CHIP8_FLAG(cmp) ((Bytes) (cmp) & 1)
+
+// a GCC vector of LANES elements of type T
+template <typename T, unsigned int LANES>
+struct Chip8Vector {
+    typedef T type __attribute__((vector_size(LANES * sizeof(T))));
+};
+
+// runs LANES instances of the same ROM in lockstep, one instance per vector
+// lane. registers, I, PC, SP, timers and the Cxkk generators are kept as
+// structure of arrays, so ALU, load, skip, jump, I and timer instructions
+// execute for every lane at once; lanes that aren't at the current pc are
+// masked off and catch up later (the lowest pc always goes next, which
+// reconverges lanes after an if/else). instructions that touch memory, the
+// stack, the screen or the keypad are run lane by lane through
+// Chip8Cpu::cycle, and when too few lanes agree for too long the rest of the
+// frame runs in scalar.
+//
+// the vectors are GCC vector extensions, so the compiler picks AVX2 or SSE
+// (or plain integer code) for whatever -march the build targets.
+template <unsigned int LANES>
+class Chip8Lockstep {
+    static_assert(LANES >= 2 && LANES <= 32 && !(LANES & (LANES - 1)), "LANES must be a power of two up to 32");
+private:
+    typedef typename Chip8Vector<unsigned char, LANES>::type Bytes;
+    typedef typename Chip8Vector<signed char, LANES>::type ByteMask;
+    typedef typename Chip8Vector<unsigned short int, LANES>::type Words;
+    typedef typename Chip8Vector<short int, LANES>::type WordMask;
+    typedef typename Chip8Vector<unsigned int, LANES>::type Dwords;
+    typedef typename Chip8Vector<int, LANES>::type DwordMask;
+
+    // consecutive steps with fewer than a quarter of the lanes running
+    // before the rest of the frame is handed to the scalar interpreter
+    static const unsigned int MAX_THIN_STEPS = 16;
+
+    Bytes v [16];
+    Words i;
+    Words pc;
+    Bytes sp;
+    Bytes delay_timer;
+    Bytes sound_timer;
+    Dwords rng;
+
+    // LANES times 4 KB, lane l at l * 4096
+    unsigned char* memory;
+    Chip8Framebuffer framebuffers [LANES];
+    Chip8Keyboard keyboards [LANES];
+    unsigned char rpl [LANES][8];
+
+    // pages (256 bytes) some lane may have written since the ROM was loaded;
+    // code fetched from any other page is the same in every lane
+    unsigned int dirty;
+
+    // scratch cpu for the instructions run lane by lane
+    Chip8Cpu cpu;
+
+    unsigned long long cycles;
+    unsigned long long frames;
+
+    unsigned long long steps;
+    unsigned long long lane_steps;
+    unsigned long long scalar_instructions;
+
+    unsigned char* lane_memory(unsigned int l) {
+        return this->memory + (size_t) l * 4096;
+    }
+
+    void touch(unsigned int addr, unsigned int len) {
+        for (unsigned int a = 0; a < len; a++)
+            this->dirty |= 1u << (((addr + a) & 0xFFF) >> 8);
+    }
+
+    // mark the pages an instruction is about to write in lane l
+    void touch_writes(unsigned int l, unsigned short int instruction) {
+        unsigned int x = (instruction >> 8) & 0xF;
+        if ((instruction >> 12) == 0x2) {
+            this->touch(0xEA0 - 2 + (((this->sp[l] + 1) & 0xFF) * 2), 2);
+        } else if ((instruction & 0xF0FF) == 0xF033) {
+            this->touch(this->i[l], 3);
+        } else if ((instruction & 0xF0FF) == 0xF055) {
+            this->touch(this->i[l], x + 1);
+        }
+    }
+
+    void load_lane(unsigned int l) {
+        for (size_t r = 0; r < 16; r++)
+            this->cpu.v[r] = this->v[r][l];
+        this->cpu.i = this->i[l];
+        this->cpu.pc = this->pc[l];
+        this->cpu.sp = this->sp[l];
+        this->cpu.rng = this->rng[l];
+        memcpy(this->cpu.rpl, this->rpl[l], 8);
+    }
+
+    void store_lane(unsigned int l) {
+        for (size_t r = 0; r < 16; r++)
+            this->v[r][l] = this->cpu.v[r];
+        this->i[l] = this->cpu.i;
+        this->pc[l] = this->cpu.pc;
+        this->sp[l] = this->cpu.sp;
+        this->rng[l] = this->cpu.rng;
+        memcpy(this->rpl[l], this->cpu.rpl, 8);
+    }
+
+    // run n instructions of lane l through the scalar interpreter
+    void run_lane(unsigned int l, unsigned int n) {
+        unsigned char* memory = this->lane_memory(l);
+        Chip8Timer delay_timer;
+        Chip8Timer sound_timer;
+        delay_timer.set(this->delay_timer[l]);
+        sound_timer.set(this->sound_timer[l]);
+
+        this->load_lane(l);
+        for (unsigned int c = 0; c < n; c++) {
+            unsigned int pc = this->cpu.pc;
+            this->touch_writes(l, (memory[pc & 0xFFF] << 8) | memory[(pc + 1) & 0xFFF]);
+            this->cpu.cycle(memory, this->framebuffers[l], delay_timer, sound_timer, this->keyboards[l]);
+        }
+        this->store_lane(l);
+
+        this->delay_timer[l] = delay_timer.get_value();
+        this->sound_timer[l] = sound_timer.get_value();
+    }
+
+    // execute one instruction for the lanes in mask, all sitting at the same
+    // pc with the same opcode
+    void execute(unsigned short int instruction, const WordMask& mask) {
+        ByteMask bmask = __builtin_convertvector(mask, ByteMask);
+        unsigned int x = (instruction >> 8) & 0x000F;
+        unsigned int y = (instruction >> 4) & 0x000F;
+        unsigned char kk = instruction & 0x00FF;
+        unsigned short int nnn = instruction & 0x0FFF;
+        Bytes* v = this->v;
+
+        switch (instruction >> 12) {
+        case 0x1:
+            CHIP8_MASKED(this->pc, mask, (Words) {} + (unsigned short int) (nnn - 2));
+            break;
+        case 0x3:
+            this->pc += __builtin_convertvector(CHIP8_FLAG(v[x] == kk), Words) * 2 & (Words) mask;
+            break;
+        case 0x4:
+            this->pc += __builtin_convertvector(CHIP8_FLAG(v[x] != kk), Words) * 2 & (Words) mask;
+            break;
+        case 0x5:
+            this->pc += __builtin_convertvector(CHIP8_FLAG(v[x] == v[y]), Words) * 2 & (Words) mask;
+            break;
+        case 0x6:
+            CHIP8_MASKED(v[x], bmask, (Bytes) {} + kk);
+            break;
+        case 0x7:
+            CHIP8_MASKED(v[x], bmask, v[x] + kk);
+            break;
+        case 0x8:
+            // same statement order as Chip8Cpu::cycle, so x or y = F behave the same
+            switch (instruction & 0x000F) {
+            case 0x0:
+                CHIP8_MASKED(v[x], bmask, v[y]);
+                break;
+            case 0x1:
+                CHIP8_MASKED(v[x], bmask, v[x] | v[y]);
+                break;
+            case 0x2:
+                CHIP8_MASKED(v[x], bmask, v[x] & v[y]);
+                break;
+            case 0x3:
+                CHIP8_MASKED(v[x], bmask, v[x] ^ v[y]);
+                break;
+            case 0x4: {
+                Bytes sum = v[x] + v[y];
+                Bytes carry = CHIP8_FLAG(sum < v[x]);
+                CHIP8_MASKED(v[0xF], bmask, carry);
+                CHIP8_MASKED(v[x], bmask, sum);
+                break;
+            }
+            case 0x5:
+                CHIP8_MASKED(v[0xF], bmask, CHIP8_FLAG(v[y] < v[x]));
+                CHIP8_MASKED(v[x], bmask, v[x] - v[y]);
+                break;
+            case 0x6:
+                CHIP8_MASKED(v[0xF], bmask, v[x] & 0x01);
+                CHIP8_MASKED(v[x], bmask, v[x] >> 1);
+                break;
+            case 0x7:
+                CHIP8_MASKED(v[0xF], bmask, CHIP8_FLAG(v[y] > v[x]));
+                CHIP8_MASKED(v[x], bmask, v[y] - v[x]);
+                break;
+            case 0xE:
+                CHIP8_MASKED(v[0xF], bmask, (v[x] & 0x80) >> 7);
+                CHIP8_MASKED(v[x], bmask, v[x] << 1);
+                break;
+            }
+            break;
+        case 0x9:
+            this->pc += __builtin_convertvector(CHIP8_FLAG(v[x] != v[y]), Words) * 2 & (Words) mask;
+            break;
+        case 0xA:
+            CHIP8_MASKED(this->i, mask, (Words) {} + nnn);
+            break;
+        case 0xB:
+            CHIP8_MASKED(this->pc, mask, __builtin_convertvector(v[0], Words) + (unsigned short int) (nnn - 2));
+            break;
+        case 0xC: {
+            // Chip8Cpu::random, one xorshift32 per lane
+            DwordMask dmask = __builtin_convertvector(mask, DwordMask);
+            Dwords r = this->rng;
+            r ^= r << 13;
+            r ^= r >> 17;
+            r ^= r << 5;
+            CHIP8_MASKED(this->rng, dmask, r);
+            CHIP8_MASKED(v[x], bmask, __builtin_convertvector(r >> 24, Bytes) & kk);
+            break;
+        }
+        case 0xF:
+            if (kk == 0x07) {
+                CHIP8_MASKED(v[x], bmask, this->delay_timer);
+                break;
+            } else if (kk == 0x15) {
+                CHIP8_MASKED(this->delay_timer, bmask, v[x]);
+                break;
+            } else if (kk == 0x18) {
+                CHIP8_MASKED(this->sound_timer, bmask, v[x]);
+                break;
+            } else if (kk == 0x1E) {
+                Words sum = this->i + __builtin_convertvector(v[x], Words);
+                CHIP8_MASKED(v[0xF], bmask, CHIP8_FLAG(__builtin_convertvector(sum < this->i, ByteMask)));
+                CHIP8_MASKED(this->i, mask, sum);
+                break;
+            } else if (kk == 0x29) {
+                CHIP8_MASKED(this->i, mask, __builtin_convertvector(v[x], Words) * 5);
+                break;
+            } else if (kk == 0x30) {
+                CHIP8_MASKED(this->i, mask, __builtin_convertvector(v[x] & 0x0F, Words) * 10 + CHIP8_BIG_FONT);
+                break;
+            }
+            // the rest runs per lane
+            [[fallthrough]];
+        default:
+            // 00E0, 00EE, the SUPER-CHIP screen ops, 2nnn, Dxyn, Exxx and the
+            // other Fxxx touch memory, the screen or the keypad, which live
+            // per lane; any other 0nnn is a no-op
+            if ((instruction >> 12) == 0x0 && instruction != 0x00E0 && instruction != 0x00EE &&
+                (instruction & 0xFFF0) != 0x00C0 && (instruction < 0x00FB || instruction > 0x00FF))
+                break;
+            for (unsigned int l = 0; l < LANES; l++) {
+                if (mask[l])
+                    this->run_lane(l, 1);
+            }
+            return;
+        }
+
+        this->pc += 2 & (Words) mask;
+    }
+    // run every lane for n instructions
+    void run_budget(unsigned short int n) {
+        Words budget = (Words) {} + n;
+        unsigned int thin = 0;
+
+        while (true) {
+            // lowest pc among the lanes with budget left goes next
+            unsigned int leader = 0x10000;
+            unsigned int first = 0;
+            unsigned int active = 0;
+            for (unsigned int l = 0; l < LANES; l++) {
+                if (budget[l]) {
+                    active++;
+                    if (this->pc[l] < leader) {
+                        leader = this->pc[l];
+                        first = l;
+                    }
+                }
+            }
+            if (!active)
+                return;
+
+            WordMask mask = (this->pc == (unsigned short int) leader) & (budget != 0);
+            unsigned char* code = this->lane_memory(first);
+            unsigned short int instruction = (code[leader & 0xFFF] << 8) | code[(leader + 1) & 0xFFF];
+
+            // lanes may disagree on the opcode where memory was written
+            if (this->dirty & ((1u << ((leader & 0xFFF) >> 8)) | (1u << (((leader + 1) & 0xFFF) >> 8)))) {
+                for (unsigned int l = first + 1; l < LANES; l++) {
+                    unsigned char* lane = this->lane_memory(l);
+                    if (mask[l] && ((lane[leader & 0xFFF] << 8) | lane[(leader + 1) & 0xFFF]) != instruction)
+                        mask[l] = 0;
+                }
+            }
+
+            unsigned int running = 0;
+            for (unsigned int l = 0; l < LANES; l++)
+                running += mask[l] & 1;
+
+            this->execute(instruction, mask);
+            budget -= 1 & (Words) mask;
+            this->steps++;
+            this->lane_steps += running;
+
+            // heavy divergence: finish the budget lane by lane
+            thin = running * 4 < active ? thin + 1 : 0;
+            if (thin >= MAX_THIN_STEPS) {
+                for (unsigned int l = 0; l < LANES; l++) {
+                    if (budget[l]) {
+                        this->run_lane(l, budget[l]);
+                        this->scalar_instructions += budget[l];
+                    }
+                }
+                return;
+            }
+        }
+    }
+public:
+    static const unsigned int lanes = LANES;
+
+    Chip8Lockstep() {
+        // allocate memory
+        this->memory = new unsigned char [(size_t) LANES * 4096];
+
+        // check for allocation errors
+        if (this->memory == NULL)
+            throw std::runtime_error("Failed to allocate memory!");
+
+        // every lane starts out as a freshly constructed core
+        Chip8Core core;
+        for (unsigned int l = 0; l < LANES; l++)
+            memcpy(this->lane_memory(l), core.get_memory(), 4096);
+
+        for (size_t r = 0; r < 16; r++)
+            this->v[r] = (Bytes) {};
+        this->i = (Words) {};
+        this->pc = (Words) {} + 0x200;
+        this->sp = (Bytes) {};
+        this->delay_timer = (Bytes) {};
+        this->sound_timer = (Bytes) {};
+        for (unsigned int l = 0; l < LANES; l++)
+            this->seed(l, CHIP8_DEFAULT_SEED);
+        memset(this->rpl, 0, sizeof(this->rpl));
+
+        this->dirty = 0;
+        this->cycles = 0;
+        this->frames = 0;
+        this->steps = 0;
+        this->lane_steps = 0;
+        this->scalar_instructions = 0;
+    }
+
+    ~Chip8Lockstep() {
+        delete[] this->memory;
+    }
+
+    Chip8Lockstep(const Chip8Lockstep&) = delete;
+    Chip8Lockstep& operator=(const Chip8Lockstep&) = delete;
+
+    // start a new Cxkk sequence in one lane, as Chip8Core::seed does
+    void seed(unsigned int l, unsigned int seed) {
+        this->cpu.seed(seed);
+        this->rng[l] = this->cpu.rng;
+    }
+
+    Chip8Framebuffer& get_framebuffer(unsigned int l) {
+        return this->framebuffers[l];
+    }
+
+    Chip8Keyboard& get_keyboard(unsigned int l) {
+        return this->keyboards[l];
+    }
+
+    unsigned char* get_memory(unsigned int l) {
+        return this->lane_memory(l);
+    }
+
+    unsigned long long get_cycles() {
+        return this->cycles;
+    }
+
+    unsigned long long get_frames() {
+        return this->frames;
+    }
+
+    // copy the same ROM image into every lane
+    bool load_rom(const unsigned char* data, size_t size) {
+        // if the rom wouldn't fit in memory (4096 - 512 - 256 - 96)
+        if (size > 3232) {
+            printf("* File too large! (%zu)\n", size);
+            return false;
+        }
+
+        for (unsigned int l = 0; l < LANES; l++)
+            memcpy(this->lane_memory(l) + 512, data, size);
+        return true;
+    }
+
+    // emulate n 60 Hz frames of ipf instructions per lane, exactly like
+    // Chip8Core::run_frames does for a single machine
+    void run_frames(unsigned long long n, unsigned int ipf) {
+        for (unsigned long long f = 0; f < n; f++) {
+            // budgets are 16 bits per lane, like the pcs they're masked with
+            for (unsigned int left = ipf; left > 0; ) {
+                unsigned int chunk = left < 0xFFFF ? left : 0xFFFF;
+                this->run_budget(chunk);
+                left -= chunk;
+            }
+
+            // timers tick once per frame, like Chip8Core::tick_timers
+            this->delay_timer -= CHIP8_FLAG(this->delay_timer != 0);
+            this->sound_timer -= CHIP8_FLAG(this->sound_timer != 0);
+            this->cycles += ipf;
+            this->frames++;
+        }
+    }
+
+    unsigned long long screen_hash(unsigned int l) {
+        return this->framebuffers[l].hash();
+    }
+
+    // snapshot one lane in the format Chip8Core::save_state uses
+    void save_state(unsigned int l, Chip8State& state) {
+        memcpy(state.memory, this->lane_memory(l), 4096);
+        for (size_t r = 0; r < 16; r++)
+            state.v[r] = this->v[r][l];
+        state.i = this->i[l];
+        state.pc = this->pc[l];
+        state.sp = this->sp[l];
+        state.rng = this->rng[l];
+        memcpy(state.rpl, this->rpl[l], 8);
+        state.delay_timer = this->delay_timer[l];
+        state.sound_timer = this->sound_timer[l];
+        this->framebuffers[l].save(state);
+        this->keyboards[l].save(state);
+        state.cycles = this->cycles;
+        state.frames = this->frames;
+        state.quirks = CHIP8_QUIRKS_MODERN + 1;
+    }
+
+    // instructions issued in lockstep (each covering one or more lanes)
+    unsigned long long get_steps() {
+        return this->steps;
+    }
+
+    // lane-instructions executed by those steps
+    unsigned long long get_lane_steps() {
+        return this->lane_steps;
+    }
+
+    // lane-instructions handed to the scalar fallback
+    unsigned long long get_scalar_instructions() {
+        return this->scalar_instructions;
+    }
+
+    // average fraction of the lanes doing useful work per lockstep instruction
+    double get_occupancy() {
+        return this->steps ? (double) this->lane_steps / (this->steps * LANES) : 0;
+    }
+};
+
+#undef CHIP8_MASKED
+#undef CHIP8_FLAG
@@ -0,0 +1,311 @@
+#pragma once
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "chip8hash.hpp"
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char CHIP8_PACK_MAGIC [4] = { 'C', '8', 'R', 'P' };
+static const unsigned int CHIP8_PACK_VERSION = 1;
+
+// one ROM in a pack. data points into the mapped pack, so it stays valid for
+// as long as the Chip8Pack is open.
+struct Chip8PackEntry {
+    unsigned long long hash;   // chip8_hash of the ROM bytes
+    const unsigned char* data;
+    size_t size;
+    std::string name;
+    unsigned int ipf;          // suggested instructions per frame, 0 if unknown
+    unsigned int quirks;       // quirk profile the ROM expects (a Chip8Quirks), 0 for the default
+};
+
+// many ROMs in one file, mapped once:
+//   header  magic "C8RP", version, count, reserved (4 x 4 bytes)
+//   index   count entries of 32 bytes, sorted by hash:
+//           hash (8), data offset (4), size (4), name offset (4),
+//           name length (2), ipf (2), quirks (4), reserved (4)
+//   names and ROM data, wherever the offsets point
+// every number is little endian.
+class Chip8Pack {
+private:
+    static const size_t HEADER_SIZE = 16;
+    static const size_t ENTRY_SIZE = 32;
+
+    const unsigned char* data;
+    size_t size;
+    unsigned int count;
+    bool mapped;
+
+    static unsigned long long get(const unsigned char* p, int bytes) {
+        unsigned long long value = 0;
+        for (int b = 0; b < bytes; b++)
+            value |= (unsigned long long) p[b] << (8 * b);
+        return value;
+    }
+
+    unsigned long long hash_at(size_t k) {
+        return get(this->data + HEADER_SIZE + k * ENTRY_SIZE, 8);
+    }
+
+    void close() {
+#ifdef __unix__
+        if (this->mapped)
+            munmap((void*) this->data, this->size);
+        else
+            delete[] this->data;
+#else
+        delete[] this->data;
+#endif
+        this->data = NULL;
+        this->size = 0;
+        this->count = 0;
+        this->mapped = false;
+    }
+public:
+    Chip8Pack() {
+        this->data = NULL;
+        this->size = 0;
+        this->count = 0;
+        this->mapped = false;
+    }
+
+    ~Chip8Pack() {
+        this->close();
+    }
+
+    Chip8Pack(const Chip8Pack&) = delete;
+    Chip8Pack& operator=(const Chip8Pack&) = delete;
+
+    bool open(const char* filename) {
+        this->close();
+
+#ifdef __unix__
+        int fd = ::open(filename, O_RDONLY);
+        if (fd < 0) {
+            printf("* Unable to open file! (%s)\n", filename);
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size < (off_t) HEADER_SIZE) {
+            ::close(fd);
+            printf("* Not a ROM pack! (%s)\n", filename);
+            return false;
+        }
+        void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mem == MAP_FAILED) {
+            printf("* Unable to map file! (%s)\n", filename);
+            return false;
+        }
+        this->data = (const unsigned char*) mem;
+        this->size = st.st_size;
+        this->mapped = true;
+#else
+        FILE* in = fopen(filename, "rb");
+        if (in == NULL) {
+            printf("* Unable to open file! (%s)\n", filename);
+            return false;
+        }
+        fseek(in, 0, SEEK_END);
+        size_t file_size = ftell(in);
+        rewind(in);
+        unsigned char* buffer = new unsigned char [file_size ? file_size : 1];
+        size_t result = fread(buffer, 1, file_size, in);
+        fclose(in);
+        this->data = buffer;
+        this->size = result;
+#endif
+
+        if (this->size < HEADER_SIZE || memcmp(this->data, CHIP8_PACK_MAGIC, 4)) {
+            printf("* Not a ROM pack! (%s)\n", filename);
+            this->close();
+            return false;
+        }
+        unsigned int version = get(this->data + 4, 4);
+        unsigned int count = get(this->data + 8, 4);
+        if (version != CHIP8_PACK_VERSION || HEADER_SIZE + (size_t) count * ENTRY_SIZE > this->size) {
+            printf("* Unsupported ROM pack version %u (%u entries)\n", version, count);
+            this->close();
+            return false;
+        }
+        this->count = count;
+        return true;
+    }
+
+    size_t get_count() {
+        return this->count;
+    }
+
+    // decode index entry k, false if it points outside the pack
+    bool get_entry(size_t k, Chip8PackEntry& entry) {
+        if (k >= this->count)
+            return false;
+
+        const unsigned char* p = this->data + HEADER_SIZE + k * ENTRY_SIZE;
+        size_t offset = get(p + 8, 4);
+        size_t rom_size = get(p + 12, 4);
+        size_t name_offset = get(p + 16, 4);
+        size_t name_length = get(p + 20, 2);
+        if (offset + rom_size > this->size || name_offset + name_length > this->size) {
+            printf("* Corrupt ROM pack entry %zu\n", k);
+            return false;
+        }
+
+        entry.hash = get(p, 8);
+        entry.data = this->data + offset;
+        entry.size = rom_size;
+        entry.name.assign((const char*) this->data + name_offset, name_length);
+        entry.ipf = get(p + 22, 2);
+        entry.quirks = get(p + 24, 4);
+        return true;
+    }
+
+    // binary search of the index
+    bool find_hash(unsigned long long hash, Chip8PackEntry& entry) {
+        size_t lo = 0;
+        size_t hi = this->count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (this->hash_at(mid) < hash)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo < this->count && this->hash_at(lo) == hash && this->get_entry(lo, entry);
+    }
+
+    // exact name, or the file name without its directories
+    bool find_name(const char* name, Chip8PackEntry& entry) {
+        size_t length = strlen(name);
+        for (size_t k = 0; k < this->count; k++) {
+            const unsigned char* p = this->data + HEADER_SIZE + k * ENTRY_SIZE;
+            size_t name_offset = get(p + 16, 4);
+            size_t name_length = get(p + 20, 2);
+            if (name_offset + name_length > this->size || name_length < length)
+                continue;
+            const char* stored = (const char*) this->data + name_offset;
+            if (memcmp(stored + name_length - length, name, length))
+                continue;
+            if (name_length == length || stored[name_length - length - 1] == '/')
+                return this->get_entry(k, entry);
+        }
+        return false;
+    }
+
+    // a 16 digit hex hash or a name
+    bool find(const char* selector, Chip8PackEntry& entry) {
+        char* end;
+        if (strlen(selector) == 16) {
+            unsigned long long hash = strtoull(selector, &end, 16);
+            if (*end == '\0' && this->find_hash(hash, entry))
+                return true;
+        }
+        if (this->find_name(selector, entry))
+            return true;
+        printf("* ROM not found in pack! (%s)\n", selector);
+        return false;
+    }
+};
+
+// builds a pack in memory and writes it out in one go
+class Chip8PackWriter {
+private:
+    struct Rom {
+        unsigned long long hash;
+        std::string name;
+        std::vector<unsigned char> data;
+        unsigned int ipf;
+        unsigned int quirks;
+
+        bool operator<(const Rom& other) const {
+            return this->hash < other.hash;
+        }
+    };
+
+    std::vector<Rom> roms;
+    std::unordered_set<unsigned long long> hashes;
+
+    static void put(std::vector<unsigned char>& out, unsigned long long value, int bytes) {
+        for (int b = 0; b < bytes; b++)
+            out.push_back((value >> (8 * b)) & 0xFF);
+    }
+public:
+    size_t get_count() {
+        return this->roms.size();
+    }
+
+    // false (and nothing added) if the same ROM is already in the pack.
+    // ipf is stored in 16 bits, so larger values are refused, not truncated
+    bool add(const std::string& name, const unsigned char* data, size_t size, unsigned int ipf, unsigned int quirks) {
+        if (ipf > 0xFFFF)
+            throw std::runtime_error("Instructions per frame don't fit a pack entry!");
+        Rom rom;
+        rom.hash = chip8_hash(data, size);
+        if (!this->hashes.insert(rom.hash).second)
+            return false;
+        rom.name = name.substr(0, 0xFFFF);
+        rom.data.assign(data, data + size);
+        rom.ipf = ipf;
+        rom.quirks = quirks;
+        this->roms.push_back(rom);
+        return true;
+    }
+
+    bool write(const char* filename) {
+        std::sort(this->roms.begin(), this->roms.end());
+
+        std::vector<unsigned char> out;
+        out.insert(out.end(), CHIP8_PACK_MAGIC, CHIP8_PACK_MAGIC + 4);
+        put(out, CHIP8_PACK_VERSION, 4);
+        put(out, this->roms.size(), 4);
+        put(out, 0, 4);
+
+        // names follow the index, ROM data follows the names
+        size_t names = 16 + this->roms.size() * 32;
+        size_t roms = names;
+        for (size_t k = 0; k < this->roms.size(); k++)
+            roms += this->roms[k].name.size();
+
+        size_t name_offset = names;
+        size_t rom_offset = roms;
+        for (size_t k = 0; k < this->roms.size(); k++) {
+            const Rom& rom = this->roms[k];
+            put(out, rom.hash, 8);
+            put(out, rom_offset, 4);
+            put(out, rom.data.size(), 4);
+            put(out, name_offset, 4);
+            put(out, rom.name.size(), 2);
+            put(out, rom.ipf, 2);
+            put(out, rom.quirks, 4);
+            put(out, 0, 4);
+            name_offset += rom.name.size();
+            rom_offset += rom.data.size();
+        }
+        for (size_t k = 0; k < this->roms.size(); k++)
+            out.insert(out.end(), this->roms[k].name.begin(), this->roms[k].name.end());
+        for (size_t k = 0; k < this->roms.size(); k++)
+            out.insert(out.end(), this->roms[k].data.begin(), this->roms[k].data.end());
+
+        FILE* file = fopen(filename, "wb");
+        if (file == NULL) {
+            printf("* Unable to open file! (%s)\n", filename);
+            return false;
+        }
+        bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+        fclose(file);
+        if (!ok)
+            printf("* File writing failed! (%s)\n", filename);
+        return ok;
+    }
+};
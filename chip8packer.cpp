@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "chip8pack.hpp"
+#include "chip8quirks.hpp"
+
+// builds ROM packs from files and directories (searched for .ch8), or lists
+// one. -i and -q set the metadata of the ROMs that follow them (-q takes a
+// profile name or number, see chip8quirks.hpp):
+//   chip8packer <pack> [-i instructions_per_frame] [-q quirk_profile] <rom or directory>...
+//   chip8packer -l <pack>
+static void usage(const char* argv0) {
+    printf("usage: %s <pack> [-i instructions_per_frame] [-q modern|vip|chip48|schip] <rom or directory>...\n"
+           "       %s -l <pack>\n", argv0, argv0);
+}
+
+static bool add_file(Chip8PackWriter& writer, const std::filesystem::path& path, unsigned int ipf, unsigned int quirks) {
+    FILE* in = fopen(path.string().c_str(), "rb");
+    if (in == NULL) {
+        printf("* Unable to open file! (%s)\n", path.string().c_str());
+        return false;
+    }
+    // one byte more than fits, so oversized files are caught
+    unsigned char data [3233];
+    size_t size = fread(data, 1, sizeof(data), in);
+    fclose(in);
+
+    if (size > 3232) {
+        printf("* File too large, skipped! (%s)\n", path.string().c_str());
+        return true;
+    }
+    if (!writer.add(path.generic_string(), data, size, ipf, quirks))
+        printf("* Duplicate ROM, skipped! (%s)\n", path.string().c_str());
+    return true;
+}
+
+static int list(const char* filename) {
+    Chip8Pack pack;
+    if (!pack.open(filename))
+        return 1;
+
+    for (size_t k = 0; k < pack.get_count(); k++) {
+        Chip8PackEntry entry;
+        if (!pack.get_entry(k, entry))
+            return 1;
+        printf("%016llx %5zu bytes  ipf %-4u quirks %-7s %s\n", entry.hash, entry.size, entry.ipf, chip8_quirks_name((Chip8Quirks) entry.quirks), entry.name.c_str());
+    }
+    printf("* %zu ROMs\n", pack.get_count());
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!strcmp(argv[1], "-l"))
+        return list(argv[2]);
+
+    try {
+        Chip8PackWriter writer;
+        unsigned int ipf = 0;
+        Chip8Quirks quirks = CHIP8_QUIRKS_MODERN;
+
+        for (int a = 2; a < argc; a++) {
+            if (!strcmp(argv[a], "-i") && a + 1 < argc) {
+                // packs store it in 16 bits
+                unsigned long value = strtoul(argv[++a], NULL, 0);
+                if (value > 0xFFFF) {
+                    printf("* Instructions per frame out of range! (%s, at most 65535)\n", argv[a]);
+                    return 1;
+                }
+                ipf = value;
+            }
+            else if (!strcmp(argv[a], "-q") && a + 1 < argc) {
+                if (!chip8_parse_quirks(argv[++a], quirks))
+                    return 1;
+            }
+            else if (argv[a][0] == '-') {
+                usage(argv[0]);
+                return 1;
+            }
+            else if (std::filesystem::is_directory(argv[a])) {
+                // sorted, so the same tree always packs the same way
+                std::vector<std::filesystem::path> paths;
+                for (const std::filesystem::directory_entry& entry : std::filesystem::recursive_directory_iterator(argv[a])) {
+                    if (entry.is_regular_file() && entry.path().extension() == ".ch8")
+                        paths.push_back(entry.path());
+                }
+                std::sort(paths.begin(), paths.end());
+                for (size_t k = 0; k < paths.size(); k++) {
+                    if (!add_file(writer, paths[k], ipf, quirks))
+                        return 1;
+                }
+            }
+            else if (!add_file(writer, argv[a], ipf, quirks))
+                return 1;
+        }
+
+        if (!writer.write(argv[1]))
+            return 1;
+        printf("* %zu ROMs written to %s\n", writer.get_count(), argv[1]);
+        return 0;
+    } catch (const std::exception& e) {
+        printf("* Runtime error! %s\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,220 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "chip8core.hpp"
+
+// outcome of one instance after Chip8Pool::run
+struct alignas(64) Chip8PoolResult {
+    unsigned long long cycles; // run by the last run()
+    unsigned long long frames;
+    unsigned long long hash;   // Chip8Core::screen_hash of the final screen
+    bool stalled;              // stopped early, blocked on Fx0A
+};
+
+// runs many independent machines on all cores. instances are handed out in
+// slices of a few frames: every worker owns a deque of instance indices,
+// takes work from its front and, once it runs dry, steals from the back of
+// the others. instances that block on Fx0A (there's no input here) drop out
+// early, so uneven instances still keep every thread busy.
+class Chip8Pool {
+private:
+    struct alignas(64) Worker {
+        std::mutex lock;
+        std::deque<size_t> queue;
+    };
+
+    Chip8Core* cores;
+    Chip8PoolResult* results;
+    size_t count;
+    unsigned int threads;
+
+    std::vector<Worker> workers;
+    std::atomic<size_t> remaining;
+
+    unsigned long long instructions;
+    double elapsed;
+
+    bool take(unsigned int w, size_t& k) {
+        // own work first, in the order it was queued
+        {
+            std::lock_guard<std::mutex> guard(this->workers[w].lock);
+            if (!this->workers[w].queue.empty()) {
+                k = this->workers[w].queue.front();
+                this->workers[w].queue.pop_front();
+                return true;
+            }
+        }
+
+        // steal from the opposite end of everyone else's
+        for (unsigned int o = 1; o < this->threads; o++) {
+            Worker& victim = this->workers[(w + o) % this->threads];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.queue.empty()) {
+                k = victim.queue.back();
+                victim.queue.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(unsigned int w, unsigned long long frames, unsigned int ipf, unsigned int slice) {
+        size_t k;
+        while (this->remaining.load(std::memory_order_acquire) > 0) {
+            if (!this->take(w, k)) {
+                // everything left is being run by other threads right now
+                std::this_thread::yield();
+                continue;
+            }
+
+            Chip8Core& core = this->cores[k];
+            Chip8PoolResult& result = this->results[k];
+            bool done = false;
+            for (unsigned int f = 0; f < slice && !done; f++) {
+                core.run_cycles(ipf);
+                core.tick_timers();
+                result.frames++;
+                result.stalled = core.get_keyboard().is_awaiting();
+                done = result.stalled || result.frames >= frames;
+            }
+
+            if (done) {
+                result.cycles = core.get_cycles() - result.cycles;
+                result.hash = core.screen_hash();
+                this->remaining.fetch_sub(1, std::memory_order_release);
+            } else {
+                std::lock_guard<std::mutex> guard(this->workers[w].lock);
+                this->workers[w].queue.push_back(k);
+            }
+        }
+    }
+public:
+    // threads = 0 uses every hardware thread
+    Chip8Pool(size_t count, unsigned int threads = 0) : workers(threads ? threads : std::max(1u, std::thread::hardware_concurrency())) {
+        this->cores = new Chip8Core [count];
+        this->results = new Chip8PoolResult [count];
+
+        // check for allocation errors
+        if (this->cores == NULL || this->results == NULL)
+            throw std::runtime_error("Failed to allocate memory!");
+
+        this->count = count;
+        this->threads = this->workers.size();
+        this->remaining = 0;
+        this->instructions = 0;
+        this->elapsed = 0;
+
+        // a different Cxkk sequence per instance
+        for (size_t k = 0; k < count; k++)
+            this->cores[k].seed(k + 1);
+    }
+
+    ~Chip8Pool() {
+        delete[] this->cores;
+        delete[] this->results;
+    }
+
+    Chip8Pool(const Chip8Pool&) = delete;
+    Chip8Pool& operator=(const Chip8Pool&) = delete;
+
+    size_t size() {
+        return this->count;
+    }
+
+    unsigned int get_threads() {
+        return this->threads;
+    }
+
+    // individual instances, e.g. to seed them or press keys before run()
+    Chip8Core& get_core(size_t k) {
+        return this->cores[k];
+    }
+
+    const Chip8PoolResult& get_result(size_t k) {
+        return this->results[k];
+    }
+
+    void set_engine(Chip8Engine engine) {
+        for (size_t k = 0; k < this->count; k++)
+            this->cores[k].set_engine(engine);
+    }
+
+    // read the ROM once and copy it into every instance
+    bool load_game(const char* filename) {
+        FILE* game_file = fopen(filename, "rb");
+        if (game_file == NULL) {
+            printf("* Unable to open file! (%s)\n", filename);
+            return false;
+        }
+
+        // one byte more than fits, so load_rom rejects oversized files
+        unsigned char rom [3233];
+        size_t result = fread(rom, 1, sizeof(rom), game_file);
+        fclose(game_file);
+
+        for (size_t k = 0; k < this->count; k++) {
+            if (!this->cores[k].load_rom(rom, result))
+                return false;
+        }
+        return true;
+    }
+
+    // run every instance for up to frames frames of ipf instructions,
+    // handing them out slice frames at a time
+    void run(unsigned long long frames, unsigned int ipf, unsigned int slice = 60) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        this->instructions = 0;
+        this->elapsed = 0;
+        for (size_t k = 0; k < this->count; k++) {
+            this->results[k].cycles = 0;
+            this->results[k].frames = 0;
+            this->results[k].hash = 0;
+            this->results[k].stalled = false;
+        }
+        if (frames == 0)
+            return;
+
+        // cycles holds the starting count until the instance finishes
+        for (size_t k = 0; k < this->count; k++)
+            this->results[k].cycles = this->cores[k].get_cycles();
+
+        // contiguous runs of instances per worker, so neighbours share a thread
+        for (unsigned int w = 0; w < this->threads; w++) {
+            this->workers[w].queue.clear();
+            for (size_t k = this->count * w / this->threads; k < this->count * (w + 1) / this->threads; k++)
+                this->workers[w].queue.push_back(k);
+        }
+        this->remaining = this->count;
+
+        std::vector<std::thread> pool;
+        for (unsigned int w = 1; w < this->threads; w++)
+            pool.push_back(std::thread(&Chip8Pool::work, this, w, frames, ipf, slice ? slice : 1));
+        this->work(0, frames, ipf, slice ? slice : 1);
+        for (size_t t = 0; t < pool.size(); t++)
+            pool[t].join();
+
+        for (size_t k = 0; k < this->count; k++)
+            this->instructions += this->results[k].cycles;
+        this->elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // totals of the last run()
+    unsigned long long get_instructions() {
+        return this->instructions;
+    }
+
+    double get_elapsed() {
+        return this->elapsed;
+    }
+
+    double get_ips() {
+        return this->elapsed > 0 ? this->instructions / this->elapsed : 0;
+    }
+};
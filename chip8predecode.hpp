@@ -0,0 +1,477 @@
+#pragma once
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include "chip8timer.hpp"
+#include "chip8keyboard.hpp"
+#include "chip8cpu.hpp"
+
+// every handler of the predecoded engine, in table order
+#define CHIP8_PREDECODED_OPS(X) \
+    X(NOP) X(CLS) X(RET) X(JP) X(CALL) X(SE_IMM) X(SNE_IMM) X(SE_REG) \
+    X(LD_IMM) X(ADD_IMM) X(LD_REG) X(OR) X(AND) X(XOR) X(ADD_REG) X(SUB) \
+    X(SHR) X(SUBN) X(SHL) X(SNE_REG) X(LD_I) X(JP_V0) X(RND) X(DRW) \
+    X(SKP) X(SKNP) X(LD_VX_DT) X(LD_VX_K) X(LD_DT_VX) X(LD_ST_VX) X(ADD_I) \
+    X(LD_F) X(LD_B) X(LD_MEM_VX) X(LD_VX_MEM) \
+    X(SCD) X(SCR) X(SCL) X(EXIT) X(LOW) X(HIGH) X(LD_HF) X(LD_R_VX) X(LD_VX_R) \
+    X(OR_VF) X(AND_VF) X(XOR_VF) X(SHR_VY) X(SHL_VY) X(JP_VX) X(LD_MEM_VX_I) X(LD_VX_MEM_I) \
+    X(REDECODE)
+
+enum Chip8DecodedHandler {
+#define CHIP8_ENUM_OP(name) CHIP8_OP_##name,
+    CHIP8_PREDECODED_OPS(CHIP8_ENUM_OP)
+#undef CHIP8_ENUM_OP
+    CHIP8_OP_COUNT
+};
+
+// one instruction with all of its fields already extracted
+struct Chip8DecodedOp {
+    unsigned char handler;
+    unsigned char x;
+    unsigned char y;
+    unsigned char kk;
+    unsigned short int nnn;
+};
+
+// execution engine that decodes the whole 4 KB address space up front and
+// dispatches through a jump table (computed goto on GCC/clang). semantics
+// match Chip8Cpu::cycle exactly; whenever an instruction writes memory the
+// entries overlapping the written bytes are pointed at REDECODE, which
+// decodes them again only if they're ever executed, so a store (or a call
+// pushing onto the stack at 0xEA0) costs one write per entry. quirks are
+// resolved while decoding: instructions the profile changes get handlers of
+// their own.
+class Chip8Predecoder {
+private:
+    Chip8DecodedOp* ops;
+    Chip8QuirkFlags quirks;
+
+    Chip8DecodedOp decode(unsigned short int instruction) {
+        Chip8DecodedOp op;
+        op.handler = CHIP8_OP_NOP;
+        op.x = (instruction >> 8) & 0x000F;
+        op.y = (instruction >> 4) & 0x000F;
+        op.kk = instruction & 0x00FF;
+        op.nnn = instruction & 0x0FFF;
+
+        switch (instruction >> 12) {
+        case 0x0:
+            if (instruction == 0xE0)
+                op.handler = CHIP8_OP_CLS;
+            else if (instruction == 0xEE)
+                op.handler = CHIP8_OP_RET;
+            else if ((instruction & 0xFFF0) == 0xC0)
+                op.handler = CHIP8_OP_SCD;
+            else if (instruction == 0xFB)
+                op.handler = CHIP8_OP_SCR;
+            else if (instruction == 0xFC)
+                op.handler = CHIP8_OP_SCL;
+            else if (instruction == 0xFD)
+                op.handler = CHIP8_OP_EXIT;
+            else if (instruction == 0xFE)
+                op.handler = CHIP8_OP_LOW;
+            else if (instruction == 0xFF)
+                op.handler = CHIP8_OP_HIGH;
+            break;
+        case 0x1: op.handler = CHIP8_OP_JP; break;
+        case 0x2: op.handler = CHIP8_OP_CALL; break;
+        case 0x3: op.handler = CHIP8_OP_SE_IMM; break;
+        case 0x4: op.handler = CHIP8_OP_SNE_IMM; break;
+        case 0x5: op.handler = CHIP8_OP_SE_REG; break;
+        case 0x6: op.handler = CHIP8_OP_LD_IMM; break;
+        case 0x7: op.handler = CHIP8_OP_ADD_IMM; break;
+        case 0x8:
+            switch (instruction & 0x000F) {
+            case 0x0: op.handler = CHIP8_OP_LD_REG; break;
+            case 0x1: op.handler = this->quirks.vf_reset ? CHIP8_OP_OR_VF : CHIP8_OP_OR; break;
+            case 0x2: op.handler = this->quirks.vf_reset ? CHIP8_OP_AND_VF : CHIP8_OP_AND; break;
+            case 0x3: op.handler = this->quirks.vf_reset ? CHIP8_OP_XOR_VF : CHIP8_OP_XOR; break;
+            case 0x4: op.handler = CHIP8_OP_ADD_REG; break;
+            case 0x5: op.handler = CHIP8_OP_SUB; break;
+            case 0x6: op.handler = this->quirks.shift_vy ? CHIP8_OP_SHR_VY : CHIP8_OP_SHR; break;
+            case 0x7: op.handler = CHIP8_OP_SUBN; break;
+            case 0xE: op.handler = this->quirks.shift_vy ? CHIP8_OP_SHL_VY : CHIP8_OP_SHL; break;
+            }
+            break;
+        case 0x9: op.handler = CHIP8_OP_SNE_REG; break;
+        case 0xA: op.handler = CHIP8_OP_LD_I; break;
+        case 0xB: op.handler = this->quirks.jump_vx ? CHIP8_OP_JP_VX : CHIP8_OP_JP_V0; break;
+        case 0xC: op.handler = CHIP8_OP_RND; break;
+        case 0xD: op.handler = CHIP8_OP_DRW; break;
+        case 0xE:
+            if ((instruction & 0x00FF) == 0x9E)
+                op.handler = CHIP8_OP_SKP;
+            else if ((instruction & 0x00FF) == 0xA1)
+                op.handler = CHIP8_OP_SKNP;
+            break;
+        case 0xF:
+            switch (instruction & 0x00FF) {
+            case 0x07: op.handler = CHIP8_OP_LD_VX_DT; break;
+            case 0x0A: op.handler = CHIP8_OP_LD_VX_K; break;
+            case 0x15: op.handler = CHIP8_OP_LD_DT_VX; break;
+            case 0x18: op.handler = CHIP8_OP_LD_ST_VX; break;
+            case 0x1E: op.handler = CHIP8_OP_ADD_I; break;
+            case 0x29: op.handler = CHIP8_OP_LD_F; break;
+            case 0x30: op.handler = CHIP8_OP_LD_HF; break;
+            case 0x33: op.handler = CHIP8_OP_LD_B; break;
+            case 0x55:
+            case 0x65:
+                if (this->quirks.load_store == CHIP8_LOAD_STORE_KEEP)
+                    op.handler = (instruction & 0x00FF) == 0x55 ? CHIP8_OP_LD_MEM_VX : CHIP8_OP_LD_VX_MEM;
+                else {
+                    // kk becomes how far I moves on
+                    op.handler = (instruction & 0x00FF) == 0x55 ? CHIP8_OP_LD_MEM_VX_I : CHIP8_OP_LD_VX_MEM_I;
+                    op.kk = op.x + (this->quirks.load_store == CHIP8_LOAD_STORE_PAST);
+                }
+                break;
+            case 0x75: op.handler = CHIP8_OP_LD_R_VX; break;
+            case 0x85: op.handler = CHIP8_OP_LD_VX_R; break;
+            }
+            break;
+        }
+
+        return op;
+    }
+
+    // Fx55/Fx65 (up to 16 bytes) eight at a time where they don't wrap,
+    // with the bounds taken up front: byte stores could alias cpu.i and op,
+    // which would then be reloaded for every byte
+    static void store(unsigned char* memory, unsigned int start, const unsigned char* v, unsigned int len) {
+        unsigned int o = 0;
+        if (start + len <= 4096 && len >= 8) {
+            memcpy(memory + start, v, 8);
+            o = 8;
+            if (len == 16) {
+                memcpy(memory + start + 8, v + 8, 8);
+                o = 16;
+            }
+        }
+        for (; o < len; o++)
+            memory[(start + o) & 0xFFF] = v[o];
+    }
+
+    static void load(unsigned char* v, const unsigned char* memory, unsigned int start, unsigned int len) {
+        unsigned int o = 0;
+        if (start + len <= 4096 && len >= 8) {
+            memcpy(v, memory + start, 8);
+            o = 8;
+            if (len == 16) {
+                memcpy(v + 8, memory + start + 8, 8);
+                o = 16;
+            }
+        }
+        for (; o < len; o++)
+            v[o] = memory[(start + o) & 0xFFF];
+    }
+public:
+    Chip8Predecoder() {
+        this->ops = new Chip8DecodedOp [4096];
+        this->quirks = Chip8QuirkFlags::of(CHIP8_QUIRKS_MODERN);
+
+        // check for allocation errors
+        if (this->ops == NULL)
+            throw std::runtime_error("Failed to allocate memory!");
+
+        for (size_t a = 0; a < 4096; a++)
+            this->ops[a] = this->decode(0);
+    }
+
+    ~Chip8Predecoder() {
+        delete[] this->ops;
+    }
+
+    Chip8Predecoder(const Chip8Predecoder&) = delete;
+    Chip8Predecoder& operator=(const Chip8Predecoder&) = delete;
+
+    // takes effect with the next decode_all()
+    void set_quirks(Chip8Quirks quirks) {
+        this->quirks = Chip8QuirkFlags::of(quirks);
+    }
+
+    // decode the whole address space, e.g. after loading a ROM
+    void decode_all(unsigned char* memory) {
+        for (size_t a = 0; a < 4096; a++)
+            this->ops[a] = this->decode((memory[a] << 8) | memory[(a + 1) & 0xFFF]);
+    }
+
+    // every entry whose two bytes overlap [addr, addr + len) is decoded
+    // again the next time it runs
+    void invalidate(unsigned int addr, unsigned int len) {
+        for (unsigned int a = addr - 1; a != addr + len; a++)
+            this->ops[a & 0xFFF].handler = CHIP8_OP_REDECODE;
+    }
+
+    // execute n instructions on the given cpu
+    void run(Chip8Cpu& cpu, unsigned char* memory, Chip8Framebuffer& framebuffer, Chip8Timer& delay_timer, Chip8Timer& sound_timer, Chip8Keyboard& keyboard, unsigned long long n) {
+        unsigned char* v = cpu.v;
+        unsigned short int pc = cpu.pc;
+        const Chip8DecodedOp* op;
+
+#define CHIP8_TRACE_OP() do { \
+            if (Chip8DefaultTrace::enabled) \
+                cpu.trace.record(pc, (memory[pc & 0xFFF] << 8) | memory[(pc + 1) & 0xFFF], cpu.i, cpu.sp, \
+                                 delay_timer.get_value(), sound_timer.get_value(), v); \
+            if (Chip8DefaultProfile::enabled) \
+                cpu.profile.record(pc, (memory[pc & 0xFFF] << 8) | memory[(pc + 1) & 0xFFF], delay_timer.get_value()); \
+        } while (0)
+
+#ifdef __GNUC__
+#define CHIP8_LABEL_OP(name) &&op_##name,
+        static const void* labels[CHIP8_OP_COUNT] = { CHIP8_PREDECODED_OPS(CHIP8_LABEL_OP) };
+#undef CHIP8_LABEL_OP
+#define CHIP8_OP(name) op_##name:
+#define CHIP8_NEXT() do { pc += 2; if (n-- == 0) goto done; op = &this->ops[pc & 0xFFF]; CHIP8_TRACE_OP(); goto *labels[op->handler]; } while (0)
+#define CHIP8_DISPATCH() goto *labels[op->handler]
+        if (n-- == 0)
+            goto done;
+        op = &this->ops[pc & 0xFFF];
+        CHIP8_TRACE_OP();
+        goto *labels[op->handler];
+        {
+#else
+#define CHIP8_OP(name) case CHIP8_OP_##name:
+#define CHIP8_NEXT() do { pc += 2; continue; } while (0)
+#define CHIP8_DISPATCH() goto dispatch
+        while (n-- != 0) {
+            op = &this->ops[pc & 0xFFF];
+            CHIP8_TRACE_OP();
+        dispatch:
+            switch (op->handler) {
+#endif
+            CHIP8_OP(NOP)
+                CHIP8_NEXT();
+            CHIP8_OP(CLS)
+                framebuffer.clear();
+                cpu.redraw = true;
+                CHIP8_NEXT();
+            CHIP8_OP(RET)
+                pc = memory[(0xEA0 - 2 + (cpu.sp * 2)) & 0xFFF] << 8;
+                pc ^= memory[(0xEA0 - 2 + (cpu.sp-- * 2) + 1) & 0xFFF];
+                CHIP8_NEXT();
+            CHIP8_OP(JP)
+                pc = op->nnn - 2;
+                CHIP8_NEXT();
+            CHIP8_OP(CALL) {
+                unsigned short int target = op->nnn;
+                unsigned int slot = (0xEA0 - 2 + (++cpu.sp * 2)) & 0xFFF;
+                memory[slot] = pc >> 8;
+                memory[(slot + 1) & 0xFFF] = pc & 0x00FF;
+                this->invalidate(slot, 2);
+                pc = target - 2;
+                CHIP8_NEXT();
+            }
+            CHIP8_OP(SE_IMM)
+                if (v[op->x] == op->kk)
+                    pc += 2;
+                CHIP8_NEXT();
+            CHIP8_OP(SNE_IMM)
+                if (v[op->x] != op->kk)
+                    pc += 2;
+                CHIP8_NEXT();
+            CHIP8_OP(SE_REG)
+                if (v[op->x] == v[op->y])
+                    pc += 2;
+                CHIP8_NEXT();
+            CHIP8_OP(LD_IMM)
+                v[op->x] = op->kk;
+                CHIP8_NEXT();
+            CHIP8_OP(ADD_IMM)
+                v[op->x] += op->kk;
+                CHIP8_NEXT();
+            CHIP8_OP(LD_REG)
+                v[op->x] = v[op->y];
+                CHIP8_NEXT();
+            CHIP8_OP(OR)
+                v[op->x] |= v[op->y];
+                CHIP8_NEXT();
+            CHIP8_OP(AND)
+                v[op->x] &= v[op->y];
+                CHIP8_NEXT();
+            CHIP8_OP(XOR)
+                v[op->x] ^= v[op->y];
+                CHIP8_NEXT();
+            CHIP8_OP(ADD_REG) {
+                unsigned short int result = v[op->x] + v[op->y];
+                v[0xF] = result > 0xFF;
+                v[op->x] = (unsigned char) (result & 0xFF);
+                CHIP8_NEXT();
+            }
+            CHIP8_OP(SUB)
+                v[0xF] = v[op->y] < v[op->x];
+                v[op->x] -= v[op->y];
+                CHIP8_NEXT();
+            CHIP8_OP(SHR)
+                v[0xF] = v[op->x] & 0x01;
+                v[op->x] >>= 1;
+                CHIP8_NEXT();
+            CHIP8_OP(SUBN)
+                v[0xF] = v[op->y] > v[op->x];
+                v[op->x] = v[op->y] - v[op->x];
+                CHIP8_NEXT();
+            CHIP8_OP(SHL)
+                v[0xF] = (v[op->x] & 0x80) >> 7;
+                v[op->x] <<= 1;
+                CHIP8_NEXT();
+            CHIP8_OP(SNE_REG)
+                if (v[op->x] != v[op->y])
+                    pc += 2;
+                CHIP8_NEXT();
+            CHIP8_OP(LD_I)
+                cpu.i = op->nnn;
+                CHIP8_NEXT();
+            CHIP8_OP(JP_V0)
+                pc = op->nnn + v[0x0] - 2;
+                CHIP8_NEXT();
+            CHIP8_OP(RND)
+                v[op->x] = cpu.random() & op->kk;
+                CHIP8_NEXT();
+            CHIP8_OP(DRW)
+                v[0xF] = framebuffer.draw(memory, cpu.i, v[op->x], v[op->y], op->kk & 0x0F);
+                cpu.redraw = true;
+                CHIP8_NEXT();
+            CHIP8_OP(SKP)
+                if (keyboard.get_key(v[op->x]))
+                    pc += 2;
+                CHIP8_NEXT();
+            CHIP8_OP(SKNP)
+                if (!keyboard.get_key(v[op->x]))
+                    pc += 2;
+                CHIP8_NEXT();
+            CHIP8_OP(LD_VX_DT)
+                v[op->x] = delay_timer.get_value();
+                CHIP8_NEXT();
+            CHIP8_OP(LD_VX_K)
+                keyboard.await();
+                if (!keyboard.ack_key())
+                    pc -= 2;
+                else
+                    v[op->x] = keyboard.last_key();
+                CHIP8_NEXT();
+            CHIP8_OP(LD_DT_VX)
+                delay_timer.set(v[op->x]);
+                CHIP8_NEXT();
+            CHIP8_OP(LD_ST_VX)
+                sound_timer.set(v[op->x]);
+                CHIP8_NEXT();
+            CHIP8_OP(ADD_I) {
+                unsigned int result = cpu.i + v[op->x];
+                v[0xF] = result > 0xFFFF;
+                cpu.i = (unsigned short int) (result & 0xFFFF);
+                CHIP8_NEXT();
+            }
+            CHIP8_OP(LD_F)
+                cpu.i = 5 * v[op->x];
+                CHIP8_NEXT();
+            CHIP8_OP(LD_B) {
+                unsigned char vv = v[op->x];
+                memory[cpu.i & 0xFFF] = vv / 100;
+                memory[(cpu.i + 1) & 0xFFF] = (vv / 10) % 10;
+                memory[(cpu.i + 2) & 0xFFF] = vv % 10;
+                this->invalidate(cpu.i, 3);
+                CHIP8_NEXT();
+            }
+            CHIP8_OP(LD_MEM_VX) {
+                unsigned int start = cpu.i & 0xFFF;
+                unsigned int len = op->x + 1;
+                store(memory, start, v, len);
+                this->invalidate(start, len);
+                CHIP8_NEXT();
+            }
+            CHIP8_OP(LD_VX_MEM)
+                load(v, memory, cpu.i & 0xFFF, op->x + 1);
+                CHIP8_NEXT();
+            CHIP8_OP(SCD)
+                framebuffer.scroll_down(op->kk & 0x0F);
+                cpu.redraw = true;
+                CHIP8_NEXT();
+            CHIP8_OP(SCR)
+                framebuffer.scroll_right(4);
+                cpu.redraw = true;
+                CHIP8_NEXT();
+            CHIP8_OP(SCL)
+                framebuffer.scroll_left(4);
+                cpu.redraw = true;
+                CHIP8_NEXT();
+            CHIP8_OP(EXIT)
+                pc -= 2;
+                CHIP8_NEXT();
+            CHIP8_OP(LOW)
+                framebuffer.set_hires(false);
+                cpu.redraw = true;
+                CHIP8_NEXT();
+            CHIP8_OP(HIGH)
+                framebuffer.set_hires(true);
+                cpu.redraw = true;
+                CHIP8_NEXT();
+            CHIP8_OP(LD_HF)
+                cpu.i = CHIP8_BIG_FONT + 10 * (v[op->x] & 0x0F);
+                CHIP8_NEXT();
+            CHIP8_OP(LD_R_VX)
+                for (unsigned int o = 0; o <= (op->x & 0x7U); o++)
+                    cpu.rpl[o] = v[o];
+                CHIP8_NEXT();
+            CHIP8_OP(LD_VX_R)
+                for (unsigned int o = 0; o <= (op->x & 0x7U); o++)
+                    v[o] = cpu.rpl[o];
+                CHIP8_NEXT();
+            CHIP8_OP(OR_VF)
+                v[op->x] |= v[op->y];
+                v[0xF] = 0;
+                CHIP8_NEXT();
+            CHIP8_OP(AND_VF)
+                v[op->x] &= v[op->y];
+                v[0xF] = 0;
+                CHIP8_NEXT();
+            CHIP8_OP(XOR_VF)
+                v[op->x] ^= v[op->y];
+                v[0xF] = 0;
+                CHIP8_NEXT();
+            CHIP8_OP(SHR_VY) {
+                unsigned char vv = v[op->y];
+                v[0xF] = vv & 0x01;
+                v[op->x] = vv >> 1;
+                CHIP8_NEXT();
+            }
+            CHIP8_OP(SHL_VY) {
+                unsigned char vv = v[op->y];
+                v[0xF] = (vv & 0x80) >> 7;
+                v[op->x] = vv << 1;
+                CHIP8_NEXT();
+            }
+            CHIP8_OP(JP_VX)
+                pc = op->nnn + v[op->x] - 2;
+                CHIP8_NEXT();
+            CHIP8_OP(LD_MEM_VX_I) {
+                // the store may overwrite op itself, so I moves on first
+                unsigned int start = cpu.i & 0xFFF;
+                unsigned int len = op->x + 1;
+                cpu.i += op->kk;
+                store(memory, start, v, len);
+                this->invalidate(start, len);
+                CHIP8_NEXT();
+            }
+            CHIP8_OP(LD_VX_MEM_I) {
+                unsigned int start = cpu.i & 0xFFF;
+                unsigned int len = op->x + 1;
+                cpu.i += op->kk;
+                load(v, memory, start, len);
+                CHIP8_NEXT();
+            }
+            CHIP8_OP(REDECODE)
+                // written since it was decoded: decode it now and run it
+                this->ops[pc & 0xFFF] = this->decode((memory[pc & 0xFFF] << 8) | memory[(pc + 1) & 0xFFF]);
+                CHIP8_DISPATCH();
+#ifndef __GNUC__
+            }
+#endif
+        }
+#undef CHIP8_OP
+#undef CHIP8_NEXT
+#undef CHIP8_DISPATCH
+#undef CHIP8_TRACE_OP
+#ifdef __GNUC__
+    done:
+#endif
+        cpu.pc = pc;
+    }
+};
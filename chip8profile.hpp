@@ -0,0 +1,304 @@
+#pragma once
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// opcode classes the profiler keeps a histogram of
+static const char* const CHIP8_PROFILE_CLASSES [] = {
+    "CLS", "RET", "SCHIP", "SYS", "JP", "CALL", "SKIP", "LD", "ADD", "ALU", "LD_I", "JP_V0",
+    "RND", "DRW", "SKP_KEY", "LD_DT", "LD_K", "SET_TIMER", "ADD_I", "FONT", "BCD", "STORE", "LOAD", "INVALID"
+};
+static const unsigned int CHIP8_PROFILE_CLASS_COUNT = sizeof(CHIP8_PROFILE_CLASSES) / sizeof(CHIP8_PROFILE_CLASSES[0]);
+
+// profiling disabled: every call inlines to nothing
+class Chip8NullProfile {
+public:
+    static const bool enabled = false;
+
+    void record(unsigned short int, unsigned short int, unsigned char) {}
+};
+
+// counts every executed instruction: hits per address, a histogram of
+// opcode classes, a call tree built from 2nnn/00EE, backward jumps (loops)
+// and instructions spent spinning in Fx0A or polling the delay timer. fed
+// before each instruction runs, from the cpu's thread only.
+class Chip8Profiler {
+private:
+    // call tree node: a function (call target) reached through its parent
+    struct Node {
+        unsigned int parent;
+        unsigned short int addr;
+        unsigned int depth;
+        unsigned long long counts [CHIP8_PROFILE_CLASS_COUNT];
+    };
+
+    // beyond this the tree stops growing, e.g. for ROMs using 2nnn as a jump
+    static const unsigned int MAX_DEPTH = 64;
+
+    // a poll loop reads DT again within this many instructions
+    static const unsigned long long POLL_WINDOW = 8;
+
+    unsigned long long* hits;
+    unsigned long long classes [CHIP8_PROFILE_CLASS_COUNT];
+
+    // backward transfers by source address: how often, and the last target
+    unsigned long long* loop_counts;
+    unsigned short int* loop_targets;
+
+    std::vector<Node> nodes;
+    std::map<std::pair<unsigned int, unsigned short int>, unsigned int> children;
+    std::map<std::pair<unsigned short int, unsigned short int>, unsigned long long> edges;
+    unsigned int current;
+
+    unsigned long long total;
+    unsigned long long key_wait;
+    unsigned long long timer_wait;
+
+    unsigned short int last_pc;
+    unsigned short int last_opcode;
+    unsigned short int poll_pc;
+    unsigned char poll_dt;
+    unsigned long long poll_at;
+
+    unsigned int new_node(unsigned int parent, unsigned short int addr, unsigned int depth) {
+        Node node;
+        node.parent = parent;
+        node.addr = addr;
+        node.depth = depth;
+        memset(node.counts, 0, sizeof(node.counts));
+        this->nodes.push_back(node);
+        return this->nodes.size() - 1;
+    }
+
+    // "main;sub_0234;sub_0310"
+    std::string stack(unsigned int n) {
+        std::vector<unsigned int> path;
+        for (; n != 0; n = this->nodes[n].parent)
+            path.push_back(n);
+        std::string out = "main";
+        char name [16];
+        for (size_t k = path.size(); k-- > 0; ) {
+            snprintf(name, sizeof(name), ";sub_%04x", this->nodes[path[k]].addr);
+            out += name;
+        }
+        return out;
+    }
+public:
+    static const bool enabled = true;
+
+    Chip8Profiler() {
+        this->hits = new unsigned long long [4096];
+        this->loop_counts = new unsigned long long [4096];
+        this->loop_targets = new unsigned short int [4096];
+
+        // check for allocation errors
+        if (this->hits == NULL || this->loop_counts == NULL || this->loop_targets == NULL)
+            throw std::runtime_error("Failed to allocate memory!");
+
+        this->reset();
+    }
+
+    ~Chip8Profiler() {
+        delete[] this->hits;
+        delete[] this->loop_counts;
+        delete[] this->loop_targets;
+    }
+
+    Chip8Profiler(const Chip8Profiler&) = delete;
+    Chip8Profiler& operator=(const Chip8Profiler&) = delete;
+
+    static unsigned int classify(unsigned short int opcode) {
+        unsigned int kk = opcode & 0x00FF;
+        switch (opcode >> 12) {
+        case 0x0:
+            if (opcode == 0x00E0) return 0;
+            if (opcode == 0x00EE) return 1;
+            if ((opcode & 0xFFF0) == 0x00C0 || (opcode >= 0x00FB && opcode <= 0x00FF)) return 2;
+            return 3;
+        case 0x1: return 4;
+        case 0x2: return 5;
+        case 0x3: case 0x4: case 0x5: case 0x9: return 6;
+        case 0x6: return 7;
+        case 0x7: return 8;
+        case 0x8: return (opcode & 0x000F) == 0x0 ? 7 : 9;
+        case 0xA: return 10;
+        case 0xB: return 11;
+        case 0xC: return 12;
+        case 0xD: return 13;
+        case 0xE: return kk == 0x9E || kk == 0xA1 ? 14 : 23;
+        default:
+            switch (kk) {
+            case 0x07: return 15;
+            case 0x0A: return 16;
+            case 0x15: case 0x18: return 17;
+            case 0x1E: return 18;
+            case 0x29: case 0x30: return 19;
+            case 0x33: return 20;
+            case 0x55: case 0x75: return 21;
+            case 0x65: case 0x85: return 22;
+            }
+            return 23;
+        }
+    }
+
+    void reset() {
+        memset(this->hits, 0, 4096 * sizeof(unsigned long long));
+        memset(this->loop_counts, 0, 4096 * sizeof(unsigned long long));
+        memset(this->loop_targets, 0, 4096 * sizeof(unsigned short int));
+        memset(this->classes, 0, sizeof(this->classes));
+        this->nodes.clear();
+        this->children.clear();
+        this->edges.clear();
+        this->current = this->new_node(0, 0x200, 0);
+        this->total = 0;
+        this->key_wait = 0;
+        this->timer_wait = 0;
+        this->last_pc = 0xFFFF;
+        this->last_opcode = 0;
+        this->poll_pc = 0xFFFF;
+        this->poll_dt = 0;
+        this->poll_at = 0;
+    }
+
+    // called with the instruction about to run and the delay timer's value
+    void record(unsigned short int pc, unsigned short int opcode, unsigned char dt) {
+        pc &= 0xFFF;
+        unsigned int type = classify(opcode);
+        this->hits[pc]++;
+        this->classes[type]++;
+        this->nodes[this->current].counts[type]++;
+
+        // the previous instruction went backwards without returning or calling: a loop
+        if (this->last_pc != 0xFFFF && pc <= this->last_pc && this->last_opcode != 0x00EE && (this->last_opcode >> 12) != 0x2) {
+            this->loop_counts[this->last_pc]++;
+            this->loop_targets[this->last_pc] = pc;
+        }
+
+        if ((opcode & 0xF0FF) == 0xF00A)
+            this->key_wait++;
+        else if ((opcode & 0xF0FF) == 0xF007) {
+            // the same read of an unchanged timer again: everything since was a wait
+            if (pc == this->poll_pc && dt == this->poll_dt && this->total - this->poll_at <= POLL_WINDOW)
+                this->timer_wait += this->total - this->poll_at;
+            this->poll_pc = pc;
+            this->poll_dt = dt;
+            this->poll_at = this->total;
+        }
+
+        if ((opcode >> 12) == 0x2) {
+            unsigned short int target = opcode & 0x0FFF;
+            this->edges[std::make_pair(this->nodes[this->current].addr, target)]++;
+            if (this->nodes[this->current].depth < MAX_DEPTH) {
+                std::pair<unsigned int, unsigned short int> key (this->current, target);
+                std::map<std::pair<unsigned int, unsigned short int>, unsigned int>::iterator it = this->children.find(key);
+                if (it == this->children.end()) {
+                    unsigned int child = this->new_node(this->current, target, this->nodes[this->current].depth + 1);
+                    it = this->children.insert(std::make_pair(key, child)).first;
+                }
+                this->current = it->second;
+            }
+        } else if (opcode == 0x00EE && this->current != 0)
+            this->current = this->nodes[this->current].parent;
+
+        this->last_pc = pc;
+        this->last_opcode = opcode;
+        this->total++;
+    }
+
+    unsigned long long get_total() {
+        return this->total;
+    }
+
+    unsigned long long get_hits(unsigned short int addr) {
+        return this->hits[addr & 0xFFF];
+    }
+
+    unsigned long long get_class(unsigned int type) {
+        return type < CHIP8_PROFILE_CLASS_COUNT ? this->classes[type] : 0;
+    }
+
+    unsigned long long get_key_wait() {
+        return this->key_wait;
+    }
+
+    unsigned long long get_timer_wait() {
+        return this->timer_wait;
+    }
+
+    // one "stack;opcode_class count" line per sample bucket, the input
+    // flamegraph.pl and speedscope take
+    void write_folded(FILE* out) {
+        for (size_t n = 0; n < this->nodes.size(); n++) {
+            std::string prefix = this->stack(n);
+            for (unsigned int c = 0; c < CHIP8_PROFILE_CLASS_COUNT; c++) {
+                if (this->nodes[n].counts[c])
+                    fprintf(out, "%s;%s %llu\n", prefix.c_str(), CHIP8_PROFILE_CLASSES[c], this->nodes[n].counts[c]);
+            }
+        }
+    }
+
+    bool write_folded(const char* filename) {
+        FILE* out = fopen(filename, "w");
+        if (out == NULL) {
+            printf("* Unable to open file! (%s)\n", filename);
+            return false;
+        }
+        this->write_folded(out);
+        fclose(out);
+        return true;
+    }
+
+    // opcode classes, waits, the top call edges and the top loops, with the
+    // instructions executed inside each loop's address range
+    void report(FILE* out, size_t top = 10) {
+        double total = this->total ? (double) this->total : 1;
+        fprintf(out, "* %llu instructions profiled\n", this->total);
+        fprintf(out, "* %llu (%.1f%%) waiting in Fx0A, %llu (%.1f%%) polling the delay timer\n",
+            this->key_wait, 100 * this->key_wait / total, this->timer_wait, 100 * this->timer_wait / total);
+
+        fprintf(out, "%-10s %14s %7s\n", "class", "instructions", "share");
+        for (unsigned int c = 0; c < CHIP8_PROFILE_CLASS_COUNT; c++) {
+            if (this->classes[c])
+                fprintf(out, "%-10s %14llu %6.1f%%\n", CHIP8_PROFILE_CLASSES[c], this->classes[c], 100 * this->classes[c] / total);
+        }
+
+        std::vector<std::pair<unsigned long long, std::pair<unsigned short int, unsigned short int> > > calls;
+        for (std::map<std::pair<unsigned short int, unsigned short int>, unsigned long long>::iterator it = this->edges.begin(); it != this->edges.end(); ++it)
+            calls.push_back(std::make_pair(it->second, it->first));
+        std::sort(calls.rbegin(), calls.rend());
+        if (!calls.empty())
+            fprintf(out, "%-10s %-10s %14s\n", "caller", "callee", "calls");
+        for (size_t k = 0; k < calls.size() && k < top; k++)
+            fprintf(out, "0x%03x      0x%03x      %14llu\n", calls[k].second.first, calls[k].second.second, calls[k].first);
+
+        std::vector<std::pair<unsigned long long, unsigned short int> > loops;
+        for (unsigned int a = 0; a < 4096; a++) {
+            unsigned long long inside = 0;
+            if (!this->loop_counts[a])
+                continue;
+            for (unsigned int b = this->loop_targets[a]; b <= a; b++)
+                inside += this->hits[b];
+            loops.push_back(std::make_pair(inside, (unsigned short int) a));
+        }
+        std::sort(loops.rbegin(), loops.rend());
+        if (!loops.empty())
+            fprintf(out, "%-13s %14s %14s %7s\n", "loop", "iterations", "instructions", "share");
+        for (size_t k = 0; k < loops.size() && k < top; k++) {
+            unsigned short int end = loops[k].second;
+            fprintf(out, "0x%03x-0x%03x   %14llu %14llu %6.1f%%\n", this->loop_targets[end], end,
+                this->loop_counts[end], loops[k].first, 100 * loops[k].first / total);
+        }
+    }
+};
+
+// build with -DCHIP8_PROFILE to compile profiling in
+#ifdef CHIP8_PROFILE
+typedef Chip8Profiler Chip8DefaultProfile;
+#else
+typedef Chip8NullProfile Chip8DefaultProfile;
+#endif
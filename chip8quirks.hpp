@@ -0,0 +1,125 @@
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// interpreters disagree on a handful of instructions, and ROMs are written
+// against one of them. a profile is picked per ROM (the number is what
+// ROM packs store, 0 being the default) and fixed for the run.
+enum Chip8Quirks {
+    CHIP8_QUIRKS_MODERN = 0,    // what most ROMs since the 2000s assume
+    CHIP8_QUIRKS_VIP = 1,       // the original COSMAC VIP interpreter
+    CHIP8_QUIRKS_CHIP48 = 2,    // CHIP-48 on the HP-48
+    CHIP8_QUIRKS_SCHIP = 3      // SUPER-CHIP 1.1
+};
+
+static const unsigned int CHIP8_QUIRKS_COUNT = 4;
+
+// what Fx55/Fx65 leave in I
+enum Chip8LoadStore {
+    CHIP8_LOAD_STORE_KEEP,  // I unchanged
+    CHIP8_LOAD_STORE_PAST,  // I + x + 1, past the last register's byte
+    CHIP8_LOAD_STORE_LAST   // I + x, on it (the CHIP-48 off by one)
+};
+
+// compile-time profile. every engine is instantiated (or decodes) per
+// profile, so quirks cost nothing while instructions run.
+//   vf_reset: 8xy1/8xy2/8xy3 clear VF
+//   shift_vy: 8xy6/8xyE shift Vy into Vx, instead of Vx in place
+//   jump_vx: Bxnn jumps to xnn + Vx, instead of Bnnn to nnn + V0
+//   load_store: I after Fx55/Fx65
+// sprites clip at the bottom and right edges and wrap as a whole in every
+// profile, as all four interpreters do.
+template <Chip8Quirks Q>
+struct Chip8QuirkProfile {
+    static const bool vf_reset = false;
+    static const bool shift_vy = false;
+    static const bool jump_vx = false;
+    static const Chip8LoadStore load_store = CHIP8_LOAD_STORE_KEEP;
+};
+
+template <>
+struct Chip8QuirkProfile<CHIP8_QUIRKS_VIP> {
+    static const bool vf_reset = true;
+    static const bool shift_vy = true;
+    static const bool jump_vx = false;
+    static const Chip8LoadStore load_store = CHIP8_LOAD_STORE_PAST;
+};
+
+template <>
+struct Chip8QuirkProfile<CHIP8_QUIRKS_CHIP48> {
+    static const bool vf_reset = false;
+    static const bool shift_vy = false;
+    static const bool jump_vx = true;
+    static const Chip8LoadStore load_store = CHIP8_LOAD_STORE_LAST;
+};
+
+template <>
+struct Chip8QuirkProfile<CHIP8_QUIRKS_SCHIP> {
+    static const bool vf_reset = false;
+    static const bool shift_vy = false;
+    static const bool jump_vx = true;
+    static const Chip8LoadStore load_store = CHIP8_LOAD_STORE_KEEP;
+};
+
+// the same, for code that picks per instruction at runtime (decoders and
+// translators, which then bake the answer in)
+struct Chip8QuirkFlags {
+    bool vf_reset;
+    bool shift_vy;
+    bool jump_vx;
+    Chip8LoadStore load_store;
+
+    template <Chip8Quirks Q>
+    static Chip8QuirkFlags of() {
+        Chip8QuirkFlags flags;
+        flags.vf_reset = Chip8QuirkProfile<Q>::vf_reset;
+        flags.shift_vy = Chip8QuirkProfile<Q>::shift_vy;
+        flags.jump_vx = Chip8QuirkProfile<Q>::jump_vx;
+        flags.load_store = Chip8QuirkProfile<Q>::load_store;
+        return flags;
+    }
+
+    static Chip8QuirkFlags of(Chip8Quirks quirks) {
+        switch (quirks) {
+        case CHIP8_QUIRKS_VIP: return of<CHIP8_QUIRKS_VIP>();
+        case CHIP8_QUIRKS_CHIP48: return of<CHIP8_QUIRKS_CHIP48>();
+        case CHIP8_QUIRKS_SCHIP: return of<CHIP8_QUIRKS_SCHIP>();
+        default: return of<CHIP8_QUIRKS_MODERN>();
+        }
+    }
+};
+
+static const char* const CHIP8_QUIRKS_NAMES [CHIP8_QUIRKS_COUNT] = { "modern", "vip", "chip48", "schip" };
+
+inline const char* chip8_quirks_name(Chip8Quirks quirks) {
+    return (unsigned int) quirks < CHIP8_QUIRKS_COUNT ? CHIP8_QUIRKS_NAMES[quirks] : "unknown";
+}
+
+// a profile by its pack number
+inline bool chip8_quirks_from_id(unsigned int id, Chip8Quirks& quirks) {
+    if (id >= CHIP8_QUIRKS_COUNT) {
+        printf("* Unknown quirk profile! (%u)\n", id);
+        return false;
+    }
+    quirks = (Chip8Quirks) id;
+    return true;
+}
+
+// a profile by name or by its pack number
+inline bool chip8_parse_quirks(const char* text, Chip8Quirks& quirks) {
+    for (unsigned int q = 0; q < CHIP8_QUIRKS_COUNT; q++) {
+        if (!strcmp(text, CHIP8_QUIRKS_NAMES[q])) {
+            quirks = (Chip8Quirks) q;
+            return true;
+        }
+    }
+    char* end;
+    unsigned long id = strtoul(text, &end, 0);
+    if (*text == '\0' || *end != '\0' || id >= CHIP8_QUIRKS_COUNT) {
+        printf("* Unknown quirk profile! (%s, expected modern, vip, chip48 or schip)\n", text);
+        return false;
+    }
+    quirks = (Chip8Quirks) id;
+    return true;
+}
@@ -0,0 +1,258 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "chip8hash.hpp"
+#include "chip8quirks.hpp"
+
+static const char CHIP8_RECORDING_MAGIC [4] = { 'C', '8', 'I', 'R' };
+static const unsigned int CHIP8_RECORDING_VERSION = 2;
+
+// a screen hash is stored every this many frames, so a replay that drifts
+// is caught close to where it happened
+static const unsigned int CHIP8_RECORDING_CHECKPOINT = 600;
+
+// everything needed to reproduce a session: the program, Cxkk seed, speed
+// and quirk profile it ran with, and the keypad state of every emulated
+// frame. the keypad is applied with Chip8Keyboard::set_keys before each
+// frame, and frames with the same keys are run-length encoded, so a long
+// session stays small.
+//
+// on disk (little endian):
+//   magic "C8IR", version (4), seed (4), ipf (4), quirks (4, since version 2),
+//   image hash (8), frames (8), run count (4), checkpoint count (4),
+//   runs: varint length, keys (2)
+//   checkpoints: screen hash (8) after every CHIP8_RECORDING_CHECKPOINT frames
+class Chip8Recording {
+private:
+    struct Run {
+        unsigned long long frames;
+        unsigned short int keys;
+    };
+
+    unsigned int seed;
+    unsigned int ipf;
+    // CHIP8_QUIRKS_COUNT for version 1 recordings, which didn't store it
+    unsigned int quirks;
+    unsigned long long image;
+    unsigned long long frames;
+    std::vector<Run> runs;
+    std::vector<unsigned long long> checkpoints;
+
+    // playback position
+    size_t run;
+    unsigned long long offset;
+
+    static void put(std::vector<unsigned char>& out, unsigned long long value, int bytes) {
+        for (int b = 0; b < bytes; b++)
+            out.push_back((value >> (8 * b)) & 0xFF);
+    }
+
+    static void put_varint(std::vector<unsigned char>& out, unsigned long long value) {
+        while (value >= 0x80) {
+            out.push_back((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        out.push_back(value);
+    }
+
+    // readers return false instead of reading past end
+    static bool get(const unsigned char*& p, const unsigned char* end, unsigned long long& value, int bytes) {
+        if (end - p < bytes)
+            return false;
+        value = 0;
+        for (int b = 0; b < bytes; b++)
+            value |= (unsigned long long) *p++ << (8 * b);
+        return true;
+    }
+
+    static bool get_varint(const unsigned char*& p, const unsigned char* end, unsigned long long& value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (p == end)
+                return false;
+            value |= (unsigned long long) (*p & 0x7F) << shift;
+            if (!(*p++ & 0x80))
+                return true;
+        }
+        return false;
+    }
+public:
+    Chip8Recording(unsigned int seed = 0, unsigned int ipf = 0, unsigned long long image = 0, Chip8Quirks quirks = CHIP8_QUIRKS_MODERN) {
+        this->seed = seed;
+        this->ipf = ipf;
+        this->quirks = quirks;
+        this->image = image;
+        this->frames = 0;
+        this->run = 0;
+        this->offset = 0;
+    }
+
+    unsigned int get_seed() {
+        return this->seed;
+    }
+
+    unsigned int get_ipf() {
+        return this->ipf;
+    }
+
+    // the profile the session ran under, false if the recording predates it
+    bool get_quirks(Chip8Quirks& quirks) {
+        if (this->quirks >= CHIP8_QUIRKS_COUNT)
+            return false;
+        quirks = (Chip8Quirks) this->quirks;
+        return true;
+    }
+
+    // identifies the program the recording belongs to
+    unsigned long long get_image() {
+        return this->image;
+    }
+
+    unsigned long long get_frames() {
+        return this->frames;
+    }
+
+    size_t get_runs() {
+        return this->runs.size();
+    }
+
+    // hash of the memory a program runs from, taken right after loading it
+    static unsigned long long image_hash(const unsigned char* memory) {
+        return chip8_hash(memory + 0x200, 4096 - 0x200);
+    }
+
+    // append one frame's keypad state
+    void record(unsigned short int keys) {
+        if (!this->runs.empty() && this->runs.back().keys == keys)
+            this->runs.back().frames++;
+        else
+            this->runs.push_back(Run { 1, keys });
+        this->frames++;
+    }
+
+    // called after every frame, with the screen at the end of it
+    void record_screen(unsigned long long frame, unsigned long long hash) {
+        if (frame % CHIP8_RECORDING_CHECKPOINT == 0)
+            this->checkpoints.push_back(hash);
+    }
+
+    // the screen hash stored for the end of frame, false if there's none
+    bool checkpoint(unsigned long long frame, unsigned long long& hash) {
+        if (frame == 0 || frame % CHIP8_RECORDING_CHECKPOINT || frame / CHIP8_RECORDING_CHECKPOINT > this->checkpoints.size())
+            return false;
+        hash = this->checkpoints[frame / CHIP8_RECORDING_CHECKPOINT - 1];
+        return true;
+    }
+
+    // start playback from the first frame
+    void rewind() {
+        this->run = 0;
+        this->offset = 0;
+    }
+
+    // keypad state of the next frame, false once the recording is over
+    bool next(unsigned short int& keys) {
+        if (this->run >= this->runs.size())
+            return false;
+        keys = this->runs[this->run].keys;
+        if (++this->offset >= this->runs[this->run].frames) {
+            this->run++;
+            this->offset = 0;
+        }
+        return true;
+    }
+
+    bool save(const char* filename) {
+        std::vector<unsigned char> data;
+        data.insert(data.end(), CHIP8_RECORDING_MAGIC, CHIP8_RECORDING_MAGIC + 4);
+        put(data, CHIP8_RECORDING_VERSION, 4);
+        put(data, this->seed, 4);
+        put(data, this->ipf, 4);
+        put(data, this->quirks, 4);
+        put(data, this->image, 8);
+        put(data, this->frames, 8);
+        put(data, this->runs.size(), 4);
+        put(data, this->checkpoints.size(), 4);
+        for (size_t k = 0; k < this->runs.size(); k++) {
+            put_varint(data, this->runs[k].frames);
+            put(data, this->runs[k].keys, 2);
+        }
+        for (size_t k = 0; k < this->checkpoints.size(); k++)
+            put(data, this->checkpoints[k], 8);
+
+        FILE* out = fopen(filename, "wb");
+        if (out == NULL) {
+            printf("* Unable to open file! (%s)\n", filename);
+            return false;
+        }
+        bool ok = fwrite(data.data(), 1, data.size(), out) == data.size();
+        fclose(out);
+        if (!ok)
+            printf("* File writing failed! (%s)\n", filename);
+        return ok;
+    }
+
+    bool load(const char* filename) {
+        FILE* in = fopen(filename, "rb");
+        if (in == NULL) {
+            printf("* Unable to open file! (%s)\n", filename);
+            return false;
+        }
+        std::vector<unsigned char> data;
+        unsigned char buffer [4096];
+        size_t result;
+        while ((result = fread(buffer, 1, sizeof(buffer), in)) > 0)
+            data.insert(data.end(), buffer, buffer + result);
+        fclose(in);
+
+        const unsigned char* p = data.data();
+        const unsigned char* end = p + data.size();
+        unsigned long long version, seed, ipf, quirks = CHIP8_QUIRKS_COUNT, image, frames, runs, checkpoints;
+        if (data.size() < 4 || memcmp(p, CHIP8_RECORDING_MAGIC, 4)) {
+            printf("* Not an input recording! (%s)\n", filename);
+            return false;
+        }
+        p += 4;
+        if (!get(p, end, version, 4) || version < 1 || version > CHIP8_RECORDING_VERSION) {
+            printf("* Unsupported input recording version! (%s)\n", filename);
+            return false;
+        }
+        if (!get(p, end, seed, 4) || !get(p, end, ipf, 4) || (version >= 2 && !get(p, end, quirks, 4)) || !get(p, end, image, 8) ||
+            !get(p, end, frames, 8) || !get(p, end, runs, 4) || !get(p, end, checkpoints, 4)) {
+            printf("* Truncated input recording! (%s)\n", filename);
+            return false;
+        }
+        if (version >= 2 && quirks >= CHIP8_QUIRKS_COUNT) {
+            printf("* Unknown quirk profile in input recording! (%s)\n", filename);
+            return false;
+        }
+
+        Chip8Recording loaded ((unsigned int) seed, (unsigned int) ipf, image);
+        loaded.quirks = (unsigned int) quirks;
+        for (unsigned long long k = 0; k < runs; k++) {
+            unsigned long long length, keys;
+            if (!get_varint(p, end, length) || !get(p, end, keys, 2) || length == 0) {
+                printf("* Truncated input recording! (%s)\n", filename);
+                return false;
+            }
+            loaded.runs.push_back(Run { length, (unsigned short int) keys });
+            loaded.frames += length;
+        }
+        for (unsigned long long k = 0; k < checkpoints; k++) {
+            unsigned long long hash;
+            if (!get(p, end, hash, 8)) {
+                printf("* Truncated input recording! (%s)\n", filename);
+                return false;
+            }
+            loaded.checkpoints.push_back(hash);
+        }
+        if (loaded.frames != frames) {
+            printf("* Corrupt input recording! (%s)\n", filename);
+            return false;
+        }
+
+        *this = loaded;
+        return true;
+    }
+};
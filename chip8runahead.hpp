@@ -0,0 +1,91 @@
+#pragma once
+#include <chrono>
+#include "chip8core.hpp"
+#include "chip8scheduler.hpp"
+#include "chip8state.hpp"
+#include "chip8framebuffer.hpp"
+
+// run-ahead: after each real frame, snapshot the core, run a few more
+// frames with the keys just read, keep the framebuffer they end on and roll
+// back. what's shown is where the game will be if the keys stay as they are,
+// hiding that many frames of the ROM's own input lag. the snapshot is a
+// plain Chip8State and rolling back only re-decodes the memory pages the
+// speculative frames wrote to, so it's cheap enough to do every frame.
+class Chip8RunAhead {
+private:
+    typedef std::chrono::steady_clock clock;
+
+    unsigned int frames;
+    Chip8State state;
+    Chip8Framebuffer framebuffer;
+
+    unsigned long long runs;
+    long long spent;        // ns, snapshot + speculation + rollback
+    long long saving;
+    long long restoring;
+public:
+    Chip8RunAhead(unsigned int frames = 1) {
+        this->frames = frames;
+        this->runs = 0;
+        this->spent = 0;
+        this->saving = 0;
+        this->restoring = 0;
+    }
+
+    Chip8RunAhead(const Chip8RunAhead&) = delete;
+    Chip8RunAhead& operator=(const Chip8RunAhead&) = delete;
+
+    unsigned int get_frames() {
+        return this->frames;
+    }
+
+    void set_frames(unsigned int frames) {
+        this->frames = frames;
+    }
+
+    // call right after the real frame: speculates and rolls back, then
+    // returns the future framebuffer. it should be shown even if nothing was
+    // drawn, as the future may have changed with the keys
+    Chip8Framebuffer& run(Chip8Core& core, Chip8Scheduler& scheduler) {
+        clock::time_point start = clock::now();
+        core.save_state(this->state);
+        // outside the state, and speculative frames would change them too
+        unsigned long long idle_cycles = core.get_idle_cycles();
+        bool beeping = core.is_beeping();
+        clock::time_point saved = clock::now();
+
+        for (unsigned int f = 0; f < this->frames; f++)
+            scheduler.run_frame(core);
+        this->framebuffer = core.get_framebuffer();
+
+        clock::time_point ran = clock::now();
+        core.load_state(this->state);
+        core.set_idle_cycles(idle_cycles);
+        core.set_beeping(beeping);
+        clock::time_point end = clock::now();
+
+        this->runs++;
+        this->spent += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        this->saving += std::chrono::duration_cast<std::chrono::nanoseconds>(saved - start).count();
+        this->restoring += std::chrono::duration_cast<std::chrono::nanoseconds>(end - ran).count();
+        return this->framebuffer;
+    }
+
+    unsigned long long get_runs() {
+        return this->runs;
+    }
+
+    // average cost per real frame in us, in total and for the snapshot and
+    // the rollback alone
+    double get_cost() {
+        return this->runs ? this->spent / 1e3 / this->runs : 0;
+    }
+
+    double get_save_cost() {
+        return this->runs ? this->saving / 1e3 / this->runs : 0;
+    }
+
+    double get_restore_cost() {
+        return this->runs ? this->restoring / 1e3 / this->runs : 0;
+    }
+};
@@ -0,0 +1,89 @@
+#pragma once
+#include <chrono>
+#include <thread>
+#include "chip8core.hpp"
+
+// ~400 Hz, the speed the emulator always ran at
+static const unsigned int CHIP8_DEFAULT_IPF = 7;
+
+// drives a core in fixed 60 Hz frames: a budget of ipf instructions, then
+// exactly one timer tick. emulated time only depends on the frame count, and
+// when throttled the host sleeps once per frame against an absolute deadline,
+// so the OS timer resolution can't make the speed drift.
+class Chip8Scheduler {
+private:
+    typedef std::chrono::steady_clock clock;
+
+    unsigned int ipf;
+    bool throttled;
+    clock::time_point start;
+    unsigned long long frame;
+    bool started;
+
+    unsigned long long late_frames;
+public:
+    Chip8Scheduler(unsigned int ipf = CHIP8_DEFAULT_IPF, bool throttled = true) {
+        this->ipf = ipf;
+        this->throttled = throttled;
+        this->frame = 0;
+        this->started = false;
+        this->late_frames = 0;
+    }
+
+    unsigned int get_ipf() {
+        return this->ipf;
+    }
+
+    void set_ipf(unsigned int ipf) {
+        this->ipf = ipf;
+    }
+
+    bool is_throttled() {
+        return this->throttled;
+    }
+
+    // unthrottled runs frames back to back as fast as the host allows
+    void set_throttled(bool throttled) {
+        this->throttled = throttled;
+        this->started = false;
+    }
+
+    // frames that finished after their deadline
+    unsigned long long get_late_frames() {
+        return this->late_frames;
+    }
+
+    // emulate one frame's worth of instructions and tick the timers once
+    void run_frame(Chip8Core& core) {
+        core.run_cycles(this->ipf);
+        core.tick_timers();
+    }
+
+    // sleep until the end of the current 1/60 s frame
+    void wait() {
+        if (!this->throttled)
+            return;
+
+        clock::time_point now = clock::now();
+        if (!this->started) {
+            this->start = now;
+            this->frame = 0;
+            this->started = true;
+        }
+
+        // deadlines are computed from the frame count, so rounding never accumulates
+        this->frame++;
+        clock::time_point deadline = this->start + std::chrono::nanoseconds(this->frame * 1000000000ULL / 60);
+        if (deadline > now) {
+            std::this_thread::sleep_until(deadline);
+        } else {
+            this->late_frames++;
+            // more than a few frames behind (e.g. the process was suspended):
+            // don't try to catch up, just restart the timeline from now
+            if (now - deadline > std::chrono::milliseconds(100)) {
+                this->start = now;
+                this->frame = 0;
+            }
+        }
+    }
+};
@@ -1,65 +1,97 @@
 #pragma once
 #include <SDL2/SDL.h>
+#include <cstdio>
+#include <cstring>
 #include <stdexcept>
-#include <cmath>
+#include "chip8framebuffer.hpp"
 
+// SDL renderer: the framebuffer is expanded into a streaming texture (sized
+// for the 128x64 mode, of which the 64x32 mode uses the top left quarter)
+// and scaled by the GPU. the frontend calls frame() once per 60 Hz frame;
+// frames where the framebuffer didn't change are skipped.
 class Chip8Screen {
 private:
     unsigned short w;
     unsigned short h;
     unsigned char scale;
-    bool* pixels;
     SDL_Window* window;
     SDL_Renderer* renderer;
-    SDL_Surface* surface;
+    SDL_Texture* texture;
 
-    void draw_pixel(unsigned char x, unsigned char y, bool pixel) {
-        // if (pixel)
-        //     printf("sreen - drawing pixel @(%d, %d)\n", x, y);
-        if (pixel)
-            SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-        else
-            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    unsigned long long presented;
+    unsigned long long skipped;
 
-        SDL_Rect rect;
-        rect.x = x * this->scale;
-        rect.y = y * this->scale;
-        rect.w = this->scale;
-        rect.h = this->scale;
-        SDL_RenderFillRect(renderer, &rect);
+    // expand the 1 bit per pixel framebuffer into the locked texture
+    void upload(Chip8Framebuffer& framebuffer) {
+        void* pixels;
+        int pitch;
+        if (SDL_LockTexture(this->texture, NULL, &pixels, &pitch) < 0)
+            return;
+
+        framebuffer.expand(pixels, pitch);
+        SDL_UnlockTexture(this->texture);
     }
 public:
     Chip8Screen(unsigned char scale) {
         this->w = 64 * scale;
         this->h = 32 * scale;
         this->scale = scale;
-        this->pixels = new bool [64 * 32];
-
-        // check for allocation errors
-        if (this->pixels == NULL)
-            throw std::runtime_error("Failed to allocate memory!");
+        this->window = NULL;
+        this->renderer = NULL;
+        this->texture = NULL;
+        this->presented = 0;
+        this->skipped = 0;
 
         if (SDL_Init(SDL_INIT_VIDEO) < 0) {
             printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
             throw std::runtime_error("SDL Error!");
-        } else {
-            SDL_CreateWindowAndRenderer(this->w, this->h, 0, &this->window, &this->renderer);
-            this->surface = SDL_GetWindowSurface(this->window);
+        }
+
+        if (SDL_CreateWindowAndRenderer(this->w, this->h, 0, &this->window, &this->renderer) < 0) {
+            printf("SDL could not create window! SDL_Error: %s\n", SDL_GetError());
+            SDL_Quit();
+            throw std::runtime_error("SDL Error!");
+        }
+
+        this->texture = SDL_CreateTexture(this->renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 128, 64);
+        if (this->texture == NULL) {
+            printf("SDL could not create texture! SDL_Error: %s\n", SDL_GetError());
+            SDL_DestroyRenderer(this->renderer);
+            SDL_DestroyWindow(this->window);
+            SDL_Quit();
+            throw std::runtime_error("SDL Error!");
         }
     }
 
     ~Chip8Screen() {
-        delete[] this->pixels;
-        SDL_DestroyWindow(this->window);
+        SDL_DestroyTexture(this->texture);
         SDL_DestroyRenderer(this->renderer);
+        SDL_DestroyWindow(this->window);
         SDL_Quit();
     }
 
-    void update(unsigned char*& memory) {
-        for (size_t i = 0xF00; i <= 0xFFF; i++) {
-            for (size_t k = 0; k < 8; k++)
-                this->draw_pixel((((i - 0xF00)*8 + k) % 64), floor(((i - 0xF00)*8 + k) / 64), ((memory[i] >> (7 - k)) & 0x01));
+    Chip8Screen(const Chip8Screen&) = delete;
+    Chip8Screen& operator=(const Chip8Screen&) = delete;
+
+    // end of an emulated frame: upload and present only if something was drawn
+    void frame(Chip8Framebuffer& framebuffer, bool changed) {
+        if (!changed) {
+            this->skipped++;
+            return;
         }
+
+        this->upload(framebuffer);
+        SDL_Rect source = { 0, 0, (int) framebuffer.get_width(), (int) framebuffer.get_height() };
+        SDL_RenderCopy(this->renderer, this->texture, &source, NULL);
         SDL_RenderPresent(this->renderer);
+        this->presented++;
+    }
+
+    unsigned long long get_presented() {
+        return this->presented;
+    }
+
+    unsigned long long get_skipped() {
+        return this->skipped;
     }
 };
@@ -0,0 +1,69 @@
+#pragma once
+#include <SDL2/SDL.h>
+#include <cstdio>
+#include <cstring>
+#include "chip8audio.hpp"
+
+// SDL audio output: the device's callback pulls samples straight out of a
+// Chip8Beeper on SDL's audio thread. a missing audio device isn't fatal,
+// the emulator just runs silent.
+class Chip8Speaker {
+private:
+    Chip8Beeper* beeper;
+    SDL_AudioDeviceID device;
+    unsigned int buffer;
+
+    static void callback(void* userdata, Uint8* stream, int length) {
+        Chip8Speaker* speaker = (Chip8Speaker*) userdata;
+        speaker->beeper->render((short int*) stream, length / sizeof(short int));
+    }
+public:
+    // buffer is the device's callback size in samples, a power of two
+    Chip8Speaker(Chip8Beeper& beeper, unsigned int buffer = 512) {
+        this->beeper = &beeper;
+        this->device = 0;
+        this->buffer = 0;
+
+        if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
+            printf("* SDL could not initialize audio, running silent! SDL_Error: %s\n", SDL_GetError());
+            return;
+        }
+
+        SDL_AudioSpec want, have;
+        memset(&want, 0, sizeof(want));
+        want.freq = beeper.get_rate();
+        want.format = AUDIO_S16SYS;
+        want.channels = 1;
+        want.samples = buffer;
+        want.callback = callback;
+        want.userdata = this;
+        // no changes allowed: the beeper renders at its own rate and format
+        this->device = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+        if (this->device == 0) {
+            printf("* SDL could not open an audio device, running silent! SDL_Error: %s\n", SDL_GetError());
+            SDL_QuitSubSystem(SDL_INIT_AUDIO);
+            return;
+        }
+        this->buffer = have.samples;
+        SDL_PauseAudioDevice(this->device, 0);
+    }
+
+    ~Chip8Speaker() {
+        if (this->device == 0)
+            return;
+        SDL_CloseAudioDevice(this->device);
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+    }
+
+    Chip8Speaker(const Chip8Speaker&) = delete;
+    Chip8Speaker& operator=(const Chip8Speaker&) = delete;
+
+    bool is_open() {
+        return this->device != 0;
+    }
+
+    // what the device buffer adds to the beeper's own latency, in ms
+    double get_buffer_latency() {
+        return this->buffer * 1000.0 / this->beeper->get_rate();
+    }
+};
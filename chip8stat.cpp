@@ -0,0 +1,128 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "chip8telemetry.hpp"
+
+// shows what chip8 and chip8headless instances started with -T publish.
+// without a pid it lists them; with one it prints a line every interval,
+// with rates over that interval, until the instance exits (or -n lines).
+// -H adds the frame time histogram:
+//   chip8stat [pid] [-i interval_ms] [-n count] [-H]
+static void usage(const char* argv0) {
+    printf("usage: %s [pid] [-i interval_ms] [-n count] [-H]\n", argv0);
+}
+
+static double percent(unsigned long long part, unsigned long long whole) {
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+// how long ago, from this process's view of the same monotonic clock
+static double age(const Chip8TelemetrySnapshot& s) {
+    unsigned long long now = chip8_telemetry_now();
+    return s.updated && now > s.updated ? (now - s.updated) / 1e9 : 0.0;
+}
+
+static void list() {
+    std::vector<int> pids;
+    std::vector<bool> alive;
+    Chip8TelemetryReader::list(pids, alive);
+    if (pids.empty()) {
+        printf("no instances publish telemetry (start chip8 or chip8headless with -T)\n");
+        return;
+    }
+
+    printf("%8s  %-24s %14s %10s %8s %10s %10s  %s\n", "pid", "rom", "instructions", "Hz", "fps", "drift ms", "dropped", "state");
+    for (size_t k = 0; k < pids.size(); k++) {
+        Chip8TelemetryReader reader;
+        Chip8TelemetrySnapshot s;
+        if (!reader.open(pids[k]) || !reader.read(s))
+            continue;
+        const char* state = !alive[k] ? "exited" : (!s.updated ? "starting" : (age(s) > 1.0 ? "stalled" : (s.throttled ? "running" : "unthrottled")));
+        printf("%8d  %-24.24s %14llu %10llu %8.2f %+10.1f %10llu  %s\n", s.pid, s.rom.c_str(), s.instructions, s.hz, s.fps / 1000.0,
+            s.drift / 1e6, s.dropped_frames, state);
+    }
+}
+
+static void histogram(const Chip8TelemetrySnapshot& s) {
+    unsigned long long total = 0;
+    for (unsigned int b = 0; b < CHIP8_TELEMETRY_BUCKETS; b++)
+        total += s.histogram[b];
+    for (unsigned int b = 0; b < CHIP8_TELEMETRY_BUCKETS; b++) {
+        if (!s.histogram[b])
+            continue;
+        if (b < CHIP8_TELEMETRY_BUCKETS - 1)
+            printf("    <= %6.2f ms %12llu  %5.1f%%\n", CHIP8_TELEMETRY_BOUNDS[b] / 1000.0, s.histogram[b], percent(s.histogram[b], total));
+        else
+            printf("     > %6.2f ms %12llu  %5.1f%%\n", CHIP8_TELEMETRY_BOUNDS[b - 1] / 1000.0, s.histogram[b], percent(s.histogram[b], total));
+    }
+}
+
+int main(int argc, char** argv) {
+    int pid = 0;
+    unsigned int interval = 1000;
+    unsigned long long count = 0;
+    bool show_histogram = false;
+
+    for (int a = 1; a < argc; a++) {
+        if (!strcmp(argv[a], "-i") && a + 1 < argc)
+            interval = strtoul(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-n") && a + 1 < argc)
+            count = strtoull(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-H"))
+            show_histogram = true;
+        else if (argv[a][0] != '-' && pid == 0)
+            pid = atoi(argv[a]);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (interval == 0)
+        interval = 1;
+
+    if (pid == 0) {
+        list();
+        return 0;
+    }
+
+    Chip8TelemetryReader reader;
+    Chip8TelemetrySnapshot last;
+    if (!reader.open(pid) || !reader.read(last)) {
+        printf("* Unable to read telemetry! (%d)\n", pid);
+        return 1;
+    }
+    printf("pid %d, %s\n", last.pid, last.rom.c_str());
+
+    for (unsigned long long n = 0; count == 0 || n < count; n++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+        Chip8TelemetrySnapshot s;
+        if (!reader.read(s)) {
+            printf("* Unable to read telemetry! (%d)\n", pid);
+            return 1;
+        }
+        if (kill(pid, 0) != 0 && errno == ESRCH) {
+            printf("* process %d exited\n", pid);
+            return 0;
+        }
+
+        // the interval as the instance saw it, so rates match its frames
+        unsigned long long wall = s.updated - last.updated;
+        unsigned long long presented = s.presented_frames - last.presented_frames;
+        if (wall == 0)
+            printf("%10llu frames, no frame for %.1f s\n", s.frames, age(s));
+        else
+            printf("%10llu frames, %8llu Hz (%u ipf), %6.2f fps, %6.2f presented, %llu dropped, %llu late, cpu %5.1f%%, render %5.1f%%, drift %+.1f ms%s\n",
+                s.frames, s.hz, s.ipf, (s.frames - last.frames) * 1e9 / wall, presented * 1e9 / wall,
+                s.dropped_frames - last.dropped_frames, s.late_frames - last.late_frames,
+                percent(s.cpu_time - last.cpu_time, wall), percent(s.render_time - last.render_time, wall),
+                s.drift / 1e6, s.throttled ? "" : " (unthrottled)");
+        if (show_histogram)
+            histogram(s);
+        fflush(stdout);
+        last = s;
+    }
+    return 0;
+}
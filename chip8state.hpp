@@ -0,0 +1,335 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+static const char CHIP8_STATE_MAGIC [4] = { 'C', '8', 'S', 'S' };
+static const unsigned int CHIP8_STATE_VERSION = 4;
+
+// complete machine state in one flat block, with no padding, so it can be
+// copied, XORed and compared as plain bytes
+struct Chip8State {
+    unsigned char memory [4096];
+    unsigned char v [16];
+    unsigned short int i;
+    unsigned short int pc;
+    unsigned char sp;
+    unsigned char delay_timer;
+    unsigned char sound_timer;
+    unsigned char keyboard_flags; // bit 0: key pressed, bit 1: awaiting a key
+    unsigned short int keys;      // one bit per hex key
+    unsigned char last_key;
+    unsigned char quirks;         // Chip8Quirks + 1, 0 if unknown (older files)
+    unsigned int rng;             // Cxkk generator, 0 if unknown
+    unsigned long long cycles;
+    unsigned long long frames;
+    unsigned long long screen [64][2]; // Chip8Framebuffer rows
+    unsigned char rpl [8];             // SUPER-CHIP Fx75/Fx85 flags
+    unsigned char display_flags;       // bit 0: 128x64 mode
+    unsigned char reserved2 [7];
+
+    static const unsigned char KEY_PRESSED = 0x01;
+    static const unsigned char AWAITING_KEY = 0x02;
+    static const unsigned char HIRES = 0x01;
+
+    Chip8State() {
+        memset(this, 0, sizeof(*this));
+    }
+
+    // versioned on-disk format: a header, then every field little endian.
+    // written into a pre-sized buffer: appending with vector inserts trips
+    // gcc 12's -Warray-bounds/-Wstringop-overflow once inlined
+    void serialize(std::vector<unsigned char>& data) const {
+        data.resize(SIZE_V4);
+        unsigned char* p = data.data();
+        memcpy(p, CHIP8_STATE_MAGIC, 4);
+        p += 4;
+        put(p, CHIP8_STATE_VERSION, 4);
+        memcpy(p, this->memory, 4096);
+        p += 4096;
+        memcpy(p, this->v, 16);
+        p += 16;
+        put(p, this->i, 2);
+        put(p, this->pc, 2);
+        put(p, this->sp, 1);
+        put(p, this->delay_timer, 1);
+        put(p, this->sound_timer, 1);
+        put(p, this->keyboard_flags, 1);
+        put(p, this->keys, 2);
+        put(p, this->last_key, 1);
+        put(p, this->cycles, 8);
+        put(p, this->frames, 8);
+        put(p, this->rng, 4);
+        for (size_t y = 0; y < 64; y++) {
+            put(p, this->screen[y][0], 8);
+            put(p, this->screen[y][1], 8);
+        }
+        memcpy(p, this->rpl, 8);
+        p += 8;
+        put(p, this->display_flags, 1);
+        put(p, this->quirks, 1);
+    }
+
+    // accepts every version serialize() ever wrote; name is only for messages
+    bool deserialize(const unsigned char* data, size_t size, const char* name) {
+        if (size < 8 || memcmp(data, CHIP8_STATE_MAGIC, 4)) {
+            printf("* Not a save state! (%s)\n", name);
+            return false;
+        }
+        const unsigned char* p = data + 4;
+        unsigned int version = (unsigned int) get(p, 4);
+        // version 1 is version 2 without the generator state, version 2 is
+        // version 3 without the SUPER-CHIP state and with the screen in memory,
+        // version 3 is version 4 without the quirk profile
+        if (!(version == 1 && size == SIZE_V1) && !(version == 2 && size == SIZE_V2) && !(version == 3 && size == SIZE_V3) &&
+            !(version == 4 && size == SIZE_V4)) {
+            printf("* Unsupported save state version %u (%zu bytes)\n", version, size);
+            return false;
+        }
+
+        memset(this, 0, sizeof(*this));
+        memcpy(this->memory, p, 4096);
+        p += 4096;
+        memcpy(this->v, p, 16);
+        p += 16;
+        this->i = get(p, 2);
+        this->pc = get(p, 2);
+        this->sp = get(p, 1);
+        this->delay_timer = get(p, 1);
+        this->sound_timer = get(p, 1);
+        this->keyboard_flags = get(p, 1);
+        this->keys = get(p, 2);
+        this->last_key = get(p, 1);
+        this->cycles = get(p, 8);
+        this->frames = get(p, 8);
+        if (version >= 2)
+            this->rng = get(p, 4);
+        if (version >= 3) {
+            for (size_t y = 0; y < 64; y++) {
+                this->screen[y][0] = get(p, 8);
+                this->screen[y][1] = get(p, 8);
+            }
+            memcpy(this->rpl, p, 8);
+            p += 8;
+            this->display_flags = get(p, 1);
+            if (version >= 4)
+                this->quirks = get(p, 1);
+        } else {
+            // 64x32 rows used to be packed at 0xF00-0xFFF, most significant byte first
+            for (size_t y = 0; y < 32; y++) {
+                for (size_t b = 0; b < 8; b++)
+                    this->screen[y][0] = (this->screen[y][0] << 8) | this->memory[0xF00 + y * 8 + b];
+            }
+        }
+        return true;
+    }
+
+    bool save(const char* filename) const {
+        FILE* out = fopen(filename, "wb");
+        if (out == NULL) {
+            printf("* Unable to open file! (%s)\n", filename);
+            return false;
+        }
+
+        std::vector<unsigned char> data;
+        this->serialize(data);
+        bool ok = fwrite(data.data(), 1, data.size(), out) == data.size();
+        fclose(out);
+        if (!ok)
+            printf("* File writing failed! (%s)\n", filename);
+        return ok;
+    }
+
+    bool load(const char* filename) {
+        FILE* in = fopen(filename, "rb");
+        if (in == NULL) {
+            printf("* Unable to open file! (%s)\n", filename);
+            return false;
+        }
+
+        unsigned char data [SIZE_V4];
+        size_t result = fread(data, 1, sizeof(data), in);
+        fclose(in);
+        return this->deserialize(data, result, filename);
+    }
+
+    // bytes serialize() writes
+    static size_t serialized_size() {
+        return SIZE_V4;
+    }
+private:
+    static const size_t SIZE_V1 = 4 + 4 + 4096 + 16 + 2 + 2 + 1 + 1 + 1 + 1 + 2 + 1 + 8 + 8;
+    static const size_t SIZE_V2 = SIZE_V1 + 4;
+    static const size_t SIZE_V3 = SIZE_V2 + 64 * 16 + 8 + 1;
+    static const size_t SIZE_V4 = SIZE_V3 + 1;
+
+    static void put(unsigned char*& p, unsigned long long value, int bytes) {
+        for (int b = 0; b < bytes; b++)
+            *p++ = (value >> (8 * b)) & 0xFF;
+    }
+
+    static unsigned long long get(const unsigned char*& p, int bytes) {
+        unsigned long long value = 0;
+        for (int b = 0; b < bytes; b++)
+            value |= (unsigned long long) *p++ << (8 * b);
+        return value;
+    }
+};
+
+static_assert(sizeof(Chip8State) == 5184, "Chip8State must not contain padding");
+
+// rewind history: the newest state is kept whole, and every older one as
+// an XOR delta against the state pushed after it, with runs of unchanged
+// bytes run-length encoded. consecutive frames differ in a few dozen bytes
+// (counters, timers, registers, the odd sprite), so a delta costs about that
+// much, and popping undoes one delta. the oldest deltas are dropped once
+// the byte budget is exceeded: at around 40 bytes a frame, the default
+// 4 MiB holds some half an hour of play, less for busy screens (see
+// seconds() and capacity()).
+class Chip8Rewind {
+private:
+    Chip8State newest;
+    // deltas back to back, oldest first, and each one's length
+    std::deque<unsigned char> deltas;
+    std::deque<unsigned int> lengths;
+    std::vector<unsigned char> scratch;
+    size_t budget;
+    size_t used;
+    size_t states;
+
+    static void put_varint(std::vector<unsigned char>& out, size_t value) {
+        while (value >= 0x80) {
+            out.push_back((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        out.push_back(value);
+    }
+
+    static size_t get_varint(const unsigned char*& p) {
+        size_t value = 0;
+        int shift = 0;
+        while (*p & 0x80) {
+            value |= (size_t) (*p++ & 0x7F) << shift;
+            shift += 7;
+        }
+        value |= (size_t) *p++ << shift;
+        return value;
+    }
+
+    // delta: (unchanged run, changed run, changed bytes XOR the other)...
+    static void encode(std::vector<unsigned char>& out, const Chip8State& from, const Chip8State& state) {
+        const unsigned char* a = (const unsigned char*) &from;
+        const unsigned char* b = (const unsigned char*) &state;
+        size_t n = sizeof(Chip8State);
+        size_t at = 0;
+        while (at < n) {
+            // skip unchanged bytes a word at a time where possible
+            size_t same = 0;
+            while (at + same + 8 <= n && !memcmp(a + at + same, b + at + same, 8))
+                same += 8;
+            while (at + same < n && a[at + same] == b[at + same])
+                same++;
+            at += same;
+            if (at == n)
+                break;
+            size_t diff = 0;
+            while (at + diff < n && a[at + diff] != b[at + diff])
+                diff++;
+            put_varint(out, same);
+            put_varint(out, diff);
+            for (size_t k = 0; k < diff; k++)
+                out.push_back(a[at + k] ^ b[at + k]);
+            at += diff;
+        }
+    }
+
+    // XOR is its own inverse, so applying a delta goes either way
+    static void apply(const unsigned char* p, const unsigned char* end, Chip8State& state) {
+        unsigned char* b = (unsigned char*) &state;
+        size_t at = 0;
+        while (p < end) {
+            at += get_varint(p);
+            size_t diff = get_varint(p);
+            for (size_t k = 0; k < diff; k++)
+                b[at++] ^= *p++;
+        }
+    }
+public:
+    Chip8Rewind(size_t budget = 4 << 20) {
+        this->budget = budget;
+        this->used = 0;
+        this->states = 0;
+    }
+
+    // number of states that can be rewound to
+    size_t size() {
+        return this->states;
+    }
+
+    size_t bytes() {
+        return this->used;
+    }
+
+    // how far back that goes, pushing one state per 60 Hz frame
+    double seconds() {
+        return this->states / 60.0;
+    }
+
+    // the seconds the budget holds at the average delta size so far
+    double capacity() {
+        if (this->states < 2)
+            return 0;
+        double per_state = (double) (this->used - sizeof(Chip8State)) / (this->states - 1);
+        return (this->budget - sizeof(Chip8State)) / per_state / 60.0;
+    }
+
+    void clear() {
+        this->deltas.clear();
+        this->lengths.clear();
+        this->used = 0;
+        this->states = 0;
+    }
+
+    void push(const Chip8State& state) {
+        if (this->states == 0)
+            this->used += sizeof(Chip8State);
+        else {
+            this->scratch.clear();
+            encode(this->scratch, this->newest, state);
+            this->deltas.insert(this->deltas.end(), this->scratch.begin(), this->scratch.end());
+            this->lengths.push_back(this->scratch.size());
+            this->used += this->scratch.size() + sizeof(unsigned int);
+        }
+        this->newest = state;
+        this->states++;
+
+        // keep at least the newest state
+        while (this->used > this->budget && !this->lengths.empty()) {
+            this->deltas.erase(this->deltas.begin(), this->deltas.begin() + this->lengths.front());
+            this->used -= this->lengths.front() + sizeof(unsigned int);
+            this->lengths.pop_front();
+            this->states--;
+        }
+    }
+
+    // take the most recent state off the history
+    bool pop(Chip8State& state) {
+        if (this->states == 0)
+            return false;
+
+        state = this->newest;
+        if (this->lengths.empty())
+            this->used -= sizeof(Chip8State);
+        else {
+            size_t n = this->lengths.back();
+            this->scratch.assign(this->deltas.end() - n, this->deltas.end());
+            apply(this->scratch.data(), this->scratch.data() + n, this->newest);
+            this->deltas.resize(this->deltas.size() - n);
+            this->lengths.pop_back();
+            this->used -= n + sizeof(unsigned int);
+        }
+        this->states--;
+        return true;
+    }
+};
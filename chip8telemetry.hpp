@@ -0,0 +1,415 @@
+#pragma once
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "chip8core.hpp"
+#include "chip8scheduler.hpp"
+
+#ifdef __unix__
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static const char CHIP8_TELEMETRY_MAGIC [4] = { 'C', '8', 'T', 'M' };
+static const unsigned int CHIP8_TELEMETRY_VERSION = 1;
+
+// frame time histogram: upper bounds in microseconds, then one bucket for
+// everything slower. finer around 16.7 ms, where a throttled run should be
+static const unsigned int CHIP8_TELEMETRY_BUCKETS = 16;
+static const unsigned int CHIP8_TELEMETRY_BOUNDS [CHIP8_TELEMETRY_BUCKETS - 1] = {
+    250, 500, 1000, 2000, 4000, 8000, 12000, 16000, 17000, 18000, 20000, 25000, 33000, 50000, 100000 };
+
+typedef std::atomic<unsigned long long> Chip8Counter;
+
+// what a running instance publishes, as laid out in the shared memory
+// segment /chip8-<pid>. the emulation thread writes its fields once per
+// frame under a sequence lock (odd while it writes), so a reader retries
+// until it gets one frame's worth; the presenting thread writes its own
+// three counters as they change. times are CLOCK_MONOTONIC nanoseconds.
+struct Chip8TelemetryBlock {
+    char magic [4];
+    unsigned int version;
+    int pid;
+    unsigned int size;
+    char rom [64];
+
+    std::atomic<unsigned int> sequence;
+    std::atomic<unsigned int> ipf;
+    std::atomic<unsigned int> throttled;
+    std::atomic<unsigned int> reserved;
+
+    // emulation thread
+    Chip8Counter updated;             // when the last frame was published
+    Chip8Counter instructions;
+    Chip8Counter idle_instructions;   // of them, skipped in idle loops
+    Chip8Counter frames;              // emulated
+    Chip8Counter late_frames;         // finished after their 60 Hz deadline
+    Chip8Counter dropped_frames;      // replaced before they were presented
+    Chip8Counter cpu_time;            // spent emulating
+    Chip8Counter hz;                  // instructions per second, last second
+    Chip8Counter fps;                 // frames per 1000 seconds, last second
+    std::atomic<long long> drift;     // wall time minus emulated time
+    Chip8Counter histogram [CHIP8_TELEMETRY_BUCKETS];
+
+    // presenting thread
+    Chip8Counter presented_frames;
+    Chip8Counter unchanged_frames;    // refreshes with nothing new to show
+    Chip8Counter render_time;
+};
+
+// one consistent copy of a block
+struct Chip8TelemetrySnapshot {
+    int pid;
+    std::string rom;
+    unsigned int ipf;
+    bool throttled;
+    unsigned long long updated;
+    unsigned long long instructions;
+    unsigned long long idle_instructions;
+    unsigned long long frames;
+    unsigned long long late_frames;
+    unsigned long long dropped_frames;
+    unsigned long long cpu_time;
+    unsigned long long hz;
+    unsigned long long fps;
+    long long drift;
+    unsigned long long histogram [CHIP8_TELEMETRY_BUCKETS];
+    unsigned long long presented_frames;
+    unsigned long long unchanged_frames;
+    unsigned long long render_time;
+};
+
+inline unsigned long long chip8_telemetry_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline std::string chip8_telemetry_name(int pid) {
+    return "/chip8-" + std::to_string(pid);
+}
+
+// publishes a running instance's counters for chip8stat. nothing happens
+// per instruction: begin_frame() and end_frame() bracket each emulated
+// frame and batch everything into one update, which costs a clock read or
+// two and a few dozen stores. the segment is removed again by close().
+class Chip8Telemetry {
+private:
+    Chip8TelemetryBlock* block;
+    std::string name;
+
+    unsigned long long histogram [CHIP8_TELEMETRY_BUCKETS];
+    unsigned long long cpu_time;
+    unsigned long long frame_start;
+    unsigned long long last_end;
+
+    // drift is measured from the first frame after opening, a pause, or a
+    // change of throttling
+    bool anchored;
+    bool throttled;
+    unsigned long long anchor_time;
+    unsigned long long anchor_frames;
+
+    // the one second window hz and fps are averaged over
+    unsigned long long window_time;
+    unsigned long long window_cycles;
+    unsigned long long window_frames;
+
+    static unsigned int bucket(unsigned long long ns) {
+        unsigned int b = 0;
+        while (b < CHIP8_TELEMETRY_BUCKETS - 1 && ns > CHIP8_TELEMETRY_BOUNDS[b] * 1000ULL)
+            b++;
+        return b;
+    }
+public:
+    Chip8Telemetry() {
+        this->block = NULL;
+        this->cpu_time = 0;
+        this->frame_start = 0;
+        this->last_end = 0;
+        this->anchored = false;
+        this->throttled = false;
+        this->anchor_time = 0;
+        this->anchor_frames = 0;
+        this->window_time = 0;
+        this->window_cycles = 0;
+        this->window_frames = 0;
+        for (unsigned int b = 0; b < CHIP8_TELEMETRY_BUCKETS; b++)
+            this->histogram[b] = 0;
+    }
+
+    ~Chip8Telemetry() {
+        this->close();
+    }
+
+    Chip8Telemetry(const Chip8Telemetry&) = delete;
+    Chip8Telemetry& operator=(const Chip8Telemetry&) = delete;
+
+    // create this process's segment, labelled with the ROM's name
+    bool open(const char* rom) {
+#ifdef __unix__
+        this->close();
+        this->name = chip8_telemetry_name(getpid());
+        int fd = shm_open(this->name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, sizeof(Chip8TelemetryBlock)) < 0) {
+            printf("* Unable to create shared memory! (%s)\n", this->name.c_str());
+            if (fd >= 0) {
+                ::close(fd);
+                shm_unlink(this->name.c_str());
+            }
+            return false;
+        }
+        void* p = mmap(NULL, sizeof(Chip8TelemetryBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            printf("* Unable to map shared memory! (%s)\n", this->name.c_str());
+            shm_unlink(this->name.c_str());
+            return false;
+        }
+
+        // fresh pages are zero, so every counter already starts at 0
+        this->block = (Chip8TelemetryBlock*) p;
+        const char* base = rom ? strrchr(rom, '/') : NULL;
+        snprintf(this->block->rom, sizeof(this->block->rom), "%s", base ? base + 1 : (rom ? rom : ""));
+        this->block->pid = getpid();
+        this->block->size = sizeof(Chip8TelemetryBlock);
+        this->block->version = CHIP8_TELEMETRY_VERSION;
+        // the magic last: readers ignore the block until it's there
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(this->block->magic, CHIP8_TELEMETRY_MAGIC, 4);
+        return true;
+#else
+        (void) rom;
+        printf("* Telemetry needs a unix host!\n");
+        return false;
+#endif
+    }
+
+    void close() {
+#ifdef __unix__
+        if (this->block) {
+            munmap(this->block, sizeof(Chip8TelemetryBlock));
+            shm_unlink(this->name.c_str());
+            this->block = NULL;
+        }
+#endif
+    }
+
+    bool is_open() {
+        return this->block != NULL;
+    }
+
+    const std::string& get_name() {
+        return this->name;
+    }
+
+    // the emulation thread's loop ran without emulating a frame (halted,
+    // rewinding): drift starts over with the next one
+    void pause() {
+        this->anchored = false;
+    }
+
+    // unthrottled, nothing sleeps between frames, so the last one's end is
+    // this one's start and one clock read per frame is enough
+    void begin_frame(Chip8Scheduler& scheduler) {
+        if (scheduler.is_throttled() || !this->last_end || !this->anchored)
+            this->frame_start = chip8_telemetry_now();
+        else
+            this->frame_start = this->last_end;
+    }
+
+    // after a frame and whatever else its thread does with it (handing it
+    // to the presenter, run-ahead), before waiting for the next: one batch.
+    // dropped is the running count of frames lost on the way to the screen
+    void end_frame(Chip8Core& core, Chip8Scheduler& scheduler, unsigned long long dropped) {
+        if (!this->block)
+            return;
+        unsigned long long now = chip8_telemetry_now();
+        unsigned long long frames = core.get_frames();
+        unsigned long long cycles = core.get_cycles();
+        this->cpu_time += now - this->frame_start;
+
+        // the frame's start against the 60 Hz timeline, which is where a
+        // throttled run sleeps to
+        if (!this->anchored || this->throttled != scheduler.is_throttled()) {
+            this->anchored = true;
+            this->throttled = scheduler.is_throttled();
+            this->anchor_time = this->frame_start;
+            this->anchor_frames = frames - 1;
+        }
+        long long drift = (long long) (this->frame_start - this->anchor_time) - (long long) ((frames - 1 - this->anchor_frames) * 1000000000ULL / 60);
+
+        unsigned int b = 0;
+        if (this->last_end) {
+            b = bucket(now - this->last_end);
+            this->histogram[b]++;
+        }
+        this->last_end = now;
+
+        Chip8TelemetryBlock* t = this->block;
+        unsigned int sequence = t->sequence.load(std::memory_order_relaxed);
+        t->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        if (now - this->window_time >= 1000000000ULL) {
+            if (this->window_time) {
+                double seconds = (now - this->window_time) / 1e9;
+                t->hz.store((unsigned long long) ((cycles - this->window_cycles) / seconds), std::memory_order_relaxed);
+                t->fps.store((unsigned long long) ((frames - this->window_frames) * 1000 / seconds), std::memory_order_relaxed);
+            }
+            this->window_time = now;
+            this->window_cycles = cycles;
+            this->window_frames = frames;
+        }
+        t->ipf.store(scheduler.get_ipf(), std::memory_order_relaxed);
+        t->throttled.store(scheduler.is_throttled(), std::memory_order_relaxed);
+        t->updated.store(now, std::memory_order_relaxed);
+        t->instructions.store(cycles, std::memory_order_relaxed);
+        t->idle_instructions.store(core.get_idle_cycles(), std::memory_order_relaxed);
+        t->frames.store(frames, std::memory_order_relaxed);
+        t->late_frames.store(scheduler.get_late_frames(), std::memory_order_relaxed);
+        t->dropped_frames.store(dropped, std::memory_order_relaxed);
+        t->cpu_time.store(this->cpu_time, std::memory_order_relaxed);
+        t->drift.store(drift, std::memory_order_relaxed);
+        t->histogram[b].store(this->histogram[b], std::memory_order_relaxed);
+
+        t->sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    // the presenting thread's running totals: frames shown, refreshes that
+    // had nothing new, and time spent drawing
+    void presented(unsigned long long presented, unsigned long long unchanged, unsigned long long render_time) {
+        if (!this->block)
+            return;
+        this->block->presented_frames.store(presented, std::memory_order_relaxed);
+        this->block->unchanged_frames.store(unchanged, std::memory_order_relaxed);
+        this->block->render_time.store(render_time, std::memory_order_relaxed);
+    }
+};
+
+// maps another process's segment read-only
+class Chip8TelemetryReader {
+private:
+    const Chip8TelemetryBlock* block;
+public:
+    Chip8TelemetryReader() {
+        this->block = NULL;
+    }
+
+    ~Chip8TelemetryReader() {
+        this->close();
+    }
+
+    Chip8TelemetryReader(const Chip8TelemetryReader&) = delete;
+    Chip8TelemetryReader& operator=(const Chip8TelemetryReader&) = delete;
+
+    bool open(int pid) {
+#ifdef __unix__
+        this->close();
+        std::string name = chip8_telemetry_name(pid);
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            printf("* No telemetry for process %d! (%s)\n", pid, name.c_str());
+            return false;
+        }
+        void* p = mmap(NULL, sizeof(Chip8TelemetryBlock), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            printf("* Unable to map shared memory! (%s)\n", name.c_str());
+            return false;
+        }
+        this->block = (const Chip8TelemetryBlock*) p;
+        if (memcmp(this->block->magic, CHIP8_TELEMETRY_MAGIC, 4) || this->block->version != CHIP8_TELEMETRY_VERSION
+            || this->block->size != sizeof(Chip8TelemetryBlock)) {
+            printf("* Not a telemetry segment of this version! (%s)\n", name.c_str());
+            this->close();
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+#else
+        printf("* Telemetry needs a unix host! (%d)\n", pid);
+        return false;
+#endif
+    }
+
+    void close() {
+#ifdef __unix__
+        if (this->block) {
+            munmap((void*) this->block, sizeof(Chip8TelemetryBlock));
+            this->block = NULL;
+        }
+#endif
+    }
+
+    // false if the writer kept getting in the way (it holds the lock for
+    // well under a microsecond per frame, so that's a writer that died
+    // halfway through)
+    bool read(Chip8TelemetrySnapshot& s) {
+        const Chip8TelemetryBlock* t = this->block;
+        if (!t)
+            return false;
+        s.pid = t->pid;
+        s.rom = std::string(t->rom, strnlen(t->rom, sizeof(t->rom)));
+        for (unsigned int attempt = 0; attempt < 1000; attempt++) {
+            unsigned int sequence = t->sequence.load(std::memory_order_acquire);
+            if (sequence & 1)
+                continue;
+            s.ipf = t->ipf.load(std::memory_order_relaxed);
+            s.throttled = t->throttled.load(std::memory_order_relaxed);
+            s.updated = t->updated.load(std::memory_order_relaxed);
+            s.instructions = t->instructions.load(std::memory_order_relaxed);
+            s.idle_instructions = t->idle_instructions.load(std::memory_order_relaxed);
+            s.frames = t->frames.load(std::memory_order_relaxed);
+            s.late_frames = t->late_frames.load(std::memory_order_relaxed);
+            s.dropped_frames = t->dropped_frames.load(std::memory_order_relaxed);
+            s.cpu_time = t->cpu_time.load(std::memory_order_relaxed);
+            s.hz = t->hz.load(std::memory_order_relaxed);
+            s.fps = t->fps.load(std::memory_order_relaxed);
+            s.drift = t->drift.load(std::memory_order_relaxed);
+            for (unsigned int b = 0; b < CHIP8_TELEMETRY_BUCKETS; b++)
+                s.histogram[b] = t->histogram[b].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (t->sequence.load(std::memory_order_relaxed) != sequence)
+                continue;
+
+            s.presented_frames = t->presented_frames.load(std::memory_order_relaxed);
+            s.unchanged_frames = t->unchanged_frames.load(std::memory_order_relaxed);
+            s.render_time = t->render_time.load(std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    // processes with a segment, and whether each is still alive (one that
+    // crashed leaves its segment behind)
+    static void list(std::vector<int>& pids, std::vector<bool>& alive) {
+        pids.clear();
+        alive.clear();
+#ifdef __unix__
+        DIR* dir = opendir("/dev/shm");
+        if (dir == NULL)
+            return;
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            char* end;
+            if (strncmp(entry->d_name, "chip8-", 6))
+                continue;
+            long pid = strtol(entry->d_name + 6, &end, 10);
+            if (*end != '\0' || pid <= 0)
+                continue;
+            pids.push_back((int) pid);
+            alive.push_back(kill((pid_t) pid, 0) == 0 || errno == EPERM);
+        }
+        closedir(dir);
+#endif
+    }
+};
+
+static_assert(Chip8Counter::is_always_lock_free, "telemetry counters must be lock free to live in shared memory");
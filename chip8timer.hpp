@@ -1,3 +1,4 @@
+#pragma once
 class Chip8Timer {
 private:
     unsigned char value;
@@ -0,0 +1,143 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <stdexcept>
+
+// one executed instruction, with the machine state right before it ran.
+// the layout is the on-disk format, so only ever append to it.
+struct Chip8TraceRecord {
+    unsigned short int pc;
+    unsigned short int opcode;
+    unsigned short int i;
+    unsigned char sp;
+    unsigned char dt;
+    unsigned char st;
+    unsigned char reserved [7];
+    unsigned char v [16];
+};
+
+static_assert(sizeof(Chip8TraceRecord) == 32, "trace records must stay 32 bytes");
+
+// trace file: this header followed by raw records
+struct Chip8TraceHeader {
+    char magic [4];
+    unsigned int version;
+    unsigned int record_size;
+    unsigned int reserved;
+};
+
+static const char CHIP8_TRACE_MAGIC [4] = { 'C', '8', 'T', 'R' };
+static const unsigned int CHIP8_TRACE_VERSION = 1;
+
+// tracing disabled: every call inlines to nothing
+class Chip8NullTrace {
+public:
+    static const bool enabled = false;
+
+    void record(unsigned short int, unsigned short int, unsigned short int, unsigned char,
+                unsigned char, unsigned char, const unsigned char*) {}
+};
+
+// single-producer/single-consumer lock-free ring of trace records. the cpu
+// is the producer and never blocks: records that don't fit are counted as
+// dropped. any one other thread may drain it into a file.
+class Chip8RingTrace {
+private:
+    Chip8TraceRecord* records;
+    size_t mask;
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+    unsigned long long dropped;
+public:
+    static const bool enabled = true;
+
+    // capacity must be a power of two
+    Chip8RingTrace(size_t capacity = 1 << 16) {
+        if (capacity == 0 || (capacity & (capacity - 1)))
+            throw std::runtime_error("Trace capacity must be a power of two!");
+
+        this->records = new Chip8TraceRecord [capacity];
+
+        // check for allocation errors
+        if (this->records == NULL)
+            throw std::runtime_error("Failed to allocate memory!");
+
+        this->mask = capacity - 1;
+        this->head.store(0);
+        this->tail.store(0);
+        this->dropped = 0;
+    }
+
+    ~Chip8RingTrace() {
+        delete[] this->records;
+    }
+
+    Chip8RingTrace(const Chip8RingTrace&) = delete;
+    Chip8RingTrace& operator=(const Chip8RingTrace&) = delete;
+
+    void record(unsigned short int pc, unsigned short int opcode, unsigned short int i, unsigned char sp,
+                unsigned char dt, unsigned char st, const unsigned char* v) {
+        size_t h = this->head.load(std::memory_order_relaxed);
+        if (h - this->tail.load(std::memory_order_acquire) > this->mask) {
+            this->dropped++;
+            return;
+        }
+
+        Chip8TraceRecord& r = this->records[h & this->mask];
+        r.pc = pc;
+        r.opcode = opcode;
+        r.i = i;
+        r.sp = sp;
+        r.dt = dt;
+        r.st = st;
+        memset(r.reserved, 0, sizeof(r.reserved));
+        memcpy(r.v, v, 16);
+
+        this->head.store(h + 1, std::memory_order_release);
+    }
+
+    // records waiting to be drained
+    size_t pending() {
+        return this->head.load(std::memory_order_acquire) - this->tail.load(std::memory_order_relaxed);
+    }
+
+    unsigned long long get_dropped() {
+        return this->dropped;
+    }
+
+    // consumer side: write everything pending to a file, returns the record count
+    size_t drain(FILE* out) {
+        size_t t = this->tail.load(std::memory_order_relaxed);
+        size_t h = this->head.load(std::memory_order_acquire);
+        size_t n = h - t;
+
+        while (t != h) {
+            // contiguous run up to the end of the ring
+            size_t run = this->mask + 1 - (t & this->mask);
+            if (run > h - t)
+                run = h - t;
+            fwrite(&this->records[t & this->mask], sizeof(Chip8TraceRecord), run, out);
+            t += run;
+        }
+
+        this->tail.store(t, std::memory_order_release);
+        return n;
+    }
+
+    static void write_header(FILE* out) {
+        Chip8TraceHeader header;
+        memcpy(header.magic, CHIP8_TRACE_MAGIC, 4);
+        header.version = CHIP8_TRACE_VERSION;
+        header.record_size = sizeof(Chip8TraceRecord);
+        header.reserved = 0;
+        fwrite(&header, sizeof(header), 1, out);
+    }
+};
+
+// build with -DCHIP8_TRACE to compile tracing in
+#ifdef CHIP8_TRACE
+typedef Chip8RingTrace Chip8DefaultTrace;
+#else
+typedef Chip8NullTrace Chip8DefaultTrace;
+#endif
@@ -0,0 +1,53 @@
+#include <cstdio>
+#include <cstring>
+#include "chip8trace.hpp"
+
+// decodes a binary trace written by a -DCHIP8_TRACE build into text:
+//   chip8tracedump <trace_file>
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        printf("usage: %s <trace_file>\n", argv[0]);
+        return 1;
+    }
+
+    FILE* in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        printf("* Unable to open file! (%s)\n", argv[1]);
+        return 1;
+    }
+
+    Chip8TraceHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, CHIP8_TRACE_MAGIC, 4)) {
+        printf("* Not a trace file! (%s)\n", argv[1]);
+        fclose(in);
+        return 1;
+    }
+
+    if (header.version != CHIP8_TRACE_VERSION || header.record_size < sizeof(Chip8TraceRecord)) {
+        printf("* Unsupported trace version %u (record size %u)\n", header.version, header.record_size);
+        fclose(in);
+        return 1;
+    }
+
+    Chip8TraceRecord r;
+    unsigned long long n = 0;
+    while (fread(&r, sizeof(r), 1, in) == 1) {
+        // skip fields appended by newer writers
+        if (header.record_size > sizeof(r))
+            fseek(in, header.record_size - sizeof(r), SEEK_CUR);
+
+        printf("@%04x: %04x - dt: %d, st: %d, sp: %d\n", r.pc, r.opcode, r.dt, r.st, r.sp);
+        printf("I = %04x, V [ ", r.i);
+        for (size_t i = 0; i <= 0xF; i++) {
+            printf("%01X: %02x", (unsigned int) i, r.v[i]);
+            if (i != 0xF)
+                printf(", ");
+        }
+        printf(" ]\n");
+        n++;
+    }
+
+    fclose(in);
+    printf("* %llu records\n", n);
+    return 0;
+}
@@ -0,0 +1,348 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "chip8verify.hpp"
+
+// runs the fast engines side by side with the interpreter and stops at the
+// first instruction after which they disagree, printing both machines (and
+// with -d writing them as save states). the candidates are the predecoded
+// engine and the jit, with idle loops skipped unless -n, and 16 lockstep
+// lanes (modern profile only). -c sets how many instructions run between
+// full comparisons; every frame ends with one. -z makes up ROMs instead:
+// random instruction streams, or mutations of the ROMs given, each run for
+// -f frames with random keys, under every quirk profile in turn unless -q;
+// ROMs that diverge are written to fuzz-<seed>.ch8:
+//   chip8verify <rom> [-e engine] [-q quirk_profile] [-f frames] [-i instructions_per_frame] [-c interval] [-s seed] [-n] [-d prefix]
+//   chip8verify -z runs [rom ...] [-e engine] [-q quirk_profile] [-f frames] [-i instructions_per_frame] [-c interval] [-s seed] [-n]
+static void usage(const char* argv0) {
+    printf("usage: %s <rom> [-e predecoded|jit|lanes|all] [-q modern|vip|chip48|schip] [-f frames] [-i instructions_per_frame]\n"
+           "       [-c interval] [-s seed] [-n] [-d prefix]\n"
+           "       %s -z runs [rom ...] [-e ...] [-q ...] [-f frames] [-i instructions_per_frame] [-c interval] [-s seed] [-n]\n", argv0, argv0);
+}
+
+enum Chip8Candidate {
+    CHIP8_CANDIDATE_PREDECODED,
+    CHIP8_CANDIDATE_JIT,
+    CHIP8_CANDIDATE_LANES
+};
+
+static const char* candidate_name(Chip8Candidate candidate) {
+    switch (candidate) {
+    case CHIP8_CANDIDATE_PREDECODED: return "predecoded";
+    case CHIP8_CANDIDATE_JIT: return "jit";
+    default: return "lanes";
+    }
+}
+
+// xorshift, so a seed gives the same ROMs and keys everywhere
+struct Chip8FuzzRandom {
+    unsigned long long state;
+
+    Chip8FuzzRandom(unsigned long long seed) {
+        this->state = seed * 0x9E3779B97F4A7C15ull + 1;
+    }
+
+    unsigned int next() {
+        this->state ^= this->state << 13;
+        this->state ^= this->state >> 7;
+        this->state ^= this->state << 17;
+        return (unsigned int) (this->state >> 32);
+    }
+
+    unsigned int below(unsigned int n) {
+        return this->next() % n;
+    }
+};
+
+// one instruction, weighted towards what exercises the engines: arithmetic,
+// skips, jumps and calls inside the ROM, stores into it (self-modifying
+// code), sprites, timers and keys, plus some raw words
+static unsigned short int fuzz_instruction(Chip8FuzzRandom& random, unsigned int size) {
+    unsigned int x = random.below(16);
+    unsigned int y = random.below(16);
+    unsigned int kk = random.below(256);
+    unsigned int target = 0x200 + random.below(size / 2) * 2;
+    static const unsigned short int alu [] = { 0, 1, 2, 3, 4, 5, 6, 7, 0xE };
+    static const unsigned short int fx [] = { 0x07, 0x0A, 0x15, 0x18, 0x1E, 0x29, 0x30, 0x33, 0x55, 0x65, 0x75, 0x85 };
+    static const unsigned short int system [] = { 0x00E0, 0x00EE, 0x00FB, 0x00FC, 0x00FE, 0x00FF };
+
+    unsigned int kind = random.below(100);
+    if (kind < 15)
+        return 0x8000 | (x << 8) | (y << 4) | alu[random.below(sizeof(alu) / sizeof(alu[0]))];
+    if (kind < 25)
+        return (random.below(2) ? 0x6000 : 0x7000) | (x << 8) | kk;
+    if (kind < 35) {
+        switch (random.below(6)) {
+        case 0: return 0x3000 | (x << 8) | kk;
+        case 1: return 0x4000 | (x << 8) | kk;
+        case 2: return 0x5000 | (x << 8) | (y << 4);
+        case 3: return 0x9000 | (x << 8) | (y << 4);
+        case 4: return 0xE09E | (x << 8);
+        default: return 0xE0A1 | (x << 8);
+        }
+    }
+    if (kind < 45) {
+        switch (random.below(4)) {
+        case 0: return 0x1000 | target;
+        case 1: return 0x2000 | target;
+        case 2: return 0xB000 | (target & 0xF00) | random.below(16) * 2;
+        default: return 0x00EE;
+        }
+    }
+    if (kind < 55)
+        return 0xA000 | (random.below(4) ? target : random.below(4096));
+    if (kind < 70)
+        return 0xF000 | (x << 8) | fx[random.below(sizeof(fx) / sizeof(fx[0]))];
+    if (kind < 82)
+        return 0xD000 | (x << 8) | (y << 4) | random.below(16);
+    if (kind < 87)
+        return random.below(2) ? system[random.below(sizeof(system) / sizeof(system[0]))] : 0x00C0 | random.below(16);
+    if (kind < 92)
+        return 0xC000 | (x << 8) | kk;
+    return random.next() & 0xFFFF;
+}
+
+static void fuzz_rom(Chip8FuzzRandom& random, std::vector<unsigned char>& rom) {
+    unsigned int size = 16 + random.below(240) * 2;
+    rom.resize(size);
+    for (unsigned int a = 0; a < size; a += 2) {
+        unsigned short int instruction = fuzz_instruction(random, size);
+        rom[a] = instruction >> 8;
+        rom[a + 1] = instruction & 0xFF;
+    }
+}
+
+// a handful of edits to a real ROM: flipped bits, replaced bytes,
+// instructions made up as above, and swapped instructions
+static void mutate_rom(Chip8FuzzRandom& random, const std::vector<unsigned char>& base, std::vector<unsigned char>& rom) {
+    rom = base;
+    if (rom.size() < 2)
+        rom.resize(2);
+    unsigned int size = rom.size() & ~1;
+    unsigned int edits = 1 + random.below(8);
+    for (unsigned int e = 0; e < edits; e++) {
+        unsigned int a = random.below(size / 2) * 2;
+        switch (random.below(4)) {
+        case 0:
+            rom[a + random.below(2)] ^= 1 << random.below(8);
+            break;
+        case 1:
+            rom[a + random.below(2)] = random.below(256);
+            break;
+        case 2: {
+            unsigned short int instruction = fuzz_instruction(random, size);
+            rom[a] = instruction >> 8;
+            rom[a + 1] = instruction & 0xFF;
+            break;
+        }
+        default: {
+            unsigned int b = random.below(size / 2) * 2;
+            std::swap(rom[a], rom[b]);
+            std::swap(rom[a + 1], rom[b + 1]);
+            break;
+        }
+        }
+    }
+}
+
+static bool read_rom(const char* filename, std::vector<unsigned char>& rom) {
+    FILE* in = fopen(filename, "rb");
+    if (in == NULL) {
+        printf("* Unable to open file! (%s)\n", filename);
+        return false;
+    }
+    rom.resize(3233);
+    size_t size = fread(rom.data(), 1, rom.size(), in);
+    fclose(in);
+    if (size > 3232) {
+        printf("* File too large! (%s)\n", filename);
+        return false;
+    }
+    rom.resize(size);
+    return true;
+}
+
+static bool write_rom(const char* filename, const std::vector<unsigned char>& rom) {
+    FILE* out = fopen(filename, "wb");
+    if (out == NULL) {
+        printf("* Unable to open file! (%s)\n", filename);
+        return false;
+    }
+    bool ok = fwrite(rom.data(), 1, rom.size(), out) == rom.size();
+    fclose(out);
+    if (!ok)
+        printf("* File writing failed! (%s)\n", filename);
+    return ok;
+}
+
+struct Chip8VerifyTotals {
+    unsigned long long cycles = 0;
+    unsigned long long idle_cycles = 0;
+    unsigned long long checks = 0;
+};
+
+// one ROM against one candidate, with keys changing at random every few
+// frames. false (with divergence filled in) if they part ways
+template <typename V>
+static bool verify(V& verifier, const std::vector<unsigned char>& rom, unsigned int seed, unsigned long long frames,
+                   unsigned int ipf, Chip8Divergence& divergence, Chip8VerifyTotals& totals) {
+    if (!verifier.load_rom(rom.data(), rom.size()))
+        return false;
+    verifier.seed(seed);
+
+    Chip8FuzzRandom random(seed);
+    unsigned short int keys = 0;
+    bool ok = true;
+    for (unsigned long long f = 0; f < frames && ok; f++) {
+        if (!random.below(8))
+            keys ^= 1 << random.below(16);
+        ok = verifier.run_frame(ipf, keys, divergence);
+    }
+    totals.cycles += verifier.get_cycles();
+    totals.idle_cycles += verifier.get_idle_cycles();
+    totals.checks += verifier.get_checks();
+    return ok;
+}
+
+static bool verify(Chip8Candidate candidate, Chip8Quirks quirks, bool idle_skip, unsigned long long interval,
+                   const std::vector<unsigned char>& rom, unsigned int seed, unsigned long long frames, unsigned int ipf,
+                   Chip8Divergence& divergence, Chip8VerifyTotals& totals) {
+    if (candidate == CHIP8_CANDIDATE_LANES) {
+        std::unique_ptr<Chip8LaneVerifier<16>> verifier(new Chip8LaneVerifier<16>());
+        return verify(*verifier, rom, seed, frames, ipf, divergence, totals);
+    }
+    Chip8Engine engine = candidate == CHIP8_CANDIDATE_JIT ? CHIP8_ENGINE_JIT : CHIP8_ENGINE_PREDECODED;
+    std::unique_ptr<Chip8Verifier> verifier(new Chip8Verifier(engine, idle_skip, quirks, interval));
+    return verify(*verifier, rom, seed, frames, ipf, divergence, totals);
+}
+
+int main(int argc, char** argv) {
+    std::vector<const char*> roms;
+    unsigned long long runs = 0;
+    std::vector<Chip8Candidate> candidates = { CHIP8_CANDIDATE_PREDECODED, CHIP8_CANDIDATE_JIT, CHIP8_CANDIDATE_LANES };
+    Chip8Quirks quirks = CHIP8_QUIRKS_MODERN;
+    bool fixed_quirks = false;
+    unsigned long long frames = 0;
+    unsigned int ipf = 0;
+    unsigned long long interval = 64;
+    unsigned int seed = 1;
+    bool idle_skip = true;
+    const char* prefix = NULL;
+
+    for (int a = 1; a < argc; a++) {
+        if (!strcmp(argv[a], "-z") && a + 1 < argc)
+            runs = strtoull(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-f") && a + 1 < argc)
+            frames = strtoull(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-i") && a + 1 < argc)
+            ipf = strtoul(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-c") && a + 1 < argc)
+            interval = strtoull(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-s") && a + 1 < argc)
+            seed = strtoul(argv[++a], NULL, 0);
+        else if (!strcmp(argv[a], "-n"))
+            idle_skip = false;
+        else if (!strcmp(argv[a], "-d") && a + 1 < argc)
+            prefix = argv[++a];
+        else if (!strcmp(argv[a], "-q") && a + 1 < argc) {
+            if (!chip8_parse_quirks(argv[++a], quirks))
+                return 1;
+            fixed_quirks = true;
+        }
+        else if (!strcmp(argv[a], "-e") && a + 1 < argc) {
+            a++;
+            if (!strcmp(argv[a], "predecoded"))
+                candidates = { CHIP8_CANDIDATE_PREDECODED };
+            else if (!strcmp(argv[a], "jit"))
+                candidates = { CHIP8_CANDIDATE_JIT };
+            else if (!strcmp(argv[a], "lanes"))
+                candidates = { CHIP8_CANDIDATE_LANES };
+            else if (strcmp(argv[a], "all")) {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (argv[a][0] != '-')
+            roms.push_back(argv[a]);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (runs == 0 && roms.size() != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<std::vector<unsigned char>> bases(roms.size());
+    for (size_t r = 0; r < roms.size(); r++) {
+        if (!read_rom(roms[r], bases[r]))
+            return 1;
+    }
+
+    // three states, 15 KB, kept off the stack
+    std::unique_ptr<Chip8Divergence> divergence(new Chip8Divergence());
+    Chip8VerifyTotals totals;
+
+    if (runs == 0) {
+        if (frames == 0)
+            frames = 600;
+        if (ipf == 0)
+            ipf = 1000;
+        for (size_t c = 0; c < candidates.size(); c++) {
+            if (candidates[c] == CHIP8_CANDIDATE_LANES && quirks != CHIP8_QUIRKS_MODERN) {
+                printf("lanes: skipped, lockstep groups only run the modern profile\n");
+                continue;
+            }
+            if (!verify(candidates[c], quirks, idle_skip, interval, bases[0], seed, frames, ipf, *divergence, totals)) {
+                printf("%s: diverged from the interpreter (%s profile)\n", candidate_name(candidates[c]), chip8_quirks_name(quirks));
+                divergence->print(stdout);
+                if (prefix)
+                    divergence->save(prefix);
+                return 2;
+            }
+            printf("%s: matches the interpreter\n", candidate_name(candidates[c]));
+        }
+    }
+    else {
+        if (frames == 0)
+            frames = 60;
+        static const unsigned int ipfs [] = { 1, 7, 15, 100, 1000 };
+        Chip8FuzzRandom random(seed);
+        std::vector<unsigned char> rom;
+        for (unsigned long long r = 0; r < runs; r++) {
+            unsigned int run_seed = random.next();
+            Chip8FuzzRandom rom_random(run_seed);
+            if (bases.empty())
+                fuzz_rom(rom_random, rom);
+            else
+                mutate_rom(rom_random, bases[rom_random.below(bases.size())], rom);
+            Chip8Quirks run_quirks = fixed_quirks ? quirks : (Chip8Quirks) (r % CHIP8_QUIRKS_COUNT);
+            unsigned int run_ipf = ipf ? ipf : ipfs[rom_random.below(sizeof(ipfs) / sizeof(ipfs[0]))];
+
+            for (size_t c = 0; c < candidates.size(); c++) {
+                if (candidates[c] == CHIP8_CANDIDATE_LANES && run_quirks != CHIP8_QUIRKS_MODERN)
+                    continue;
+                if (verify(candidates[c], run_quirks, idle_skip, interval, rom, run_seed, frames, run_ipf, *divergence, totals))
+                    continue;
+
+                std::string name = "fuzz-" + std::to_string(run_seed);
+                printf("%s: diverged from the interpreter on run %llu (%s profile, seed %u, %u instructions per frame)\n",
+                    candidate_name(candidates[c]), r, chip8_quirks_name(run_quirks), run_seed, run_ipf);
+                divergence->print(stdout);
+                write_rom((name + ".ch8").c_str(), rom);
+                divergence->save(name.c_str());
+                printf("* ROM written to %s.ch8, states to %s.*.c8s\n", name.c_str(), name.c_str());
+                return 2;
+            }
+        }
+        printf("%llu ROMs match the interpreter\n", runs);
+    }
+
+    printf("%llu instructions (%llu skipped as idle), %llu comparisons\n", totals.cycles, totals.idle_cycles, totals.checks);
+    return 0;
+}
@@ -0,0 +1,317 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "chip8core.hpp"
+#include "chip8lockstep.hpp"
+#include "chip8state.hpp"
+
+// where a candidate engine first stopped matching the reference
+struct Chip8Divergence {
+    // instructions and frames both ran in agreement
+    unsigned long long cycles;
+    unsigned long long frames;
+    // narrowed down to the single instruction at pc, or only to the
+    // stretch since the last check
+    bool exact;
+    unsigned short int pc;
+    unsigned short int opcode;
+    // the lane of a lockstep group
+    unsigned int lane;
+    // both machines before that instruction (or stretch), and after it
+    Chip8State before;
+    Chip8State reference;
+    Chip8State candidate;
+
+    // what differs, and the state both started from
+    void print(FILE* out) {
+        if (this->exact)
+            fprintf(out, "* divergence after %llu instructions (frame %llu), at 0x%03X: %04X\n",
+                this->cycles, this->frames, this->pc, this->opcode);
+        else
+            fprintf(out, "* divergence within the instructions after %llu (frame %llu), from 0x%03X\n",
+                this->cycles, this->frames, this->pc);
+        if (this->lane)
+            fprintf(out, "*   in lane %u\n", this->lane);
+
+        const Chip8State& a = this->reference;
+        const Chip8State& b = this->candidate;
+        for (unsigned int x = 0; x < 16; x++) {
+            if (a.v[x] != b.v[x])
+                fprintf(out, "*   V%X: reference %02X, candidate %02X\n", x, a.v[x], b.v[x]);
+        }
+        if (a.i != b.i)
+            fprintf(out, "*   I: reference %04X, candidate %04X\n", a.i, b.i);
+        if (a.pc != b.pc)
+            fprintf(out, "*   PC: reference %04X, candidate %04X\n", a.pc, b.pc);
+        if (a.sp != b.sp)
+            fprintf(out, "*   SP: reference %02X, candidate %02X\n", a.sp, b.sp);
+        if (a.delay_timer != b.delay_timer || a.sound_timer != b.sound_timer)
+            fprintf(out, "*   DT/ST: reference %02X/%02X, candidate %02X/%02X\n", a.delay_timer, a.sound_timer, b.delay_timer, b.sound_timer);
+        if (a.keyboard_flags != b.keyboard_flags || a.keys != b.keys || a.last_key != b.last_key)
+            fprintf(out, "*   keypad: reference %02X/%04X/%X, candidate %02X/%04X/%X\n",
+                a.keyboard_flags, a.keys, a.last_key, b.keyboard_flags, b.keys, b.last_key);
+        if (a.rng != b.rng)
+            fprintf(out, "*   RNG: reference %08X, candidate %08X\n", a.rng, b.rng);
+        if (memcmp(a.rpl, b.rpl, sizeof(a.rpl)))
+            fprintf(out, "*   RPL flags differ\n");
+        if (a.cycles != b.cycles || a.frames != b.frames)
+            fprintf(out, "*   counted: reference %llu/%llu, candidate %llu/%llu instructions/frames\n", a.cycles, a.frames, b.cycles, b.frames);
+
+        unsigned int bytes = 0;
+        for (unsigned int addr = 0; addr < 4096; addr++) {
+            if (a.memory[addr] == b.memory[addr])
+                continue;
+            if (bytes++ < 8)
+                fprintf(out, "*   memory %03X: reference %02X, candidate %02X\n", addr, a.memory[addr], b.memory[addr]);
+        }
+        if (bytes > 8)
+            fprintf(out, "*   ... %u bytes of memory differ\n", bytes);
+
+        unsigned int rows = 0;
+        for (unsigned int y = 0; y < 64; y++)
+            rows += a.screen[y][0] != b.screen[y][0] || a.screen[y][1] != b.screen[y][1];
+        if (rows || a.display_flags != b.display_flags)
+            fprintf(out, "*   screen: %u rows differ%s\n", rows, a.display_flags != b.display_flags ? ", and the resolution" : "");
+
+        const Chip8State& s = this->before;
+        fprintf(out, "* before:");
+        for (unsigned int x = 0; x < 16; x++)
+            fprintf(out, " V%X=%02X", x, s.v[x]);
+        fprintf(out, "\n*         I=%04X PC=%04X SP=%02X DT=%02X ST=%02X\n", s.i, s.pc, s.sp, s.delay_timer, s.sound_timer);
+    }
+
+    // the three states as save state files, to load into chip8headless -l
+    bool save(const char* prefix) {
+        std::string base = prefix;
+        return this->before.save((base + ".before.c8s").c_str())
+            && this->reference.save((base + ".reference.c8s").c_str())
+            && this->candidate.save((base + ".candidate.c8s").c_str());
+    }
+};
+
+// runs a candidate engine side by side with the plain interpreter, which
+// defines what every instruction does, and compares the whole machine
+// (registers, memory, screen, timers, keypad, counters) every interval
+// instructions and after every frame. on a mismatch both go back to the
+// last state that matched and the stretch is bisected down to the first
+// instruction after which they differ.
+//
+// the candidate keeps fast-forwarding idle loops (unless turned off); the
+// reference never does. going back is load_state, which keeps the
+// candidate's decoded code wherever memory matches, so a divergence that
+// only stale code causes may not reproduce; it is then reported for the
+// whole stretch.
+class Chip8Verifier {
+private:
+    Chip8Core reference;
+    Chip8Core candidate;
+    unsigned long long interval;
+    unsigned long long checks;
+
+    // the last state both agreed on, and scratch space for comparing
+    Chip8State last;
+    Chip8State a;
+    Chip8State b;
+
+    bool matches() {
+        this->reference.save_state(this->a);
+        this->candidate.save_state(this->b);
+        return !memcmp(&this->a, &this->b, sizeof(Chip8State))
+            && this->reference.is_beeping() == this->candidate.is_beeping();
+    }
+
+    // restore both to the last match and run n instructions
+    bool replay(unsigned long long n) {
+        this->reference.load_state(this->last);
+        this->candidate.load_state(this->last);
+        this->reference.run_cycles(n);
+        this->candidate.run_cycles(n);
+        return this->matches();
+    }
+
+    // the first instruction of the last n after which the machines differ
+    void locate(unsigned long long n, Chip8Divergence& divergence) {
+        divergence.exact = false;
+        divergence.lane = 0;
+        divergence.cycles = this->last.cycles;
+        divergence.frames = this->last.frames;
+        divergence.pc = this->last.pc;
+        divergence.opcode = (this->last.memory[this->last.pc & 0xFFF] << 8) | this->last.memory[(this->last.pc + 1) & 0xFFF];
+        divergence.before = this->last;
+        divergence.reference = this->a;
+        divergence.candidate = this->b;
+        if (this->replay(n))
+            return;
+
+        unsigned long long lo = 0;
+        unsigned long long hi = n;
+        while (hi - lo > 1) {
+            unsigned long long mid = lo + (hi - lo) / 2;
+            if (this->replay(mid))
+                lo = mid;
+            else
+                hi = mid;
+        }
+
+        this->replay(lo);
+        divergence.before = this->a;
+        this->replay(hi);
+        divergence.exact = true;
+        divergence.cycles = this->last.cycles + lo;
+        divergence.pc = divergence.before.pc;
+        divergence.opcode = (divergence.before.memory[divergence.pc & 0xFFF] << 8) | divergence.before.memory[(divergence.pc + 1) & 0xFFF];
+        divergence.reference = this->a;
+        divergence.candidate = this->b;
+    }
+public:
+    Chip8Verifier(Chip8Engine engine, bool idle_skip, Chip8Quirks quirks, unsigned long long interval) {
+        this->reference.set_idle_skip(false);
+        this->reference.set_quirks(quirks);
+        this->candidate.set_engine(engine);
+        this->candidate.set_idle_skip(idle_skip);
+        this->candidate.set_quirks(quirks);
+        this->interval = interval ? interval : 1;
+        this->checks = 0;
+    }
+
+    Chip8Verifier(const Chip8Verifier&) = delete;
+    Chip8Verifier& operator=(const Chip8Verifier&) = delete;
+
+    bool load_rom(const unsigned char* data, size_t size) {
+        return this->reference.load_rom(data, size) && this->candidate.load_rom(data, size);
+    }
+
+    void seed(unsigned int seed) {
+        this->reference.seed(seed);
+        this->candidate.seed(seed);
+    }
+
+    // one frame of ipf instructions with the given keys held. returns false
+    // (with divergence filled in) as soon as the machines differ
+    bool run_frame(unsigned int ipf, unsigned short int keys, Chip8Divergence& divergence) {
+        this->reference.get_keyboard().set_keys(keys);
+        this->candidate.get_keyboard().set_keys(keys);
+
+        for (unsigned long long left = ipf; left > 0; ) {
+            unsigned long long n = left < this->interval ? left : this->interval;
+            this->reference.save_state(this->last);
+            this->reference.run_cycles(n);
+            this->candidate.run_cycles(n);
+            left -= n;
+            this->checks++;
+            if (!this->matches()) {
+                this->locate(n, divergence);
+                return false;
+            }
+        }
+
+        this->reference.save_state(this->last);
+        this->reference.tick_timers();
+        this->candidate.tick_timers();
+        this->checks++;
+        if (!this->matches()) {
+            // the tick itself: nothing to bisect
+            this->locate(0, divergence);
+            return false;
+        }
+        return true;
+    }
+
+    unsigned long long get_checks() {
+        return this->checks;
+    }
+
+    unsigned long long get_cycles() {
+        return this->reference.get_cycles();
+    }
+
+    // instructions the candidate skipped in idle loops
+    unsigned long long get_idle_cycles() {
+        return this->candidate.get_idle_cycles();
+    }
+};
+
+// the same for a lockstep group: every lane against a core of its own,
+// seeded the same, after every frame (a group can't be stopped or rolled
+// back mid-frame, so divergences are found per frame, not per instruction).
+// lanes run the modern quirk profile.
+template <unsigned int LANES>
+class Chip8LaneVerifier {
+private:
+    Chip8Lockstep<LANES> group;
+    Chip8Core references [LANES];
+    unsigned long long checks;
+
+    Chip8State last;
+    Chip8State a;
+    Chip8State b;
+public:
+    Chip8LaneVerifier() {
+        for (unsigned int l = 0; l < LANES; l++)
+            this->references[l].set_idle_skip(false);
+        this->checks = 0;
+    }
+
+    Chip8LaneVerifier(const Chip8LaneVerifier&) = delete;
+    Chip8LaneVerifier& operator=(const Chip8LaneVerifier&) = delete;
+
+    bool load_rom(const unsigned char* data, size_t size) {
+        for (unsigned int l = 0; l < LANES; l++) {
+            if (!this->references[l].load_rom(data, size))
+                return false;
+        }
+        return this->group.load_rom(data, size);
+    }
+
+    // lane l gets seed + l, so the lanes part ways on Cxkk
+    void seed(unsigned int seed) {
+        for (unsigned int l = 0; l < LANES; l++) {
+            this->references[l].seed(seed + l);
+            this->group.seed(l, seed + l);
+        }
+    }
+
+    bool run_frame(unsigned int ipf, unsigned short int keys, Chip8Divergence& divergence) {
+        for (unsigned int l = 0; l < LANES; l++) {
+            this->references[l].get_keyboard().set_keys(keys);
+            this->group.get_keyboard(l).set_keys(keys);
+        }
+        this->references[0].save_state(this->last);
+        this->group.run_frames(1, ipf);
+
+        for (unsigned int l = 0; l < LANES; l++) {
+            if (l)
+                this->references[l].save_state(this->last);
+            this->references[l].run_frames(1, ipf);
+            this->references[l].save_state(this->a);
+            this->group.save_state(l, this->b);
+            this->checks++;
+            if (memcmp(&this->a, &this->b, sizeof(Chip8State))) {
+                divergence.exact = false;
+                divergence.lane = l;
+                divergence.cycles = this->last.cycles;
+                divergence.frames = this->last.frames;
+                divergence.pc = this->last.pc;
+                divergence.opcode = (this->last.memory[this->last.pc & 0xFFF] << 8) | this->last.memory[(this->last.pc + 1) & 0xFFF];
+                divergence.before = this->last;
+                divergence.reference = this->a;
+                divergence.candidate = this->b;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    unsigned long long get_checks() {
+        return this->checks;
+    }
+
+    unsigned long long get_cycles() {
+        return this->references[0].get_cycles();
+    }
+
+    unsigned long long get_idle_cycles() {
+        return 0;
+    }
+};
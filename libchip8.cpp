@@ -0,0 +1,168 @@
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <vector>
+#include "libchip8.h"
+#include "chip8core.hpp"
+#include "chip8state.hpp"
+
+// a chip8_machine is a Chip8Core; C callers only ever see the pointer.
+// nothing may throw across the C boundary, so anything that allocates is
+// wrapped and turned into a failure return.
+static Chip8Core& core_of(chip8_machine* machine) {
+    return *(Chip8Core*) machine;
+}
+
+static_assert(sizeof(Chip8Core) % alignof(Chip8Core) == 0, "machines must pack back to back");
+
+size_t chip8_size(void) {
+    return sizeof(Chip8Core);
+}
+
+size_t chip8_alignment(void) {
+    return alignof(Chip8Core);
+}
+
+chip8_machine* chip8_init(void* block) {
+    if (block == NULL || (uintptr_t) block % alignof(Chip8Core))
+        return NULL;
+    try {
+        return (chip8_machine*) new (block) Chip8Core();
+    } catch (...) {
+        return NULL;
+    }
+}
+
+void chip8_fini(chip8_machine* machine) {
+    if (machine)
+        core_of(machine).~Chip8Core();
+}
+
+chip8_machine* chip8_create(void) {
+    try {
+        return (chip8_machine*) new Chip8Core();
+    } catch (...) {
+        return NULL;
+    }
+}
+
+void chip8_destroy(chip8_machine* machine) {
+    delete (Chip8Core*) machine;
+}
+
+int chip8_load(chip8_machine* machine, const unsigned char* rom, size_t size) {
+    return core_of(machine).load_rom(rom, size) ? 0 : -1;
+}
+
+int chip8_set_engine(chip8_machine* machine, enum chip8_engine engine) {
+    Chip8Engine engines [] = { CHIP8_ENGINE_INTERPRETER, CHIP8_ENGINE_PREDECODED, CHIP8_ENGINE_JIT };
+    if ((unsigned int) engine > CHIP8_JIT)
+        return -1;
+    try {
+        core_of(machine).set_engine(engines[engine]);
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+int chip8_set_quirks(chip8_machine* machine, enum chip8_quirks quirks) {
+    if ((unsigned int) quirks >= CHIP8_QUIRKS_COUNT)
+        return -1;
+    core_of(machine).set_quirks((Chip8Quirks) quirks);
+    return 0;
+}
+
+void chip8_seed(chip8_machine* machine, unsigned int seed) {
+    core_of(machine).seed(seed);
+}
+
+void chip8_step(chip8_machine* machine, unsigned long long n) {
+    core_of(machine).run_cycles(n);
+}
+
+void chip8_run_frame(chip8_machine* machine, unsigned int ipf) {
+    core_of(machine).run_frames(1, ipf);
+}
+
+unsigned long long chip8_cycles(chip8_machine* machine) {
+    return core_of(machine).get_cycles();
+}
+
+unsigned long long chip8_frames(chip8_machine* machine) {
+    return core_of(machine).get_frames();
+}
+
+void chip8_set_key(chip8_machine* machine, unsigned int key, int pressed) {
+    if (key <= 0xF)
+        core_of(machine).get_keyboard().set_key(key, pressed != 0);
+}
+
+void chip8_set_keys(chip8_machine* machine, unsigned short keys) {
+    core_of(machine).get_keyboard().set_keys(keys);
+}
+
+unsigned int chip8_width(chip8_machine* machine) {
+    return core_of(machine).get_framebuffer().get_width();
+}
+
+unsigned int chip8_height(chip8_machine* machine) {
+    return core_of(machine).get_framebuffer().get_height();
+}
+
+size_t chip8_framebuffer(chip8_machine* machine, unsigned char* out, size_t size) {
+    Chip8Framebuffer& framebuffer = core_of(machine).get_framebuffer();
+    unsigned int width = framebuffer.get_width();
+    unsigned int height = framebuffer.get_height();
+    size_t needed = (size_t) width * height;
+    if (out == NULL || size < needed)
+        return needed;
+
+    for (unsigned int y = 0; y < height; y++) {
+        const unsigned long long* row = framebuffer.get_row(y);
+        for (unsigned int x = 0; x < width; x++)
+            *out++ = (row[x / 64] >> (63 - x % 64)) & 0x01;
+    }
+    return needed;
+}
+
+unsigned long long chip8_screen_hash(chip8_machine* machine) {
+    return core_of(machine).screen_hash();
+}
+
+int chip8_beeping(chip8_machine* machine) {
+    return core_of(machine).is_beeping();
+}
+
+size_t chip8_state_size(void) {
+    return Chip8State::serialized_size();
+}
+
+size_t chip8_serialize(chip8_machine* machine, void* out, size_t size) {
+    size_t needed = Chip8State::serialized_size();
+    if (out == NULL || size < needed)
+        return needed;
+
+    try {
+        Chip8State state;
+        core_of(machine).save_state(state);
+        std::vector<unsigned char> data;
+        state.serialize(data);
+        memcpy(out, data.data(), data.size());
+        return data.size();
+    } catch (...) {
+        return 0;
+    }
+}
+
+int chip8_deserialize(chip8_machine* machine, const void* data, size_t size) {
+    Chip8State state;
+    if (data == NULL || !state.deserialize((const unsigned char*) data, size, "memory"))
+        return -1;
+    try {
+        core_of(machine).load_state(state);
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
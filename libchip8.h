@@ -0,0 +1,89 @@
+#ifndef LIBCHIP8_H
+#define LIBCHIP8_H
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the emulator core behind a flat C API, for hosting machines in other
+ * programs. a machine is one contiguous block of chip8_size() bytes aligned
+ * to chip8_alignment(), with nothing else on the heap as long as it runs on
+ * the interpreter. so it can live in memory the caller owns: an arena of
+ * n * chip8_size() bytes holds n machines, and costs exactly that.
+ *
+ * functions returning int return 0 on success and -1 on failure. nothing
+ * here is thread safe per machine, but different machines can run on
+ * different threads. */
+
+typedef struct chip8_machine chip8_machine;
+
+enum chip8_engine {
+    CHIP8_INTERPRETER,
+    CHIP8_PREDECODED,   /* allocates a decode table for the machine */
+    CHIP8_JIT           /* allocates translated code for the machine */
+};
+
+/* how the interpreters ROMs were written for differ (see chip8quirks.hpp),
+ * numbered as in ROM packs */
+enum chip8_quirks {
+    CHIP8_MODERN,
+    CHIP8_VIP,
+    CHIP8_CHIP48,
+    CHIP8_SCHIP
+};
+
+/* a multiple of chip8_alignment(), so machines can be packed back to back */
+size_t chip8_size(void);
+size_t chip8_alignment(void);
+
+/* construct a powered-on machine in block, which has to be chip8_size()
+ * bytes aligned to chip8_alignment(). returns NULL if it isn't. the block
+ * must outlive the machine, and chip8_fini() must run before it's reused */
+chip8_machine* chip8_init(void* block);
+void chip8_fini(chip8_machine* machine);
+
+/* or let the library allocate the block */
+chip8_machine* chip8_create(void);
+void chip8_destroy(chip8_machine* machine);
+
+/* copy a ROM image to 0x200 */
+int chip8_load(chip8_machine* machine, const unsigned char* rom, size_t size);
+int chip8_set_engine(chip8_machine* machine, enum chip8_engine engine);
+int chip8_set_quirks(chip8_machine* machine, enum chip8_quirks quirks);
+/* start a new Cxkk random sequence */
+void chip8_seed(chip8_machine* machine, unsigned int seed);
+
+/* run n instructions without ticking the timers */
+void chip8_step(chip8_machine* machine, unsigned long long n);
+/* run ipf instructions, then tick the timers: one 1/60 s frame */
+void chip8_run_frame(chip8_machine* machine, unsigned int ipf);
+unsigned long long chip8_cycles(chip8_machine* machine);
+unsigned long long chip8_frames(chip8_machine* machine);
+
+/* key is 0x0-0xF; keys has one bit per key */
+void chip8_set_key(chip8_machine* machine, unsigned int key, int pressed);
+void chip8_set_keys(chip8_machine* machine, unsigned short keys);
+
+/* 64x32, or 128x64 in SUPER-CHIP high resolution */
+unsigned int chip8_width(chip8_machine* machine);
+unsigned int chip8_height(chip8_machine* machine);
+/* one byte per pixel, 0 or 1, row by row. returns the bytes the screen
+ * takes; nothing is written if that's more than size */
+size_t chip8_framebuffer(chip8_machine* machine, unsigned char* out, size_t size);
+/* hash of the screen, as chip8headless prints it */
+unsigned long long chip8_screen_hash(chip8_machine* machine);
+/* the sound timer ran during the last frame */
+int chip8_beeping(chip8_machine* machine);
+
+/* the machine state in the save state file format. returns the bytes it
+ * takes; nothing is written if that's more than size */
+size_t chip8_state_size(void);
+size_t chip8_serialize(chip8_machine* machine, void* out, size_t size);
+int chip8_deserialize(chip8_machine* machine, const void* data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
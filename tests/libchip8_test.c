@@ -0,0 +1,103 @@
+/* drives libchip8 from C the way an embedder would: machines packed into
+ * one aligned arena, run for a while, a state copied from one machine into
+ * another through serialize/deserialize, and a misaligned block refused */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libchip8.h"
+
+#define MACHINES 16
+
+/* tests/roundtrip.ch8: random sprites, BCD stores and both timers */
+static const unsigned char rom [] = {
+    0x00, 0xE0, 0x6A, 0x00, 0xC0, 0x3F, 0xC1, 0x1F, 0xA2, 0x22, 0xD0, 0x15,
+    0xF2, 0x07, 0x8A, 0x24, 0x32, 0x00, 0x12, 0x16, 0xF0, 0x15, 0xA3, 0x00,
+    0xF0, 0x33, 0xF2, 0x65, 0x7A, 0x01, 0xF0, 0x18, 0x12, 0x04, 0xF0, 0x90,
+    0xF0, 0x90, 0xF0
+};
+
+static int failed = 0;
+
+static void check(int ok, const char* what) {
+    if (!ok) {
+        printf("* %s\n", what);
+        failed = 1;
+    }
+}
+
+int main(void) {
+    size_t size = chip8_size();
+    size_t state_size = chip8_state_size();
+    chip8_machine* machines [MACHINES];
+    unsigned char* arena;
+    unsigned char* a;
+    unsigned char* b;
+    chip8_machine* single;
+    unsigned int k;
+
+    check(size % chip8_alignment() == 0, "machine size is not a multiple of the alignment");
+    arena = aligned_alloc(chip8_alignment(), MACHINES * size);
+    a = malloc(state_size);
+    b = malloc(state_size);
+    if (arena == NULL || a == NULL || b == NULL) {
+        printf("* Failed to allocate memory!\n");
+        return 1;
+    }
+
+    check(chip8_init(arena + 1) == NULL, "chip8_init accepted a misaligned block");
+
+    /* machine k runs with seed k, so they part ways on Cxkk */
+    for (k = 0; k < MACHINES; k++) {
+        machines[k] = chip8_init(arena + k * size);
+        check(machines[k] != NULL, "chip8_init refused an aligned block");
+        if (machines[k] == NULL)
+            return 1;
+        check(chip8_load(machines[k], rom, sizeof(rom)) == 0, "chip8_load failed");
+        chip8_seed(machines[k], k);
+    }
+    for (k = 0; k < MACHINES; k++) {
+        unsigned int f;
+        for (f = 0; f < 300; f++)
+            chip8_run_frame(machines[k], 15);
+        check(chip8_frames(machines[k]) == 300 && chip8_cycles(machines[k]) == 300 * 15, "frames or instructions miscounted");
+    }
+    check(chip8_screen_hash(machines[0]) != chip8_screen_hash(machines[1]), "differently seeded machines drew the same screen");
+
+    /* a machine of its own, seeded like machine 0, draws what machine 0 drew */
+    single = chip8_create();
+    check(single != NULL, "chip8_create failed");
+    if (single == NULL)
+        return 1;
+    chip8_load(single, rom, sizeof(rom));
+    chip8_seed(single, 0);
+    for (k = 0; k < 300; k++)
+        chip8_run_frame(single, 15);
+    check(chip8_screen_hash(single) == chip8_screen_hash(machines[0]), "same seed, different screen");
+
+    /* too small a buffer gets the size and nothing written */
+    memset(a, 0xAA, state_size);
+    check(chip8_serialize(machines[0], a, state_size - 1) == state_size && a[0] == 0xAA, "chip8_serialize wrote into too small a buffer");
+
+    /* machine 1 becomes machine 0, and stays in step with it */
+    check(chip8_serialize(machines[0], a, state_size) == state_size, "chip8_serialize failed");
+    check(chip8_deserialize(machines[1], a, state_size) == 0, "chip8_deserialize failed");
+    check(chip8_deserialize(machines[1], a, state_size - 1) != 0, "chip8_deserialize accepted a truncated state");
+    for (k = 0; k < 120; k++) {
+        chip8_run_frame(machines[0], 15);
+        chip8_run_frame(machines[1], 15);
+    }
+    chip8_serialize(machines[0], a, state_size);
+    chip8_serialize(machines[1], b, state_size);
+    check(memcmp(a, b, state_size) == 0, "a deserialized machine drifted from the original");
+    check(chip8_screen_hash(machines[0]) == chip8_screen_hash(machines[1]), "a deserialized machine drew another screen");
+
+    chip8_destroy(single);
+    for (k = 0; k < MACHINES; k++)
+        chip8_fini(machines[k]);
+    free(arena);
+    free(a);
+    free(b);
+    if (!failed)
+        printf("* %u machines of %zu bytes each behave\n", MACHINES, size);
+    return failed;
+}
@@ -0,0 +1,14 @@
+# the profiler's loop listing must hold only real loops. backcall.ch8 jumps
+# forward to a call back to 0x202, whose 00EE returns to a jump back to the
+# call: one loop, 0x206-0x208, with the backward 2nnn and 00EE not counted:
+#   cmake -DHEADLESS=<chip8headless> -DROM=<rom> -P profile.cmake
+execute_process(COMMAND ${HEADLESS} ${ROM} -f 60 -n -H 10
+    RESULT_VARIABLE result OUTPUT_VARIABLE output ERROR_VARIABLE output)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "chip8headless ${ROM} -H 10 failed:\n${output}")
+endif()
+
+string(REGEX MATCHALL "0x[0-9a-f]+-0x[0-9a-f]+ " loops "${output}")
+if(NOT loops STREQUAL "0x206-0x208 ")
+    message(FATAL_ERROR "expected the one loop 0x206-0x208, got:\n${output}")
+endif()
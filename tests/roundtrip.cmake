@@ -0,0 +1,23 @@
+# a save state taken partway through and resumed must end exactly where one
+# uninterrupted run does. roundtrip.ch8 draws random sprites, stores their
+# coordinates as BCD, adds the delay timer into VA and reloads it once it runs
+# out, so the generator, timers, memory and screen all have to come back:
+#   cmake -DHEADLESS=<chip8headless> -DROM=<rom> -DENGINE=<engine> -DDIR=<scratch dir> -P roundtrip.cmake
+file(MAKE_DIRECTORY ${DIR})
+
+function(headless)
+    execute_process(COMMAND ${HEADLESS} ${ARGN} -e ${ENGINE}
+        RESULT_VARIABLE result OUTPUT_VARIABLE output ERROR_VARIABLE output)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "chip8headless ${ARGN} -e ${ENGINE} failed:\n${output}")
+    endif()
+endfunction()
+
+headless(${ROM} -f 600 -s ${DIR}/full.c8s)
+headless(${ROM} -f 250 -s ${DIR}/partway.c8s)
+headless(-l ${DIR}/partway.c8s -f 350 -s ${DIR}/resumed.c8s)
+
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${DIR}/full.c8s ${DIR}/resumed.c8s RESULT_VARIABLE differ)
+if(differ)
+    message(FATAL_ERROR "resuming from ${DIR}/partway.c8s ended in a different state than running straight through")
+endif()